@@ -0,0 +1,160 @@
+#include "AwaitableBufferEvent.hh"
+
+#include <stdlib.h>
+
+using namespace std;
+
+AwaitableBufferEvent::closed_error::closed_error()
+    : runtime_error("connection closed") {}
+
+AwaitableBufferEvent::timeout_error::timeout_error()
+    : runtime_error("operation timed out") {}
+
+AwaitableBufferEvent::AwaitableBufferEvent(EventBase& base, evutil_socket_t fd,
+    enum bufferevent_options options, SSL_CTX* ssl_ctx)
+    : BufferEvent(base, fd, options, ssl_ctx),
+      wait_type(WaitType::NONE),
+      wait_bytes(0),
+      wait_eol_style(EVBUFFER_EOL_CRLF),
+      closed_events(0),
+      timed_out(false),
+      base(bufferevent_get_base(this->bev)),
+      timeout_event(this->base, [this]() {
+        this->timed_out = true;
+        this->resume_waiter();
+      }) {}
+
+AwaitableBufferEvent::AwaitableBufferEvent(struct bufferevent* bev)
+    : BufferEvent(bev),
+      wait_type(WaitType::NONE),
+      wait_bytes(0),
+      wait_eol_style(EVBUFFER_EOL_CRLF),
+      closed_events(0),
+      timed_out(false),
+      base(bufferevent_get_base(this->bev)),
+      timeout_event(this->base, [this]() {
+        this->timed_out = true;
+        this->resume_waiter();
+      }) {}
+
+AwaitableBufferEvent::Awaiter::Awaiter(
+    AwaitableBufferEvent& abev, WaitType type, uint64_t timeout_usecs)
+    : abev(abev),
+      type(type),
+      timeout_usecs(timeout_usecs) {}
+
+bool AwaitableBufferEvent::Awaiter::await_ready() {
+  this->abev.wait_type = this->type;
+  return this->abev.is_condition_met() || this->abev.is_closed();
+}
+
+void AwaitableBufferEvent::Awaiter::await_suspend(coroutine_handle<> h) {
+  this->abev.start_wait(h, this->type, this->timeout_usecs);
+}
+
+void AwaitableBufferEvent::Awaiter::await_resume() {
+  bool met = this->abev.is_condition_met();
+  bool timed_out = this->abev.timed_out;
+  this->abev.wait_type = WaitType::NONE;
+  this->abev.timed_out = false;
+  if (!met) {
+    if (timed_out) {
+      throw timeout_error();
+    }
+    throw closed_error();
+  }
+}
+
+string AwaitableBufferEvent::LineAwaiter::await_resume() {
+  auto eol_style = this->abev.wait_eol_style;
+  this->Awaiter::await_resume();
+  size_t bytes_read;
+  char* line = evbuffer_readln(
+      bufferevent_get_input(this->abev.bev), &bytes_read, eol_style);
+  if (!line) {
+    throw closed_error();
+  }
+  string ret(line, bytes_read);
+  free(line);
+  return ret;
+}
+
+AwaitableBufferEvent::Awaiter AwaitableBufferEvent::await_bytes_available(
+    size_t size, uint64_t timeout_usecs) {
+  this->wait_bytes = size;
+  return Awaiter(*this, WaitType::BYTES, timeout_usecs);
+}
+
+AwaitableBufferEvent::LineAwaiter AwaitableBufferEvent::await_line(
+    enum evbuffer_eol_style eol_style, uint64_t timeout_usecs) {
+  this->wait_eol_style = eol_style;
+  return LineAwaiter(*this, WaitType::LINE, timeout_usecs);
+}
+
+AwaitableBufferEvent::Awaiter AwaitableBufferEvent::await_drain(
+    uint64_t timeout_usecs) {
+  return Awaiter(*this, WaitType::DRAIN, timeout_usecs);
+}
+
+bool AwaitableBufferEvent::is_condition_met() {
+  switch (this->wait_type) {
+    case WaitType::BYTES:
+      return evbuffer_get_length(bufferevent_get_input(this->bev)) >= this->wait_bytes;
+    case WaitType::LINE: {
+      struct evbuffer* buf = bufferevent_get_input(this->bev);
+      size_t eol_len;
+      return evbuffer_search_eol(buf, nullptr, &eol_len, this->wait_eol_style).pos >= 0;
+    }
+    case WaitType::DRAIN:
+      return evbuffer_get_length(bufferevent_get_output(this->bev)) == 0;
+    default:
+      return false;
+  }
+}
+
+void AwaitableBufferEvent::start_wait(
+    coroutine_handle<> h, WaitType type, uint64_t timeout_usecs) {
+  if (this->waiter) {
+    throw logic_error("AwaitableBufferEvent already has a waiting coroutine");
+  }
+  this->waiter = h;
+  this->wait_type = type;
+  this->timed_out = false;
+  if (timeout_usecs) {
+    this->timeout_event.call_after_usecs(timeout_usecs);
+  }
+}
+
+void AwaitableBufferEvent::finish_wait() {
+  this->timeout_event.del();
+}
+
+void AwaitableBufferEvent::resume_waiter() {
+  if (this->waiter) {
+    this->finish_wait();
+    // The coroutine may destroy this object (or wait again) before resume()
+    // returns, so we can't touch it afterward
+    coroutine_handle<> h = this->waiter;
+    this->waiter = nullptr;
+    h.resume();
+  }
+}
+
+void AwaitableBufferEvent::on_read() {
+  if (this->waiter && (this->wait_type != WaitType::DRAIN) && this->is_condition_met()) {
+    this->resume_waiter();
+  }
+}
+
+void AwaitableBufferEvent::on_write() {
+  if (this->waiter && (this->wait_type == WaitType::DRAIN) && this->is_condition_met()) {
+    this->resume_waiter();
+  }
+}
+
+void AwaitableBufferEvent::on_event(short what) {
+  if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    this->closed_events = what;
+    this->resume_waiter();
+  }
+}
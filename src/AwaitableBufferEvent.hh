@@ -0,0 +1,109 @@
+#pragma once
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include <coroutine>
+#include <stdexcept>
+#include <string>
+
+#include "BufferEvent.hh"
+#include "Event.hh"
+#include "EventBase.hh"
+
+class CoroutineStreamServer;
+
+// A BufferEvent whose reads and drains can be awaited from a coroutine. Only
+// one coroutine may await a given AwaitableBufferEvent at a time.
+//
+// The awaitables throw closed_error if the connection is closed or fails
+// before the condition is met, and timeout_error if a nonzero timeout is given
+// and it expires first. Data received before the connection was closed is
+// still available in the input buffer.
+//
+// When constructed from an existing bufferevent, this object is non-owning and
+// does not install its own callbacks; whoever owns the bufferevent must call
+// on_read/on_write/on_event (CoroutineStreamServer does this).
+class AwaitableBufferEvent : public BufferEvent {
+public:
+  class closed_error : public std::runtime_error {
+  public:
+    closed_error();
+  };
+
+  class timeout_error : public std::runtime_error {
+  public:
+    timeout_error();
+  };
+
+  AwaitableBufferEvent(EventBase& base, evutil_socket_t fd,
+      enum bufferevent_options options, SSL_CTX* ssl_ctx = nullptr);
+  explicit AwaitableBufferEvent(struct bufferevent* bev);
+  AwaitableBufferEvent(const AwaitableBufferEvent&) = delete;
+  AwaitableBufferEvent(AwaitableBufferEvent&&) = delete;
+  AwaitableBufferEvent& operator=(const AwaitableBufferEvent&) = delete;
+  AwaitableBufferEvent& operator=(AwaitableBufferEvent&&) = delete;
+  virtual ~AwaitableBufferEvent() = default;
+
+  enum class WaitType {
+    NONE = 0,
+    BYTES,
+    LINE,
+    DRAIN,
+  };
+
+  class Awaiter {
+  public:
+    Awaiter(AwaitableBufferEvent& abev, WaitType type, uint64_t timeout_usecs);
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume();
+
+  protected:
+    AwaitableBufferEvent& abev;
+    WaitType type;
+    uint64_t timeout_usecs;
+  };
+
+  class LineAwaiter : public Awaiter {
+  public:
+    using Awaiter::Awaiter;
+    std::string await_resume();
+  };
+
+  // Resumes when the input buffer contains at least the given number of bytes
+  Awaiter await_bytes_available(size_t size, uint64_t timeout_usecs = 0);
+  // Resumes when the input buffer contains a complete line, and returns the
+  // line (without the EOL sequence), removing it from the buffer
+  LineAwaiter await_line(
+      enum evbuffer_eol_style eol_style = EVBUFFER_EOL_CRLF,
+      uint64_t timeout_usecs = 0);
+  // Resumes when the output buffer is empty
+  Awaiter await_drain(uint64_t timeout_usecs = 0);
+
+  inline bool is_closed() const {
+    return this->closed_events != 0;
+  }
+
+protected:
+  friend class CoroutineStreamServer;
+
+  bool is_condition_met();
+  void start_wait(std::coroutine_handle<> h, WaitType type, uint64_t timeout_usecs);
+  void finish_wait();
+  void resume_waiter();
+
+  virtual void on_read();
+  virtual void on_write();
+  virtual void on_event(short what);
+
+  std::coroutine_handle<> waiter;
+  WaitType wait_type;
+  size_t wait_bytes;
+  enum evbuffer_eol_style wait_eol_style;
+  short closed_events;
+  bool timed_out;
+  EventBase base;
+  InlineEvent<CallbackEvent> timeout_event;
+};
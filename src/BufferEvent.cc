@@ -4,6 +4,8 @@
 
 #include <phosg/Time.hh>
 
+#include "LoopMonitor.hh"
+
 using namespace std;
 
 BufferEvent::BufferEvent(EventBase& base, evutil_socket_t fd,
@@ -213,6 +215,7 @@ struct bufferevent* BufferEvent::get() {
 }
 
 void BufferEvent::dispatch_on_read(struct bufferevent*, void* ctx) {
+  LoopMonitor::CallbackScope scope(LoopMonitor::Trampoline::BUFFEREVENT_READ);
   reinterpret_cast<BufferEvent*>(ctx)->on_read();
 }
 
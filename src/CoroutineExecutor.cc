@@ -0,0 +1,48 @@
+#include "CoroutineExecutor.hh"
+
+using namespace std;
+
+CoroutineExecutor::CoroutineExecutor(EventBase& base)
+    : base(base),
+      log("[CoroutineExecutor] ") {}
+
+void CoroutineExecutor::spawn(task<>&& t) {
+  task<> owned_t = std::move(t);
+  auto h = owned_t.release();
+  h.promise().on_complete = &CoroutineExecutor::on_spawned_task_complete;
+  h.promise().on_complete_ctx = this;
+  h.resume();
+}
+
+void CoroutineExecutor::on_spawned_task_complete(
+    void* ctx, coroutine_handle<> h, exception_ptr exc) {
+  auto* ex = reinterpret_cast<CoroutineExecutor*>(ctx);
+  if (exc) {
+    try {
+      rethrow_exception(exc);
+    } catch (const exception& e) {
+      ex->log.error("Spawned task failed: %s", e.what());
+    } catch (...) {
+      ex->log.error("Spawned task failed with a non-standard exception");
+    }
+  }
+  // The coroutine is suspended at its final suspend point, so it's safe to
+  // destroy it here
+  h.destroy();
+}
+
+CoroutineExecutor::SleepAwaiter::SleepAwaiter(EventBase& base, uint64_t usecs)
+    : base(base),
+      usecs(usecs) {}
+
+void CoroutineExecutor::SleepAwaiter::await_suspend(coroutine_handle<> h) {
+  this->base.once([h]() { h.resume(); }, this->usecs);
+}
+
+CoroutineExecutor::SleepAwaiter CoroutineExecutor::sleep(uint64_t usecs) {
+  return SleepAwaiter(this->base, usecs);
+}
+
+CoroutineExecutor::SleepAwaiter CoroutineExecutor::yield() {
+  return SleepAwaiter(this->base, 0);
+}
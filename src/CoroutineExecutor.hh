@@ -0,0 +1,58 @@
+#pragma once
+
+#include <coroutine>
+#include <phosg/Strings.hh>
+
+#include "EventBase.hh"
+#include "Task.hh"
+
+// Runs top-level coroutines on an EventBase's thread. spawn() starts a task
+// immediately (it runs until its first suspension point before spawn returns)
+// and takes ownership of its coroutine frame, which is destroyed when the task
+// finishes. Exceptions that escape a spawned task are logged.
+//
+// All of this executor's functions (and all the awaitables it returns) must
+// only be used from the base's thread; to start a coroutine from another
+// thread, use EventBase::post to call spawn.
+class CoroutineExecutor {
+public:
+  explicit CoroutineExecutor(EventBase& base);
+  CoroutineExecutor(const CoroutineExecutor&) = delete;
+  CoroutineExecutor(CoroutineExecutor&&) = delete;
+  CoroutineExecutor& operator=(const CoroutineExecutor&) = delete;
+  CoroutineExecutor& operator=(CoroutineExecutor&&) = delete;
+  ~CoroutineExecutor() = default;
+
+  void spawn(task<>&& t);
+
+  // Awaiting the result of sleep() suspends the coroutine and resumes it from
+  // the event loop after the given time. sleep(0) resumes it on the next loop
+  // iteration, which is what yield() does.
+  class SleepAwaiter {
+  public:
+    SleepAwaiter(EventBase& base, uint64_t usecs);
+
+    inline bool await_ready() const noexcept {
+      return false;
+    }
+    void await_suspend(std::coroutine_handle<> h);
+    inline void await_resume() const noexcept {}
+
+  private:
+    EventBase& base;
+    uint64_t usecs;
+  };
+
+  SleepAwaiter sleep(uint64_t usecs);
+  SleepAwaiter yield();
+
+  inline EventBase& get_base() {
+    return this->base;
+  }
+
+protected:
+  static void on_spawned_task_complete(void* ctx, std::coroutine_handle<> h, std::exception_ptr exc);
+
+  EventBase base;
+  PrefixedLogger log;
+};
@@ -0,0 +1,63 @@
+#include "CoroutineStreamServer.hh"
+
+using namespace std;
+
+CoroutineStreamServerClientState::CoroutineStreamServerClientState(struct bufferevent* bev)
+    : abev(bev) {}
+
+CoroutineStreamServer::CoroutineStreamServer(
+    EventBase& base, shared_ptr<SSL_CTX> ssl_ctx)
+    : StreamServer(base, ssl_ctx, "[CoroutineStreamServer] ") {
+  // AwaitableBufferEvent::await_drain needs to know when output drains
+  this->client_output_callback_enabled = true;
+}
+
+CoroutineStreamServer::CoroutineStreamServer(
+    EventBasePool& pool, shared_ptr<SSL_CTX> ssl_ctx)
+    : StreamServer(pool, ssl_ctx, "[CoroutineStreamServer] ") {
+  this->client_output_callback_enabled = true;
+}
+
+void CoroutineStreamServer::on_client_connect(shared_ptr<Client> c) {
+  c->state.reset(new CoroutineStreamServerClientState(c->bev.get()));
+  c->state->connection_task = this->handle_connection(c->state->abev);
+  c->state->connection_task.start(&CoroutineStreamServer::on_connection_task_complete, c.get());
+}
+
+void CoroutineStreamServer::on_client_input(shared_ptr<Client> c) {
+  c->state->abev.on_read();
+}
+
+void CoroutineStreamServer::on_client_output(shared_ptr<Client> c) {
+  c->state->abev.on_write();
+}
+
+void CoroutineStreamServer::on_connection_task_complete(
+    void* ctx, coroutine_handle<>, exception_ptr exc) {
+  Client* c = reinterpret_cast<Client*>(ctx);
+  Shard* shard = c->shard;
+  auto* s = static_cast<CoroutineStreamServer*>(shard->server);
+
+  if (exc) {
+    try {
+      rethrow_exception(exc);
+    } catch (const AwaitableBufferEvent::closed_error&) {
+    } catch (const exception& e) {
+      s->log.error("Error in connection handler: %s", e.what());
+    }
+  }
+
+  // The client's task object still owns the coroutine, and this may be called
+  // before the client is added to the shard's client map (if the task finishes
+  // before its first suspension), so disconnect the client on the next loop
+  // iteration instead. The bufferevent pointer could be reused by a new client
+  // by then, so only disconnect it if its task is done.
+  struct bufferevent* bev = c->bev.get();
+  shard->base.once([s, shard, bev]() {
+    auto it = shard->bev_to_client.find(bev);
+    if ((it != shard->bev_to_client.end()) && it->second->state &&
+        it->second->state->connection_task.done()) {
+      s->disconnect_client(it->second);
+    }
+  });
+}
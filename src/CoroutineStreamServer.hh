@@ -0,0 +1,44 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+
+#include "AwaitableBufferEvent.hh"
+#include "EventBase.hh"
+#include "EventBasePool.hh"
+#include "StreamServer.hh"
+#include "Task.hh"
+
+struct CoroutineStreamServerClientState {
+  AwaitableBufferEvent abev;
+  task<> connection_task;
+
+  explicit CoroutineStreamServerClientState(struct bufferevent* bev);
+};
+
+// A StreamServer that runs one coroutine per client instead of calling
+// on_client_input. handle_connection is called when each client connects, and
+// the client is disconnected when the returned task finishes (exceptions other
+// than AwaitableBufferEvent::closed_error are logged). If the client
+// disconnects or times out first, the coroutine is destroyed at its current
+// suspension point. handle_connection must not call disconnect_client for its
+// own client; it should co_return instead.
+class CoroutineStreamServer : public StreamServer<CoroutineStreamServerClientState> {
+public:
+  explicit CoroutineStreamServer(
+      EventBase& base, std::shared_ptr<SSL_CTX> ssl_ctx = nullptr);
+  explicit CoroutineStreamServer(
+      EventBasePool& pool, std::shared_ptr<SSL_CTX> ssl_ctx = nullptr);
+  virtual ~CoroutineStreamServer() = default;
+
+protected:
+  virtual task<> handle_connection(AwaitableBufferEvent& abev) = 0;
+
+  virtual void on_client_connect(std::shared_ptr<Client> c);
+  virtual void on_client_input(std::shared_ptr<Client> c);
+  virtual void on_client_output(std::shared_ptr<Client> c);
+
+  static void on_connection_task_complete(
+      void* ctx, std::coroutine_handle<> h, std::exception_ptr exc);
+};
@@ -7,13 +7,15 @@ using namespace std;
 
 class EchoServer : public CoroutineStreamServer {
 public:
-  EchoServer(EventBase& base, SSL_CTX* ssl_ctx = nullptr);
+  EchoServer(EventBase& base, shared_ptr<SSL_CTX> ssl_ctx = nullptr)
+      : CoroutineStreamServer(base, ssl_ctx) {}
   virtual ~EchoServer() = default;
 
   virtual task<> handle_connection(AwaitableBufferEvent& abev) {
     for (;;) {
       co_await abev.await_bytes_available(1);
-      abev.get_output().add_buffer(abev.get_input());
+      EvBuffer input = abev.get_input();
+      abev.get_output().add_buffer(input);
     }
   }
 };
@@ -24,7 +26,7 @@ int main(int argc, char** argv) {
   EventBase base;
   EchoServer server(base, nullptr);
 
-  scoped_fd fd = listen(port);
+  scoped_fd fd = listen("", port, SOMAXCONN);
   server.add_socket(fd);
 
   base.dispatch();
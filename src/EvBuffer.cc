@@ -10,7 +10,7 @@ EvBuffer::BoundedReader::BoundedReader(EvBuffer* buf, size_t size)
       bytes_remaining(size) {}
 
 void EvBuffer::BoundedReader::consume(size_t size) {
-  if (size < this->bytes_remaining) {
+  if (size > this->bytes_remaining) {
     throw EvBuffer::insufficient_data();
   }
   this->bytes_remaining -= size;
@@ -31,6 +31,280 @@ std::string EvBuffer::BoundedReader::read(size_t size) {
   return this->buf->remove(size);
 }
 
+EvBuffer::StructReader::StructReader(EvBuffer* buf, size_t size)
+    : buf(buf),
+      data(nullptr),
+      total_size(size),
+      offset(0) {
+  if (this->buf->get_length() < size) {
+    throw EvBuffer::insufficient_data();
+  }
+  if (size) {
+    this->data = this->buf->pullup(size);
+  }
+}
+
+void EvBuffer::StructReader::skip(size_t size) {
+  this->check(size);
+  this->offset += size;
+}
+
+void EvBuffer::StructReader::read(void* data, size_t size) {
+  this->check(size);
+  memcpy(data, this->data + this->offset, size);
+  this->offset += size;
+}
+
+string EvBuffer::StructReader::read(size_t size) {
+  this->check(size);
+  string ret(reinterpret_cast<const char*>(this->data + this->offset), size);
+  this->offset += size;
+  return ret;
+}
+
+string_view EvBuffer::StructReader::read_view(size_t size) {
+  this->check(size);
+  string_view ret(reinterpret_cast<const char*>(this->data + this->offset), size);
+  this->offset += size;
+  return ret;
+}
+
+void EvBuffer::StructReader::finish() {
+  this->buf->drain(this->total_size);
+  this->data = nullptr;
+  this->total_size = 0;
+  this->offset = 0;
+}
+
+EvBuffer::View::View(EvBuffer& buf, ssize_t size)
+    : buf(&buf),
+      total_size(0),
+      num_vecs(0),
+      vecs(this->inline_vecs) {
+  size_t buf_length = evbuffer_get_length(buf.get());
+  if ((size < 0) || (static_cast<size_t>(size) > buf_length)) {
+    size = buf_length;
+  }
+  if (size == 0) {
+    return;
+  }
+
+  int n = evbuffer_peek(buf.get(), size, nullptr, this->inline_vecs, NUM_INLINE_VECS);
+  if (n < 0) {
+    throw runtime_error("evbuffer_peek");
+  }
+  if (static_cast<size_t>(n) > NUM_INLINE_VECS) {
+    this->heap_vecs.resize(n);
+    this->vecs = this->heap_vecs.data();
+    n = evbuffer_peek(buf.get(), size, nullptr, this->vecs, n);
+    if (n < 0) {
+      throw runtime_error("evbuffer_peek");
+    }
+  }
+  this->num_vecs = n;
+
+  // The last chain may extend past the requested size
+  size_t remaining = size;
+  for (size_t z = 0; z < this->num_vecs; z++) {
+    if (this->vecs[z].iov_len > remaining) {
+      this->vecs[z].iov_len = remaining;
+    }
+    remaining -= this->vecs[z].iov_len;
+  }
+  this->total_size = size - remaining;
+}
+
+EvBuffer::Cursor EvBuffer::View::cursor() const {
+  return Cursor(*this);
+}
+
+void EvBuffer::View::consume(size_t size) {
+  if (size > this->total_size) {
+    throw EvBuffer::insufficient_data();
+  }
+  this->buf->drain(size);
+  this->total_size = 0;
+  this->num_vecs = 0;
+}
+
+EvBuffer::Cursor::Cursor(const View& view)
+    : view(&view),
+      pos(0),
+      chain_index(0),
+      chain_offset(0) {
+  this->advance(0);
+}
+
+void EvBuffer::Cursor::advance(size_t size) {
+  this->pos += size;
+  size += this->chain_offset;
+  while ((this->chain_index < this->view->num_vecs) &&
+      (size >= this->view->vecs[this->chain_index].iov_len)) {
+    size -= this->view->vecs[this->chain_index].iov_len;
+    this->chain_index++;
+  }
+  this->chain_offset = size;
+}
+
+void EvBuffer::Cursor::skip(size_t size) {
+  if (size > this->remaining()) {
+    throw EvBuffer::insufficient_data();
+  }
+  this->advance(size);
+}
+
+void EvBuffer::Cursor::read_slow(void* data, size_t size) {
+  if (size > this->remaining()) {
+    throw EvBuffer::insufficient_data();
+  }
+  uint8_t* out = reinterpret_cast<uint8_t*>(data);
+  size_t index = this->chain_index;
+  size_t offset = this->chain_offset;
+  size_t bytes_left = size;
+  while (bytes_left) {
+    const auto& vec = this->view->vecs[index];
+    size_t bytes_to_copy = min<size_t>(vec.iov_len - offset, bytes_left);
+    memcpy(out, reinterpret_cast<const uint8_t*>(vec.iov_base) + offset, bytes_to_copy);
+    out += bytes_to_copy;
+    bytes_left -= bytes_to_copy;
+    index++;
+    offset = 0;
+  }
+  this->advance(size);
+}
+
+string EvBuffer::Cursor::read(size_t size) {
+  string ret(size, '\0');
+  this->read(ret.data(), size);
+  return ret;
+}
+
+bool EvBuffer::Cursor::is_contiguous(size_t size) const {
+  if (size == 0) {
+    return true;
+  }
+  // The cursor may be at the end of a chain (after a read that ended there),
+  // in which case the data starts at the beginning of the next chain
+  size_t index = this->chain_index;
+  size_t offset = this->chain_offset;
+  while ((index < this->view->num_vecs) && (offset >= this->view->vecs[index].iov_len)) {
+    offset -= this->view->vecs[index].iov_len;
+    index++;
+  }
+  return (index < this->view->num_vecs) &&
+      (offset + size <= this->view->vecs[index].iov_len);
+}
+
+string_view EvBuffer::Cursor::read_view(size_t size, string& scratch) {
+  if (size > this->remaining()) {
+    throw EvBuffer::insufficient_data();
+  }
+  this->advance(0);
+  if (this->is_contiguous(size)) {
+    const char* data = (size == 0)
+        ? ""
+        : reinterpret_cast<const char*>(this->view->vecs[this->chain_index].iov_base) + this->chain_offset;
+    this->advance(size);
+    return string_view(data, size);
+  }
+  scratch.resize(size);
+  this->read_slow(scratch.data(), size);
+  return string_view(scratch.data(), size);
+}
+
+ssize_t EvBuffer::Cursor::find(uint8_t ch) const {
+  size_t base_offset = 0;
+  size_t offset = this->chain_offset;
+  for (size_t index = this->chain_index; index < this->view->num_vecs; index++) {
+    const auto& vec = this->view->vecs[index];
+    const void* found = memchr(
+        reinterpret_cast<const uint8_t*>(vec.iov_base) + offset, ch, vec.iov_len - offset);
+    if (found) {
+      return base_offset + (reinterpret_cast<const uint8_t*>(found) - reinterpret_cast<const uint8_t*>(vec.iov_base) - offset);
+    }
+    base_offset += vec.iov_len - offset;
+    offset = 0;
+  }
+  return -1;
+}
+
+ssize_t EvBuffer::Cursor::find(string_view needle) const {
+  if (needle.empty()) {
+    return 0;
+  }
+  Cursor c = *this;
+  size_t skipped = 0;
+  for (;;) {
+    // Find the next occurrence of the first byte, then check the rest of the
+    // needle (which may span chains) without moving c
+    ssize_t first = c.find(static_cast<uint8_t>(needle[0]));
+    if ((first < 0) || (static_cast<size_t>(first) + needle.size() > c.remaining())) {
+      return -1;
+    }
+    c.advance(first);
+    skipped += first;
+
+    Cursor check = c;
+    check.advance(1);
+    size_t z;
+    for (z = 1; z < needle.size(); z++) {
+      const auto& vec = check.view->vecs[check.chain_index];
+      if (reinterpret_cast<const char*>(vec.iov_base)[check.chain_offset] != needle[z]) {
+        break;
+      }
+      check.advance(1);
+    }
+    if (z == needle.size()) {
+      return skipped;
+    }
+    c.advance(1);
+    skipped++;
+  }
+}
+
+EvBuffer::Writer::Writer(EvBuffer* buf, size_t size_hint)
+    : buf(buf),
+      size_hint(size_hint ? size_hint : 1),
+      bytes_committed(0),
+      start(nullptr),
+      pos(nullptr),
+      end(nullptr) {
+  this->vec.iov_base = nullptr;
+  this->vec.iov_len = 0;
+  this->reserve(0);
+}
+
+EvBuffer::Writer::~Writer() {
+  try {
+    this->commit();
+  } catch (const exception&) {
+  }
+}
+
+void EvBuffer::Writer::reserve(size_t size) {
+  this->commit();
+  if (this->buf->reserve_space(max<size_t>(size, this->size_hint), &this->vec, 1) != 1) {
+    throw runtime_error("evbuffer_reserve_space");
+  }
+  this->start = reinterpret_cast<uint8_t*>(this->vec.iov_base);
+  this->pos = this->start;
+  this->end = this->start + this->vec.iov_len;
+}
+
+void EvBuffer::Writer::commit() {
+  if (!this->start) {
+    return;
+  }
+  size_t bytes = this->pos - this->start;
+  this->vec.iov_len = bytes;
+  // Committing zero iovecs releases the reservation without adding data
+  this->buf->commit_space(&this->vec, bytes ? 1 : 0);
+  this->bytes_committed += bytes;
+  this->start = nullptr;
+  this->pos = nullptr;
+  this->end = nullptr;
+}
+
 EvBuffer::LockGuard::LockGuard(EvBuffer* buf) : buf(buf) {
   this->buf->lock();
 }
@@ -428,6 +702,13 @@ void EvBuffer::add_file(int fd, off_t offset, size_t size) {
   }
 }
 
+void EvBuffer::add_file_segment(
+    struct evbuffer_file_segment* seg, off_t offset, size_t size) {
+  if (evbuffer_add_file_segment(this->buf, seg, offset, size)) {
+    throw runtime_error("evbuffer_add_file_segment");
+  }
+}
+
 void EvBuffer::add_buffer_reference(struct evbuffer* other_buf) {
   if (evbuffer_add_buffer_reference(this->buf, other_buf)) {
     throw runtime_error("evbuffer_add_buffer_reference");
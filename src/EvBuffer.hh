@@ -1,11 +1,35 @@
 #pragma once
 
 #include <event2/buffer.h>
+#include <string.h>
 
 #include <functional>
 #include <memory>
 #include <phosg/Encoding.hh>
+#include <span>
 #include <string>
+#include <string_view>
+#include <vector>
+
+// StructReader and Cursor decode these types by reinterpreting buffer memory,
+// so they must have the same layout as the values they represent
+#define PHOSG_EVENT_CHECK_ENDIAN_TYPE(T, SIZE)                                  \
+  static_assert(sizeof(T) == (SIZE) && alignof(T) == 1 &&                      \
+          std::is_trivially_copyable_v<T> && std::is_standard_layout_v<T>,     \
+      #T " does not have the expected layout")
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(be_uint16_t, 2);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(be_int16_t, 2);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(le_uint16_t, 2);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(le_int16_t, 2);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(be_uint32_t, 4);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(be_int32_t, 4);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(le_uint32_t, 4);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(le_int32_t, 4);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(be_uint64_t, 8);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(be_int64_t, 8);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(le_uint64_t, 8);
+PHOSG_EVENT_CHECK_ENDIAN_TYPE(le_int64_t, 8);
+#undef PHOSG_EVENT_CHECK_ENDIAN_TYPE
 
 struct EvBuffer {
   class insufficient_data : public std::runtime_error {
@@ -27,7 +51,7 @@ struct EvBuffer {
 
     template <typename T>
     T get() {
-      this->skip(sizeof(T));
+      this->consume(sizeof(T));
       return this->buf->remove<T>();
     }
 
@@ -41,6 +65,296 @@ struct EvBuffer {
     size_t bytes_remaining;
   };
 
+  // Decodes a fixed-size prefix of a buffer with one evbuffer_pullup and one
+  // drain, instead of one evbuffer_remove call per field. Fields are decoded
+  // directly from the pulled-up memory; finish() drains the prefix. If the
+  // reader is destroyed without calling finish() (e.g. because parsing
+  // failed), no data is removed from the buffer.
+  class StructReader {
+  public:
+    // Throws insufficient_data if the buffer contains fewer than size bytes
+    StructReader(EvBuffer* buf, size_t size);
+    ~StructReader() = default;
+
+    inline size_t size() const {
+      return this->total_size;
+    }
+    inline size_t position() const {
+      return this->offset;
+    }
+    inline size_t remaining() const {
+      return this->total_size - this->offset;
+    }
+
+    void skip(size_t size);
+    void read(void* data, size_t size);
+    std::string read(size_t size);
+    // The returned view is valid until the buffer is modified
+    std::string_view read_view(size_t size);
+
+    template <typename T, std::enable_if_t<std::is_pod_v<T>, bool> = true>
+    T get() {
+      T ret;
+      this->read(&ret, sizeof(T));
+      return ret;
+    }
+
+    // Returns a reference directly into the buffer, which is valid until the
+    // buffer is modified. T must be a packed type (for example, a struct made
+    // of phosg's be_/le_ types with __attribute__((packed))), since the data
+    // may be at any alignment.
+    template <typename T>
+    const T& get_ref() {
+      static_assert(std::is_trivially_copyable_v<T> && std::is_standard_layout_v<T>,
+          "get_ref requires a trivially-copyable standard-layout type");
+      static_assert(alignof(T) == 1, "get_ref requires a packed type");
+      this->check(sizeof(T));
+      const T* ret = reinterpret_cast<const T*>(this->data + this->offset);
+      this->offset += sizeof(T);
+      return *ret;
+    }
+
+    inline uint8_t get_u8() { return this->get<uint8_t>(); }
+    inline int8_t get_s8() { return this->get<int8_t>(); }
+    inline uint16_t get_u16b() { return this->get_ref<be_uint16_t>(); }
+    inline int16_t get_s16b() { return this->get_ref<be_int16_t>(); }
+    inline uint16_t get_u16l() { return this->get_ref<le_uint16_t>(); }
+    inline int16_t get_s16l() { return this->get_ref<le_int16_t>(); }
+    inline uint32_t get_u32b() { return this->get_ref<be_uint32_t>(); }
+    inline int32_t get_s32b() { return this->get_ref<be_int32_t>(); }
+    inline uint32_t get_u32l() { return this->get_ref<le_uint32_t>(); }
+    inline int32_t get_s32l() { return this->get_ref<le_int32_t>(); }
+    inline uint64_t get_u64b() { return this->get_ref<be_uint64_t>(); }
+    inline int64_t get_s64b() { return this->get_ref<be_int64_t>(); }
+    inline uint64_t get_u64l() { return this->get_ref<le_uint64_t>(); }
+    inline int64_t get_s64l() { return this->get_ref<le_int64_t>(); }
+
+    // Drains the entire prefix (not only the bytes that were read) from the
+    // buffer. The reader can't be used after this.
+    void finish();
+
+  private:
+    inline void check(size_t size) const {
+      if (size > this->total_size - this->offset) {
+        throw EvBuffer::insufficient_data();
+      }
+    }
+
+    EvBuffer* buf;
+    const uint8_t* data;
+    size_t total_size;
+    size_t offset;
+  };
+
+  class Cursor;
+
+  // A read-only view of the data at the beginning of a buffer, which exposes
+  // the buffer's chains directly (via evbuffer_peek) without copying them.
+  // The view is invalidated by any operation that modifies the buffer, except
+  // for consume(), which drains the buffer and leaves the view empty. The
+  // usual pattern is to parse a message with a Cursor, then consume the
+  // cursor's position only if the message was complete.
+  class View {
+  public:
+    // If size is negative, the view covers the entire buffer
+    explicit View(EvBuffer& buf, ssize_t size = -1);
+    View(const View&) = delete;
+    View(View&&) = delete;
+    View& operator=(const View&) = delete;
+    View& operator=(View&&) = delete;
+    ~View() = default;
+
+    inline size_t size() const {
+      return this->total_size;
+    }
+    inline size_t chain_count() const {
+      return this->num_vecs;
+    }
+    inline std::span<const uint8_t> chain(size_t index) const {
+      const auto& vec = this->vecs[index];
+      return std::span<const uint8_t>(
+          reinterpret_cast<const uint8_t*>(vec.iov_base), vec.iov_len);
+    }
+
+    Cursor cursor() const;
+
+    // Drains size bytes from the buffer and empties the view
+    void consume(size_t size);
+
+  private:
+    friend class Cursor;
+
+    static constexpr size_t NUM_INLINE_VECS = 8;
+
+    EvBuffer* buf;
+    size_t total_size;
+    size_t num_vecs;
+    struct evbuffer_iovec* vecs;
+    struct evbuffer_iovec inline_vecs[NUM_INLINE_VECS];
+    std::vector<struct evbuffer_iovec> heap_vecs;
+  };
+
+  // Reads data from a View. Reads that span chain boundaries are handled
+  // transparently; reads that don't are a single memcpy. All functions that
+  // read data throw insufficient_data (without moving the cursor) if there
+  // isn't enough data in the view.
+  class Cursor {
+  public:
+    explicit Cursor(const View& view);
+    Cursor(const Cursor& other) = default;
+    Cursor& operator=(const Cursor& other) = default;
+    ~Cursor() = default;
+
+    inline size_t position() const {
+      return this->pos;
+    }
+    inline size_t remaining() const {
+      return this->view->total_size - this->pos;
+    }
+    inline bool eof() const {
+      return this->pos >= this->view->total_size;
+    }
+
+    void skip(size_t size);
+
+    inline void read(void* data, size_t size) {
+      if (this->chain_index < this->view->num_vecs) {
+        const auto& vec = this->view->vecs[this->chain_index];
+        // A read that ends exactly at the end of the chain leaves the cursor
+        // there; the next read moves to the following chain via read_slow
+        if (this->chain_offset + size <= vec.iov_len) {
+          memcpy(data, reinterpret_cast<const uint8_t*>(vec.iov_base) + this->chain_offset, size);
+          this->chain_offset += size;
+          this->pos += size;
+          return;
+        }
+      }
+      this->read_slow(data, size);
+    }
+    std::string read(size_t size);
+
+    // Returns true if the next size bytes are all in the same chain
+    bool is_contiguous(size_t size) const;
+    // Returns a view of the next size bytes and advances past them. If the
+    // bytes are contiguous, the view points directly into the buffer;
+    // otherwise, they're copied into scratch and the view points there.
+    std::string_view read_view(size_t size, std::string& scratch);
+
+    // Returns the offset of the first occurrence of the given byte or string
+    // after the cursor, relative to the cursor, or -1 if not found. Matches may
+    // span chain boundaries. Doesn't move the cursor.
+    ssize_t find(uint8_t ch) const;
+    ssize_t find(std::string_view needle) const;
+
+    template <typename T, std::enable_if_t<std::is_pod_v<T>, bool> = true>
+    T get() {
+      T ret;
+      this->read(&ret, sizeof(T));
+      return ret;
+    }
+
+    inline uint8_t get_u8() { return this->get<uint8_t>(); }
+    inline int8_t get_s8() { return this->get<int8_t>(); }
+    inline uint16_t get_u16b() { return this->get<be_uint16_t>(); }
+    inline int16_t get_s16b() { return this->get<be_int16_t>(); }
+    inline uint16_t get_u16l() { return this->get<le_uint16_t>(); }
+    inline int16_t get_s16l() { return this->get<le_int16_t>(); }
+    inline uint32_t get_u32b() { return this->get<be_uint32_t>(); }
+    inline int32_t get_s32b() { return this->get<be_int32_t>(); }
+    inline uint32_t get_u32l() { return this->get<le_uint32_t>(); }
+    inline int32_t get_s32l() { return this->get<le_int32_t>(); }
+    inline uint64_t get_u64b() { return this->get<be_uint64_t>(); }
+    inline int64_t get_s64b() { return this->get<be_int64_t>(); }
+    inline uint64_t get_u64l() { return this->get<le_uint64_t>(); }
+    inline int64_t get_s64l() { return this->get<le_int64_t>(); }
+
+  private:
+    void read_slow(void* data, size_t size);
+    void advance(size_t size);
+
+    const View* view;
+    size_t pos;
+    size_t chain_index;
+    size_t chain_offset;
+  };
+
+  // Writes data directly into a buffer's free space, instead of calling
+  // evbuffer_add once per field. size_hint should be the size of the message
+  // being written (or an upper bound on it): the constructor reserves that
+  // much with a single evbuffer_reserve_space call, so writing the message
+  // only has to check and advance a pointer for each field. Writes that don't
+  // fit in the reservation reserve more space (at least size_hint bytes at a
+  // time). Written data is committed with a single evbuffer_commit_space call
+  // when commit() is called or the Writer is destroyed. No other operations
+  // may be done on the buffer from when the Writer is constructed until then.
+  class Writer {
+  public:
+    explicit Writer(EvBuffer* buf, size_t size_hint = 0x100);
+    Writer(const Writer&) = delete;
+    Writer(Writer&&) = delete;
+    Writer& operator=(const Writer&) = delete;
+    Writer& operator=(Writer&&) = delete;
+    ~Writer();
+
+    // Returns the number of bytes written so far (committed or not)
+    inline size_t size() const {
+      return this->bytes_committed + (this->pos - this->start);
+    }
+
+    inline void add(const void* data, size_t size) {
+      if (static_cast<size_t>(this->end - this->pos) < size) {
+        this->reserve(size);
+      }
+      memcpy(this->pos, data, size);
+      this->pos += size;
+    }
+    inline void add(const std::string& data) {
+      this->add(data.data(), data.size());
+    }
+    inline void add(std::string_view data) {
+      this->add(data.data(), data.size());
+    }
+
+    template <typename T, std::enable_if_t<std::is_pod_v<T>, bool> = true>
+    void add(const T& t) {
+      if (static_cast<size_t>(this->end - this->pos) < sizeof(T)) {
+        this->reserve(sizeof(T));
+      }
+      memcpy(this->pos, &t, sizeof(T));
+      this->pos += sizeof(T);
+    }
+
+    inline void add_u8(uint8_t v) { this->add<uint8_t>(v); }
+    inline void add_s8(int8_t v) { this->add<int8_t>(v); }
+    inline void add_u16b(uint16_t v) { this->add<be_uint16_t>(v); }
+    inline void add_s16b(int16_t v) { this->add<be_int16_t>(v); }
+    inline void add_u16l(uint16_t v) { this->add<le_uint16_t>(v); }
+    inline void add_s16l(int16_t v) { this->add<le_int16_t>(v); }
+    inline void add_u32b(uint32_t v) { this->add<be_uint32_t>(v); }
+    inline void add_s32b(int32_t v) { this->add<be_int32_t>(v); }
+    inline void add_u32l(uint32_t v) { this->add<le_uint32_t>(v); }
+    inline void add_s32l(int32_t v) { this->add<le_int32_t>(v); }
+    inline void add_u64b(uint64_t v) { this->add<be_uint64_t>(v); }
+    inline void add_s64b(int64_t v) { this->add<be_int64_t>(v); }
+    inline void add_u64l(uint64_t v) { this->add<le_uint64_t>(v); }
+    inline void add_s64l(int64_t v) { this->add<le_int64_t>(v); }
+
+    // Makes all written data visible in the buffer. The Writer can still be
+    // used afterward.
+    void commit();
+
+  private:
+    void reserve(size_t size);
+
+    EvBuffer* buf;
+    size_t size_hint;
+    size_t bytes_committed;
+    struct evbuffer_iovec vec;
+    uint8_t* start;
+    uint8_t* pos;
+    uint8_t* end;
+  };
+
   class LockGuard {
   public:
     LockGuard(EvBuffer* buf);
@@ -69,6 +383,12 @@ struct EvBuffer {
   inline BoundedReader bounded_reader(size_t remaining) {
     return BoundedReader(this, remaining);
   }
+  inline StructReader struct_reader(size_t size) {
+    return StructReader(this, size);
+  }
+  inline Writer writer(size_t size_hint = 0x100) {
+    return Writer(this, size_hint);
+  }
 
   void enable_locking(void* lock = nullptr);
   void lock();
@@ -202,6 +522,10 @@ struct EvBuffer {
       std::function<void(const void* data, size_t size)> cleanup_fn);
 
   void add_file(int fd, off_t offset, size_t size);
+  // Adds part of a file segment to the buffer. The segment is reference
+  // counted, so the same segment (and file descriptor) can be added to many
+  // buffers at once.
+  void add_file_segment(struct evbuffer_file_segment* seg, off_t offset, size_t size);
 
   void add_buffer_reference(struct evbuffer* other_buf);
   void add_buffer_reference(EvBuffer& other_buf);
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include "EvBuffer.hh"
+
+using namespace std;
+
+static uint64_t now_nsecs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void benchmark_length_prefixed_parsing() {
+  // Messages are a 32-bit big-endian size followed by the payload. The input
+  // arrives in fixed-size reads, so messages are frequently split across
+  // chains and parsing has to stop at incomplete ones.
+  static constexpr size_t NUM_MESSAGES = 1000000;
+  static constexpr size_t READ_SIZE = 0x4000;
+  for (size_t max_payload_size : {16, 256, 2048}) {
+    mt19937 rng(max_payload_size);
+    string stream;
+    for (size_t z = 0; z < NUM_MESSAGES; z++) {
+      uint32_t size = 1 + (rng() % max_payload_size);
+      be_uint32_t size_be = size;
+      stream.append(reinterpret_cast<const char*>(&size_be), sizeof(size_be));
+      stream.append(size, static_cast<char>('a' + (z % 26)));
+    }
+
+    uint64_t times[2];
+    uint64_t checksums[2] = {0, 0};
+    for (size_t mode = 0; mode < 2; mode++) {
+      EvBuffer buf;
+      string scratch;
+      size_t num_parsed = 0;
+      uint64_t start = now_nsecs();
+      for (size_t offset = 0; offset < stream.size(); offset += READ_SIZE) {
+        buf.add(stream.data() + offset, min<size_t>(READ_SIZE, stream.size() - offset));
+        if (mode == 0) {
+          while (buf.get_length() >= sizeof(be_uint32_t)) {
+            uint32_t size = buf.copyout<be_uint32_t>();
+            if (buf.get_length() < sizeof(be_uint32_t) + size) {
+              break;
+            }
+            buf.drain(sizeof(be_uint32_t));
+            string payload = buf.remove(size);
+            checksums[mode] += static_cast<uint8_t>(payload.back());
+            num_parsed++;
+          }
+        } else {
+          EvBuffer::View view(buf);
+          auto cursor = view.cursor();
+          size_t consumed = 0;
+          while (cursor.remaining() >= sizeof(be_uint32_t)) {
+            uint32_t size = cursor.get_u32b();
+            if (cursor.remaining() < size) {
+              break;
+            }
+            string_view payload = cursor.read_view(size, scratch);
+            checksums[mode] += static_cast<uint8_t>(payload.back());
+            consumed = cursor.position();
+            num_parsed++;
+          }
+          view.consume(consumed);
+        }
+      }
+      times[mode] = now_nsecs() - start;
+      if (num_parsed != NUM_MESSAGES) {
+        throw logic_error("incorrect message count");
+      }
+    }
+    if (checksums[0] != checksums[1]) {
+      throw logic_error("parsers returned different data");
+    }
+
+    printf("payloads up to %4zu bytes: remove() %6.1f ns/message, View %6.1f ns/message\n",
+        max_payload_size, static_cast<double>(times[0]) / NUM_MESSAGES,
+        static_cast<double>(times[1]) / NUM_MESSAGES);
+  }
+}
+
+static void benchmark_struct_reader() {
+  // Each header is 20 big-endian 32-bit fields
+  static constexpr size_t NUM_HEADERS = 200000;
+  static constexpr size_t NUM_FIELDS = 20;
+  uint64_t times[2];
+  uint64_t sums[2] = {0, 0};
+  for (size_t mode = 0; mode < 2; mode++) {
+    EvBuffer buf;
+    for (size_t z = 0; z < NUM_HEADERS; z++) {
+      for (size_t f = 0; f < NUM_FIELDS; f++) {
+        buf.add_u32b(z + f);
+      }
+    }
+    uint64_t start = now_nsecs();
+    if (mode == 0) {
+      while (buf.get_length()) {
+        for (size_t f = 0; f < NUM_FIELDS; f++) {
+          sums[mode] += buf.remove_u32b();
+        }
+      }
+    } else {
+      while (buf.get_length()) {
+        auto r = buf.struct_reader(NUM_FIELDS * sizeof(be_uint32_t));
+        for (size_t f = 0; f < NUM_FIELDS; f++) {
+          sums[mode] += r.get_u32b();
+        }
+        r.finish();
+      }
+    }
+    times[mode] = now_nsecs() - start;
+  }
+  if (sums[0] != sums[1]) {
+    throw logic_error("readers returned different data");
+  }
+  printf("%zu-field header: remove_u32b() %6.1f ns/header, StructReader %6.1f ns/header\n",
+      NUM_FIELDS, static_cast<double>(times[0]) / NUM_HEADERS,
+      static_cast<double>(times[1]) / NUM_HEADERS);
+}
+
+static void benchmark_writer() {
+  // Each message has 7 fields of various sizes (28 bytes in total); the
+  // buffer is drained every 1000 messages, as if it were being written to a
+  // socket
+  static constexpr size_t NUM_MESSAGES = 2000000;
+  static constexpr size_t MESSAGE_SIZE = 28;
+  uint64_t times[2];
+  size_t lengths[2] = {0, 0};
+  for (size_t mode = 0; mode < 2; mode++) {
+    EvBuffer buf;
+    uint64_t start = now_nsecs();
+    for (size_t z = 0; z < NUM_MESSAGES; z++) {
+      if (mode == 0) {
+        buf.add_u8(0x82);
+        buf.add_u8(z & 0x7F);
+        buf.add_u16b(z);
+        buf.add_u32b(z);
+        buf.add_u64b(z);
+        buf.add_u32l(z);
+        buf.add_u64l(z);
+      } else {
+        auto w = buf.writer(MESSAGE_SIZE);
+        w.add_u8(0x82);
+        w.add_u8(z & 0x7F);
+        w.add_u16b(z);
+        w.add_u32b(z);
+        w.add_u64b(z);
+        w.add_u32l(z);
+        w.add_u64l(z);
+      }
+      if ((z % 1000) == 999) {
+        lengths[mode] += buf.get_length();
+        buf.drain_all();
+      }
+    }
+    times[mode] = now_nsecs() - start;
+  }
+  if ((lengths[0] != lengths[1]) || (lengths[0] != NUM_MESSAGES * MESSAGE_SIZE)) {
+    throw logic_error("writers produced different amounts of data");
+  }
+  printf("7-field message: add_*() %6.1f ns/message, Writer %6.1f ns/message\n",
+      static_cast<double>(times[0]) / NUM_MESSAGES,
+      static_cast<double>(times[1]) / NUM_MESSAGES);
+}
+
+static const struct {
+  const char* name;
+  void (*fn)();
+} benchmarks[] = {
+    {"view", benchmark_length_prefixed_parsing},
+    {"struct-reader", benchmark_struct_reader},
+    {"writer", benchmark_writer},
+};
+
+int main(int argc, char** argv) {
+  bool found = false;
+  for (const auto& b : benchmarks) {
+    if ((argc < 2) || !strcmp(argv[1], b.name)) {
+      printf("-- %s\n", b.name);
+      b.fn();
+      found = true;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -88,6 +88,11 @@ unordered_map<string, string> EvHTTPRequest::parse_url_params_unique(
   return ret;
 }
 
+HTTPQueryView EvHTTPRequest::get_query_view() const {
+  const struct evhttp_uri* uri = evhttp_request_get_evhttp_uri(this->req);
+  return HTTPQueryView(uri ? evhttp_uri_get_query(uri) : nullptr);
+}
+
 enum evhttp_cmd_type EvHTTPRequest::get_command() const {
   return evhttp_request_get_command(this->req);
 }
@@ -7,6 +7,7 @@
 #include <unordered_map>
 
 #include "EvBuffer.hh"
+#include "HTTPQuery.hh"
 
 class EvHTTPRequest {
 public:
@@ -22,6 +23,10 @@ public:
       const char* query = nullptr);
   std::unordered_map<std::string, std::string> parse_url_params_unique(
       const char* query = nullptr);
+  // Returns a view of the request's query string that parses parameters
+  // lazily, without copying them. The view is valid as long as the request
+  // is.
+  HTTPQueryView get_query_view() const;
 
   enum evhttp_cmd_type get_command() const;
   struct evhttp_connection* get_connection();
@@ -2,57 +2,174 @@
 
 #include <phosg/Time.hh>
 
+#include "LoopMonitor.hh"
+
 using namespace std;
 
+EventSlab::EventSlab(size_t events_per_chunk)
+    : event_size((event_get_struct_event_size() + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1)),
+      events_per_chunk(events_per_chunk ? events_per_chunk : 1),
+      free_head(nullptr),
+      num_allocated(0) {}
+
+struct event* EventSlab::allocate() {
+  if (!this->free_head) {
+    // new[] returns memory aligned for any fundamental type, and event_size
+    // is a multiple of that alignment, so every block is suitably aligned
+    auto& chunk = this->chunks.emplace_back(new uint8_t[this->event_size * this->events_per_chunk]);
+    for (size_t z = this->events_per_chunk; z > 0; z--) {
+      FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk.get() + (z - 1) * this->event_size);
+      block->next = this->free_head;
+      this->free_head = block;
+    }
+  }
+  FreeBlock* block = this->free_head;
+  this->free_head = block->next;
+  this->num_allocated++;
+  return reinterpret_cast<struct event*>(block);
+}
+
+void EventSlab::free(struct event* ev) {
+  FreeBlock* block = reinterpret_cast<FreeBlock*>(ev);
+  block->next = this->free_head;
+  this->free_head = block;
+  this->num_allocated--;
+}
+
+InlineEventStorage::InlineEventStorage() {
+  if (event_get_struct_event_size() > InlineEventStorage::MAX_SIZE) {
+    throw logic_error("struct event is too large for inline storage");
+  }
+}
+
 Event::Event()
     : event(nullptr),
-      owned(false) {}
+      owned(false),
+      storage_type(StorageType::EVENT_NEW),
+      slab(nullptr) {}
 
 Event::Event(EventBase& base, evutil_socket_t fd, short what)
     : event(event_new(base.get(), fd, what, &Event::dispatch_on_trigger, this)),
-      owned(true) {
+      owned(true),
+      storage_type(StorageType::EVENT_NEW),
+      slab(nullptr) {
   if (!this->event) {
     throw runtime_error("event_new");
   }
 }
 
+Event::Event(EventStorage storage, EventBase& base, evutil_socket_t fd, short what)
+    : event(storage.slab ? storage.slab->allocate() : storage.ev),
+      owned(true),
+      storage_type(storage.slab
+              ? StorageType::SLAB
+              : (storage.embedded ? StorageType::EMBEDDED : StorageType::EXTERNAL)),
+      slab(storage.slab) {
+  if (event_assign(this->event, base.get(), fd, what, &Event::dispatch_on_trigger, this)) {
+    if (this->slab) {
+      this->slab->free(this->event);
+    }
+    throw runtime_error("event_assign");
+  }
+}
+
 Event::Event(struct event* ev)
     : event(ev),
-      owned(false) {}
+      owned(false),
+      storage_type(StorageType::EVENT_NEW),
+      slab(nullptr) {}
 
 Event::Event(const Event& other)
     : event(other.event),
-      owned(false) {}
+      owned(false),
+      storage_type(StorageType::EVENT_NEW),
+      slab(nullptr) {}
 
 Event::Event(Event&& other)
     : event(other.event),
-      owned(other.owned) {
+      owned(other.owned),
+      storage_type(other.storage_type),
+      slab(other.slab) {
+  other.check_movable();
+  this->take_callback_from(&other);
   other.owned = false;
 }
 
 Event& Event::operator=(const Event& other) {
-  if (this->owned && this->event) {
-    event_free(this->event);
-  }
+  this->release();
   this->event = other.event;
   this->owned = false;
+  this->storage_type = StorageType::EVENT_NEW;
+  this->slab = nullptr;
   return *this;
 }
 
 Event& Event::operator=(Event&& other) {
-  if (this->owned && this->event) {
-    event_free(this->event);
+  if (this == &other) {
+    return *this;
   }
+  other.check_movable();
+  this->release();
   this->event = other.event;
   this->owned = other.owned;
+  this->storage_type = other.storage_type;
+  this->slab = other.slab;
+  this->take_callback_from(&other);
   other.owned = false;
   return *this;
 }
 
 Event::~Event() {
-  if (this->owned && this->event) {
-    event_free(this->event);
+  this->release();
+}
+
+bool Event::calls_back_to(const Event* ev) const {
+  return this->owned && this->event &&
+      (event_get_callback(this->event) == &Event::dispatch_on_trigger) &&
+      (event_get_callback_arg(this->event) == ev);
+}
+
+void Event::check_movable() const {
+  if (this->owned && (this->storage_type == StorageType::EMBEDDED)) {
+    throw logic_error("cannot move an event whose storage is embedded in it");
+  }
+  // libevent refers to the Event object by address, and there's no public API
+  // to change the callback argument of a pending or active event
+  if (this->calls_back_to(this) &&
+      event_pending(this->event, EV_TIMEOUT | EV_READ | EV_WRITE | EV_SIGNAL, nullptr)) {
+    throw logic_error("cannot move a pending or active event");
+  }
+}
+
+void Event::take_callback_from(const Event* other) {
+  if (!this->calls_back_to(other)) {
+    return;
+  }
+  if (event_assign(this->event, event_get_base(this->event),
+          event_get_fd(this->event), event_get_events(this->event),
+          &Event::dispatch_on_trigger, this)) {
+    throw runtime_error("event_assign");
+  }
+}
+
+void Event::release() {
+  if (!this->owned || !this->event) {
+    return;
+  }
+  switch (this->storage_type) {
+    case StorageType::EVENT_NEW:
+      event_free(this->event);
+      break;
+    case StorageType::EXTERNAL:
+    case StorageType::EMBEDDED:
+      event_del(this->event);
+      break;
+    case StorageType::SLAB:
+      event_del(this->event);
+      this->slab->free(this->event);
+      break;
   }
+  this->owned = false;
 }
 
 void Event::add(const struct timeval* tv) {
@@ -123,6 +240,7 @@ void Event::on_trigger(evutil_socket_t, short) {
 }
 
 void Event::dispatch_on_trigger(evutil_socket_t fd, short what, void* ctx) {
+  LoopMonitor::CallbackScope scope(LoopMonitor::Trampoline::EVENT_TRIGGER);
   Event* ev = reinterpret_cast<Event*>(ctx);
   ev->on_trigger(fd, what);
 }
@@ -137,6 +255,14 @@ TimeoutEvent::TimeoutEvent(EventBase& base, uint64_t usecs, bool persist)
     : Event(base, -1, EV_TIMEOUT | (persist ? EV_PERSIST : 0)),
       tv(usecs_to_timeval(usecs)) {}
 
+TimeoutEvent::TimeoutEvent(EventStorage storage, EventBase& base, const struct timeval* tv, bool persist)
+    : Event(storage, base, -1, EV_TIMEOUT | (persist ? EV_PERSIST : 0)),
+      tv(*tv) {}
+
+TimeoutEvent::TimeoutEvent(EventStorage storage, EventBase& base, uint64_t usecs, bool persist)
+    : Event(storage, base, -1, EV_TIMEOUT | (persist ? EV_PERSIST : 0)),
+      tv(usecs_to_timeval(usecs)) {}
+
 TimeoutEvent::TimeoutEvent(const TimeoutEvent& other)
     : Event(other),
       tv(other.tv) {}
@@ -167,24 +293,18 @@ CallbackEvent::CallbackEvent()
     : Event(),
       fn(nullptr) {}
 
-CallbackEvent::CallbackEvent(EventBase& base, std::function<void()> fn, bool persist)
+CallbackEvent::CallbackEvent(EventBase& base, InlineFunction<void()> fn, bool persist)
     : Event(base, -1, EV_TIMEOUT | (persist ? EV_PERSIST : 0)),
       fn(std::move(fn)) {}
 
-CallbackEvent::CallbackEvent(const CallbackEvent& other)
-    : Event(other),
-      fn(other.fn) {}
+CallbackEvent::CallbackEvent(EventStorage storage, EventBase& base, InlineFunction<void()> fn, bool persist)
+    : Event(storage, base, -1, EV_TIMEOUT | (persist ? EV_PERSIST : 0)),
+      fn(std::move(fn)) {}
 
 CallbackEvent::CallbackEvent(CallbackEvent&& other)
     : Event(std::move(other)),
       fn(std::move(other.fn)) {}
 
-CallbackEvent& CallbackEvent::operator=(const CallbackEvent& other) {
-  this->Event::operator=(other);
-  this->fn = other.fn;
-  return *this;
-}
-
 CallbackEvent& CallbackEvent::operator=(CallbackEvent&& other) {
   this->Event::operator=(std::move(other));
   this->fn = std::move(other.fn);
@@ -207,6 +327,9 @@ SignalEvent::SignalEvent() : Event() {}
 SignalEvent::SignalEvent(EventBase& base, int signum)
     : Event(base, signum, EV_SIGNAL | EV_PERSIST) {}
 
+SignalEvent::SignalEvent(EventStorage storage, EventBase& base, int signum)
+    : Event(storage, base, signum, EV_SIGNAL | EV_PERSIST) {}
+
 SignalEvent::SignalEvent(const SignalEvent& other) : Event(other) {}
 
 SignalEvent::SignalEvent(SignalEvent&& other) : Event(std::move(other)) {}
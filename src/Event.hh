@@ -1,17 +1,74 @@
 #pragma once
 
 #include <event2/event.h>
+#include <stdint.h>
 
+#include <cstddef>
 #include <memory>
+#include <vector>
 
 #include "EventBase.hh"
+#include "InlineFunction.hh"
+
+// A slab allocator for struct events. Events constructed with an EventSlab get
+// their struct event from the slab's free list instead of from event_new, and
+// return it there when destroyed. Slabs are not thread-safe; use one per
+// EventBase (that is, per event loop thread). All events allocated from a slab
+// must be destroyed before the slab is.
+class EventSlab {
+public:
+  explicit EventSlab(size_t events_per_chunk = 64);
+  EventSlab(const EventSlab&) = delete;
+  EventSlab(EventSlab&&) = delete;
+  EventSlab& operator=(const EventSlab&) = delete;
+  EventSlab& operator=(EventSlab&&) = delete;
+  ~EventSlab() = default;
+
+  struct event* allocate();
+  void free(struct event* ev);
+
+  inline size_t allocated_count() const {
+    return this->num_allocated;
+  }
+
+private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  size_t event_size;
+  size_t events_per_chunk;
+  std::vector<std::unique_ptr<uint8_t[]>> chunks;
+  FreeBlock* free_head;
+  size_t num_allocated;
+};
 
-// TODO: should we support unallocated event structs (e.g. via event_assign)?
+// Specifies where an Event's struct event lives, for events that aren't
+// allocated with event_new. See EventSlab and InlineEvent. embedded means the
+// struct event is part of the Event object itself, so the Event can't be moved.
+struct EventStorage {
+  struct event* ev;
+  EventSlab* slab;
+  bool embedded;
+
+  EventStorage(EventSlab& slab) : ev(nullptr), slab(&slab), embedded(false) {}
+  explicit EventStorage(struct event* ev, bool embedded = false)
+      : ev(ev), slab(nullptr), embedded(embedded) {}
+};
 
+// Owning Events can be moved only while they aren't pending or active, since
+// libevent calls them back by address; moving an armed event throws
+// logic_error. Events whose struct event is embedded in them (InlineEvents)
+// can't be moved at all, even via a base class's move constructor, since the
+// destination would point into the source object. Copies are non-owning and
+// don't change the callback target.
 class Event {
 public:
   Event();
   Event(EventBase& base, evutil_socket_t fd, short what);
+  // Initializes the event with event_assign instead of event_new. The storage
+  // must outlive this object.
+  Event(EventStorage storage, EventBase& base, evutil_socket_t fd, short what);
   explicit Event(struct event* ev);
   Event(const Event& ev);
   Event(Event&& ev);
@@ -36,11 +93,24 @@ public:
   struct event* get();
 
 protected:
+  enum class StorageType {
+    EVENT_NEW = 0,
+    EXTERNAL,
+    EMBEDDED,
+    SLAB,
+  };
+
   virtual void on_trigger(evutil_socket_t fd, short what);
   static void dispatch_on_trigger(evutil_socket_t fd, short what, void* ctx);
+  bool calls_back_to(const Event* ev) const;
+  void check_movable() const;
+  void take_callback_from(const Event* other);
+  void release();
 
   struct event* event;
   bool owned;
+  StorageType storage_type;
+  EventSlab* slab;
 };
 
 class TimeoutEvent : public Event {
@@ -48,6 +118,8 @@ public:
   TimeoutEvent();
   TimeoutEvent(EventBase& base, const struct timeval* tv, bool persist = false);
   TimeoutEvent(EventBase& base, uint64_t usecs, bool persist = false);
+  TimeoutEvent(EventStorage storage, EventBase& base, const struct timeval* tv, bool persist = false);
+  TimeoutEvent(EventStorage storage, EventBase& base, uint64_t usecs, bool persist = false);
   TimeoutEvent(const TimeoutEvent& ev);
   TimeoutEvent(TimeoutEvent&& ev);
   TimeoutEvent& operator=(const TimeoutEvent& ev);
@@ -63,10 +135,13 @@ protected:
 class CallbackEvent : public Event {
 public:
   CallbackEvent();
-  CallbackEvent(EventBase& base, std::function<void()> fn, bool persist = false);
-  CallbackEvent(const CallbackEvent& ev);
+  CallbackEvent(EventBase& base, InlineFunction<void()> fn, bool persist = false);
+  CallbackEvent(EventStorage storage, EventBase& base, InlineFunction<void()> fn, bool persist = false);
+  // The callback is only ever called through the owning object, so copies
+  // would be useless
+  CallbackEvent(const CallbackEvent& ev) = delete;
   CallbackEvent(CallbackEvent&& ev);
-  CallbackEvent& operator=(const CallbackEvent& ev);
+  CallbackEvent& operator=(const CallbackEvent& ev) = delete;
   CallbackEvent& operator=(CallbackEvent&& ev);
   virtual ~CallbackEvent() = default;
 
@@ -78,16 +153,53 @@ public:
 
 protected:
   virtual void on_trigger(evutil_socket_t fd, short what);
-  std::function<void()> fn;
+  InlineFunction<void()> fn;
 };
 
 class SignalEvent : public Event {
 public:
   SignalEvent();
   SignalEvent(EventBase& base, int signum);
+  SignalEvent(EventStorage storage, EventBase& base, int signum);
   SignalEvent(const SignalEvent& ev);
   SignalEvent(SignalEvent&& ev);
   SignalEvent& operator=(const SignalEvent& ev);
   SignalEvent& operator=(SignalEvent&& ev);
   virtual ~SignalEvent() = default;
 };
+
+// Space for a struct event inside another object. libevent doesn't expose the
+// struct's size at compile time, so this reserves enough space for current
+// libevent versions and checks event_get_struct_event_size() at runtime.
+class InlineEventStorage {
+protected:
+  InlineEventStorage();
+
+  inline struct event* get_inline_event() {
+    return reinterpret_cast<struct event*>(this->inline_event_data);
+  }
+
+  static constexpr size_t MAX_SIZE = 192;
+  alignas(std::max_align_t) uint8_t inline_event_data[MAX_SIZE];
+};
+
+// An event whose struct event is embedded in the object, so constructing it
+// doesn't allocate memory and using it doesn't follow an extra pointer. For
+// example, InlineEvent<CallbackEvent> ev(base, fn) constructs a CallbackEvent
+// as if by CallbackEvent(base, fn). EventT must have a constructor that takes
+// an EventStorage followed by an EventBase&. InlineEvents can't be copied or
+// moved, since libevent refers to the struct event by address; moving one into
+// an EventT (e.g. CallbackEvent(std::move(inline_ev))) throws logic_error.
+template <typename EventT>
+class InlineEvent : private InlineEventStorage, public EventT {
+public:
+  template <typename... ArgsT>
+  explicit InlineEvent(EventBase& base, ArgsT&&... args)
+      : InlineEventStorage(),
+        EventT(EventStorage(this->get_inline_event(), true), base, std::forward<ArgsT>(args)...) {}
+  InlineEvent(const InlineEvent&) = delete;
+  InlineEvent(InlineEvent&&) = delete;
+  InlineEvent& operator=(const InlineEvent&) = delete;
+  InlineEvent& operator=(InlineEvent&&) = delete;
+  virtual ~InlineEvent() = default;
+};
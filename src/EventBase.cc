@@ -1,14 +1,227 @@
 #include "EventBase.hh"
 
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <atomic>
+#include <mutex>
 #include <phosg/Time.hh>
+#include <thread>
+#include <unordered_map>
 
 #include "Event.hh"
+#include "LoopMonitor.hh"
 
 using namespace std;
 
+// This is a bounded multi-producer single-consumer queue (based on Dmitry
+// Vyukov's bounded MPMC queue, with the consumer side simplified since only
+// the base's thread dequeues). Each slot has a sequence number which tells
+// producers and the consumer whether the slot is free or filled for the
+// current lap around the ring. Producers only write to the wakeup fd if no
+// wakeup is already pending, so a burst of posts costs one syscall and one
+// callback on the consumer side.
+//
+// close() may be called while other threads are in push(). Producers count
+// themselves in active_producers before checking the closed flag, and close()
+// waits for that count to reach zero before closing the fds, so a producer
+// never writes to a closed (or reused) fd.
+class EventBase::PostQueue {
+public:
+  PostQueue(struct event_base* base, size_t capacity)
+      : mask(0),
+        enqueue_pos(0),
+        dequeue_pos(0),
+        wakeup_pending(false),
+        closed(false),
+        active_producers(0),
+        read_fd(-1),
+        write_fd(-1),
+        event(nullptr) {
+    size_t num_slots = 1;
+    while (num_slots < capacity) {
+      num_slots <<= 1;
+    }
+    this->mask = num_slots - 1;
+    this->slots.reset(new Slot[num_slots]);
+    for (size_t z = 0; z < num_slots; z++) {
+      this->slots[z].sequence.store(z, memory_order_relaxed);
+    }
+
+#ifdef __linux__
+    this->read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->read_fd < 0) {
+      throw runtime_error("eventfd");
+    }
+    this->write_fd = this->read_fd;
+#else
+    int fds[2];
+    if (pipe(fds)) {
+      throw runtime_error("pipe");
+    }
+    this->read_fd = fds[0];
+    this->write_fd = fds[1];
+    for (int fd : fds) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    this->event = event_new(base, this->read_fd, EV_READ | EV_PERSIST,
+        &PostQueue::dispatch_on_wakeup, this);
+    if (!this->event) {
+      this->close_fds();
+      throw runtime_error("event_new");
+    }
+    if (event_add(this->event, nullptr)) {
+      event_free(this->event);
+      this->close_fds();
+      throw runtime_error("event_add");
+    }
+  }
+
+  PostQueue(const PostQueue&) = delete;
+  PostQueue(PostQueue&&) = delete;
+  PostQueue& operator=(const PostQueue&) = delete;
+  PostQueue& operator=(PostQueue&&) = delete;
+
+  ~PostQueue() {
+    this->close();
+  }
+
+  // Must be called on the base's thread (or after it has stopped)
+  void close() {
+    if (this->event) {
+      this->closed.store(true, memory_order_seq_cst);
+      while (this->active_producers.load(memory_order_seq_cst)) {
+        this_thread::yield();
+      }
+      event_free(this->event);
+      this->event = nullptr;
+      this->close_fds();
+    }
+  }
+
+  inline bool is_closed() const {
+    return this->closed.load(memory_order_relaxed);
+  }
+
+  bool push(InlineFunction<void()>&& fn) {
+    this->active_producers.fetch_add(1, memory_order_seq_cst);
+    bool ret = !this->closed.load(memory_order_seq_cst) && this->push_locked(std::move(fn));
+    this->active_producers.fetch_sub(1, memory_order_seq_cst);
+    return ret;
+  }
+
+protected:
+  struct Slot {
+    atomic<size_t> sequence;
+    InlineFunction<void()> fn;
+  };
+
+  unique_ptr<Slot[]> slots;
+  size_t mask;
+  atomic<size_t> enqueue_pos;
+  size_t dequeue_pos; // Only used by the base's thread
+  atomic<bool> wakeup_pending;
+  atomic<bool> closed;
+  atomic<size_t> active_producers;
+  int read_fd;
+  int write_fd;
+  struct event* event;
+
+  bool push_locked(InlineFunction<void()>&& fn) {
+    size_t pos = this->enqueue_pos.load(memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+      slot = &this->slots[pos & this->mask];
+      size_t seq = slot->sequence.load(memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (this->enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false; // Queue is full
+      } else {
+        pos = this->enqueue_pos.load(memory_order_relaxed);
+      }
+    }
+    slot->fn = std::move(fn);
+    slot->sequence.store(pos + 1, memory_order_release);
+
+    if (!this->wakeup_pending.exchange(true, memory_order_acq_rel)) {
+      this->wake();
+    }
+    return true;
+  }
+
+  void close_fds() {
+    if (this->write_fd != this->read_fd) {
+      ::close(this->write_fd);
+    }
+    ::close(this->read_fd);
+    this->read_fd = -1;
+    this->write_fd = -1;
+  }
+
+  void wake() {
+    uint64_t value = 1;
+    // If this fails with EAGAIN, the fd is already readable, so the base will
+    // wake up anyway
+    ssize_t ret = ::write(this->write_fd, &value, sizeof(value));
+    (void)ret;
+  }
+
+  bool pop(InlineFunction<void()>& fn) {
+    Slot& slot = this->slots[this->dequeue_pos & this->mask];
+    size_t seq = slot.sequence.load(memory_order_acquire);
+    if (seq != this->dequeue_pos + 1) {
+      return false; // Queue is empty, or a producer hasn't finished writing
+    }
+    fn = std::move(slot.fn);
+    slot.fn = nullptr;
+    slot.sequence.store(this->dequeue_pos + this->mask + 1, memory_order_release);
+    this->dequeue_pos++;
+    return true;
+  }
+
+  void on_wakeup() {
+    uint8_t data[64];
+    while (::read(this->read_fd, data, sizeof(data)) > 0) {
+    }
+
+    // This must be cleared before draining, so that a task pushed after we
+    // stop draining causes another wakeup. The exchange (rather than a plain
+    // store) makes sure we see all tasks whose producers saw the flag set.
+    this->wakeup_pending.exchange(false, memory_order_acq_rel);
+
+    // Run at most one queue's worth of tasks per callback, so producers can't
+    // starve the rest of the base's events
+    InlineFunction<void()> fn;
+    for (size_t z = 0; z <= this->mask; z++) {
+      if (!this->pop(fn)) {
+        return;
+      }
+      fn();
+    }
+    if (!this->wakeup_pending.exchange(true, memory_order_acq_rel)) {
+      this->wake();
+    }
+  }
+
+  static void dispatch_on_wakeup(evutil_socket_t, short, void* ctx) {
+    reinterpret_cast<PostQueue*>(ctx)->on_wakeup();
+  }
+};
+
 EventBase::EventBase()
     : base(event_base_new()),
-      owned(true) {
+      owned(true),
+      break_requested(false) {
   if (!this->base) {
     throw runtime_error("event_base_new");
   }
@@ -16,7 +229,8 @@ EventBase::EventBase()
 
 EventBase::EventBase(EventConfig& config)
     : base(event_base_new_with_config(config.get())),
-      owned(true) {
+      owned(true),
+      break_requested(false) {
   if (!this->base) {
     throw runtime_error("event_base_new_with_config");
   }
@@ -24,38 +238,84 @@ EventBase::EventBase(EventConfig& config)
 
 EventBase::EventBase(struct event_base* base)
     : base(base),
-      owned(false) {}
+      owned(false),
+      break_requested(false) {}
 
 EventBase::EventBase(const EventBase& other)
     : base(other.base),
-      owned(false) {}
+      owned(false),
+      break_requested(false),
+      post_queue(other.post_queue) {}
 
 EventBase::EventBase(EventBase&& other)
     : base(other.base),
-      owned(other.owned) {
+      owned(other.owned),
+      break_requested(false),
+      post_queue(std::move(other.post_queue)) {
   other.owned = false;
 }
 
 EventBase& EventBase::operator=(const EventBase& other) {
   this->base = other.base;
   this->owned = false;
+  this->post_queue = other.post_queue;
   return *this;
 }
 
 EventBase& EventBase::operator=(EventBase&& other) {
   this->base = other.base;
   this->owned = other.owned;
+  this->post_queue = std::move(other.post_queue);
   other.owned = false;
   return *this;
 }
 
 EventBase::~EventBase() {
   if (this->owned && this->base) {
+    // The queue's wakeup event must be freed before the base is, even if
+    // copies of this EventBase still refer to the queue
+    auto queue = EventBase::unregister_post_queue(this->base);
+    if (queue) {
+      queue->close();
+    }
+    this->free_once_records();
     event_base_free(this->base);
   }
 }
 
+// Post queues belong to the underlying event_base, not to the EventBase
+// wrapper, so that copies of an EventBase made before enable_post was called
+// can still find the queue.
+static mutex post_queues_lock;
+
+unordered_map<struct event_base*, shared_ptr<EventBase::PostQueue>>& EventBase::all_post_queues() {
+  static unordered_map<struct event_base*, shared_ptr<PostQueue>> ret;
+  return ret;
+}
+
+shared_ptr<EventBase::PostQueue> EventBase::find_post_queue(struct event_base* base) {
+  lock_guard<mutex> g(post_queues_lock);
+  auto& queues = EventBase::all_post_queues();
+  auto it = queues.find(base);
+  return (it == queues.end()) ? nullptr : it->second;
+}
+
+shared_ptr<EventBase::PostQueue> EventBase::unregister_post_queue(struct event_base* base) {
+  lock_guard<mutex> g(post_queues_lock);
+  auto& queues = EventBase::all_post_queues();
+  auto it = queues.find(base);
+  if (it == queues.end()) {
+    return nullptr;
+  }
+  auto ret = std::move(it->second);
+  queues.erase(it);
+  return ret;
+}
+
 bool EventBase::dispatch() {
+  if (LoopMonitor::is_enabled()) {
+    return this->loop_instrumented(0);
+  }
   int ret = event_base_dispatch(this->get());
   if (ret < 0) {
     throw runtime_error("event_base_dispatch");
@@ -64,6 +324,9 @@ bool EventBase::dispatch() {
 }
 
 bool EventBase::loop(int flags) {
+  if (LoopMonitor::is_enabled()) {
+    return this->loop_instrumented(flags);
+  }
   int ret = event_base_loop(this->base, flags);
   if (ret < 0) {
     throw runtime_error("event_base_loop");
@@ -71,6 +334,33 @@ bool EventBase::loop(int flags) {
   return (ret == 0);
 }
 
+bool EventBase::loop_instrumented(int flags) {
+  // libevent has no hooks for the start and end of each iteration, so we
+  // emulate a normal loop by running one iteration at a time
+  bool single_iteration = flags & (EVLOOP_ONCE | EVLOOP_NONBLOCK);
+  // Like event_base_loop, ignore breaks requested before the loop started
+  this->break_requested.store(false, memory_order_relaxed);
+  for (;;) {
+    int ret;
+    {
+      LoopMonitor::IterationScope scope;
+      ret = event_base_loop(this->base, flags | EVLOOP_ONCE);
+    }
+    if (ret < 0) {
+      throw runtime_error("event_base_loop");
+    }
+    if (single_iteration || (ret == 1) || this->got_exit() || this->got_break()) {
+      return (ret == 0);
+    }
+    if (this->break_requested.exchange(false, memory_order_relaxed)) {
+      return true;
+    }
+    if (!LoopMonitor::is_enabled()) {
+      return this->loop(flags);
+    }
+  }
+}
+
 void EventBase::loopexit(uint64_t usecs) {
   int ret;
   if (usecs) {
@@ -91,6 +381,7 @@ void EventBase::loopexit(const struct timeval* tv) {
 }
 
 void EventBase::loopbreak() {
+  this->break_requested.store(true, memory_order_relaxed);
   if (event_base_loopbreak(this->base)) {
     throw runtime_error("event_base_loopbreak");
   }
@@ -110,39 +401,142 @@ bool EventBase::got_break() const {
   return event_base_got_break(this->base);
 }
 
+// Once records hold the callback and the struct event for a single once()
+// call. The struct event immediately follows the record in memory; its size
+// isn't known at compile time, so the records are allocated as raw blocks.
+// After the callback runs, the record goes onto a free list belonging to the
+// thread that ran it, so in the steady state once() doesn't allocate at all.
+struct EventBase::OnceRecord {
+  OnceRecord* next_free;
+  InlineFunction<void(evutil_socket_t, short)> fd_cb;
+  InlineFunction<void()> cb;
+
+  inline struct event* get_event() {
+    return reinterpret_cast<struct event*>(
+        reinterpret_cast<uint8_t*>(this) + OnceRecord::event_offset());
+  }
+
+  static constexpr size_t event_offset() {
+    return (sizeof(OnceRecord) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+  }
+
+  static OnceRecord* allocate() {
+    auto& free_list = OnceRecord::free_list();
+    void* data;
+    if (free_list.head) {
+      data = free_list.head;
+      free_list.head = free_list.head->next_free;
+      free_list.count--;
+    } else {
+      data = ::operator new(OnceRecord::event_offset() + event_get_struct_event_size());
+    }
+    return new (data) OnceRecord();
+  }
+
+  static void free(OnceRecord* rec) {
+    rec->~OnceRecord();
+    auto& free_list = OnceRecord::free_list();
+    if (free_list.count >= OnceRecord::MAX_FREE_RECORDS) {
+      ::operator delete(rec);
+    } else {
+      rec->next_free = free_list.head;
+      free_list.head = rec;
+      free_list.count++;
+    }
+  }
+
+private:
+  static constexpr size_t MAX_FREE_RECORDS = 0x4000;
+
+  struct FreeList {
+    OnceRecord* head = nullptr;
+    size_t count = 0;
+
+    ~FreeList() {
+      while (this->head) {
+        OnceRecord* next = this->head->next_free;
+        ::operator delete(this->head);
+        this->head = next;
+      }
+    }
+  };
+
+  static FreeList& free_list() {
+    static thread_local FreeList fl;
+    return fl;
+  }
+};
+
 void EventBase::dispatch_once_cb(evutil_socket_t fd, short what, void* ctx) {
-  auto* fn = reinterpret_cast<function<void(evutil_socket_t, short)>*>(ctx);
-  (*fn)(fd, what);
-  delete fn;
+  // Move the callback out and release the record before calling it, so the
+  // callback can reuse the record if it calls once() again
+  auto* rec = reinterpret_cast<OnceRecord*>(ctx);
+  if (rec->fd_cb) {
+    auto fn = std::move(rec->fd_cb);
+    OnceRecord::free(rec);
+    fn(fd, what);
+  } else {
+    auto fn = std::move(rec->cb);
+    OnceRecord::free(rec);
+    fn();
+  }
 }
 
-void EventBase::dispatch_once_timeout_cb(evutil_socket_t, short, void* ctx) {
-  auto* fn = reinterpret_cast<function<void()>*>(ctx);
-  (*fn)();
-  delete fn;
+void EventBase::add_once_record(OnceRecord* rec, evutil_socket_t fd,
+    short what, const struct timeval* timeout) {
+  struct event* ev = rec->get_event();
+  if (event_assign(ev, this->base, fd, what & ~EV_PERSIST,
+          &EventBase::dispatch_once_cb, rec)) {
+    OnceRecord::free(rec);
+    throw runtime_error("event_assign");
+  }
+  // Like event_base_once, a pure timeout with no duration means the callback
+  // should be called on the next loop iteration
+  if (((what & (EV_TIMEOUT | EV_SIGNAL | EV_READ | EV_WRITE | EV_CLOSED)) == EV_TIMEOUT) && !timeout) {
+    event_active(ev, EV_TIMEOUT, 1);
+  } else if (event_add(ev, timeout)) {
+    OnceRecord::free(rec);
+    throw runtime_error("event_add");
+  }
+}
+
+void EventBase::free_once_records() {
+  // Callbacks that never ran would otherwise leak their records (and
+  // whatever their callables own) when the base is freed
+  vector<struct event*> events;
+  this->foreach_event_raw([&](const struct event* ev) -> int {
+    if (event_get_callback(ev) == &EventBase::dispatch_once_cb) {
+      events.emplace_back(const_cast<struct event*>(ev));
+    }
+    return 0;
+  });
+  for (struct event* ev : events) {
+    auto* rec = reinterpret_cast<OnceRecord*>(event_get_callback_arg(ev));
+    event_del(ev);
+    OnceRecord::free(rec);
+  }
 }
 
 void EventBase::once(
     evutil_socket_t fd,
     short what,
-    function<void(evutil_socket_t, short)> cb,
+    InlineFunction<void(evutil_socket_t, short)> cb,
     const struct timeval* timeout) {
-  // TODO: can we do this without an extra allocation?
-  auto fn = new function<void(evutil_socket_t, short)>(cb);
-  if (event_base_once(this->base, fd, what, &EventBase::dispatch_once_cb, fn,
-          timeout)) {
-    delete fn;
-    throw runtime_error("event_base_once");
+  if (what & EV_SIGNAL) {
+    throw invalid_argument("once() cannot be used for signals");
   }
+  OnceRecord* rec = OnceRecord::allocate();
+  rec->fd_cb = std::move(cb);
+  this->add_once_record(rec, fd, what, timeout);
 }
 
 void EventBase::once(
     evutil_socket_t fd,
     short what,
-    function<void(evutil_socket_t, short)> cb,
+    InlineFunction<void(evutil_socket_t, short)> cb,
     uint64_t timeout_usecs) {
   auto tv = usecs_to_timeval(timeout_usecs);
-  this->once(fd, what, cb, &tv);
+  this->once(fd, what, std::move(cb), &tv);
 }
 
 void EventBase::once(
@@ -167,29 +561,62 @@ void EventBase::once(
 }
 
 void EventBase::once(
-    function<void()> cb,
+    InlineFunction<void()> cb,
     uint64_t timeout_usecs) {
   auto tv = usecs_to_timeval(timeout_usecs);
-  this->once(cb, &tv);
+  this->once(std::move(cb), &tv);
 }
 
 void EventBase::once(
-    function<void()> cb,
+    InlineFunction<void()> cb,
     const struct timeval* timeout) {
-  // TODO: can we do this without an extra allocation?
-  auto fn = new function<void()>(cb);
-  if (event_base_once(this->base, -1, EV_TIMEOUT, &EventBase::dispatch_once_timeout_cb, fn, timeout)) {
-    delete fn;
-    throw runtime_error("event_base_once");
-  }
+  OnceRecord* rec = OnceRecord::allocate();
+  rec->cb = std::move(cb);
+  this->add_once_record(rec, -1, EV_TIMEOUT, timeout);
 }
 
-CallbackEvent EventBase::call_next(std::function<void()> cb) {
+unique_ptr<CallbackEvent> EventBase::call_next(InlineFunction<void()> cb) {
   return this->call_later(std::move(cb), 0);
 }
 
-CallbackEvent EventBase::call_later(std::function<void()> cb, uint64_t usecs) {
-  return CallbackEvent(*this, std::move(cb), usecs);
+unique_ptr<CallbackEvent> EventBase::call_later(InlineFunction<void()> cb, uint64_t usecs) {
+  auto ev = make_unique<CallbackEvent>(*this, std::move(cb));
+  ev->call_after_usecs(usecs);
+  return ev;
+}
+
+void EventBase::enable_post(size_t capacity) {
+  if (this->post_queue) {
+    return;
+  }
+  lock_guard<mutex> g(post_queues_lock);
+  auto& queue = EventBase::all_post_queues()[this->base];
+  if (!queue) {
+    queue = make_shared<PostQueue>(this->base, capacity);
+  }
+  this->post_queue = queue;
+}
+
+bool EventBase::try_post(InlineFunction<void()> fn) {
+  if (this->post_queue) {
+    return this->post_queue->push(std::move(fn));
+  }
+  // This EventBase was copied before enable_post was called on the original.
+  // The result isn't saved in this->post_queue, since other threads may be
+  // posting via this object concurrently.
+  auto queue = EventBase::find_post_queue(this->base);
+  if (!queue) {
+    throw logic_error("post() is not enabled on this EventBase");
+  }
+  return queue->push(std::move(fn));
+}
+
+void EventBase::post(InlineFunction<void()> fn) {
+  if (this->try_post(std::move(fn))) {
+    return;
+  }
+  auto queue = this->post_queue ? this->post_queue : EventBase::find_post_queue(this->base);
+  throw runtime_error((queue && !queue->is_closed()) ? "post queue is full" : "post queue is closed");
 }
 
 Event EventBase::get_running_event() {
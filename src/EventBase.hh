@@ -2,10 +2,14 @@
 
 #include <event2/event.h>
 
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include "EventConfig.hh"
+#include "InlineFunction.hh"
 
 class Event;
 class CallbackEvent;
@@ -21,6 +25,11 @@ public:
   EventBase& operator=(EventBase&& base);
   ~EventBase();
 
+  // If LoopMonitor is enabled, these run the loop one iteration at a time so
+  // each iteration can be measured. libevent forgets breaks requested between
+  // iterations, so loopbreak() also sets a flag on this object that the loop
+  // checks; in this mode, loopbreak() must be called on the same EventBase
+  // object that is running the loop (not a copy of it) to be reliable.
   bool dispatch();
   bool loop(int flags);
   void loopexit(uint64_t usecs);
@@ -30,15 +39,19 @@ public:
   bool got_exit() const;
   bool got_break() const;
 
+  // The once() variants that take a callable don't allocate memory for
+  // callables that fit in InlineFunction's inline storage: the callable and
+  // the struct event are stored in a record that's reused from a per-thread
+  // free list after the callback runs.
   void once(
       evutil_socket_t fd,
       short what,
-      std::function<void(evutil_socket_t, short)> cb,
+      InlineFunction<void(evutil_socket_t, short)> cb,
       const struct timeval* timeout);
   void once(
       evutil_socket_t fd,
       short what,
-      std::function<void(evutil_socket_t, short)> cb,
+      InlineFunction<void(evutil_socket_t, short)> cb,
       uint64_t timeout_usecs);
   void once(
       evutil_socket_t fd,
@@ -53,11 +66,30 @@ public:
       void* cbarg,
       uint64_t timeout_usecs);
 
-  void once(std::function<void()> cb, const struct timeval* timeout);
-  void once(std::function<void()> cb, uint64_t timeout_usecs = 0);
-
-  CallbackEvent call_next(std::function<void()> cb);
-  CallbackEvent call_later(std::function<void()> cb, uint64_t usecs);
+  void once(InlineFunction<void()> cb, const struct timeval* timeout);
+  void once(InlineFunction<void()> cb, uint64_t timeout_usecs = 0);
+
+  // The returned event is already scheduled, so it can't be moved (see Event);
+  // destroying it cancels the call.
+  std::unique_ptr<CallbackEvent> call_next(InlineFunction<void()> cb);
+  std::unique_ptr<CallbackEvent> call_later(InlineFunction<void()> cb, uint64_t usecs);
+
+  // post() runs a function on this base's thread. Unlike once(), it doesn't
+  // touch libevent on the calling thread, so it doesn't need libevent's
+  // locking and is safe to call from any thread. Tasks are queued in a bounded
+  // lock-free ring; many tasks posted in a short time are all run by a single
+  // wakeup callback. The queue belongs to the underlying event_base, so
+  // enable_post may be called on any EventBase object that refers to it, but
+  // it must be called before any thread calls post(). Copies made before
+  // enable_post was called look up the queue on each call, which is slower.
+  // try_post returns false if the queue is full or the base has been freed
+  // (posting via a copy made before enable_post throws logic_error instead
+  // once the base is freed); post throws in both cases.
+  // Callables are stored in the queue's slots, so posting one that fits in
+  // InlineFunction's inline storage doesn't allocate.
+  void enable_post(size_t capacity = 4096);
+  bool try_post(InlineFunction<void()> fn);
+  void post(InlineFunction<void()> fn);
 
   Event get_running_event();
   struct event* get_running_event_raw();
@@ -84,11 +116,22 @@ public:
   struct event_base* get();
 
 protected:
+  class PostQueue;
+  struct OnceRecord;
+
   static void dispatch_once_cb(evutil_socket_t fd, short what, void* ctx);
-  static void dispatch_once_timeout_cb(evutil_socket_t fd, short what, void* ctx);
+  void add_once_record(OnceRecord* rec, evutil_socket_t fd, short what,
+      const struct timeval* timeout);
+  void free_once_records();
+  bool loop_instrumented(int flags);
+  static std::unordered_map<struct event_base*, std::shared_ptr<PostQueue>>& all_post_queues();
+  static std::shared_ptr<PostQueue> find_post_queue(struct event_base* base);
+  static std::shared_ptr<PostQueue> unregister_post_queue(struct event_base* base);
   static int dispatch_foreach_event_raw_cb(const struct event_base* base,
       const struct event* event, void* ctx);
 
   struct event_base* base;
   bool owned;
+  std::atomic<bool> break_requested;
+  std::shared_ptr<PostQueue> post_queue;
 };
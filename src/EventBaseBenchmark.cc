@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "Event.hh"
+#include "EventBase.hh"
+#include "EventBasePool.hh"
+#include "TimerWheel.hh"
+
+using namespace std;
+
+static uint64_t now_nsecs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void benchmark_post_throughput() {
+  static constexpr size_t NUM_TASKS = 1000000;
+  for (size_t num_producers : {1, 2, 4, 8, 16}) {
+    for (bool use_post : {true, false}) {
+      EventBasePool pool(1);
+      EventBase& base = pool.get(0);
+      if (use_post) {
+        base.enable_post(4096);
+      }
+      pool.start();
+
+      atomic<size_t> num_run(0);
+      size_t tasks_per_producer = NUM_TASKS / num_producers;
+      uint64_t start = now_nsecs();
+      vector<thread> producers;
+      for (size_t z = 0; z < num_producers; z++) {
+        producers.emplace_back([&]() -> void {
+          for (size_t x = 0; x < tasks_per_producer; x++) {
+            if (use_post) {
+              while (!base.try_post([&num_run]() -> void { num_run++; })) {
+                this_thread::yield();
+              }
+            } else {
+              base.once([&num_run]() -> void { num_run++; });
+            }
+          }
+        });
+      }
+      for (auto& t : producers) {
+        t.join();
+      }
+      size_t expected = tasks_per_producer * num_producers;
+      while (num_run.load() < expected) {
+        this_thread::yield();
+      }
+      uint64_t elapsed = now_nsecs() - start;
+      pool.stop();
+
+      printf("%2zu producers, %-4s: %6.2fM tasks/s\n", num_producers,
+          use_post ? "post" : "once", expected * 1000.0 / elapsed);
+    }
+  }
+}
+
+static void benchmark_post_latency() {
+  static constexpr size_t NUM_SAMPLES = 20000;
+  for (bool use_post : {true, false}) {
+    EventBasePool pool(1);
+    EventBase& base = pool.get(0);
+    if (use_post) {
+      base.enable_post(4096);
+    }
+    pool.start();
+
+    // Each task records how long it took to start running after it was
+    // submitted; the next one isn't submitted until it has run, so the base's
+    // thread is idle (and has to be woken up) every time
+    vector<uint64_t> latencies(NUM_SAMPLES);
+    for (size_t z = 0; z < NUM_SAMPLES; z++) {
+      atomic<bool> done(false);
+      uint64_t* latency = &latencies[z];
+      uint64_t start = now_nsecs();
+      auto fn = [&done, latency, start]() -> void {
+        *latency = now_nsecs() - start;
+        done = true;
+      };
+      if (use_post) {
+        base.post(fn);
+      } else {
+        base.once(fn);
+      }
+      while (!done.load()) {
+        this_thread::yield();
+      }
+    }
+    pool.stop();
+
+    sort(latencies.begin(), latencies.end());
+    printf("%-4s wakeup latency: p50 %5.1f us, p99 %5.1f us, max %7.1f us\n",
+        use_post ? "post" : "once",
+        latencies[NUM_SAMPLES / 2] / 1000.0,
+        latencies[NUM_SAMPLES * 99 / 100] / 1000.0,
+        latencies.back() / 1000.0);
+  }
+}
+
+static void benchmark_timers() {
+  // This simulates client idle timeouts: every timer is scheduled once, then
+  // rescheduled (as if its client sent some data), then cancelled
+  for (size_t num_timers : {100000, 300000, 1000000}) {
+    mt19937 rng(num_timers);
+    vector<uint64_t> timeouts(num_timers);
+    for (auto& t : timeouts) {
+      t = 10000000 + (rng() % 20000000);
+    }
+
+    EventBase base;
+    uint64_t event_times[4];
+    {
+      uint64_t start = now_nsecs();
+      vector<TimeoutEvent> events;
+      events.reserve(num_timers);
+      for (size_t z = 0; z < num_timers; z++) {
+        events.emplace_back(base, timeouts[z]);
+        events.back().add();
+      }
+      event_times[0] = now_nsecs() - start;
+      start = now_nsecs();
+      for (size_t z = 0; z < num_timers; z++) {
+        events[z].Event::add(timeouts[num_timers - z - 1]);
+      }
+      event_times[1] = now_nsecs() - start;
+      start = now_nsecs();
+      for (auto& ev : events) {
+        ev.del();
+      }
+      event_times[2] = now_nsecs() - start;
+      start = now_nsecs();
+      events.clear();
+      event_times[3] = now_nsecs() - start;
+    }
+
+    uint64_t wheel_times[4];
+    {
+      TimerWheel wheel(base, 100000);
+      uint64_t start = now_nsecs();
+      unique_ptr<TimerWheel::Timer[]> timers(new TimerWheel::Timer[num_timers]);
+      for (size_t z = 0; z < num_timers; z++) {
+        wheel.schedule(timers[z], timeouts[z]);
+      }
+      wheel_times[0] = now_nsecs() - start;
+      start = now_nsecs();
+      for (size_t z = 0; z < num_timers; z++) {
+        wheel.schedule(timers[z], timeouts[num_timers - z - 1]);
+      }
+      wheel_times[1] = now_nsecs() - start;
+      start = now_nsecs();
+      for (size_t z = 0; z < num_timers; z++) {
+        wheel.cancel(timers[z]);
+      }
+      wheel_times[2] = now_nsecs() - start;
+      start = now_nsecs();
+      timers.reset();
+      wheel_times[3] = now_nsecs() - start;
+    }
+
+    static const char* phase_names[4] = {"create+add", "reschedule", "cancel", "destroy"};
+    for (size_t z = 0; z < 4; z++) {
+      printf("%7zu timers, %-10s: event_add %6.1f ns/timer, wheel %6.1f ns/timer\n",
+          num_timers, phase_names[z],
+          static_cast<double>(event_times[z]) / num_timers,
+          static_cast<double>(wheel_times[z]) / num_timers);
+    }
+  }
+  printf("memory per timer: TimeoutEvent %zu bytes + %zu-byte struct event, wheel Timer %zu bytes\n",
+      sizeof(TimeoutEvent), event_get_struct_event_size(), sizeof(TimerWheel::Timer));
+}
+
+static void benchmark_event_cycles() {
+  // Each cycle creates an event, schedules it, and destroys it, either while
+  // it's still pending or after one loop iteration has run it. The loop
+  // iteration calls into the backend (epoll_wait, even with EVLOOP_NONBLOCK),
+  // which costs more than allocating the event, so that phase shows smaller
+  // differences. The modes run in alternating rounds and the fastest round of
+  // each is reported, so that drift over the run (e.g. CPU frequency changes)
+  // doesn't favor whichever mode runs first.
+  static constexpr size_t NUM_CYCLES = 200000;
+  static constexpr size_t NUM_ROUNDS = 5;
+  EventBase base;
+  EventSlab slab;
+  for (bool fire : {false, true}) {
+    size_t num_fired = 0;
+    auto fn = [&num_fired]() -> void { num_fired++; };
+    uint64_t delay_usecs = fire ? 0 : 1000000;
+    uint64_t best_times[3] = {UINT64_MAX, UINT64_MAX, UINT64_MAX};
+    for (size_t round = 0; round < NUM_ROUNDS; round++) {
+      for (size_t mode = 0; mode < 3; mode++) {
+        uint64_t start = now_nsecs();
+        for (size_t z = 0; z < NUM_CYCLES; z++) {
+          if (mode == 0) {
+            CallbackEvent ev(base, fn);
+            ev.call_after_usecs(delay_usecs);
+            if (fire) {
+              base.loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
+            }
+          } else if (mode == 1) {
+            InlineEvent<CallbackEvent> ev(base, fn);
+            ev.call_after_usecs(delay_usecs);
+            if (fire) {
+              base.loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
+            }
+          } else {
+            CallbackEvent ev(slab, base, fn);
+            ev.call_after_usecs(delay_usecs);
+            if (fire) {
+              base.loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
+            }
+          }
+        }
+        best_times[mode] = min<uint64_t>(best_times[mode], now_nsecs() - start);
+      }
+    }
+    if (num_fired != (fire ? (NUM_ROUNDS * 3 * NUM_CYCLES) : 0)) {
+      throw logic_error("incorrect number of events fired");
+    }
+    printf("%-16s: event_new %6.1f ns/cycle, InlineEvent %6.1f ns/cycle, EventSlab %6.1f ns/cycle\n",
+        fire ? "add+fire+destroy" : "add+destroy",
+        static_cast<double>(best_times[0]) / NUM_CYCLES,
+        static_cast<double>(best_times[1]) / NUM_CYCLES,
+        static_cast<double>(best_times[2]) / NUM_CYCLES);
+  }
+}
+
+static const struct {
+  const char* name;
+  void (*fn)();
+} benchmarks[] = {
+    {"post-throughput", benchmark_post_throughput},
+    {"post-latency", benchmark_post_latency},
+    {"timers", benchmark_timers},
+    {"event-cycles", benchmark_event_cycles},
+};
+
+int main(int argc, char** argv) {
+  bool found = false;
+  for (const auto& b : benchmarks) {
+    if ((argc < 2) || !strcmp(argv[1], b.name)) {
+      printf("-- %s\n", b.name);
+      b.fn();
+      found = true;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,81 @@
+#include "EventBasePool.hh"
+
+#include <event2/thread.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+static void enable_libevent_threading() {
+  // This must happen before any bases are created, since bases only get locks
+  // if threading was enabled when they were constructed. Initializing a local
+  // static is thread-safe, so this is also safe if pools are constructed
+  // concurrently; if it throws, the next call tries again.
+  static const bool enabled = []() -> bool {
+    if (evthread_use_pthreads()) {
+      throw runtime_error("evthread_use_pthreads");
+    }
+    return true;
+  }();
+  (void)enabled;
+}
+
+EventBasePool::EventBasePool(size_t num_threads) : next_index(0) {
+  enable_libevent_threading();
+
+  if (num_threads == 0) {
+    num_threads = thread::hardware_concurrency();
+    if (num_threads == 0) {
+      num_threads = 1;
+    }
+  }
+  while (this->bases.size() < num_threads) {
+    this->bases.emplace_back(new EventBase());
+  }
+}
+
+EventBasePool::~EventBasePool() {
+  if (this->is_running()) {
+    this->stop();
+  }
+}
+
+void EventBasePool::start() {
+  if (this->is_running()) {
+    throw logic_error("event base pool is already running");
+  }
+  for (size_t z = 0; z < this->bases.size(); z++) {
+    this->threads.emplace_back(&EventBasePool::run_thread, this, z);
+  }
+}
+
+void EventBasePool::stop() {
+  for (auto& base : this->bases) {
+    base->loopexit();
+  }
+  this->join();
+}
+
+void EventBasePool::join() {
+  for (auto& t : this->threads) {
+    t.join();
+  }
+  this->threads.clear();
+}
+
+EventBase& EventBasePool::get(size_t index) {
+  return *this->bases.at(index);
+}
+
+EventBase& EventBasePool::operator[](size_t index) {
+  return *this->bases[index];
+}
+
+EventBase& EventBasePool::next() {
+  size_t index = this->next_index.fetch_add(1, memory_order_relaxed);
+  return *this->bases[index % this->bases.size()];
+}
+
+void EventBasePool::run_thread(size_t index) {
+  this->bases[index]->loop(EVLOOP_NO_EXIT_ON_EMPTY);
+}
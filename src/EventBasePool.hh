@@ -0,0 +1,59 @@
+#pragma once
+
+#include <event2/event.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "EventBase.hh"
+
+// A fixed set of threads, each of which runs its own EventBase. Nothing is
+// shared between the bases; objects created on one base (events, bufferevents,
+// listeners, etc.) must only be used from that base's thread once the pool is
+// started. The pool enables libevent's pthreads locking when it's constructed,
+// so it's safe to call loopexit/loopbreak and to add events to a base from
+// another thread, but the intent is that each base is touched only by its own
+// thread during normal operation.
+
+class EventBasePool {
+public:
+  // If num_threads is zero, one thread per hardware thread is used.
+  explicit EventBasePool(size_t num_threads = 0);
+  EventBasePool(const EventBasePool&) = delete;
+  EventBasePool(EventBasePool&&) = delete;
+  EventBasePool& operator=(const EventBasePool&) = delete;
+  EventBasePool& operator=(EventBasePool&&) = delete;
+  ~EventBasePool();
+
+  // Starts one thread per base. Each thread runs its base's loop until stop()
+  // is called, even if the base has no pending events.
+  void start();
+  // Tells all bases to exit their loops and waits for the threads to finish.
+  void stop();
+  // Waits for the threads to finish without asking them to exit.
+  void join();
+
+  inline bool is_running() const {
+    return !this->threads.empty();
+  }
+
+  inline size_t size() const {
+    return this->bases.size();
+  }
+
+  EventBase& get(size_t index);
+  EventBase& operator[](size_t index);
+
+  // Returns the bases in round-robin order. This is safe to call from any
+  // thread.
+  EventBase& next();
+
+protected:
+  void run_thread(size_t index);
+
+  std::vector<std::unique_ptr<EventBase>> bases;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> next_index;
+};
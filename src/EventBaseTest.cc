@@ -0,0 +1,142 @@
+#include <stdio.h>
+
+#include <memory>
+#include <new>
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+
+#include "Event.hh"
+#include "EventBase.hh"
+
+using namespace std;
+
+static size_t num_allocations = 0;
+
+void* operator new(size_t size) {
+  num_allocations++;
+  void* ret = malloc(size ? size : 1);
+  if (!ret) {
+    throw bad_alloc();
+  }
+  return ret;
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+static void test_once_does_not_allocate() {
+  fprintf(stderr, "-- once() does not allocate in the steady state\n");
+  EventBase base;
+  size_t num_calls = 0;
+  auto run_batch = [&]() -> void {
+    for (size_t z = 0; z < 100; z++) {
+      base.once([&num_calls]() -> void { num_calls++; });
+    }
+    base.loop(EVLOOP_NONBLOCK);
+  };
+
+  // The first batch fills the per-thread free list (and lets libevent
+  // allocate whatever it needs for its queues)
+  run_batch();
+  size_t allocations_before = num_allocations;
+  for (size_t z = 0; z < 10; z++) {
+    run_batch();
+  }
+  expect_eq(num_allocations, allocations_before);
+  expect_eq(num_calls, 1100u);
+}
+
+static void test_post_does_not_allocate() {
+  fprintf(stderr, "-- post() does not allocate for captures that fit inline\n");
+  EventBase base;
+  base.enable_post(256);
+  size_t num_calls = 0;
+  // This capture is larger than std::function's inline storage
+  uint64_t a = 1, b = 2, c = 3;
+  auto run_batch = [&]() -> void {
+    for (size_t z = 0; z < 100; z++) {
+      base.post([&num_calls, a, b, c]() -> void { num_calls += (a + b + c == 6); });
+    }
+    base.loop(EVLOOP_NONBLOCK);
+  };
+
+  run_batch();
+  size_t allocations_before = num_allocations;
+  for (size_t z = 0; z < 10; z++) {
+    run_batch();
+  }
+  expect_eq(num_allocations, allocations_before);
+  expect_eq(num_calls, 1100u);
+}
+
+static void test_pending_once_records_freed_with_base() {
+  fprintf(stderr, "-- pending once() callbacks are destroyed with the base\n");
+  auto token = make_shared<int>(0);
+  {
+    EventBase base;
+    base.once([token]() -> void {}, 1000000);
+    base.once([token]() -> void {});
+    expect_eq(token.use_count(), 3);
+  }
+  expect_eq(token.use_count(), 1);
+}
+
+static void test_event_moves() {
+  fprintf(stderr, "-- unarmed events call back the object they were moved to\n");
+  EventBase base;
+  size_t num_calls = 0;
+  CallbackEvent ev1(base, [&num_calls]() -> void { num_calls++; });
+  CallbackEvent ev2(std::move(ev1));
+  ev2.call_next();
+  base.loop(EVLOOP_NONBLOCK);
+  expect_eq(num_calls, 1u);
+
+  fprintf(stderr, "-- armed events can't be moved\n");
+  auto ev3 = base.call_later([&num_calls]() -> void { num_calls++; }, 0);
+  try {
+    CallbackEvent ev4(std::move(*ev3));
+    expect(false);
+  } catch (const logic_error&) {
+  }
+  base.loop(EVLOOP_NONBLOCK);
+  expect_eq(num_calls, 2u);
+
+  fprintf(stderr, "-- inline events can't be moved into their base class\n");
+  {
+    InlineEvent<CallbackEvent> ev5(base, [&num_calls]() -> void { num_calls++; });
+    try {
+      CallbackEvent ev6(std::move(ev5));
+      expect(false);
+    } catch (const logic_error&) {
+    }
+    CallbackEvent ev7;
+    try {
+      ev7 = std::move(ev5);
+      expect(false);
+    } catch (const logic_error&) {
+    }
+    ev5.call_next();
+  }
+  base.loop(EVLOOP_NONBLOCK);
+  expect_eq(num_calls, 2u);
+  {
+    InlineEvent<CallbackEvent> ev8(base, [&num_calls]() -> void { num_calls++; });
+    ev8.call_next();
+    base.loop(EVLOOP_NONBLOCK);
+  }
+  expect_eq(num_calls, 3u);
+}
+
+int main(int, char**) {
+  test_once_does_not_allocate();
+  test_post_does_not_allocate();
+  test_pending_once_records_freed_with_base();
+  test_event_moves();
+  fprintf(stderr, "All tests passed\n");
+  return 0;
+}
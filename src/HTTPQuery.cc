@@ -0,0 +1,182 @@
+#include "HTTPQuery.hh"
+
+#include <string.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+int value_for_hex_digit(char ch) {
+  if ((ch >= '0') && (ch <= '9')) {
+    return ch - '0';
+  }
+  if ((ch >= 'A') && (ch <= 'F')) {
+    return ch - 'A' + 10;
+  }
+  if ((ch >= 'a') && (ch <= 'f')) {
+    return ch - 'a' + 10;
+  }
+  return -1;
+}
+
+HTTPQueryKeySet::HTTPQueryKeySet(initializer_list<string_view> keys) {
+  this->keys.reserve(keys.size());
+  for (const auto& key : keys) {
+    this->keys.emplace_back(key);
+  }
+
+  // Keep the table at most half full so probe sequences stay short
+  size_t table_size = 4;
+  while (table_size < this->keys.size() * 2) {
+    table_size <<= 1;
+  }
+  this->table.resize(table_size, 0);
+  this->table_mask = table_size - 1;
+  for (size_t z = 0; z < this->keys.size(); z++) {
+    size_t slot = hash_key(this->keys[z]) & this->table_mask;
+    while (this->table[slot]) {
+      if (this->keys[this->table[slot] - 1] == this->keys[z]) {
+        throw invalid_argument("duplicate key in query key set");
+      }
+      slot = (slot + 1) & this->table_mask;
+    }
+    this->table[slot] = z + 1;
+  }
+}
+
+size_t HTTPQueryKeySet::index_of(string_view key) const {
+  size_t slot = hash_key(key) & this->table_mask;
+  while (this->table[slot]) {
+    size_t index = this->table[slot] - 1;
+    if (this->keys[index] == key) {
+      return index;
+    }
+    slot = (slot + 1) & this->table_mask;
+  }
+  return npos;
+}
+
+size_t HTTPQueryKeySet::hash_key(string_view key) {
+  // FNV-1a; query keys are short, so anything more elaborate isn't worth it
+  uint64_t hash = 0xCBF29CE484222325;
+  for (char ch : key) {
+    hash = (hash ^ static_cast<uint8_t>(ch)) * 0x100000001B3;
+  }
+  return hash ^ (hash >> 32);
+}
+
+HTTPQueryView::Iterator::Iterator(string_view remaining)
+    : remaining(remaining) {
+  this->parse_next();
+}
+
+HTTPQueryView::Iterator& HTTPQueryView::Iterator::operator++() {
+  this->parse_next();
+  return *this;
+}
+
+HTTPQueryView::Iterator HTTPQueryView::Iterator::operator++(int) {
+  Iterator ret = *this;
+  this->parse_next();
+  return ret;
+}
+
+void HTTPQueryView::Iterator::parse_next() {
+  // Empty parameters (e.g. from "a=1&&b=2") are skipped
+  while (!this->remaining.empty()) {
+    size_t param_size = this->remaining.find('&');
+    if (param_size == string_view::npos) {
+      param_size = this->remaining.size();
+    }
+    string_view param = this->remaining.substr(0, param_size);
+    this->remaining.remove_prefix(min(param_size + 1, this->remaining.size()));
+    if (param.empty()) {
+      continue;
+    }
+
+    size_t equals_offset = param.find('=');
+    if (equals_offset == string_view::npos) {
+      this->current.key = param;
+      this->current.value = param.substr(param.size());
+    } else {
+      this->current.key = param.substr(0, equals_offset);
+      this->current.value = param.substr(equals_offset + 1);
+    }
+    return;
+  }
+  this->current = Param();
+}
+
+HTTPQueryView::HTTPQueryView(string_view query)
+    : query(query) {}
+
+HTTPQueryView::HTTPQueryView(const char* query)
+    : query(query ? string_view(query) : string_view()) {}
+
+HTTPQueryView::Iterator HTTPQueryView::begin() const {
+  return Iterator(this->query);
+}
+
+HTTPQueryView::Iterator HTTPQueryView::end() const {
+  return Iterator();
+}
+
+string_view HTTPQueryView::get(string_view key) const {
+  for (const auto& param : *this) {
+    if (param.key == key) {
+      return param.value;
+    }
+  }
+  return string_view();
+}
+
+size_t HTTPQueryView::extract(const HTTPQueryKeySet& keys, string_view* values) const {
+  for (size_t z = 0; z < keys.size(); z++) {
+    values[z] = string_view();
+  }
+  size_t num_found = 0;
+  for (const auto& param : *this) {
+    size_t index = keys.index_of(param.key);
+    if ((index != HTTPQueryKeySet::npos) && !values[index].data()) {
+      values[index] = param.value;
+      num_found++;
+    }
+  }
+  return num_found;
+}
+
+string_view HTTPQueryView::decode(string_view raw, char* scratch) {
+  size_t read_offset = 0;
+  while ((read_offset < raw.size()) && (raw[read_offset] != '%') && (raw[read_offset] != '+')) {
+    read_offset++;
+  }
+  if (read_offset == raw.size()) {
+    return raw;
+  }
+
+  memcpy(scratch, raw.data(), read_offset);
+  size_t write_offset = read_offset;
+  while (read_offset < raw.size()) {
+    char ch = raw[read_offset];
+    if (ch == '+') {
+      ch = ' ';
+    } else if ((ch == '%') && (read_offset + 2 < raw.size())) {
+      int high = value_for_hex_digit(raw[read_offset + 1]);
+      int low = value_for_hex_digit(raw[read_offset + 2]);
+      if ((high >= 0) && (low >= 0)) {
+        ch = static_cast<char>((high << 4) | low);
+        read_offset += 2;
+      }
+    }
+    scratch[write_offset++] = ch;
+    read_offset++;
+  }
+  return string_view(scratch, write_offset);
+}
+
+string_view HTTPQueryView::decode(string_view raw, string& scratch) {
+  if (scratch.size() < raw.size()) {
+    scratch.resize(raw.size());
+  }
+  return HTTPQueryView::decode(raw, scratch.data());
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <initializer_list>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Returns the value of a hexadecimal digit (in either case), or -1 if ch isn't
+// one. This is used for decoding %XX escapes in URLs.
+int value_for_hex_digit(char ch);
+
+// A fixed set of query parameter names, hashed once (e.g. at startup) so that
+// HTTPQueryView::extract can find each parameter's slot in constant time
+class HTTPQueryKeySet {
+public:
+  HTTPQueryKeySet(std::initializer_list<std::string_view> keys);
+  HTTPQueryKeySet(const HTTPQueryKeySet&) = default;
+  HTTPQueryKeySet(HTTPQueryKeySet&&) = default;
+  HTTPQueryKeySet& operator=(const HTTPQueryKeySet&) = default;
+  HTTPQueryKeySet& operator=(HTTPQueryKeySet&&) = default;
+  ~HTTPQueryKeySet() = default;
+
+  static constexpr size_t npos = static_cast<size_t>(-1);
+
+  inline size_t size() const {
+    return this->keys.size();
+  }
+  // Returns the key's position in the list passed to the constructor, or npos
+  // if it isn't in the set
+  size_t index_of(std::string_view key) const;
+
+private:
+  std::vector<std::string> keys;
+  // Open-addressed table of (key index + 1); zero means empty
+  std::vector<uint32_t> table;
+  size_t table_mask;
+
+  static size_t hash_key(std::string_view key);
+};
+
+// A read-only view of a query string (the part of a URI after the ?) which
+// parses parameters as they're iterated over, without allocating memory.
+// Keys and values are views into the original string and are still
+// URL-encoded; use decode() to get the decoded form of a value. Keys are
+// compared in encoded form. The view is only valid as long as the string it
+// was created from.
+class HTTPQueryView {
+public:
+  struct Param {
+    std::string_view key;
+    // Empty (but not null) for parameters with an empty value or no = sign
+    std::string_view value;
+  };
+
+  class Iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Param;
+    using difference_type = ptrdiff_t;
+    using pointer = const Param*;
+    using reference = const Param&;
+
+    Iterator() = default;
+    explicit Iterator(std::string_view remaining);
+
+    inline const Param& operator*() const {
+      return this->current;
+    }
+    inline const Param* operator->() const {
+      return &this->current;
+    }
+    Iterator& operator++();
+    Iterator operator++(int);
+    inline bool operator==(const Iterator& other) const {
+      return this->current.key.data() == other.current.key.data();
+    }
+
+  private:
+    // Unparsed part of the query after the current parameter
+    std::string_view remaining;
+    // key.data() is null at the end
+    Param current;
+
+    void parse_next();
+  };
+
+  HTTPQueryView() = default;
+  explicit HTTPQueryView(std::string_view query);
+  // query may be null, in which case the view is empty
+  explicit HTTPQueryView(const char* query);
+
+  Iterator begin() const;
+  Iterator end() const;
+
+  inline std::string_view get_query() const {
+    return this->query;
+  }
+
+  // Returns the encoded value of the first parameter with the given key. The
+  // returned view's data() is null if the key isn't present.
+  std::string_view get(std::string_view key) const;
+
+  // Finds all of the given keys in one pass over the query. After this
+  // returns, values[i] is the encoded value of the first parameter named
+  // keys[i], or a view with a null data() if there's no such parameter.
+  // values must have room for keys.size() entries. Returns the number of keys
+  // that were found.
+  size_t extract(const HTTPQueryKeySet& keys, std::string_view* values) const;
+
+  // URL-decodes a key or value (%XX escapes and + for space). If there's
+  // nothing to decode, returns the input view without copying it; otherwise,
+  // decodes into scratch (which must have room for raw.size() bytes) and
+  // returns a view of the decoded data. Invalid escapes are left as is.
+  static std::string_view decode(std::string_view raw, char* scratch);
+  // Like the above, but resizes scratch as needed. Reusing the same string for
+  // many values avoids allocating for each one.
+  static std::string_view decode(std::string_view raw, std::string& scratch);
+
+private:
+  std::string_view query;
+};
@@ -0,0 +1,112 @@
+#include <stdio.h>
+
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "HTTPQuery.hh"
+
+using namespace std;
+
+static void test_decode() {
+  fprintf(stderr, "-- decode handles escapes and + and leaves invalid escapes alone\n");
+  string scratch;
+  auto decode = [&scratch](string_view raw) -> string {
+    return string(HTTPQueryView::decode(raw, scratch));
+  };
+  expect_eq(decode(""), "");
+  expect_eq(decode("abc"), "abc");
+  expect_eq(decode("+"), " ");
+  expect_eq(decode("a+b+"), "a b ");
+  expect_eq(decode("%41"), "A");
+  expect_eq(decode("%6a%6A"), "jj");
+  expect_eq(decode("x%20y%2Bz"), "x y+z");
+  expect_eq(decode("%2b"), "+");
+  expect_eq(decode("%00"), string("\0", 1));
+  expect_eq(decode("%FF"), "\xFF");
+  // Truncated and invalid escapes are copied literally
+  expect_eq(decode("%"), "%");
+  expect_eq(decode("%4"), "%4");
+  expect_eq(decode("a%4"), "a%4");
+  expect_eq(decode("%zz"), "%zz");
+  expect_eq(decode("%4g"), "%4g");
+  expect_eq(decode("%g4"), "%g4");
+  expect_eq(decode("%%41"), "%A");
+  expect_eq(decode("%+"), "% ");
+  expect_eq(decode("100%"), "100%");
+
+  fprintf(stderr, "-- decode returns the input if there's nothing to decode\n");
+  string_view raw = "plain-value";
+  expect(HTTPQueryView::decode(raw, scratch).data() == raw.data());
+  char buf[8];
+  string_view decoded = HTTPQueryView::decode("a+b", buf);
+  expect(decoded.data() == buf);
+  expect_eq(decoded, "a b");
+}
+
+static void test_iteration() {
+  fprintf(stderr, "-- parameters are parsed in order, skipping empty ones\n");
+  HTTPQueryView q("a=1&&b=2&c&=x&d=&a=3&");
+  vector<pair<string, string>> params;
+  for (const auto& p : q) {
+    params.emplace_back(p.key, p.value);
+  }
+  vector<pair<string, string>> expected = {
+      {"a", "1"}, {"b", "2"}, {"c", ""}, {"", "x"}, {"d", ""}, {"a", "3"}};
+  expect(params == expected);
+
+  expect(HTTPQueryView("").begin() == HTTPQueryView("").end());
+  expect(HTTPQueryView("&&").begin() == HTTPQueryView("&&").end());
+  expect(HTTPQueryView(static_cast<const char*>(nullptr)).begin() == HTTPQueryView().end());
+
+  fprintf(stderr, "-- get returns the first value, distinguishing empty from missing\n");
+  expect_eq(q.get("a"), "1");
+  expect(q.get("c").data() != nullptr);
+  expect(q.get("c").empty());
+  expect(q.get("d").data() != nullptr);
+  expect(q.get("missing").data() == nullptr);
+  // Keys are compared without decoding them
+  HTTPQueryView encoded("a%20b=1&a+b=2");
+  expect_eq(encoded.get("a%20b"), "1");
+  expect_eq(encoded.get("a+b"), "2");
+  expect(encoded.get("a b").data() == nullptr);
+}
+
+static void test_extract() {
+  fprintf(stderr, "-- extract finds the first value of each key in one pass\n");
+  static const HTTPQueryKeySet keys({"page", "sort", "q", "missing"});
+  expect_eq(keys.size(), 4u);
+  expect_eq(keys.index_of("q"), 2u);
+  expect_eq(keys.index_of("nope"), HTTPQueryKeySet::npos);
+
+  HTTPQueryView q("q=hello+world&page=2&other=1&page=3&sort");
+  string_view values[4];
+  expect_eq(q.extract(keys, values), 3u);
+  expect_eq(values[0], "2");
+  expect(values[1].data() != nullptr);
+  expect(values[1].empty());
+  expect_eq(values[2], "hello+world");
+  expect(values[3].data() == nullptr);
+
+  fprintf(stderr, "-- key sets can't contain duplicates\n");
+  try {
+    HTTPQueryKeySet duplicate_keys({"a", "b", "a"});
+    expect(false);
+  } catch (const invalid_argument&) {
+  }
+  // Enough keys to need a larger table than the initial one
+  HTTPQueryKeySet many_keys({"k0", "k1", "k2", "k3", "k4", "k5", "k6", "k7", "k8"});
+  for (size_t z = 0; z < many_keys.size(); z++) {
+    expect_eq(many_keys.index_of("k" + to_string(z)), z);
+  }
+}
+
+int main(int, char**) {
+  test_decode();
+  test_iteration();
+  test_extract();
+  fprintf(stderr, "All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,257 @@
+#include "HTTPResponseCache.hh"
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <string.h>
+#include <strings.h>
+
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+HTTPResponseCache::Entry::Entry()
+    : code(0),
+      store_time_usecs(0),
+      expire_time_usecs(0),
+      cost(0),
+      refcount(1) {}
+
+void HTTPResponseCache::Entry::add_body_to(EvBuffer& buf) const {
+  if (this->body_buffer) {
+    // libevent can't make references to file segments (or to other
+    // references), so bodies containing them are copied chain by chain
+    if (evbuffer_add_buffer_reference(buf.get(), this->body_buffer->get())) {
+      struct evbuffer* src = this->body_buffer->get();
+      vector<struct evbuffer_iovec> vecs(evbuffer_peek(src, -1, nullptr, nullptr, 0));
+      evbuffer_peek(src, -1, nullptr, vecs.data(), vecs.size());
+      for (const auto& vec : vecs) {
+        buf.add(vec.iov_base, vec.iov_len);
+      }
+    }
+    return;
+  }
+  if (this->body.empty()) {
+    return;
+  }
+  this->refcount++;
+  try {
+    buf.add_reference(this->body.data(), this->body.size(),
+        &Entry::dispatch_release, const_cast<Entry*>(this));
+  } catch (const exception&) {
+    this->refcount--;
+    throw;
+  }
+}
+
+void HTTPResponseCache::Entry::dispatch_release(const void*, size_t, void* ctx) {
+  HTTPResponseCache::release(reinterpret_cast<const Entry*>(ctx));
+}
+
+void HTTPResponseCache::release(const Entry* entry) {
+  if (entry && !--entry->refcount) {
+    delete entry;
+  }
+}
+
+HTTPResponseCache::HTTPResponseCache(EventBase& base, size_t max_bytes)
+    : base(base),
+      max_bytes(max_bytes),
+      total_bytes(0),
+      hits(0),
+      misses(0),
+      coalesced(0),
+      bypasses(0),
+      evictions(0) {}
+
+HTTPResponseCache::~HTTPResponseCache() {
+  this->clear();
+}
+
+HTTPResponseCache::Status HTTPResponseCache::lookup(const string& key,
+    struct evhttp_request* req, uint64_t ttl_usecs, const Entry** entry) {
+  auto it = this->entries.find(key);
+  if (it != this->entries.end()) {
+    Entry* e = it->second;
+    if (e->expire_time_usecs > this->base.gettimeofday_cached64()) {
+      this->hits++;
+      this->lru.splice(this->lru.begin(), this->lru, e->lru_it);
+      *entry = e;
+      return Status::HIT;
+    }
+    this->erase(e);
+  }
+
+  auto pending_it = this->pending.find(key);
+  if (pending_it != this->pending.end()) {
+    this->coalesced++;
+    pending_it->second.waiters.emplace_back(req);
+    return Status::COALESCED;
+  }
+
+  if (!ttl_usecs) {
+    this->bypasses++;
+    return Status::BYPASS;
+  }
+  if (!this->unshareable_keys.empty()) {
+    auto unshareable_it = this->unshareable_keys.find(key);
+    if (unshareable_it != this->unshareable_keys.end()) {
+      if (unshareable_it->second > this->base.gettimeofday_cached64()) {
+        this->bypasses++;
+        return Status::BYPASS;
+      }
+      this->unshareable_keys.erase(unshareable_it);
+    }
+  }
+
+  this->misses++;
+  this->pending.emplace(key, Pending{ttl_usecs, {}});
+  this->pending_keys.emplace(req, key);
+  return Status::MISS;
+}
+
+const HTTPResponseCache::Entry* HTTPResponseCache::complete(
+    struct evhttp_request* req, int code, const char* content_type,
+    struct evkeyvalq* headers, EvBuffer& body, vector<struct evhttp_request*>& waiters) {
+  auto key_it = this->pending_keys.find(req);
+  if (key_it == this->pending_keys.end()) {
+    throw logic_error("request is not pending in the response cache");
+  }
+  auto pending_it = this->pending.find(key_it->second);
+  uint64_t ttl_usecs = pending_it->second.ttl_usecs;
+  waiters = std::move(pending_it->second.waiters);
+  this->pending.erase(pending_it);
+  string key = std::move(key_it->second);
+  this->pending_keys.erase(key_it);
+
+  uint64_t now_usecs = this->base.gettimeofday_cached64();
+  if (!is_cacheable(code, headers)) {
+    this->remember_unshareable_key(std::move(key), now_usecs + ttl_usecs);
+    return nullptr;
+  }
+
+  Entry* entry = new Entry();
+  entry->code = code;
+  if (content_type) {
+    entry->content_type = content_type;
+  }
+  size_t headers_size = 0;
+  for (struct evkeyval* h = headers->tqh_first; h; h = h->next.tqe_next) {
+    entry->headers.emplace_back(h->key, h->value);
+    headers_size += strlen(h->key) + strlen(h->value);
+  }
+  size_t body_size = body.get_length();
+  entry->store_time_usecs = now_usecs;
+  entry->expire_time_usecs = entry->store_time_usecs + ttl_usecs;
+  entry->cost = sizeof(Entry) + key.size() + entry->content_type.size() +
+      headers_size + body_size;
+
+  // Responses that don't fit in the budget aren't stored, but are still
+  // shared with the requests that were waiting for them. Their bodies are
+  // kept in their original chains rather than being copied into a string.
+  if (entry->cost > this->max_bytes) {
+    entry->body_buffer.reset(new EvBuffer());
+    entry->body_buffer->add_buffer(body);
+  } else {
+    entry->body = body.remove(body_size);
+    auto existing_it = this->entries.find(key);
+    if (existing_it != this->entries.end()) {
+      this->erase(existing_it->second);
+    }
+    while (this->total_bytes + entry->cost > this->max_bytes) {
+      this->evictions++;
+      this->erase(this->lru.back());
+    }
+    entry->key = std::move(key);
+    entry->refcount++;
+    this->lru.emplace_front(entry);
+    entry->lru_it = this->lru.begin();
+    this->entries.emplace(entry->key, entry);
+    this->total_bytes += entry->cost;
+  }
+  return entry;
+}
+
+static bool has_token(const char* header, const char* token) {
+  string_view remaining(header);
+  size_t token_size = strlen(token);
+  while (!remaining.empty()) {
+    size_t comma_offset = remaining.find(',');
+    string_view item = remaining.substr(0, comma_offset);
+    remaining = (comma_offset == string_view::npos) ? string_view() : remaining.substr(comma_offset + 1);
+    while (!item.empty() && ((item.front() == ' ') || (item.front() == '\t'))) {
+      item.remove_prefix(1);
+    }
+    // Directives may have arguments (e.g. private="Set-Cookie")
+    item = item.substr(0, item.find('='));
+    while (!item.empty() && ((item.back() == ' ') || (item.back() == '\t'))) {
+      item.remove_suffix(1);
+    }
+    if ((item.size() == token_size) && !strncasecmp(item.data(), token, token_size)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HTTPResponseCache::is_cacheable(int code, struct evkeyvalq* headers) {
+  // RFC 9110 section 15.1
+  switch (code) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 308:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+      break;
+    default:
+      return false;
+  }
+  if (evhttp_find_header(headers, "Set-Cookie")) {
+    return false;
+  }
+  const char* cache_control = evhttp_find_header(headers, "Cache-Control");
+  return !cache_control ||
+      (!has_token(cache_control, "no-store") &&
+          !has_token(cache_control, "no-cache") &&
+          !has_token(cache_control, "private"));
+}
+
+void HTTPResponseCache::remember_unshareable_key(string&& key, uint64_t expire_time_usecs) {
+  if (this->unshareable_keys.size() >= MAX_UNSHAREABLE_KEYS) {
+    uint64_t now_usecs = this->base.gettimeofday_cached64();
+    for (auto it = this->unshareable_keys.begin(); it != this->unshareable_keys.end();) {
+      if (it->second <= now_usecs) {
+        it = this->unshareable_keys.erase(it);
+      } else {
+        it++;
+      }
+    }
+    // If there are still too many keys, requests for this one are coalesced
+    // as usual
+    if (this->unshareable_keys.size() >= MAX_UNSHAREABLE_KEYS) {
+      return;
+    }
+  }
+  this->unshareable_keys[std::move(key)] = expire_time_usecs;
+}
+
+void HTTPResponseCache::clear() {
+  while (!this->lru.empty()) {
+    this->erase(this->lru.back());
+  }
+}
+
+void HTTPResponseCache::erase(Entry* entry) {
+  this->entries.erase(entry->key);
+  this->lru.erase(entry->lru_it);
+  this->total_bytes -= entry->cost;
+  release(entry);
+}
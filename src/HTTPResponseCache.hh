@@ -0,0 +1,182 @@
+#pragma once
+
+#include <event2/http.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "EvBuffer.hh"
+#include "EventBase.hh"
+
+// Stores complete HTTP responses (code, headers, and body) by key, so that
+// handlers whose output only depends on the request URI don't have to run for
+// every request. Entries expire after a per-entry TTL, and the least recently
+// used entries are evicted when the total size exceeds a byte budget.
+//
+// Entries are immutable and reference-counted; bodies are added to output
+// buffers by reference (with evbuffer_add_reference), so serving a cached
+// response doesn't copy the body, and an entry can be evicted while responses
+// that use it are still being sent.
+//
+// While a response is being generated for a key, other requests with the same
+// key wait for it instead of running the handler again; see lookup() and
+// complete(). This class is not thread-safe; each server (and hence each
+// EventBase thread) should have its own cache.
+class HTTPResponseCache {
+public:
+  class Entry {
+  public:
+    int code;
+    // Empty if the response has no Content-Type header
+    std::string content_type;
+    // Other headers set by the handler
+    std::vector<std::pair<std::string, std::string>> headers;
+    // Empty if the response is too large to be stored, in which case the
+    // body is in body_buffer instead (in the handler's original chains, so
+    // file segments aren't read into memory)
+    std::string body;
+    std::unique_ptr<EvBuffer> body_buffer;
+    uint64_t store_time_usecs;
+    uint64_t expire_time_usecs;
+
+    // Appends the body to buf without copying it. The entry isn't destroyed
+    // until buf no longer refers to it.
+    void add_body_to(EvBuffer& buf) const;
+
+  private:
+    friend class HTTPResponseCache;
+
+    std::string key;
+    // Approximate memory used by the entry, counted against the byte budget
+    size_t cost;
+    std::list<Entry*>::iterator lru_it;
+    mutable size_t refcount;
+
+    Entry();
+    Entry(const Entry&) = delete;
+    Entry(Entry&&) = delete;
+    Entry& operator=(const Entry&) = delete;
+    Entry& operator=(Entry&&) = delete;
+    ~Entry() = default;
+
+    static void dispatch_release(const void* data, size_t size, void* ctx);
+  };
+
+  enum class Status {
+    // entry was set to a live cached response
+    HIT = 0,
+    // The caller must generate a response and pass it to complete()
+    MISS,
+    // Another request with the same key is already being handled; this
+    // request is returned by complete() when that one's response is ready
+    COALESCED,
+    // A recent response for this key couldn't be shared, so the caller should
+    // generate a response without waiting for other requests or calling
+    // complete()
+    BYPASS,
+  };
+
+  HTTPResponseCache(EventBase& base, size_t max_bytes);
+  HTTPResponseCache(const HTTPResponseCache&) = delete;
+  HTTPResponseCache(HTTPResponseCache&&) = delete;
+  HTTPResponseCache& operator=(const HTTPResponseCache&) = delete;
+  HTTPResponseCache& operator=(HTTPResponseCache&&) = delete;
+  ~HTTPResponseCache();
+
+  // Looks up the response for a key. If the result is MISS, req becomes the
+  // key's pending request, and its response will be stored for ttl_usecs. If
+  // ttl_usecs is zero, or if a response for the key couldn't be shared within
+  // the last ttl_usecs, the result is BYPASS, since waiting for another
+  // request's response would be pointless.
+  Status lookup(const std::string& key, struct evhttp_request* req,
+      uint64_t ttl_usecs, const Entry** entry);
+
+  // Returns true if req got MISS from lookup() and hasn't been completed yet
+  inline bool is_pending(struct evhttp_request* req) const {
+    return !this->pending_keys.empty() && this->pending_keys.count(req);
+  }
+
+  // Completes a pending request with its response, consuming the body. If
+  // the response can be shared (see is_cacheable), returns an entry for it,
+  // which is also stored in the cache if it fits in the byte budget. The
+  // caller owns a reference to the returned entry and must call release()
+  // when it's done with it. If the response can't be shared, returns nullptr,
+  // and lookup() returns BYPASS for the key for a while. In either case,
+  // waiters is set to the requests that were coalesced into this one; they
+  // haven't been responded to, and if nullptr is returned they must be
+  // handled from scratch.
+  const Entry* complete(struct evhttp_request* req, int code,
+      const char* content_type, struct evkeyvalq* headers, EvBuffer& body,
+      std::vector<struct evhttp_request*>& waiters);
+
+  static void release(const Entry* entry);
+
+  // Returns true if a response with this code and these headers may be
+  // shared between clients. Only status codes that are cacheable by default
+  // are accepted (so 206 and 304, which depend on the request's headers,
+  // aren't), and responses with Set-Cookie or with Cache-Control: no-store,
+  // no-cache, or private are rejected.
+  static bool is_cacheable(int code, struct evkeyvalq* headers);
+
+  // Removes all entries. Pending requests are unaffected.
+  void clear();
+
+  inline size_t size() const {
+    return this->entries.size();
+  }
+  inline size_t get_total_bytes() const {
+    return this->total_bytes;
+  }
+  inline size_t get_max_bytes() const {
+    return this->max_bytes;
+  }
+  inline uint64_t get_hits() const {
+    return this->hits;
+  }
+  inline uint64_t get_misses() const {
+    return this->misses;
+  }
+  inline uint64_t get_coalesced() const {
+    return this->coalesced;
+  }
+  inline uint64_t get_bypasses() const {
+    return this->bypasses;
+  }
+  inline uint64_t get_evictions() const {
+    return this->evictions;
+  }
+
+private:
+  struct Pending {
+    uint64_t ttl_usecs;
+    std::vector<struct evhttp_request*> waiters;
+  };
+
+  EventBase base;
+  size_t max_bytes;
+  size_t total_bytes;
+
+  std::unordered_map<std::string, Entry*> entries;
+  // Most recently used entries are at the front
+  std::list<Entry*> lru;
+  std::unordered_map<std::string, Pending> pending;
+  std::unordered_map<struct evhttp_request*, std::string> pending_keys;
+  // Keys whose last response couldn't be shared, and when to forget them
+  static constexpr size_t MAX_UNSHAREABLE_KEYS = 0x1000;
+  std::unordered_map<std::string, uint64_t> unshareable_keys;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t coalesced;
+  uint64_t bypasses;
+  uint64_t evictions;
+
+  void erase(Entry* entry);
+  void remember_unshareable_key(std::string&& key, uint64_t expire_time_usecs);
+};
@@ -0,0 +1,213 @@
+#include <event2/http.h>
+#include <stdio.h>
+
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "EvBuffer.hh"
+#include "EventBase.hh"
+#include "HTTPResponseCache.hh"
+
+using namespace std;
+
+// The cache only uses requests as keys and reads their output headers, so the
+// requests in these tests aren't associated with any connection
+class TestRequest {
+public:
+  TestRequest() : req(evhttp_request_new(nullptr, nullptr)) {}
+  ~TestRequest() {
+    evhttp_request_free(this->req);
+  }
+
+  struct evhttp_request* req;
+};
+
+static const HTTPResponseCache::Entry* complete(HTTPResponseCache& cache,
+    TestRequest& r, int code, const string& body,
+    vector<struct evhttp_request*>& waiters) {
+  EvBuffer buf;
+  buf.add(body);
+  return cache.complete(r.req, code, "text/plain",
+      evhttp_request_get_output_headers(r.req), buf, waiters);
+}
+
+// Runs the base until its cached time has advanced by at least usecs
+static void wait_usecs(EventBase& base, uint64_t usecs) {
+  uint64_t end_usecs = base.gettimeofday_cached64() + usecs;
+  while (base.gettimeofday_cached64() < end_usecs) {
+    base.once([]() -> void {}, 1000);
+    base.loop(EVLOOP_ONCE);
+  }
+}
+
+static void test_coalescing() {
+  fprintf(stderr, "-- requests for a pending key wait for its response\n");
+  EventBase base;
+  HTTPResponseCache cache(base, 0x10000);
+  TestRequest r1, r2, r3, r4, r5;
+  const HTTPResponseCache::Entry* entry = nullptr;
+  expect(cache.lookup("key", r1.req, 1000000, &entry) == HTTPResponseCache::Status::MISS);
+  expect(cache.is_pending(r1.req));
+  expect(cache.lookup("key", r2.req, 1000000, &entry) == HTTPResponseCache::Status::COALESCED);
+  expect(cache.lookup("key", r3.req, 1000000, &entry) == HTTPResponseCache::Status::COALESCED);
+  expect(!cache.is_pending(r2.req));
+  // Other keys aren't affected
+  expect(cache.lookup("other", r4.req, 1000000, &entry) == HTTPResponseCache::Status::MISS);
+
+  evhttp_add_header(evhttp_request_get_output_headers(r1.req), "X-Test", "1");
+  vector<struct evhttp_request*> waiters;
+  entry = complete(cache, r1, 200, "hello", waiters);
+  expect(entry != nullptr);
+  expect(waiters == vector<struct evhttp_request*>({r2.req, r3.req}));
+  expect(!cache.is_pending(r1.req));
+  expect_eq(entry->code, 200);
+  expect_eq(entry->content_type, "text/plain");
+  expect_eq(entry->body, "hello");
+  expect_eq(entry->headers.size(), 1u);
+  expect_eq(entry->headers[0].first, "X-Test");
+  expect_eq(entry->headers[0].second, "1");
+  HTTPResponseCache::release(entry);
+
+  fprintf(stderr, "-- completed responses are hits until they expire\n");
+  entry = nullptr;
+  expect(cache.lookup("key", r5.req, 1000000, &entry) == HTTPResponseCache::Status::HIT);
+  expect(entry != nullptr);
+  expect_eq(entry->body, "hello");
+  expect_eq(cache.size(), 1u);
+  expect_eq(cache.get_misses(), 2u);
+  expect_eq(cache.get_coalesced(), 2u);
+  expect_eq(cache.get_hits(), 1u);
+
+  entry = complete(cache, r4, 200, "short-lived", waiters);
+  expect(waiters.empty());
+  HTTPResponseCache::release(entry);
+  // The TTL passed to lookup() is the one used when the response is stored,
+  // so this entry lives for 1 second even though this lookup asks for 5ms
+  expect(cache.lookup("other", r4.req, 5000, &entry) == HTTPResponseCache::Status::HIT);
+  wait_usecs(base, 5000);
+  expect(cache.lookup("other", r4.req, 5000, &entry) == HTTPResponseCache::Status::HIT);
+  expect(cache.lookup("short", r4.req, 5000, &entry) == HTTPResponseCache::Status::MISS);
+  entry = complete(cache, r4, 200, "short-lived", waiters);
+  HTTPResponseCache::release(entry);
+  expect(cache.lookup("short", r4.req, 5000, &entry) == HTTPResponseCache::Status::HIT);
+  wait_usecs(base, 5000);
+  expect(cache.lookup("short", r4.req, 5000, &entry) == HTTPResponseCache::Status::MISS);
+  expect_eq(cache.size(), 2u);
+  HTTPResponseCache::release(complete(cache, r4, 200, "", waiters));
+}
+
+static void test_bypass() {
+  fprintf(stderr, "-- responses that can't be shared make their key bypass the cache\n");
+  EventBase base;
+  HTTPResponseCache cache(base, 0x10000);
+  TestRequest r1, r2, r3;
+  const HTTPResponseCache::Entry* entry;
+  expect(cache.lookup("key", r1.req, 10000, &entry) == HTTPResponseCache::Status::MISS);
+  expect(cache.lookup("key", r2.req, 10000, &entry) == HTTPResponseCache::Status::COALESCED);
+  evhttp_add_header(evhttp_request_get_output_headers(r1.req), "Set-Cookie", "a=b");
+  vector<struct evhttp_request*> waiters;
+  expect(complete(cache, r1, 200, "private", waiters) == nullptr);
+  // The waiters have to be handled separately, and don't wait for each other
+  expect(waiters == vector<struct evhttp_request*>({r2.req}));
+  expect_eq(cache.size(), 0u);
+  expect(cache.lookup("key", r2.req, 10000, &entry) == HTTPResponseCache::Status::BYPASS);
+  expect(cache.lookup("key", r3.req, 10000, &entry) == HTTPResponseCache::Status::BYPASS);
+  expect(!cache.is_pending(r2.req));
+  expect_eq(cache.get_bypasses(), 2u);
+
+  fprintf(stderr, "-- keys stop bypassing the cache after the TTL\n");
+  wait_usecs(base, 10000);
+  expect(cache.lookup("key", r3.req, 10000, &entry) == HTTPResponseCache::Status::MISS);
+  entry = complete(cache, r3, 200, "shared", waiters);
+  expect(entry != nullptr);
+  HTTPResponseCache::release(entry);
+  expect_eq(cache.size(), 1u);
+
+  fprintf(stderr, "-- lookups with no TTL always bypass the cache\n");
+  expect(cache.lookup("new", r1.req, 0, &entry) == HTTPResponseCache::Status::BYPASS);
+  expect(!cache.is_pending(r1.req));
+
+  fprintf(stderr, "-- only responses without private headers or codes are cacheable\n");
+  auto is_cacheable = [](int code, const char* header_name, const char* header_value) -> bool {
+    TestRequest r;
+    struct evkeyvalq* headers = evhttp_request_get_output_headers(r.req);
+    if (header_name) {
+      evhttp_add_header(headers, header_name, header_value);
+    }
+    return HTTPResponseCache::is_cacheable(code, headers);
+  };
+  expect(is_cacheable(200, nullptr, nullptr));
+  expect(is_cacheable(404, nullptr, nullptr));
+  expect(!is_cacheable(206, nullptr, nullptr));
+  expect(!is_cacheable(304, nullptr, nullptr));
+  expect(!is_cacheable(500, nullptr, nullptr));
+  expect(!is_cacheable(200, "Set-Cookie", "a=b"));
+  expect(!is_cacheable(200, "Cache-Control", "no-store"));
+  expect(!is_cacheable(200, "Cache-Control", "max-age=60, No-Cache"));
+  expect(!is_cacheable(200, "Cache-Control", "public,\tprivate=\"Set-Cookie\""));
+  expect(is_cacheable(200, "Cache-Control", "public, max-age=60"));
+  expect(is_cacheable(200, "Cache-Control", "no-storage"));
+}
+
+static void test_size_limits() {
+  fprintf(stderr, "-- responses larger than the cache are shared but not stored\n");
+  EventBase base;
+  HTTPResponseCache cache(base, 1200);
+  TestRequest r1, r2;
+  const HTTPResponseCache::Entry* entry;
+  string large_body(2000, 'x');
+  expect(cache.lookup("large", r1.req, 1000000, &entry) == HTTPResponseCache::Status::MISS);
+  expect(cache.lookup("large", r2.req, 1000000, &entry) == HTTPResponseCache::Status::COALESCED);
+  vector<struct evhttp_request*> waiters;
+  entry = complete(cache, r1, 200, large_body, waiters);
+  expect(entry != nullptr);
+  expect(waiters == vector<struct evhttp_request*>({r2.req}));
+  expect(entry->body.empty());
+  expect(entry->body_buffer != nullptr);
+  for (size_t z = 0; z < 2; z++) {
+    EvBuffer out;
+    entry->add_body_to(out);
+    expect(out.remove(out.get_length()) == large_body);
+  }
+  HTTPResponseCache::release(entry);
+  expect_eq(cache.size(), 0u);
+  expect_eq(cache.get_total_bytes(), 0u);
+  expect(cache.lookup("large", r1.req, 1000000, &entry) == HTTPResponseCache::Status::MISS);
+  HTTPResponseCache::release(complete(cache, r1, 200, large_body, waiters));
+
+  fprintf(stderr, "-- the least recently used responses are evicted\n");
+  // Each of these entries costs about half of the budget, so only two fit
+  string body(300, 'y');
+  for (const char* key : {"key1", "key2"}) {
+    expect(cache.lookup(key, r1.req, 1000000, &entry) == HTTPResponseCache::Status::MISS);
+    HTTPResponseCache::release(complete(cache, r1, 200, body, waiters));
+  }
+  expect_eq(cache.size(), 2u);
+  expect(cache.lookup("key1", r1.req, 1000000, &entry) == HTTPResponseCache::Status::HIT);
+  expect(cache.lookup("key3", r1.req, 1000000, &entry) == HTTPResponseCache::Status::MISS);
+  // Evicted entries aren't destroyed until their last reference is released
+  const HTTPResponseCache::Entry* key3_entry = complete(cache, r1, 200, body, waiters);
+  expect_eq(cache.size(), 2u);
+  expect_eq(cache.get_evictions(), 1u);
+  expect(cache.get_total_bytes() <= cache.get_max_bytes());
+  expect(cache.lookup("key1", r2.req, 1000000, &entry) == HTTPResponseCache::Status::HIT);
+  expect(cache.lookup("key3", r2.req, 1000000, &entry) == HTTPResponseCache::Status::HIT);
+  expect(cache.lookup("key2", r2.req, 1000000, &entry) == HTTPResponseCache::Status::MISS);
+  HTTPResponseCache::release(complete(cache, r2, 200, body, waiters));
+
+  cache.clear();
+  expect_eq(cache.size(), 0u);
+  expect_eq(cache.get_total_bytes(), 0u);
+  expect_eq(key3_entry->body, body);
+  HTTPResponseCache::release(key3_entry);
+}
+
+int main(int, char**) {
+  test_coalescing();
+  test_bypass();
+  test_size_limits();
+  fprintf(stderr, "All tests passed\n");
+  return 0;
+}
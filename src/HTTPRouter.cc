@@ -0,0 +1,258 @@
+#include "HTTPRouter.hh"
+
+#include <string.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+HTTPRouteMatch::HTTPRouteMatch()
+    : route(nullptr),
+      num_params(0),
+      allowed_methods(0) {}
+
+string_view HTTPRouteMatch::get_param(string_view name) const {
+  if (!this->route) {
+    return string_view();
+  }
+  const auto& names = static_cast<const HTTPRouter::Route*>(this->route)->param_names;
+  for (size_t z = 0; (z < names.size()) && (z < this->num_params); z++) {
+    if (names[z] == name) {
+      return this->params[z];
+    }
+  }
+  return string_view();
+}
+
+string_view HTTPRouteMatch::get_param(size_t index) const {
+  if (index >= this->num_params) {
+    throw out_of_range("route parameter index out of range");
+  }
+  return this->params[index];
+}
+
+const string& HTTPRouteMatch::get_pattern() const {
+  if (!this->route) {
+    throw logic_error("no route was matched");
+  }
+  return static_cast<const HTTPRouter::Route*>(this->route)->pattern;
+}
+
+HTTPRouter::HTTPRouter() = default;
+HTTPRouter::~HTTPRouter() = default;
+
+void HTTPRouter::add(uint32_t methods, const string& pattern, Handler handler) {
+  if (pattern.empty() || (pattern[0] != '/')) {
+    throw invalid_argument("route pattern must begin with /");
+  }
+  if (!methods) {
+    throw invalid_argument("route must accept at least one method");
+  }
+
+  // Split the pattern into static text and parameter segments before
+  // modifying the trie, so a malformed pattern doesn't leave nodes behind.
+  // Parameters and wildcards must be whole segments.
+  struct Piece {
+    string_view text;
+    bool is_param;
+  };
+  vector<Piece> pieces;
+  vector<string> param_names;
+  bool has_wildcard = false;
+  string_view remaining = pattern;
+  while (!remaining.empty()) {
+    size_t param_start = 0;
+    while ((param_start < remaining.size()) &&
+        !(((remaining[param_start] == ':') || (remaining[param_start] == '*')) &&
+            (param_start > 0) && (remaining[param_start - 1] == '/'))) {
+      param_start++;
+    }
+    pieces.emplace_back(Piece{remaining.substr(0, param_start), false});
+    if (param_start == remaining.size()) {
+      break;
+    }
+
+    size_t name_end = remaining.find('/', param_start);
+    if (name_end == string_view::npos) {
+      name_end = remaining.size();
+    }
+    string name(remaining.substr(param_start + 1, name_end - param_start - 1));
+    if (name.empty()) {
+      throw invalid_argument("route parameter has no name: " + pattern);
+    }
+    for (const auto& existing_name : param_names) {
+      if (existing_name == name) {
+        throw invalid_argument("route parameter appears multiple times: " + pattern);
+      }
+    }
+    param_names.emplace_back(std::move(name));
+    if (remaining[param_start] == '*') {
+      if (name_end != remaining.size()) {
+        throw invalid_argument("route wildcard must be the last segment: " + pattern);
+      }
+      has_wildcard = true;
+      break;
+    }
+    pieces.emplace_back(Piece{string_view(), true});
+    remaining = remaining.substr(name_end);
+  }
+  if (param_names.size() > HTTPRouteMatch::MAX_PARAMS) {
+    throw invalid_argument("route has too many parameters: " + pattern);
+  }
+
+  Node* node = &this->root;
+  for (const auto& piece : pieces) {
+    if (piece.is_param) {
+      if (!node->param_child) {
+        node->param_child = make_unique<Node>();
+      }
+      node = node->param_child.get();
+    } else {
+      node = this->insert_static(node, piece.text);
+    }
+  }
+
+  add_endpoint(has_wildcard ? node->wildcard_endpoints : node->endpoints,
+      methods, this->routes.size(), this->routes.data());
+  auto& route = this->routes.emplace_back();
+  route.pattern = pattern;
+  route.param_names = std::move(param_names);
+  route.methods = methods;
+  route.handler = std::move(handler);
+}
+
+HTTPRouter::Node* HTTPRouter::insert_static(Node* node, string_view text) {
+  while (!text.empty()) {
+    size_t child_index = node->child_first_bytes.find(text[0]);
+    if (child_index == string::npos) {
+      auto& child = node->children.emplace_back(make_unique<Node>());
+      child->prefix = text;
+      node->child_first_bytes.push_back(text[0]);
+      return child.get();
+    }
+
+    Node* child = node->children[child_index].get();
+    size_t common_size = 0;
+    while ((common_size < child->prefix.size()) && (common_size < text.size()) &&
+        (child->prefix[common_size] == text[common_size])) {
+      common_size++;
+    }
+
+    // If the text diverges from the child's prefix partway through, split the
+    // child into a node for the common part and a node for the rest
+    if (common_size < child->prefix.size()) {
+      auto split_node = make_unique<Node>();
+      split_node->prefix = child->prefix.substr(0, common_size);
+      child->prefix.erase(0, common_size);
+      split_node->child_first_bytes.push_back(child->prefix[0]);
+      split_node->children.emplace_back(std::move(node->children[child_index]));
+      node->children[child_index] = std::move(split_node);
+      child = node->children[child_index].get();
+    }
+
+    text.remove_prefix(common_size);
+    node = child;
+  }
+  return node;
+}
+
+void HTTPRouter::add_endpoint(vector<Endpoint>& endpoints, uint32_t methods,
+    size_t route_index, const Route* routes) {
+  for (const auto& e : endpoints) {
+    if (e.methods & methods) {
+      throw invalid_argument("route conflicts with existing route: " +
+          routes[e.route_index].pattern);
+    }
+  }
+  endpoints.emplace_back(Endpoint{methods, route_index});
+}
+
+HTTPRouter::Result HTTPRouter::match(
+    uint32_t method, string_view path, HTTPRouteMatch& m) const {
+  m.route = nullptr;
+  m.num_params = 0;
+  m.allowed_methods = 0;
+  if (this->match_node(&this->root, method, path, m)) {
+    return Result::FOUND;
+  }
+  return m.allowed_methods ? Result::METHOD_NOT_ALLOWED : Result::NOT_FOUND;
+}
+
+bool HTTPRouter::match_node(const Node* node, uint32_t method,
+    string_view path, HTTPRouteMatch& m) const {
+  if (path.empty()) {
+    if (this->match_endpoints(node->endpoints, method, m)) {
+      return true;
+    }
+
+  } else {
+    size_t child_index = node->child_first_bytes.find(path[0]);
+    if (child_index != string::npos) {
+      const Node* child = node->children[child_index].get();
+      if (path.starts_with(child->prefix) &&
+          this->match_node(child, method, path.substr(child->prefix.size()), m)) {
+        return true;
+      }
+    }
+
+    if (node->param_child && (m.num_params < HTTPRouteMatch::MAX_PARAMS)) {
+      size_t segment_size = path.find('/');
+      if (segment_size == string_view::npos) {
+        segment_size = path.size();
+      }
+      if (segment_size > 0) {
+        m.params[m.num_params++] = path.substr(0, segment_size);
+        if (this->match_node(node->param_child.get(), method, path.substr(segment_size), m)) {
+          return true;
+        }
+        m.num_params--;
+      }
+    }
+  }
+
+  if (!node->wildcard_endpoints.empty() && (m.num_params < HTTPRouteMatch::MAX_PARAMS)) {
+    m.params[m.num_params++] = path;
+    if (this->match_endpoints(node->wildcard_endpoints, method, m)) {
+      return true;
+    }
+    m.num_params--;
+  }
+  return false;
+}
+
+bool HTTPRouter::match_endpoints(
+    const vector<Endpoint>& endpoints, uint32_t method, HTTPRouteMatch& m) const {
+  for (const auto& e : endpoints) {
+    if (e.methods & method) {
+      m.route = &this->routes[e.route_index];
+      return true;
+    }
+  }
+  if (method == EVHTTP_REQ_HEAD) {
+    for (const auto& e : endpoints) {
+      if (e.methods & EVHTTP_REQ_GET) {
+        m.route = &this->routes[e.route_index];
+        return true;
+      }
+    }
+  }
+  for (const auto& e : endpoints) {
+    m.allowed_methods |= e.methods;
+  }
+  return false;
+}
+
+void HTTPRouter::call(EvHTTPRequest& req, const HTTPRouteMatch& m) const {
+  if (!m.route) {
+    throw logic_error("no route was matched");
+  }
+  static_cast<const Route*>(m.route)->handler(req, m);
+}
+
+string_view HTTPRouter::path_for_uri(const char* uri) {
+  if (!uri) {
+    return string_view();
+  }
+  size_t size = strcspn(uri, "?#");
+  return string_view(uri, size);
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <event2/http.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "EvHTTPRequest.hh"
+#include "InlineFunction.hh"
+
+class HTTPRouter;
+
+// The result of matching a request path against the router. Parameter values
+// are views into the request URI (they aren't percent-decoded), so they're
+// only valid as long as the request is.
+class HTTPRouteMatch {
+public:
+  static constexpr size_t MAX_PARAMS = 16;
+
+  HTTPRouteMatch();
+
+  // Returns the value of a named parameter (":name" or "*name" in the
+  // pattern), or an empty view if the route has no such parameter
+  std::string_view get_param(std::string_view name) const;
+  // Returns parameter values in the order they appear in the pattern
+  std::string_view get_param(size_t index) const;
+  inline size_t param_count() const {
+    return this->num_params;
+  }
+  // Returns the pattern of the matched route
+  const std::string& get_pattern() const;
+  // When a path matches some routes but none of them accept the request
+  // method, this is the union of the methods they do accept
+  inline uint32_t get_allowed_methods() const {
+    return this->allowed_methods;
+  }
+
+private:
+  friend class HTTPRouter;
+
+  const void* route;
+  std::string_view params[MAX_PARAMS];
+  size_t num_params;
+  uint32_t allowed_methods;
+};
+
+// Maps request methods and paths to handlers. Patterns are made of segments
+// separated by slashes; a segment may be a parameter (":name", which matches
+// any nonempty segment), and the last segment may be a wildcard ("*name",
+// which matches the rest of the path, including any slashes). For example:
+//   /users/:user_id/posts/:post_id
+//   /static/*path
+// Routes are compiled into a compressed radix trie as they're added, so
+// lookups take time proportional to the path length rather than the number
+// of routes. Static segments take precedence over parameters, which take
+// precedence over wildcards; lookups backtrack if a more specific branch
+// doesn't lead to a match. Methods are bitmasks of evhttp_cmd_type values;
+// HEAD requests also match GET routes if there's no explicit HEAD route.
+class HTTPRouter {
+public:
+  using Handler = InlineFunction<void(EvHTTPRequest&, const HTTPRouteMatch&)>;
+
+  static constexpr uint32_t ALL_METHODS = 0xFFFFFFFF;
+
+  enum class Result {
+    FOUND = 0,
+    NOT_FOUND,
+    METHOD_NOT_ALLOWED,
+  };
+
+  HTTPRouter();
+  HTTPRouter(const HTTPRouter&) = delete;
+  HTTPRouter(HTTPRouter&&) = delete;
+  HTTPRouter& operator=(const HTTPRouter&) = delete;
+  HTTPRouter& operator=(HTTPRouter&&) = delete;
+  ~HTTPRouter();
+
+  // Throws invalid_argument if the pattern is malformed, or if an existing
+  // route with the same pattern accepts any of the same methods
+  void add(uint32_t methods, const std::string& pattern, Handler handler);
+
+  // Matches a request path (without the query string). If the result is
+  // FOUND, the handler can be called with call().
+  Result match(uint32_t method, std::string_view path, HTTPRouteMatch& m) const;
+  void call(EvHTTPRequest& req, const HTTPRouteMatch& m) const;
+
+  inline size_t route_count() const {
+    return this->routes.size();
+  }
+
+  // Returns the path part of a request URI (everything before the query string
+  // or fragment), without copying it
+  static std::string_view path_for_uri(const char* uri);
+
+private:
+  friend class HTTPRouteMatch;
+
+  struct Route {
+    std::string pattern;
+    std::vector<std::string> param_names;
+    uint32_t methods;
+    // InlineFunction can only be called through a non-const reference
+    mutable Handler handler;
+  };
+
+  struct Endpoint {
+    uint32_t methods;
+    size_t route_index;
+  };
+
+  struct Node {
+    // Static text leading into this node (empty for the root and parameter
+    // nodes)
+    std::string prefix;
+    // First byte of each static child's prefix, for finding the right child
+    // without following the child pointers
+    std::string child_first_bytes;
+    std::vector<std::unique_ptr<Node>> children;
+    std::unique_ptr<Node> param_child;
+    // Routes that end at this node, and routes that end with a wildcard
+    // segment starting at this node
+    std::vector<Endpoint> endpoints;
+    std::vector<Endpoint> wildcard_endpoints;
+  };
+
+  std::vector<Route> routes;
+  Node root;
+
+  Node* insert_static(Node* node, std::string_view text);
+  static void add_endpoint(std::vector<Endpoint>& endpoints, uint32_t methods,
+      size_t route_index, const Route* routes);
+  bool match_node(const Node* node, uint32_t method, std::string_view path,
+      HTTPRouteMatch& m) const;
+  bool match_endpoints(const std::vector<Endpoint>& endpoints, uint32_t method,
+      HTTPRouteMatch& m) const;
+};
@@ -0,0 +1,157 @@
+#include <event2/http.h>
+#include <stdio.h>
+
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+
+#include "HTTPRouter.hh"
+
+using namespace std;
+
+static void add_route(HTTPRouter& r, uint32_t methods, const string& pattern) {
+  r.add(methods, pattern, [](EvHTTPRequest&, const HTTPRouteMatch&) -> void {});
+}
+
+static void test_precedence() {
+  fprintf(stderr, "-- static segments take precedence over parameters and wildcards\n");
+  HTTPRouter r;
+  add_route(r, EVHTTP_REQ_GET, "/users/*rest");
+  add_route(r, EVHTTP_REQ_GET, "/users/:id");
+  add_route(r, EVHTTP_REQ_GET, "/users/me");
+  add_route(r, EVHTTP_REQ_GET, "/users/:id/posts/:post_id");
+
+  HTTPRouteMatch m;
+  expect(r.match(EVHTTP_REQ_GET, "/users/me", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/users/me");
+  expect_eq(m.param_count(), 0u);
+
+  expect(r.match(EVHTTP_REQ_GET, "/users/mel", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/users/:id");
+  expect_eq(m.get_param("id"), "mel");
+
+  expect(r.match(EVHTTP_REQ_GET, "/users/42/posts/7", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/users/:id/posts/:post_id");
+  expect_eq(m.get_param("id"), "42");
+  expect_eq(m.get_param("post_id"), "7");
+  expect_eq(m.get_param(1), "7");
+  expect_eq(m.get_param("missing"), "");
+
+  expect(r.match(EVHTTP_REQ_GET, "/users/42/comments", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/users/*rest");
+  expect_eq(m.get_param("rest"), "42/comments");
+
+  // Parameters don't match empty segments
+  expect(r.match(EVHTTP_REQ_GET, "/users/", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/users/*rest");
+  expect_eq(m.get_param("rest"), "");
+
+  expect(r.match(EVHTTP_REQ_GET, "/user", m) == HTTPRouter::Result::NOT_FOUND);
+  expect(r.match(EVHTTP_REQ_GET, "/", m) == HTTPRouter::Result::NOT_FOUND);
+}
+
+static void test_backtracking() {
+  fprintf(stderr, "-- lookups backtrack out of branches that don't match\n");
+  HTTPRouter r;
+  add_route(r, EVHTTP_REQ_GET, "/a/b/c");
+  add_route(r, EVHTTP_REQ_GET, "/a/:x/d");
+  add_route(r, EVHTTP_REQ_GET, "/files/special/x");
+  add_route(r, EVHTTP_REQ_GET, "/files/*path");
+  add_route(r, EVHTTP_REQ_GET, "/p/:a/x/:b");
+  add_route(r, EVHTTP_REQ_GET, "/p/*rest");
+
+  HTTPRouteMatch m;
+  expect(r.match(EVHTTP_REQ_GET, "/a/b/c", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/a/b/c");
+  // The static branch matches "/a/b/" but not "d"
+  expect(r.match(EVHTTP_REQ_GET, "/a/b/d", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/a/:x/d");
+  expect_eq(m.get_param("x"), "b");
+  // Splitting "/a/b/c" and "/a/:x/d" doesn't make "/a/bb/d" take the static
+  // branch
+  expect(r.match(EVHTTP_REQ_GET, "/a/bb/d", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_param("x"), "bb");
+
+  expect(r.match(EVHTTP_REQ_GET, "/files/special/y", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/files/*path");
+  expect_eq(m.get_param("path"), "special/y");
+
+  // The parameter branch captures "1" before failing, which must be undone
+  // before the wildcard captures the rest of the path
+  expect(r.match(EVHTTP_REQ_GET, "/p/1/x/", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/p/*rest");
+  expect_eq(m.param_count(), 1u);
+  expect_eq(m.get_param("rest"), "1/x/");
+  expect(r.match(EVHTTP_REQ_GET, "/p/1/x/2", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/p/:a/x/:b");
+  expect_eq(m.param_count(), 2u);
+}
+
+static void test_methods() {
+  fprintf(stderr, "-- paths with no route for the method return the allowed methods\n");
+  HTTPRouter r;
+  add_route(r, EVHTTP_REQ_GET, "/items");
+  add_route(r, EVHTTP_REQ_POST | EVHTTP_REQ_PUT, "/items");
+  add_route(r, EVHTTP_REQ_GET, "/things/:id");
+  add_route(r, EVHTTP_REQ_POST, "/things/special");
+
+  HTTPRouteMatch m;
+  expect(r.match(EVHTTP_REQ_PUT, "/items", m) == HTTPRouter::Result::FOUND);
+  expect(r.match(EVHTTP_REQ_DELETE, "/items", m) == HTTPRouter::Result::METHOD_NOT_ALLOWED);
+  expect_eq(m.get_allowed_methods(), static_cast<uint32_t>(EVHTTP_REQ_GET | EVHTTP_REQ_POST | EVHTTP_REQ_PUT));
+  // The allowed methods include those of every route that matches the path
+  expect(r.match(EVHTTP_REQ_DELETE, "/things/special", m) == HTTPRouter::Result::METHOD_NOT_ALLOWED);
+  expect_eq(m.get_allowed_methods(), static_cast<uint32_t>(EVHTTP_REQ_GET | EVHTTP_REQ_POST));
+  expect(r.match(EVHTTP_REQ_GET, "/things/special", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/things/:id");
+  expect(r.match(EVHTTP_REQ_DELETE, "/nothing", m) == HTTPRouter::Result::NOT_FOUND);
+  expect_eq(m.get_allowed_methods(), 0u);
+
+  fprintf(stderr, "-- HEAD requests fall back to GET routes\n");
+  add_route(r, EVHTTP_REQ_GET, "/page");
+  add_route(r, EVHTTP_REQ_GET, "/page2");
+  add_route(r, EVHTTP_REQ_HEAD, "/page2");
+  expect(r.match(EVHTTP_REQ_HEAD, "/page", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/page");
+  expect(r.match(EVHTTP_REQ_HEAD, "/page2", m) == HTTPRouter::Result::FOUND);
+  expect_eq(m.get_pattern(), "/page2");
+  expect_eq(r.route_count(), 7u);
+  // The fallback is only for HEAD
+  expect(r.match(EVHTTP_REQ_POST, "/page", m) == HTTPRouter::Result::METHOD_NOT_ALLOWED);
+  expect_eq(m.get_allowed_methods(), static_cast<uint32_t>(EVHTTP_REQ_GET));
+}
+
+static void test_invalid_routes() {
+  fprintf(stderr, "-- malformed and conflicting routes are rejected\n");
+  HTTPRouter r;
+  add_route(r, EVHTTP_REQ_GET, "/x/:id");
+  for (const char* pattern : {"", "x", "/a/:", "/a/:id/:id", "/a/*rest/b"}) {
+    try {
+      add_route(r, EVHTTP_REQ_GET, pattern);
+      expect(false);
+    } catch (const invalid_argument&) {
+    }
+  }
+  try {
+    add_route(r, EVHTTP_REQ_GET | EVHTTP_REQ_POST, "/x/:id");
+    expect(false);
+  } catch (const invalid_argument&) {
+  }
+  add_route(r, EVHTTP_REQ_POST, "/x/:id");
+  expect_eq(r.route_count(), 2u);
+
+  fprintf(stderr, "-- path_for_uri strips the query and fragment\n");
+  expect_eq(HTTPRouter::path_for_uri("/a/b?c=d#e"), "/a/b");
+  expect_eq(HTTPRouter::path_for_uri("/a#b?c"), "/a");
+  expect_eq(HTTPRouter::path_for_uri("/a"), "/a");
+  expect_eq(HTTPRouter::path_for_uri(nullptr), "");
+}
+
+int main(int, char**) {
+  test_precedence();
+  test_backtracking();
+  test_methods();
+  test_invalid_routes();
+  fprintf(stderr, "All tests passed\n");
+  return 0;
+}
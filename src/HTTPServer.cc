@@ -1,179 +1,763 @@
-#include "HTTPServer.hh"
-
-#include <event2/buffer.h>
-#include <event2/bufferevent_ssl.h>
-#include <event2/event.h>
-#include <event2/http.h>
-#include <inttypes.h>
-#include <openssl/err.h>
-#include <openssl/ssl.h>
-#include <signal.h>
-#include <stdlib.h>
-#include <string.h>
-
-#include <phosg/Encoding.hh>
-#include <string>
-#include <thread>
-#include <vector>
-
-using namespace std;
-
-const unordered_map<int, const char*> HTTPServer::explanation_for_response_code({
-    {100, "Continue"},
-    {101, "Switching Protocols"},
-    {102, "Processing"},
-    {200, "OK"},
-    {201, "Created"},
-    {202, "Accepted"},
-    {203, "Non-Authoritative Information"},
-    {204, "No Content"},
-    {205, "Reset Content"},
-    {206, "Partial Content"},
-    {207, "Multi-Status"},
-    {208, "Already Reported"},
-    {226, "IM Used"},
-    {300, "Multiple Choices"},
-    {301, "Moved Permanently"},
-    {302, "Found"},
-    {303, "See Other"},
-    {304, "Not Modified"},
-    {305, "Use Proxy"},
-    {307, "Temporary Redirect"},
-    {308, "Permanent Redirect"},
-    {400, "Bad Request"},
-    {401, "Unathorized"},
-    {402, "Payment Required"},
-    {403, "Forbidden"},
-    {404, "Not Found"},
-    {405, "Method Not Allowed"},
-    {406, "Not Acceptable"},
-    {407, "Proxy Authentication Required"},
-    {408, "Request Timeout"},
-    {409, "Conflict"},
-    {410, "Gone"},
-    {411, "Length Required"},
-    {412, "Precondition Failed"},
-    {413, "Request Entity Too Large"},
-    {414, "Request-URI Too Long"},
-    {415, "Unsupported Media Type"},
-    {416, "Requested Range Not Satisfiable"},
-    {417, "Expectation Failed"},
-    {418, "I\'m a Teapot"},
-    {420, "Enhance Your Calm"},
-    {422, "Unprocessable Entity"},
-    {423, "Locked"},
-    {424, "Failed Dependency"},
-    {426, "Upgrade Required"},
-    {428, "Precondition Required"},
-    {429, "Too Many Requests"},
-    {431, "Request Header Fields Too Large"},
-    {444, "No Response"},
-    {449, "Retry With"},
-    {451, "Unavailable For Legal Reasons"},
-    {500, "Internal Server Error"},
-    {501, "Not Implemented"},
-    {502, "Bad Gateway"},
-    {503, "Service Unavailable"},
-    {504, "Gateway Timeout"},
-    {505, "HTTP Version Not Supported"},
-    {506, "Variant Also Negotiates"},
-    {507, "Insufficient Storage"},
-    {508, "Loop Detected"},
-    {509, "Bandwidth Limit Exceeded"},
-    {510, "Not Extended"},
-    {511, "Network Authentication Required"},
-    {598, "Network Read Timeout Error"},
-    {599, "Network Connect Timeout Error"},
-});
-
-HTTPServer::HTTPServer(EventBase& base, shared_ptr<SSL_CTX> ssl_ctx)
-    : base(base),
-      http(nullptr),
-      ssl_ctx(ssl_ctx) {}
-
-HTTPServer::~HTTPServer() {
-  if (this->http) {
-    evhttp_free(this->http);
-  }
-}
-
-void HTTPServer::add_socket(int fd) {
-  if (!this->http) {
-    this->http = evhttp_new(this->base.get());
-    if (this->ssl_ctx) {
-      evhttp_set_bevcb(
-          this->http,
-          this->dispatch_on_ssl_connection,
-          this->ssl_ctx.get());
-    }
-    evhttp_set_gencb(this->http, this->dispatch_handle_request, this);
-  }
-
-  evhttp_accept_socket(this->http, fd);
-}
-
-void HTTPServer::set_server_name(const char* new_server_name) {
-  this->server_name = new_server_name;
-}
-
-struct bufferevent* HTTPServer::dispatch_on_ssl_connection(
-    struct event_base* base, void* ctx) {
-
-  SSL_CTX* ssl_ctx = reinterpret_cast<SSL_CTX*>(ctx);
-  SSL* ssl = SSL_new(ssl_ctx);
-  return bufferevent_openssl_socket_new(
-      base,
-      -1,
-      ssl,
-      BUFFEREVENT_SSL_ACCEPTING,
-      BEV_OPT_CLOSE_ON_FREE);
-}
-
-void HTTPServer::dispatch_handle_request(
-    struct evhttp_request* req,
-    void* ctx) {
-  EvHTTPRequest req_obj(req);
-  reinterpret_cast<HTTPServer*>(ctx)->handle_request(req_obj);
-}
-
-void HTTPServer::send_response(EvHTTPRequest& req, int code,
-    const char* content_type, EvBuffer& b) {
-
-  req.add_output_header("Content-Type", content_type);
-  if (!this->server_name.empty()) {
-    req.add_output_header("Server", this->server_name.c_str());
-  }
-
-  evhttp_send_reply(
-      req.get(),
-      code,
-      HTTPServer::explanation_for_response_code.at(code),
-      b.get());
-}
-
-void HTTPServer::send_response(EvHTTPRequest& req, int code,
-    const char* content_type, const char* fmt, ...) {
-  EvBuffer out_buffer;
-
-  va_list va;
-  va_start(va, fmt);
-  out_buffer.add_vprintf(fmt, va);
-  va_end(va);
-
-  HTTPServer::send_response(req, code, content_type, out_buffer);
-}
-
-void HTTPServer::send_response(EvHTTPRequest& req, int code,
-    const char* content_type) {
-  if (!this->server_name.empty()) {
-    req.add_output_header("Server", this->server_name.c_str());
-  }
-  if (content_type) {
-    req.add_output_header("Content-Type", content_type);
-  }
-  evhttp_send_reply(
-      req.get(),
-      code,
-      HTTPServer::explanation_for_response_code.at(code),
-      nullptr);
-}
+#include "HTTPServer.hh"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/util.h>
+#include <inttypes.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <phosg/Encoding.hh>
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LoopMonitor.hh"
+
+using namespace std;
+
+struct ResponseCodeExplanation {
+  int code;
+  const char* explanation;
+};
+
+static constexpr ResponseCodeExplanation explanations[] = {
+    {100, "Continue"},
+    {101, "Switching Protocols"},
+    {102, "Processing"},
+    {200, "OK"},
+    {201, "Created"},
+    {202, "Accepted"},
+    {203, "Non-Authoritative Information"},
+    {204, "No Content"},
+    {205, "Reset Content"},
+    {206, "Partial Content"},
+    {207, "Multi-Status"},
+    {208, "Already Reported"},
+    {226, "IM Used"},
+    {300, "Multiple Choices"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {303, "See Other"},
+    {304, "Not Modified"},
+    {305, "Use Proxy"},
+    {307, "Temporary Redirect"},
+    {308, "Permanent Redirect"},
+    {400, "Bad Request"},
+    {401, "Unauthorized"},
+    {402, "Payment Required"},
+    {403, "Forbidden"},
+    {404, "Not Found"},
+    {405, "Method Not Allowed"},
+    {406, "Not Acceptable"},
+    {407, "Proxy Authentication Required"},
+    {408, "Request Timeout"},
+    {409, "Conflict"},
+    {410, "Gone"},
+    {411, "Length Required"},
+    {412, "Precondition Failed"},
+    {413, "Request Entity Too Large"},
+    {414, "Request-URI Too Long"},
+    {415, "Unsupported Media Type"},
+    {416, "Requested Range Not Satisfiable"},
+    {417, "Expectation Failed"},
+    {418, "I\'m a Teapot"},
+    {420, "Enhance Your Calm"},
+    {422, "Unprocessable Entity"},
+    {423, "Locked"},
+    {424, "Failed Dependency"},
+    {426, "Upgrade Required"},
+    {428, "Precondition Required"},
+    {429, "Too Many Requests"},
+    {431, "Request Header Fields Too Large"},
+    {444, "No Response"},
+    {449, "Retry With"},
+    {451, "Unavailable For Legal Reasons"},
+    {500, "Internal Server Error"},
+    {501, "Not Implemented"},
+    {502, "Bad Gateway"},
+    {503, "Service Unavailable"},
+    {504, "Gateway Timeout"},
+    {505, "HTTP Version Not Supported"},
+    {506, "Variant Also Negotiates"},
+    {507, "Insufficient Storage"},
+    {508, "Loop Detected"},
+    {509, "Bandwidth Limit Exceeded"},
+    {510, "Not Extended"},
+    {511, "Network Authentication Required"},
+    {598, "Network Read Timeout Error"},
+    {599, "Network Connect Timeout Error"},
+};
+
+// Indexed by (code - MIN_RESPONSE_CODE); codes without a standard explanation
+// have an empty string, so lookups never fail for codes in the valid range
+static constexpr int MIN_RESPONSE_CODE = 100;
+static constexpr int MAX_RESPONSE_CODE = 599;
+using ExplanationTable = array<const char*, MAX_RESPONSE_CODE - MIN_RESPONSE_CODE + 1>;
+
+static constexpr ExplanationTable make_explanation_table() {
+  ExplanationTable ret{};
+  for (auto& explanation : ret) {
+    explanation = "";
+  }
+  for (const auto& it : explanations) {
+    ret[it.code - MIN_RESPONSE_CODE] = it.explanation;
+  }
+  return ret;
+}
+
+static constexpr ExplanationTable explanation_table = make_explanation_table();
+
+const char* HTTPServer::explanation_for_response_code(int code) {
+  if ((code < MIN_RESPONSE_CODE) || (code > MAX_RESPONSE_CODE)) {
+    throw invalid_argument("invalid HTTP response code");
+  }
+  return explanation_table[code - MIN_RESPONSE_CODE];
+}
+
+HTTPServer::HTTPServer(EventBase& base, shared_ptr<SSL_CTX> ssl_ctx)
+    : base(base),
+      http(nullptr),
+      ssl_ctx(ssl_ctx),
+      date_header_secs(-1),
+      date_header{} {}
+
+HTTPServer::~HTTPServer() {
+  if (this->http) {
+    evhttp_free(this->http);
+  }
+}
+
+void HTTPServer::add_socket(int fd) {
+  if (!this->http) {
+    this->http = evhttp_new(this->base.get());
+    if (this->ssl_ctx) {
+      evhttp_set_bevcb(
+          this->http,
+          this->dispatch_on_ssl_connection,
+          this->ssl_ctx.get());
+    }
+    evhttp_set_gencb(this->http, this->dispatch_handle_request, this);
+  }
+
+  evhttp_accept_socket(this->http, fd);
+}
+
+void HTTPServer::set_server_name(const char* new_server_name) {
+  this->set_default_header("Server", new_server_name);
+}
+
+void HTTPServer::set_default_header(const char* name, const char* value) {
+  for (auto it = this->default_headers.begin(); it != this->default_headers.end(); it++) {
+    if (!strcasecmp(it->first.c_str(), name)) {
+      this->default_headers.erase(it);
+      break;
+    }
+  }
+  if (value && *value) {
+    this->default_headers.emplace_back(name, value);
+  }
+}
+
+void HTTPServer::add_route(
+    uint32_t methods, const string& pattern, HTTPRouter::Handler handler) {
+  this->router.add(methods, pattern, std::move(handler));
+}
+
+StaticFileCache& HTTPServer::add_static_files(
+    const string& url_prefix, const string& root_dir, size_t max_cached_files) {
+  string pattern = url_prefix;
+  while (!pattern.empty() && (pattern.back() == '/')) {
+    pattern.pop_back();
+  }
+  pattern += "/*path";
+
+  StaticFileCache* cache = this->static_file_caches.emplace_back(
+      new StaticFileCache(this->base, root_dir, max_cached_files)).get();
+  this->add_route(EVHTTP_REQ_GET, pattern,
+      [this, cache](EvHTTPRequest& req, const HTTPRouteMatch& m) -> void {
+        auto file = cache->get(m.get_param("path"));
+        if (file) {
+          this->send_file(req, *file);
+        } else {
+          this->send_response(req, 404);
+        }
+      });
+  return *cache;
+}
+
+HTTPResponseCache& HTTPServer::enable_response_cache(size_t max_bytes) {
+  if (this->response_cache) {
+    throw logic_error("response cache is already enabled");
+  }
+  this->response_cache.reset(new HTTPResponseCache(this->base, max_bytes));
+  return *this->response_cache;
+}
+
+void HTTPServer::add_cached_route(uint32_t methods, const string& pattern,
+    uint64_t ttl_usecs, HTTPRouter::Handler handler, const vector<string>& key_headers) {
+  if (!this->response_cache) {
+    throw logic_error("response cache is not enabled");
+  }
+  this->add_route(methods, pattern,
+      [this, ttl_usecs, handler = std::move(handler), key_headers](
+          EvHTTPRequest& req, const HTTPRouteMatch& m) mutable -> void {
+        // Headers that are absent and headers that are empty are considered
+        // the same, since handlers almost never distinguish between them
+        string& key = this->response_cache_key;
+        enum evhttp_cmd_type command = req.get_command();
+        key.assign(reinterpret_cast<const char*>(&command), sizeof(command));
+        key += req.get_uri();
+        for (const auto& header_name : key_headers) {
+          key.push_back('\n');
+          const char* value = req.get_input_header(header_name.c_str());
+          if (value) {
+            key += value;
+          }
+        }
+
+        const HTTPResponseCache::Entry* entry;
+        switch (this->response_cache->lookup(key, req.get(), ttl_usecs, &entry)) {
+          case HTTPResponseCache::Status::HIT:
+            this->send_cached_response(req, *entry, true);
+            break;
+          case HTTPResponseCache::Status::MISS:
+          case HTTPResponseCache::Status::BYPASS:
+            handler(req, m);
+            break;
+          case HTTPResponseCache::Status::COALESCED:
+            break;
+        }
+      });
+}
+
+const char* HTTPServer::get_date_header() {
+  struct timeval tv;
+  this->base.gettimeofday_cached(&tv);
+  if (tv.tv_sec != this->date_header_secs) {
+    struct tm t;
+    gmtime_r(&tv.tv_sec, &t);
+    evutil_date_rfc1123(this->date_header, sizeof(this->date_header), &t);
+    this->date_header_secs = tv.tv_sec;
+  }
+  return this->date_header;
+}
+
+void HTTPServer::add_default_headers(EvHTTPRequest& req) {
+  // If there's no Date header, evhttp adds one itself, but it formats the
+  // current time again for every response
+  struct evkeyvalq* headers = req.get_output_headers();
+  if (!evhttp_find_header(headers, "Date")) {
+    evhttp_add_header(headers, "Date", this->get_date_header());
+  }
+  for (const auto& it : this->default_headers) {
+    evhttp_add_header(headers, it.first.c_str(), it.second.c_str());
+  }
+}
+
+struct bufferevent* HTTPServer::dispatch_on_ssl_connection(
+    struct event_base* base, void* ctx) {
+
+  SSL_CTX* ssl_ctx = reinterpret_cast<SSL_CTX*>(ctx);
+  SSL* ssl = SSL_new(ssl_ctx);
+  return bufferevent_openssl_socket_new(
+      base,
+      -1,
+      ssl,
+      BUFFEREVENT_SSL_ACCEPTING,
+      BEV_OPT_CLOSE_ON_FREE);
+}
+
+void HTTPServer::dispatch_handle_request(
+    struct evhttp_request* req,
+    void* ctx) {
+  LoopMonitor::CallbackScope scope(LoopMonitor::Trampoline::HTTPSERVER_HANDLE_REQUEST);
+  EvHTTPRequest req_obj(req);
+  reinterpret_cast<HTTPServer*>(ctx)->handle_request(req_obj);
+}
+
+static const struct {
+  uint32_t method;
+  const char* name;
+} method_names[] = {
+    {EVHTTP_REQ_GET, "GET"},
+    {EVHTTP_REQ_HEAD, "HEAD"},
+    {EVHTTP_REQ_POST, "POST"},
+    {EVHTTP_REQ_PUT, "PUT"},
+    {EVHTTP_REQ_DELETE, "DELETE"},
+    {EVHTTP_REQ_OPTIONS, "OPTIONS"},
+    {EVHTTP_REQ_TRACE, "TRACE"},
+    {EVHTTP_REQ_CONNECT, "CONNECT"},
+    {EVHTTP_REQ_PATCH, "PATCH"},
+};
+
+bool HTTPServer::route_request(EvHTTPRequest& req) {
+  HTTPRouteMatch m;
+  auto result = this->router.match(
+      req.get_command(), HTTPRouter::path_for_uri(req.get_uri()), m);
+  if (result == HTTPRouter::Result::FOUND) {
+    this->router.call(req, m);
+    return true;
+  }
+
+  if (result == HTTPRouter::Result::METHOD_NOT_ALLOWED) {
+    uint32_t allowed_methods = m.get_allowed_methods();
+    if (allowed_methods & EVHTTP_REQ_GET) {
+      allowed_methods |= EVHTTP_REQ_HEAD;
+    }
+    string allow_header;
+    for (const auto& it : method_names) {
+      if (allowed_methods & it.method) {
+        if (!allow_header.empty()) {
+          allow_header += ", ";
+        }
+        allow_header += it.name;
+      }
+    }
+    req.add_output_header("Allow", allow_header.c_str());
+    this->send_response(req, 405);
+  } else {
+    this->send_response(req, 404);
+  }
+  return false;
+}
+
+void HTTPServer::handle_request(EvHTTPRequest& req) {
+  this->route_request(req);
+}
+
+void HTTPServer::send_response(EvHTTPRequest& req, int code,
+    const char* content_type, EvBuffer& b) {
+  if (this->response_cache && this->response_cache->is_pending(req.get()) &&
+      this->complete_cached_response(req, code, content_type, b)) {
+    return;
+  }
+
+  if (content_type) {
+    req.add_output_header("Content-Type", content_type);
+  }
+  this->add_default_headers(req);
+
+  // evhttp sends the body even in responses to HEAD requests (which GET
+  // routes also handle), and doesn't add Content-Length to responses without
+  // bodies, so we send the length instead of the body
+  if (req.get_command() == EVHTTP_REQ_HEAD) {
+    if ((code >= 200) && (code != 204) && (code != 304)) {
+      char content_length[24];
+      snprintf(content_length, sizeof(content_length), "%zu", b.get_length());
+      req.add_output_header("Content-Length", content_length);
+    }
+    evhttp_send_reply(req.get(), code,
+        HTTPServer::explanation_for_response_code(code), nullptr);
+    return;
+  }
+
+  evhttp_send_reply(
+      req.get(),
+      code,
+      HTTPServer::explanation_for_response_code(code),
+      b.get());
+}
+
+// Parses an HTTP date (only the IMF-fixdate format, which is the only one
+// that current clients send). Returns -1 if the date is invalid.
+static time_t parse_http_date(const char* s) {
+  struct tm t = {};
+  const char* end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &t);
+  if (!end || *end) {
+    return -1;
+  }
+  return timegm(&t);
+}
+
+// Returns true if the ETag matches any of the entity tags in an If-None-Match
+// header. This uses the weak comparison, as RFC 9110 requires for
+// If-None-Match.
+static bool etag_list_contains(const char* header, const char* etag) {
+  string_view remaining(header);
+  string_view target(etag);
+  while (!remaining.empty()) {
+    size_t comma_offset = remaining.find(',');
+    string_view item = remaining.substr(0, comma_offset);
+    remaining = (comma_offset == string_view::npos) ? string_view() : remaining.substr(comma_offset + 1);
+    while (!item.empty() && ((item.front() == ' ') || (item.front() == '\t'))) {
+      item.remove_prefix(1);
+    }
+    while (!item.empty() && ((item.back() == ' ') || (item.back() == '\t'))) {
+      item.remove_suffix(1);
+    }
+    if (item.starts_with("W/")) {
+      item.remove_prefix(2);
+    }
+    if ((item == "*") || (item == target)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool parse_decimal(string_view s, uint64_t* value) {
+  if (s.empty() || (s.size() > 19)) {
+    return false;
+  }
+  *value = 0;
+  for (char ch : s) {
+    if ((ch < '0') || (ch > '9')) {
+      return false;
+    }
+    *value = (*value * 10) + (ch - '0');
+  }
+  return true;
+}
+
+enum class ByteRangeResult {
+  // The header is malformed or has multiple ranges; the whole file is sent
+  IGNORE = 0,
+  SATISFIABLE,
+  UNSATISFIABLE,
+};
+
+static ByteRangeResult parse_byte_range(
+    const char* header, uint64_t file_size, uint64_t* start, uint64_t* end) {
+  string_view spec(header);
+  if ((spec.size() < 6) || strncasecmp(spec.data(), "bytes=", 6)) {
+    return ByteRangeResult::IGNORE;
+  }
+  spec.remove_prefix(6);
+  size_t dash_offset = spec.find('-');
+  if ((dash_offset == string_view::npos) || (spec.find(',') != string_view::npos)) {
+    return ByteRangeResult::IGNORE;
+  }
+  string_view first = spec.substr(0, dash_offset);
+  string_view last = spec.substr(dash_offset + 1);
+
+  if (first.empty()) {
+    // Suffix range: the last N bytes
+    uint64_t suffix_size;
+    if (!parse_decimal(last, &suffix_size)) {
+      return ByteRangeResult::IGNORE;
+    }
+    if (!suffix_size || !file_size) {
+      return ByteRangeResult::UNSATISFIABLE;
+    }
+    *start = (suffix_size < file_size) ? (file_size - suffix_size) : 0;
+    *end = file_size - 1;
+    return ByteRangeResult::SATISFIABLE;
+  }
+
+  if (!parse_decimal(first, start)) {
+    return ByteRangeResult::IGNORE;
+  }
+  if (last.empty()) {
+    *end = file_size - 1;
+  } else if (!parse_decimal(last, end) || (*end < *start)) {
+    return ByteRangeResult::IGNORE;
+  }
+  if (*start >= file_size) {
+    return ByteRangeResult::UNSATISFIABLE;
+  }
+  if (*end >= file_size) {
+    *end = file_size - 1;
+  }
+  return ByteRangeResult::SATISFIABLE;
+}
+
+void HTTPServer::send_file(EvHTTPRequest& req, const StaticFileCache::Entry& file) {
+  struct evkeyvalq* headers = req.get_output_headers();
+  evhttp_add_header(headers, "ETag", file.etag);
+  evhttp_add_header(headers, "Last-Modified", file.last_modified);
+  evhttp_add_header(headers, "Accept-Ranges", "bytes");
+
+  // If-Modified-Since is ignored if If-None-Match is present
+  const char* if_none_match = req.get_input_header("If-None-Match");
+  bool not_modified;
+  if (if_none_match) {
+    not_modified = etag_list_contains(if_none_match, file.etag);
+  } else {
+    const char* if_modified_since = req.get_input_header("If-Modified-Since");
+    time_t since = if_modified_since ? parse_http_date(if_modified_since) : -1;
+    not_modified = (since >= 0) && (file.mtime_secs <= since);
+  }
+  if (not_modified) {
+    this->send_response(req, 304);
+    return;
+  }
+
+  int code = 200;
+  uint64_t start = 0;
+  uint64_t size = file.size;
+  const char* range = req.get_input_header("Range");
+  if (range) {
+    // If-Range makes the range conditional on the file being unchanged; it
+    // contains either an ETag (which must match exactly) or a date
+    const char* if_range = req.get_input_header("If-Range");
+    bool range_applies = !if_range ||
+        ((if_range[0] == '"') ? !strcmp(if_range, file.etag)
+                              : (parse_http_date(if_range) == file.mtime_secs));
+    uint64_t end;
+    auto result = range_applies
+        ? parse_byte_range(range, file.size, &start, &end)
+        : ByteRangeResult::IGNORE;
+    char content_range[64];
+    if (result == ByteRangeResult::UNSATISFIABLE) {
+      snprintf(content_range, sizeof(content_range), "bytes */%" PRIu64, file.size);
+      evhttp_add_header(headers, "Content-Range", content_range);
+      this->send_response(req, 416);
+      return;
+    } else if (result == ByteRangeResult::SATISFIABLE) {
+      snprintf(content_range, sizeof(content_range), "bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64,
+          start, end, file.size);
+      evhttp_add_header(headers, "Content-Range", content_range);
+      code = 206;
+      size = end - start + 1;
+    } else {
+      start = 0;
+    }
+  }
+
+  // evhttp doesn't add Content-Length to responses without bodies
+  char content_length[24];
+  snprintf(content_length, sizeof(content_length), "%" PRIu64, size);
+
+  EvBuffer body;
+  if (req.get_command() == EVHTTP_REQ_HEAD) {
+    evhttp_add_header(headers, "Content-Length", content_length);
+  } else if (file.segment) {
+    // libevent only uses sendfile for segments in a buffer that drains
+    // directly to a socket; in any other buffer (such as body, or a TLS
+    // connection's output), the segment is mapped into memory when it's
+    // added. So on plain connections, the headers are sent without a body
+    // and the segment is added to the connection's output buffer after them.
+    // evhttp doesn't read the next request until this response has been
+    // written, so nothing else can be written to the connection in between.
+    struct evhttp_connection* conn = req.get_connection();
+    struct bufferevent* bev = conn ? evhttp_connection_get_bufferevent(conn) : nullptr;
+    if (bev && !bufferevent_openssl_get_ssl(bev) &&
+        !(this->response_cache && this->response_cache->is_pending(req.get()))) {
+      evhttp_add_header(headers, "Content-Length", content_length);
+      this->send_response(req, code, file.content_type);
+      EvBuffer(bufferevent_get_output(bev)).add_file_segment(file.segment, start, size);
+      return;
+    }
+    body.add_file_segment(file.segment, start, size);
+  } else {
+    body.add(file.data.data() + start, size);
+  }
+  this->send_response(req, code, file.content_type, body);
+}
+
+void HTTPServer::send_response(EvHTTPRequest& req, int code,
+    const char* content_type, const char* fmt, ...) {
+  EvBuffer out_buffer;
+
+  va_list va;
+  va_start(va, fmt);
+  out_buffer.add_vprintf(fmt, va);
+  va_end(va);
+
+  HTTPServer::send_response(req, code, content_type, out_buffer);
+}
+
+void HTTPServer::send_response(EvHTTPRequest& req, int code,
+    const char* content_type) {
+  if (this->response_cache && this->response_cache->is_pending(req.get())) {
+    EvBuffer b;
+    if (this->complete_cached_response(req, code, content_type, b)) {
+      return;
+    }
+  }
+
+  this->add_default_headers(req);
+  if (content_type) {
+    req.add_output_header("Content-Type", content_type);
+  }
+  evhttp_send_reply(
+      req.get(),
+      code,
+      HTTPServer::explanation_for_response_code(code),
+      nullptr);
+}
+
+void HTTPServer::send_cached_response(
+    EvHTTPRequest& req, const HTTPResponseCache::Entry& entry, bool is_hit) {
+  struct evkeyvalq* headers = req.get_output_headers();
+  for (const auto& it : entry.headers) {
+    evhttp_add_header(headers, it.first.c_str(), it.second.c_str());
+  }
+  if (is_hit) {
+    char age[24];
+    snprintf(age, sizeof(age), "%" PRIu64,
+        (this->base.gettimeofday_cached64() - entry.store_time_usecs) / 1000000);
+    evhttp_add_header(headers, "Age", age);
+  }
+
+  EvBuffer body;
+  entry.add_body_to(body);
+  this->send_response(req, entry.code,
+      entry.content_type.empty() ? nullptr : entry.content_type.c_str(), body);
+}
+
+bool HTTPServer::complete_cached_response(
+    EvHTTPRequest& req, int code, const char* content_type, EvBuffer& b) {
+  vector<struct evhttp_request*> waiters;
+  const auto* entry = this->response_cache->complete(
+      req.get(), code, content_type, req.get_output_headers(), b, waiters);
+
+  if (!entry) {
+    // The waiting requests may get different responses (e.g. if the response
+    // depends on a cookie), so they're handled as if they just arrived. The
+    // cache now bypasses this key, so they don't wait for each other.
+    for (auto* waiter : waiters) {
+      EvHTTPRequest waiter_obj(waiter);
+      this->handle_request(waiter_obj);
+    }
+    return false;
+  }
+
+  // The entry contains the headers the handler added, so they're removed
+  // from the original request to avoid sending them twice
+  evhttp_clear_headers(req.get_output_headers());
+  try {
+    this->send_cached_response(req, *entry, false);
+    for (auto* waiter : waiters) {
+      EvHTTPRequest waiter_obj(waiter);
+      this->send_cached_response(waiter_obj, *entry, false);
+    }
+  } catch (...) {
+    HTTPResponseCache::release(entry);
+    throw;
+  }
+  HTTPResponseCache::release(entry);
+  return true;
+}
+
+void HTTPServer::start_streaming_response(EvHTTPRequest& req, int code,
+    const char* content_type, size_t low_watermark,
+    InlineFunction<void(EvHTTPRequest&)> on_writable,
+    InlineFunction<void()> on_close) {
+  if (this->response_cache && this->response_cache->is_pending(req.get())) {
+    throw logic_error("responses to cached routes cannot be streamed");
+  }
+  if (this->response_streams.count(req.get())) {
+    throw logic_error("streaming response already started");
+  }
+
+  // If the client disconnected while the handler was waiting to start the
+  // response, evhttp has already detached the request from the connection;
+  // ending the response frees it
+  struct evhttp_connection* conn = req.get_connection();
+  if (!conn) {
+    evhttp_send_reply_end(req.get());
+    if (on_close) {
+      on_close();
+    }
+    return;
+  }
+
+  if (content_type) {
+    req.add_output_header("Content-Type", content_type);
+  }
+  this->add_default_headers(req);
+  evhttp_send_reply_start(
+      req.get(),
+      code,
+      HTTPServer::explanation_for_response_code(code));
+  if (req.get_command() == EVHTTP_REQ_HEAD) {
+    evhttp_send_reply_end(req.get());
+    return;
+  }
+
+  auto* stream = this->response_streams.emplace(req.get(), new ResponseStream{
+      this, req.get(), std::move(on_writable), std::move(on_close), false, false})
+      .first->second.get();
+  // evhttp calls the chunk callback when the output buffer drains to the low
+  // write watermark, which it otherwise leaves at zero
+  bufferevent_setwatermark(
+      evhttp_connection_get_bufferevent(conn), EV_WRITE, low_watermark, 0);
+  evhttp_connection_set_closecb(
+      conn, &HTTPServer::dispatch_on_response_stream_close, stream);
+  this->call_on_writable(stream);
+}
+
+HTTPServer::ResponseStream* HTTPServer::get_response_stream(EvHTTPRequest& req) {
+  auto it = this->response_streams.find(req.get());
+  if ((it == this->response_streams.end()) || it->second->ended) {
+    throw logic_error("no streaming response is in progress");
+  }
+  return it->second.get();
+}
+
+void HTTPServer::send_response_chunk(EvHTTPRequest& req, EvBuffer& b) {
+  ResponseStream* stream = this->get_response_stream(req);
+  evhttp_send_reply_chunk_with_cb(req.get(), b.get(),
+      &HTTPServer::dispatch_on_response_stream_writable, stream);
+}
+
+void HTTPServer::end_streaming_response(EvHTTPRequest& req) {
+  ResponseStream* stream = this->get_response_stream(req);
+
+  // The watermark must be reset before ending the response, since evhttp
+  // also uses the write callback to find out when the response has been
+  // completely sent
+  struct evhttp_connection* conn = req.get_connection();
+  bufferevent_setwatermark(evhttp_connection_get_bufferevent(conn), EV_WRITE, 0, 0);
+  evhttp_connection_set_closecb(conn, nullptr, nullptr);
+  struct evhttp_request* evreq = req.get();
+  evhttp_send_reply_end(evreq);
+
+  if (stream->in_callback) {
+    stream->ended = true;
+  } else {
+    this->response_streams.erase(evreq);
+  }
+}
+
+void HTTPServer::call_on_writable(ResponseStream* stream) {
+  if (stream->on_writable) {
+    EvHTTPRequest req(stream->req);
+    stream->in_callback = true;
+    stream->on_writable(req);
+    stream->in_callback = false;
+  }
+  if (stream->ended) {
+    this->response_streams.erase(stream->req);
+  }
+}
+
+void HTTPServer::dispatch_on_response_stream_writable(
+    struct evhttp_connection*, void* ctx) {
+  LoopMonitor::CallbackScope scope(LoopMonitor::Trampoline::HTTPSERVER_RESPONSE_STREAM_WRITABLE);
+  auto* stream = reinterpret_cast<ResponseStream*>(ctx);
+  stream->server->call_on_writable(stream);
+}
+
+void HTTPServer::dispatch_on_response_stream_close(
+    struct evhttp_connection*, void* ctx) {
+  auto* stream = reinterpret_cast<ResponseStream*>(ctx);
+  HTTPServer* server = stream->server;
+  struct evhttp_request* req = stream->req;
+  stream->ended = true;
+  if (stream->on_close) {
+    stream->on_close();
+  }
+  // If the connection failed, evhttp has detached the request from it, and
+  // ending the response frees the request. If the connection is being freed
+  // for another reason (e.g. the server is being destroyed), evhttp frees
+  // the request itself.
+  if (!evhttp_request_get_connection(req)) {
+    evhttp_send_reply_end(req);
+  }
+  if (!stream->in_callback) {
+    server->response_streams.erase(req);
+  }
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #define _STDC_FORMAT_MACROS
 
 #include <event2/buffer.h>
@@ -8,13 +10,21 @@
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "EvBuffer.hh"
 #include "EvHTTPRequest.hh"
 #include "EventBase.hh"
+#include "HTTPResponseCache.hh"
+#include "HTTPRouter.hh"
+#include "InlineFunction.hh"
+#include "StaticFileCache.hh"
 
 class HTTPServer {
 public:
@@ -29,11 +39,70 @@ public:
 
   void set_server_name(const char* server_name);
 
+  // Adds a header to every response sent with send_response, replacing any
+  // existing default header with the same name. A null or empty value removes
+  // the header. The Server header set by set_server_name is also a default
+  // header.
+  void set_default_header(const char* name, const char* value);
+
+  // Adds a route to the server's router. methods is a bitmask of
+  // evhttp_cmd_type values (or HTTPRouter::ALL_METHODS). Routes are used by
+  // the default implementation of handle_request.
+  void add_route(uint32_t methods, const std::string& pattern, HTTPRouter::Handler handler);
+
+  // Adds a route that serves files from root_dir for GET and HEAD requests
+  // whose paths begin with url_prefix (e.g. "/static"). Files are sent with
+  // send_file from a StaticFileCache, which is returned so its counters can be
+  // inspected.
+  StaticFileCache& add_static_files(const std::string& url_prefix,
+      const std::string& root_dir, size_t max_cached_files = 0x400);
+
+  // Creates the response cache used by add_cached_route, which holds at most
+  // max_bytes of responses. Returns the cache so its counters can be
+  // inspected. Throws logic_error if the cache was already created.
+  HTTPResponseCache& enable_response_cache(size_t max_bytes);
+  // Like add_route, but responses are cached for ttl_usecs and sent to
+  // later requests with the same method, URI, and values of the key_headers
+  // request headers without calling the handler. Requests that arrive while
+  // the handler is generating a response for the same key wait for that
+  // response. The handler must send exactly one response with send_response
+  // (or send_file), even if it does so asynchronously, since other requests
+  // may be waiting for it. Responses that can't be shared (see
+  // HTTPResponseCache::is_cacheable) aren't cached; requests that were
+  // waiting for them, and requests for the same key within the next
+  // ttl_usecs, are handled separately. Throws logic_error if
+  // enable_response_cache hasn't been called.
+  void add_cached_route(uint32_t methods, const std::string& pattern,
+      uint64_t ttl_usecs, HTTPRouter::Handler handler,
+      const std::vector<std::string>& key_headers = {});
+
 protected:
   EventBase base;
   struct evhttp* http;
   std::shared_ptr<SSL_CTX> ssl_ctx;
-  std::string server_name;
+  // Default headers are kept in a flat list and added directly to each
+  // response's header list; there are usually only a few of them
+  std::vector<std::pair<std::string, std::string>> default_headers;
+  // Value of the Date header, refreshed at most once per second
+  time_t date_header_secs;
+  char date_header[32];
+  HTTPRouter router;
+  std::vector<std::unique_ptr<StaticFileCache>> static_file_caches;
+  std::unique_ptr<HTTPResponseCache> response_cache;
+  // Reused for building cache keys, to avoid allocating for each request
+  std::string response_cache_key;
+
+  struct ResponseStream {
+    HTTPServer* server;
+    struct evhttp_request* req;
+    InlineFunction<void(EvHTTPRequest&)> on_writable;
+    InlineFunction<void()> on_close;
+    // If end_streaming_response is called from one of the callbacks, the
+    // stream (and hence the callback) is destroyed after the callback returns
+    bool in_callback;
+    bool ended;
+  };
+  std::unordered_map<struct evhttp_request*, std::unique_ptr<ResponseStream>> response_streams;
 
   static struct bufferevent* dispatch_on_ssl_connection(struct event_base* base,
       void* ctx);
@@ -44,8 +113,72 @@ protected:
   void send_response(EvHTTPRequest& req, int code, const char* content_type,
       const char* fmt, ...);
   void send_response(EvHTTPRequest& req, int code, const char* content_type = nullptr);
+  // Sends a file in response to a GET or HEAD request. This handles
+  // conditional requests (If-None-Match and If-Modified-Since, responding with
+  // 304) and single byte ranges (Range and If-Range, responding with 206 or
+  // 416). Large files are added to the body as references to the file, so
+  // they're sent with sendfile on plain connections and never copied into
+  // memory.
+  void send_file(EvHTTPRequest& req, const StaticFileCache::Entry& file);
+  // Starts a chunked response, for bodies that are generated incrementally
+  // (and may be too large to hold in memory). on_writable is called
+  // immediately, then again each time the connection's output buffer drains
+  // to low_watermark bytes or fewer after a chunk is sent; it should send
+  // chunks with send_response_chunk, or end the response with
+  // end_streaming_response. If it sends nothing, it isn't called again until
+  // another chunk is sent, so producers that wait for data (e.g. log tails)
+  // can send chunks later from other callbacks. If the client disconnects
+  // before the response ends, on_close is called (if given), after which the
+  // request must not be used. Responses to HEAD requests end immediately,
+  // without calling either callback. Throws logic_error if the request is a
+  // pending response cache miss (cached routes can't stream responses).
+  void start_streaming_response(EvHTTPRequest& req, int code,
+      const char* content_type, size_t low_watermark,
+      InlineFunction<void(EvHTTPRequest&)> on_writable,
+      InlineFunction<void()> on_close = nullptr);
+  // Sends a chunk of a streaming response. The buffer's contents are moved to
+  // the connection's output buffer.
+  void send_response_chunk(EvHTTPRequest& req, EvBuffer& b);
+  void end_streaming_response(EvHTTPRequest& req);
+
+  // Sends a response from the response cache. The body isn't copied. If
+  // is_hit is true, an Age header is added.
+  void send_cached_response(EvHTTPRequest& req,
+      const HTTPResponseCache::Entry& entry, bool is_hit);
+
+  // Adds the Date header and the default headers to a response. This is done
+  // by send_response; handlers that send responses in other ways (e.g. with
+  // evhttp_send_reply_start) can call it directly.
+  void add_default_headers(EvHTTPRequest& req);
+  // Returns the current time formatted for the Date header. The value comes
+  // from the event loop's cached time, and is only reformatted when the
+  // second changes.
+  const char* get_date_header();
+
+  // Calls the handler for the route that matches the request's method and
+  // path. If there's no such route, sends a 404 response (or a 405 response,
+  // if routes match the path but not the method) and returns false.
+  bool route_request(EvHTTPRequest& req);
+
+  // The default implementation calls route_request
+  virtual void handle_request(EvHTTPRequest& req);
+
+  // Returns the reason phrase for a response code, or an empty string if the
+  // code has no standard reason phrase. Throws invalid_argument if the code
+  // isn't between 100 and 599.
+  static const char* explanation_for_response_code(int code);
 
-  virtual void handle_request(EvHTTPRequest& req) = 0;
+private:
+  // Called by send_response when req is waiting for a response to be cached.
+  // Returns false if the response can't be cached, in which case the caller
+  // should send it normally.
+  bool complete_cached_response(EvHTTPRequest& req, int code,
+      const char* content_type, EvBuffer& b);
 
-  static const std::unordered_map<int, const char*> explanation_for_response_code;
+  ResponseStream* get_response_stream(EvHTTPRequest& req);
+  void call_on_writable(ResponseStream* stream);
+  static void dispatch_on_response_stream_writable(
+      struct evhttp_connection* conn, void* ctx);
+  static void dispatch_on_response_stream_close(
+      struct evhttp_connection* conn, void* ctx);
 };
@@ -0,0 +1,497 @@
+#include <arpa/inet.h>
+#include <event2/http.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "EvHTTPRequest.hh"
+#include "HTTPQuery.hh"
+#include "HTTPRouter.hh"
+#include "HTTPServer.hh"
+
+using namespace std;
+
+static constexpr uint64_t DURATION_USECS = 2000000;
+
+static uint64_t now_nsecs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+class BenchmarkHTTPServer : public HTTPServer {
+public:
+  using HTTPServer::end_streaming_response;
+  using HTTPServer::explanation_for_response_code;
+  using HTTPServer::get_date_header;
+  using HTTPServer::send_response;
+  using HTTPServer::send_response_chunk;
+  using HTTPServer::start_streaming_response;
+
+  explicit BenchmarkHTTPServer(EventBase& base) : HTTPServer(base) {}
+  virtual ~BenchmarkHTTPServer() = default;
+};
+
+// Runs a server's EventBase on a separate thread, listening on an ephemeral
+// loopback port
+class BenchmarkServerThread {
+public:
+  BenchmarkServerThread(EventBase& base, HTTPServer& server) : base(base) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t sin_len = sizeof(sin);
+    if ((fd < 0) ||
+        bind(fd, reinterpret_cast<struct sockaddr*>(&sin), sizeof(sin)) ||
+        ::listen(fd, SOMAXCONN) ||
+        getsockname(fd, reinterpret_cast<struct sockaddr*>(&sin), &sin_len)) {
+      throw runtime_error("can't create listening socket");
+    }
+    evutil_make_socket_nonblocking(fd);
+    server.add_socket(fd);
+    this->port = ntohs(sin.sin_port);
+    this->t = thread([this]() -> void {
+      this->base.loop(EVLOOP_NO_EXIT_ON_EMPTY);
+    });
+  }
+  ~BenchmarkServerThread() {
+    this->base.loopbreak();
+    this->t.join();
+  }
+
+  int port;
+
+private:
+  EventBase& base;
+  thread t;
+};
+
+static int connect_to_server(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sin = {};
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&sin), sizeof(sin))) {
+    throw runtime_error("connect");
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+// Sends a GET request on a keep-alive connection and reads the response,
+// discarding the body. Returns the body size.
+static size_t fetch(int fd, const string& path, string& buf) {
+  string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  if (write(fd, request.data(), request.size()) != static_cast<ssize_t>(request.size())) {
+    throw runtime_error("write");
+  }
+
+  buf.clear();
+  size_t header_end;
+  for (;;) {
+    char data[0x1000];
+    ssize_t bytes_read = read(fd, data, sizeof(data));
+    if (bytes_read <= 0) {
+      throw runtime_error("connection closed by server");
+    }
+    buf.append(data, bytes_read);
+    header_end = buf.find("\r\n\r\n");
+    if (header_end != string::npos) {
+      break;
+    }
+  }
+  if (buf.compare(9, 3, "200")) {
+    throw runtime_error("server returned " + buf.substr(0, buf.find('\r')));
+  }
+
+  size_t body_size = 0;
+  for (size_t offset = buf.find("\r\n") + 2; offset < header_end;) {
+    size_t line_end = buf.find("\r\n", offset);
+    if (!strncasecmp(buf.data() + offset, "Content-Length:", 15)) {
+      body_size = strtoull(buf.c_str() + offset + 15, nullptr, 10);
+    }
+    offset = line_end + 2;
+  }
+
+  size_t remaining = body_size - (buf.size() - header_end - 4);
+  while (remaining) {
+    char data[0x10000];
+    ssize_t bytes_read = read(fd, data, min<size_t>(remaining, sizeof(data)));
+    if (bytes_read <= 0) {
+      throw runtime_error("connection closed by server");
+    }
+    remaining -= bytes_read;
+  }
+  return body_size;
+}
+
+struct ClientResults {
+  uint64_t num_requests;
+  uint64_t num_body_bytes;
+  uint64_t elapsed_nsecs;
+};
+
+// Requests path repeatedly for DURATION_USECS on num_connections keep-alive
+// connections, each with its own thread. Each connection makes at least one
+// request, even if it takes longer than that.
+static ClientResults run_clients(int port, const string& path, size_t num_connections) {
+  atomic<uint64_t> num_requests(0);
+  atomic<uint64_t> num_body_bytes(0);
+  uint64_t start = now_nsecs();
+  uint64_t end = start + DURATION_USECS * 1000;
+  vector<thread> threads;
+  for (size_t z = 0; z < num_connections; z++) {
+    threads.emplace_back([&]() -> void {
+      int fd = connect_to_server(port);
+      string buf;
+      do {
+        num_body_bytes += fetch(fd, path, buf);
+        num_requests++;
+      } while (now_nsecs() < end);
+      close(fd);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  return ClientResults{num_requests.load(), num_body_bytes.load(), now_nsecs() - start};
+}
+
+static void benchmark_status_phrases() {
+  // The unordered_map is what the response code table replaced
+  unordered_map<int, const char*> phrases;
+  for (int code = 100; code < 600; code++) {
+    try {
+      const char* phrase = BenchmarkHTTPServer::explanation_for_response_code(code);
+      if (*phrase) {
+        phrases.emplace(code, phrase);
+      }
+    } catch (const invalid_argument&) {
+    }
+  }
+
+  static constexpr size_t NUM_LOOKUPS = 100000000;
+  static const int codes[4] = {200, 404, 200, 500};
+  size_t checksum = 0;
+  uint64_t start = now_nsecs();
+  for (size_t z = 0; z < NUM_LOOKUPS; z++) {
+    checksum += reinterpret_cast<size_t>(phrases.at(codes[z & 3]));
+  }
+  uint64_t map_elapsed = now_nsecs() - start;
+  start = now_nsecs();
+  for (size_t z = 0; z < NUM_LOOKUPS; z++) {
+    checksum -= reinterpret_cast<size_t>(
+        BenchmarkHTTPServer::explanation_for_response_code(codes[z & 3]));
+  }
+  uint64_t table_elapsed = now_nsecs() - start;
+  if (checksum) {
+    throw logic_error("lookups returned different phrases");
+  }
+  printf("reason phrase lookup: unordered_map %4.2f ns, table %4.2f ns\n",
+      static_cast<double>(map_elapsed) / NUM_LOOKUPS,
+      static_cast<double>(table_elapsed) / NUM_LOOKUPS);
+}
+
+static void benchmark_date_header() {
+  // This is outside the event loop, so the cached time falls back to
+  // gettimeofday; inside the loop, get_date_header is only a comparison
+  static constexpr size_t NUM_RESPONSES = 5000000;
+  EventBase base;
+  BenchmarkHTTPServer server(base);
+  size_t checksum = 0;
+  uint64_t start = now_nsecs();
+  for (size_t z = 0; z < NUM_RESPONSES; z++) {
+    char date[50];
+    time_t t = time(nullptr);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    evutil_date_rfc1123(date, sizeof(date), &tm);
+    checksum += date[5];
+  }
+  uint64_t format_elapsed = now_nsecs() - start;
+  start = now_nsecs();
+  for (size_t z = 0; z < NUM_RESPONSES; z++) {
+    checksum += server.get_date_header()[5];
+  }
+  uint64_t cached_elapsed = now_nsecs() - start;
+  printf("Date header: formatted %5.1f ns/response, cached %5.1f ns/response (%zu)\n",
+      static_cast<double>(format_elapsed) / NUM_RESPONSES,
+      static_cast<double>(cached_elapsed) / NUM_RESPONSES, checksum & 1);
+}
+
+static void benchmark_minimal_responses() {
+  EventBase base;
+  BenchmarkHTTPServer server(base);
+  server.add_route(EVHTTP_REQ_GET, "/", [&server](EvHTTPRequest& req, const HTTPRouteMatch&) -> void {
+    server.send_response(req, 200, "text/plain", "ok");
+  });
+  BenchmarkServerThread server_thread(base, server);
+  for (size_t num_connections : {1, 4, 16}) {
+    auto results = run_clients(server_thread.port, "/", num_connections);
+    printf("%2zu connections: %7.0f requests/s\n", num_connections,
+        results.num_requests * 1000000000.0 / results.elapsed_nsecs);
+  }
+}
+
+static void benchmark_router() {
+  // Compares the router against a linear scan of prefix checks over the same
+  // routes, which is what handlers did before
+  static constexpr size_t NUM_LOOKUPS = 2000000;
+  for (size_t num_routes : {10, 100, 1000}) {
+    HTTPRouter router;
+    vector<string> patterns;
+    for (size_t z = 0; z < num_routes; z++) {
+      string pattern = "/api/v1/" + string(1, 'a' + (z % 26)) + "resource" +
+          to_string(z) + ((z % 3) ? "/:id" : "/list");
+      router.add(EVHTTP_REQ_GET, pattern, [](EvHTTPRequest&, const HTTPRouteMatch&) -> void {});
+      patterns.emplace_back(std::move(pattern));
+    }
+    vector<string> paths;
+    for (size_t z = 0; z < num_routes; z++) {
+      string path = patterns[(z * 7919) % num_routes];
+      size_t param_offset = path.find(":id");
+      if (param_offset != string::npos) {
+        path = path.substr(0, param_offset) + "12345";
+      }
+      paths.emplace_back(std::move(path));
+    }
+
+    size_t num_found = 0;
+    uint64_t start = now_nsecs();
+    for (size_t z = 0; z < NUM_LOOKUPS; z++) {
+      HTTPRouteMatch m;
+      num_found += (router.match(EVHTTP_REQ_GET, paths[z % num_routes], m) == HTTPRouter::Result::FOUND);
+    }
+    uint64_t trie_elapsed = now_nsecs() - start;
+    start = now_nsecs();
+    for (size_t z = 0; z < NUM_LOOKUPS; z++) {
+      const string& path = paths[z % num_routes];
+      for (const auto& pattern : patterns) {
+        size_t param_offset = pattern.find(':');
+        size_t prefix_size = (param_offset == string::npos) ? pattern.size() : param_offset;
+        if (!strncmp(path.c_str(), pattern.c_str(), prefix_size) &&
+            ((param_offset != string::npos) || (path.size() == prefix_size))) {
+          num_found--;
+          break;
+        }
+      }
+    }
+    uint64_t scan_elapsed = now_nsecs() - start;
+    if (num_found) {
+      throw logic_error("not all paths were found");
+    }
+    printf("%4zu routes: router %5.0f ns/lookup, linear scan %5.0f ns/lookup\n",
+        num_routes, static_cast<double>(trie_elapsed) / NUM_LOOKUPS,
+        static_cast<double>(scan_elapsed) / NUM_LOOKUPS);
+  }
+}
+
+static void benchmark_query() {
+  static constexpr size_t NUM_PARSES = 500000;
+  static const char* queries[] = {
+      "q=running+shoes&page=2&sort=price_asc&utm_source=google&utm_medium=cpc&utm_campaign=spring%20sale",
+      "id=12345",
+      "lat=37.7749&lng=-122.4194&radius=5000&types=restaurant%7Ccafe&key=AIzaSyD-abcdefghijklmnopqrstuvwxyz&lang=en",
+  };
+  HTTPQueryKeySet keys({"q", "page", "sort", "id", "lat", "lng", "radius", "types"});
+  EvHTTPRequest req(nullptr);
+  for (const char* query : queries) {
+    size_t checksum = 0;
+    uint64_t start = now_nsecs();
+    for (size_t z = 0; z < NUM_PARSES; z++) {
+      checksum += req.parse_url_params(query).size();
+    }
+    uint64_t map_elapsed = now_nsecs() - start;
+    start = now_nsecs();
+    string scratch;
+    for (size_t z = 0; z < NUM_PARSES; z++) {
+      for (const auto& param : HTTPQueryView(query)) {
+        checksum += HTTPQueryView::decode(param.value, scratch).size();
+      }
+    }
+    uint64_t view_elapsed = now_nsecs() - start;
+    start = now_nsecs();
+    for (size_t z = 0; z < NUM_PARSES; z++) {
+      string_view values[8];
+      checksum += HTTPQueryView(query).extract(keys, values);
+    }
+    uint64_t extract_elapsed = now_nsecs() - start;
+    printf("%3zu-byte query: parse_url_params %5.0f ns, view+decode %5.0f ns, extract 8 keys %5.0f ns (%zu)\n",
+        strlen(query), static_cast<double>(map_elapsed) / NUM_PARSES,
+        static_cast<double>(view_elapsed) / NUM_PARSES,
+        static_cast<double>(extract_elapsed) / NUM_PARSES, checksum & 1);
+  }
+}
+
+static void benchmark_static_files() {
+  // Compares StaticFileCache against a handler that reads the file into memory
+  // for each request. The files are sparse, so this doesn't need 1GB of disk
+  // space.
+  char dir_template[] = "/tmp/phosg-event-benchmark-XXXXXX";
+  const char* dir = mkdtemp(dir_template);
+  if (!dir) {
+    throw runtime_error("mkdtemp");
+  }
+  static const pair<const char*, off_t> files[] = {
+      {"4KB", 0x1000}, {"1MB", 0x100000}, {"1GB", 0x40000000}};
+  for (const auto& [name, size] : files) {
+    string path = string(dir) + "/" + name;
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if ((fd < 0) || ftruncate(fd, size)) {
+      throw runtime_error("can't create " + path);
+    }
+    close(fd);
+  }
+
+  {
+    EventBase base;
+    BenchmarkHTTPServer server(base);
+    server.add_static_files("/static/", dir);
+    string dir_str = dir;
+    server.add_route(EVHTTP_REQ_GET, "/copy/:name", [&server, dir_str](EvHTTPRequest& req, const HTTPRouteMatch& m) -> void {
+      string path = dir_str + "/" + string(m.get_param("name"));
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        server.send_response(req, 404);
+        return;
+      }
+      string contents;
+      char data[0x10000];
+      ssize_t bytes_read;
+      while ((bytes_read = read(fd, data, sizeof(data))) > 0) {
+        contents.append(data, bytes_read);
+      }
+      close(fd);
+      EvBuffer b;
+      b.add(contents);
+      server.send_response(req, 200, "application/octet-stream", b);
+    });
+    BenchmarkServerThread server_thread(base, server);
+
+    for (const auto& [name, size] : files) {
+      auto cached = run_clients(server_thread.port, string("/static/") + name, 1);
+      auto copied = run_clients(server_thread.port, string("/copy/") + name, 1);
+      printf("%s: StaticFileCache %8.1f requests/s (%5.0f MB/s), copy %8.1f requests/s (%5.0f MB/s)\n",
+          name, cached.num_requests * 1000000000.0 / cached.elapsed_nsecs,
+          cached.num_body_bytes * 1000.0 / cached.elapsed_nsecs,
+          copied.num_requests * 1000000000.0 / copied.elapsed_nsecs,
+          copied.num_body_bytes * 1000.0 / copied.elapsed_nsecs);
+    }
+  }
+
+  for (const auto& [name, size] : files) {
+    unlink((string(dir) + "/" + name).c_str());
+  }
+  rmdir(dir);
+}
+
+static void benchmark_streaming() {
+  // Sends a 1GB response in 64KB chunks with a 256KB low watermark, and
+  // records how large the output buffer gets
+  static constexpr uint64_t RESPONSE_SIZE = 0x40000000;
+  static constexpr size_t LOW_WATERMARK = 0x40000;
+  static const string block(0x10000, 'x');
+
+  EventBase base;
+  BenchmarkHTTPServer server(base);
+  atomic<size_t> max_output_bytes(0);
+  server.add_route(EVHTTP_REQ_GET, "/stream", [&](EvHTTPRequest& req, const HTTPRouteMatch&) -> void {
+    auto bytes_sent = make_shared<uint64_t>(0);
+    server.start_streaming_response(req, 200, "application/octet-stream", LOW_WATERMARK,
+        [&server, &max_output_bytes, bytes_sent](EvHTTPRequest& req) -> void {
+          struct bufferevent* bev = evhttp_connection_get_bufferevent(req.get_connection());
+          max_output_bytes = max<size_t>(
+              max_output_bytes.load(), evbuffer_get_length(bufferevent_get_output(bev)));
+          size_t size = min<uint64_t>(block.size(), RESPONSE_SIZE - *bytes_sent);
+          EvBuffer b;
+          b.add_reference(block.data(), size, nullptr, nullptr);
+          server.send_response_chunk(req, b);
+          *bytes_sent += size;
+          if (*bytes_sent >= RESPONSE_SIZE) {
+            server.end_streaming_response(req);
+          }
+        });
+  });
+  BenchmarkServerThread server_thread(base, server);
+
+  // This is an HTTP/1.0 request, so the response isn't chunked, and it ends
+  // when the server closes the connection
+  int fd = connect_to_server(server_thread.port);
+  static const char* request = "GET /stream HTTP/1.0\r\n\r\n";
+  if (write(fd, request, strlen(request)) != static_cast<ssize_t>(strlen(request))) {
+    throw runtime_error("write");
+  }
+  uint64_t start = now_nsecs();
+  uint64_t bytes_received = 0;
+  for (;;) {
+    char data[0x10000];
+    ssize_t bytes_read = read(fd, data, sizeof(data));
+    if (bytes_read < 0) {
+      throw runtime_error("read");
+    } else if (bytes_read == 0) {
+      break;
+    }
+    bytes_received += bytes_read;
+  }
+  uint64_t elapsed = now_nsecs() - start;
+  close(fd);
+  if (bytes_received < RESPONSE_SIZE) {
+    throw runtime_error("response is incomplete");
+  }
+  printf("1GB streamed response: %6.0f MB/s, output buffer peaked at %zu bytes\n",
+      bytes_received * 1000.0 / elapsed, max_output_bytes.load());
+}
+
+static const struct {
+  const char* name;
+  void (*fn)();
+} benchmarks[] = {
+    {"status-phrases", benchmark_status_phrases},
+    {"date-header", benchmark_date_header},
+    {"minimal-responses", benchmark_minimal_responses},
+    {"router", benchmark_router},
+    {"query", benchmark_query},
+    {"static-files", benchmark_static_files},
+    {"streaming", benchmark_streaming},
+};
+
+int main(int argc, char** argv) {
+  if (evthread_use_pthreads()) {
+    throw runtime_error("evthread_use_pthreads");
+  }
+  bool found = false;
+  for (const auto& b : benchmarks) {
+    if ((argc < 2) || !strcmp(argv[1], b.name)) {
+      printf("-- %s\n", b.name);
+      b.fn();
+      found = true;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
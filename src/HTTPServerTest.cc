@@ -0,0 +1,433 @@
+#include <arpa/inet.h>
+#include <event2/http.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "EvHTTPRequest.hh"
+#include "HTTPResponseCache.hh"
+#include "HTTPServer.hh"
+
+using namespace std;
+
+class TestHTTPServer : public HTTPServer {
+public:
+  using HTTPServer::send_response;
+
+  explicit TestHTTPServer(EventBase& base) : HTTPServer(base) {}
+  virtual ~TestHTTPServer() = default;
+};
+
+// Runs a server's EventBase on a separate thread, listening on an ephemeral
+// loopback port. Routes must be added before this is created.
+class ServerThread {
+public:
+  ServerThread(EventBase& base, HTTPServer& server) : base(base) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t sin_len = sizeof(sin);
+    if ((fd < 0) ||
+        bind(fd, reinterpret_cast<struct sockaddr*>(&sin), sizeof(sin)) ||
+        ::listen(fd, SOMAXCONN) ||
+        getsockname(fd, reinterpret_cast<struct sockaddr*>(&sin), &sin_len)) {
+      throw runtime_error("can't create listening socket");
+    }
+    evutil_make_socket_nonblocking(fd);
+    server.add_socket(fd);
+    this->port = ntohs(sin.sin_port);
+    this->t = thread([this]() -> void {
+      this->base.loop(EVLOOP_NO_EXIT_ON_EMPTY);
+    });
+  }
+  ~ServerThread() {
+    this->base.loopbreak();
+    this->t.join();
+  }
+
+  int port;
+
+private:
+  EventBase& base;
+  thread t;
+};
+
+struct Response {
+  int code;
+  vector<pair<string, string>> headers;
+  string body;
+
+  // Returns an empty string if the header is missing
+  string get_header(const char* name) const {
+    for (const auto& it : this->headers) {
+      if (!strcasecmp(it.first.c_str(), name)) {
+        return it.second;
+      }
+    }
+    return "";
+  }
+};
+
+// Sends a request on a new connection and reads the response until the
+// server closes the connection
+static Response request(int port, const string& method, const string& path,
+    const vector<pair<string, string>>& headers = {}) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sin = {};
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&sin), sizeof(sin))) {
+    throw runtime_error("connect");
+  }
+
+  string data = method + " " + path + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n";
+  for (const auto& it : headers) {
+    data += it.first + ": " + it.second + "\r\n";
+  }
+  data += "\r\n";
+  if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+    throw runtime_error("write");
+  }
+  data.clear();
+  for (;;) {
+    char buf[0x1000];
+    ssize_t bytes_read = read(fd, buf, sizeof(buf));
+    if (bytes_read < 0) {
+      throw runtime_error("read");
+    }
+    if (bytes_read == 0) {
+      break;
+    }
+    data.append(buf, bytes_read);
+  }
+  close(fd);
+
+  size_t header_end = data.find("\r\n\r\n");
+  if ((header_end == string::npos) || data.compare(0, 9, "HTTP/1.1 ")) {
+    throw runtime_error("malformed response");
+  }
+  Response ret;
+  ret.code = atoi(data.c_str() + 9);
+  for (size_t offset = data.find("\r\n") + 2; offset < header_end;) {
+    size_t line_end = data.find("\r\n", offset);
+    size_t colon = data.find(':', offset);
+    size_t value_start = data.find_first_not_of(' ', colon + 1);
+    ret.headers.emplace_back(data.substr(offset, colon - offset),
+        data.substr(value_start, line_end - value_start));
+    offset = line_end + 2;
+  }
+  ret.body = data.substr(header_end + 4);
+  return ret;
+}
+
+static void test_methods() {
+  fprintf(stderr, "-- requests with no route for the method get 405 with Allow\n");
+  EventBase base;
+  TestHTTPServer server(base);
+  server.add_route(EVHTTP_REQ_GET, "/page", [&server](EvHTTPRequest& req, const HTTPRouteMatch&) -> void {
+    server.send_response(req, 200, "text/plain", "hello");
+  });
+  server.add_route(EVHTTP_REQ_POST, "/page", [&server](EvHTTPRequest& req, const HTTPRouteMatch&) -> void {
+    server.send_response(req, 201, "text/plain", "created");
+  });
+  server.add_route(EVHTTP_REQ_PUT | EVHTTP_REQ_DELETE, "/items/:id", [&server](EvHTTPRequest& req, const HTTPRouteMatch&) -> void {
+    server.send_response(req, 204);
+  });
+  ServerThread t(base, server);
+
+  auto resp = request(t.port, "GET", "/page");
+  expect_eq(resp.code, 200);
+  expect_eq(resp.body, "hello");
+  resp = request(t.port, "POST", "/page");
+  expect_eq(resp.code, 201);
+  resp = request(t.port, "DELETE", "/page");
+  expect_eq(resp.code, 405);
+  expect_eq(resp.get_header("Allow"), "GET, HEAD, POST");
+  // HEAD is only added to Allow if GET is allowed
+  resp = request(t.port, "GET", "/items/3");
+  expect_eq(resp.code, 405);
+  expect_eq(resp.get_header("Allow"), "PUT, DELETE");
+  resp = request(t.port, "GET", "/nothing");
+  expect_eq(resp.code, 404);
+  expect_eq(resp.get_header("Allow"), "");
+
+  fprintf(stderr, "-- HEAD requests are handled by GET routes, without a body\n");
+  resp = request(t.port, "HEAD", "/page");
+  expect_eq(resp.code, 200);
+  expect_eq(resp.get_header("Content-Type"), "text/plain");
+  expect_eq(resp.body, "");
+}
+
+// Creates a temporary directory containing the given files, and deletes it
+// when destroyed
+class TemporaryDirectory {
+public:
+  explicit TemporaryDirectory(const vector<pair<string, string>>& files)
+      : files(files) {
+    char path_template[] = "/tmp/HTTPServerTest-XXXXXX";
+    if (!mkdtemp(path_template)) {
+      throw runtime_error("mkdtemp");
+    }
+    this->path = path_template;
+    for (const auto& it : this->files) {
+      FILE* f = fopen((this->path + "/" + it.first).c_str(), "wb");
+      if (!f) {
+        throw runtime_error("fopen");
+      }
+      if (fwrite(it.second.data(), 1, it.second.size(), f) != it.second.size()) {
+        fclose(f);
+        throw runtime_error("fwrite");
+      }
+      fclose(f);
+    }
+  }
+  ~TemporaryDirectory() {
+    for (const auto& it : this->files) {
+      unlink((this->path + "/" + it.first).c_str());
+    }
+    rmdir(this->path.c_str());
+  }
+
+  string path;
+
+private:
+  vector<pair<string, string>> files;
+};
+
+static void test_static_files() {
+  string data;
+  for (size_t z = 0; z < 10; z++) {
+    data += "0123456789";
+  }
+  // Large enough to be sent from a file segment instead of from memory
+  string big_data;
+  for (size_t z = 0; z < 0x5000; z++) {
+    big_data.push_back('a' + (z % 26));
+  }
+  TemporaryDirectory dir({{"data.txt", data}, {"empty.txt", ""}, {"big.bin", big_data}});
+
+  EventBase base;
+  TestHTTPServer server(base);
+  server.add_static_files("/static", dir.path);
+  ServerThread t(base, server);
+
+  fprintf(stderr, "-- static files are sent with validators\n");
+  auto resp = request(t.port, "GET", "/static/data.txt");
+  expect_eq(resp.code, 200);
+  expect_eq(resp.body, data);
+  expect_eq(resp.get_header("Accept-Ranges"), "bytes");
+  expect(!resp.get_header("Last-Modified").empty());
+  string etag = resp.get_header("ETag");
+  expect(etag.size() > 2);
+  expect_eq(etag.front(), '"');
+  expect_eq(etag.back(), '"');
+  expect_eq(request(t.port, "GET", "/static/missing.txt").code, 404);
+
+  resp = request(t.port, "HEAD", "/static/data.txt");
+  expect_eq(resp.code, 200);
+  expect_eq(resp.get_header("Content-Length"), "100");
+  expect_eq(resp.body, "");
+
+  fprintf(stderr, "-- byte ranges are satisfied and clamped to the file\n");
+  auto get_range = [&](const string& path, const string& range,
+                       const vector<pair<string, string>>& extra_headers = {}) -> Response {
+    vector<pair<string, string>> headers = {{"Range", range}};
+    headers.insert(headers.end(), extra_headers.begin(), extra_headers.end());
+    return request(t.port, "GET", path, headers);
+  };
+  resp = get_range("/static/data.txt", "bytes=10-19");
+  expect_eq(resp.code, 206);
+  expect_eq(resp.body, data.substr(10, 10));
+  expect_eq(resp.get_header("Content-Range"), "bytes 10-19/100");
+  resp = get_range("/static/data.txt", "bytes=90-");
+  expect_eq(resp.code, 206);
+  expect_eq(resp.body, data.substr(90));
+  expect_eq(resp.get_header("Content-Range"), "bytes 90-99/100");
+  resp = get_range("/static/data.txt", "bytes=95-200");
+  expect_eq(resp.code, 206);
+  expect_eq(resp.body, data.substr(95));
+  expect_eq(resp.get_header("Content-Range"), "bytes 95-99/100");
+
+  fprintf(stderr, "-- suffix ranges return the end of the file\n");
+  resp = get_range("/static/data.txt", "bytes=-5");
+  expect_eq(resp.code, 206);
+  expect_eq(resp.body, data.substr(95));
+  expect_eq(resp.get_header("Content-Range"), "bytes 95-99/100");
+  // Suffixes longer than the file return the entire file
+  resp = get_range("/static/data.txt", "bytes=-500");
+  expect_eq(resp.code, 206);
+  expect_eq(resp.body, data);
+  expect_eq(resp.get_header("Content-Range"), "bytes 0-99/100");
+
+  fprintf(stderr, "-- unsatisfiable ranges get 416\n");
+  for (const char* range : {"bytes=100-", "bytes=200-300", "bytes=-0"}) {
+    resp = get_range("/static/data.txt", range);
+    expect_eq(resp.code, 416);
+    expect_eq(resp.get_header("Content-Range"), "bytes */100");
+    expect_eq(resp.body, "");
+  }
+
+  fprintf(stderr, "-- multiple and malformed ranges are ignored\n");
+  for (const char* range : {"bytes=0-0,5-9", "bytes=5-2", "items=0-5", "bytes=a-b", "bytes=5"}) {
+    resp = get_range("/static/data.txt", range);
+    expect_eq(resp.code, 200);
+    expect_eq(resp.body, data);
+    expect_eq(resp.get_header("Content-Range"), "");
+  }
+
+  fprintf(stderr, "-- zero-size files can't satisfy any range\n");
+  resp = request(t.port, "GET", "/static/empty.txt");
+  expect_eq(resp.code, 200);
+  expect_eq(resp.body, "");
+  for (const char* range : {"bytes=0-", "bytes=-5"}) {
+    resp = get_range("/static/empty.txt", range);
+    expect_eq(resp.code, 416);
+    expect_eq(resp.get_header("Content-Range"), "bytes */0");
+  }
+
+  fprintf(stderr, "-- If-Range applies the range only if the ETag matches\n");
+  resp = get_range("/static/data.txt", "bytes=0-4", {{"If-Range", etag}});
+  expect_eq(resp.code, 206);
+  expect_eq(resp.body, "01234");
+  resp = get_range("/static/data.txt", "bytes=0-4", {{"If-Range", "\"other\""}});
+  expect_eq(resp.code, 200);
+  expect_eq(resp.body, data);
+  // If-Range requires a strong comparison
+  resp = get_range("/static/data.txt", "bytes=0-4", {{"If-Range", "W/" + etag}});
+  expect_eq(resp.code, 200);
+
+  fprintf(stderr, "-- If-None-Match returns 304 if any ETag matches\n");
+  for (const string& if_none_match : {etag, "W/" + etag, "\"other\", " + etag, string("*")}) {
+    resp = request(t.port, "GET", "/static/data.txt", {{"If-None-Match", if_none_match}});
+    expect_eq(resp.code, 304);
+    expect_eq(resp.body, "");
+    expect_eq(resp.get_header("ETag"), etag);
+  }
+  for (const string& if_none_match : {string("\"other\""), string("\"a\", \"b\""), etag.substr(0, etag.size() - 1) + "0\""}) {
+    resp = request(t.port, "GET", "/static/data.txt", {{"If-None-Match", if_none_match}});
+    expect_eq(resp.code, 200);
+    expect_eq(resp.body, data);
+  }
+  // Ranges don't apply to 304s
+  resp = get_range("/static/data.txt", "bytes=0-4", {{"If-None-Match", etag}});
+  expect_eq(resp.code, 304);
+
+  fprintf(stderr, "-- large files and ranges of them are sent from segments\n");
+  resp = request(t.port, "GET", "/static/big.bin");
+  expect_eq(resp.code, 200);
+  expect(resp.body == big_data);
+  resp = get_range("/static/big.bin", "bytes=100-20099");
+  expect_eq(resp.code, 206);
+  expect(resp.body == big_data.substr(100, 20000));
+  expect_eq(resp.get_header("Content-Length"), "20000");
+  resp = request(t.port, "HEAD", "/static/big.bin");
+  expect_eq(resp.code, 200);
+  expect_eq(resp.get_header("Content-Length"), to_string(big_data.size()));
+  expect_eq(resp.body, "");
+}
+
+// Sends the same request on several connections at once
+static vector<Response> concurrent_requests(int port, size_t count, const string& path) {
+  vector<Response> responses(count);
+  vector<thread> threads;
+  for (size_t z = 0; z < count; z++) {
+    threads.emplace_back([&responses, port, &path, z]() -> void {
+      responses[z] = request(port, "GET", path);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  return responses;
+}
+
+static void test_response_cache() {
+  EventBase base;
+  TestHTTPServer server(base);
+  auto& cache = server.enable_response_cache(0x1000);
+  // The handlers run on the server's thread, but the counts are only read
+  // after the requests that change them have been responded to
+  size_t slow_calls = 0;
+  size_t cookie_calls = 0;
+  size_t large_calls = 0;
+  server.add_cached_route(EVHTTP_REQ_GET, "/slow", 1000000, [&](EvHTTPRequest& req, const HTTPRouteMatch&) -> void {
+    slow_calls++;
+    struct evhttp_request* raw_req = req.get();
+    base.once([&server, raw_req]() -> void {
+      EvHTTPRequest req(raw_req);
+      server.send_response(req, 200, "text/plain", "slow response");
+    }, 200000);
+  });
+  server.add_cached_route(EVHTTP_REQ_GET, "/cookie", 1000000, [&](EvHTTPRequest& req, const HTTPRouteMatch&) -> void {
+    req.add_output_header("Set-Cookie", ("id=" + to_string(++cookie_calls)).c_str());
+    server.send_response(req, 200, "text/plain", "cookie");
+  });
+  server.add_cached_route(EVHTTP_REQ_GET, "/large", 1000000, [&](EvHTTPRequest& req, const HTTPRouteMatch&) -> void {
+    large_calls++;
+    EvBuffer body;
+    body.add(string(0x2000, 'x'));
+    server.send_response(req, 200, "text/plain", body);
+  });
+  ServerThread t(base, server);
+
+  fprintf(stderr, "-- concurrent requests for a cached route run the handler once\n");
+  auto responses = concurrent_requests(t.port, 4, "/slow");
+  for (const auto& resp : responses) {
+    expect_eq(resp.code, 200);
+    expect_eq(resp.body, "slow response");
+    expect_eq(resp.get_header("Content-Type"), "text/plain");
+  }
+  expect_eq(slow_calls, 1u);
+  expect(cache.get_coalesced() > 0);
+  expect_eq(cache.get_misses(), 1u);
+  expect_eq(cache.get_coalesced() + cache.get_hits(), 3u);
+  // Later requests are hits, which have an Age header
+  auto resp = request(t.port, "GET", "/slow");
+  expect_eq(resp.body, "slow response");
+  expect_eq(resp.get_header("Age"), "0");
+  expect_eq(slow_calls, 1u);
+
+  fprintf(stderr, "-- responses that can't be shared run the handler for each request\n");
+  resp = request(t.port, "GET", "/cookie");
+  expect_eq(resp.get_header("Set-Cookie"), "id=1");
+  resp = request(t.port, "GET", "/cookie");
+  expect_eq(resp.get_header("Set-Cookie"), "id=2");
+  expect_eq(cookie_calls, 2u);
+  expect(cache.get_bypasses() > 0);
+
+  fprintf(stderr, "-- responses larger than the cache are sent but not stored\n");
+  for (size_t z = 0; z < 2; z++) {
+    resp = request(t.port, "GET", "/large");
+    expect_eq(resp.code, 200);
+    expect_eq(resp.body.size(), 0x2000u);
+  }
+  expect_eq(large_calls, 2u);
+  expect_eq(cache.size(), 1u);
+}
+
+int main(int, char**) {
+  // The servers run on other threads, which loopbreak() has to wake up
+  if (evthread_use_pthreads()) {
+    throw runtime_error("evthread_use_pthreads");
+  }
+  test_methods();
+  test_static_files();
+  test_response_cache();
+  fprintf(stderr, "All tests passed\n");
+  return 0;
+}
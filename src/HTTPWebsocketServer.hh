@@ -1,273 +1,1019 @@
-#include <event2/buffer.h>
-#include <event2/bufferevent_ssl.h>
-#include <event2/event.h>
-#include <event2/http.h>
-#include <inttypes.h>
-#include <stdlib.h>
-
-#include <phosg/Encoding.hh>
-#include <phosg/Hash.hh>
-#include <phosg/Network.hh>
-#include <phosg/Strings.hh>
-#include <string>
-#include <unordered_map>
-
-#include "BufferEvent.hh"
-#include "HTTPServer.hh"
-#include "StreamServer.hh"
-
-template <typename ClientStateT>
-class HTTPWebSocketServer : public HTTPServer {
-public:
-  HTTPWebSocketServer(EventBase& base, SSL_CTX* ssl_ctx)
-      : HTTPServer(base, ssl_ctx) {}
-
-  HTTPWebSocketServer(const HTTPWebSocketServer&) = delete;
-  HTTPWebSocketServer(HTTPWebSocketServer&&) = delete;
-  HTTPWebSocketServer& operator=(const HTTPWebSocketServer&) = delete;
-  HTTPWebSocketServer& operator=(HTTPWebSocketServer&&) = delete;
-  virtual ~HTTPWebSocketServer() = default;
-
-protected:
-  struct WebSocketClient {
-    BufferEvent bev;
-    std::unique_ptr<struct evhttp_connection, void (*)(struct evhttp_connection*)> http_conn;
-    uint8_t ws_pending_opcode;
-    std::string ws_pending_data;
-    std::unique_ptr<ClientStateT> state;
-
-    WebSocketClient(struct evhttp_connection* conn)
-        : http_conn(conn, evhttp_connection_free),
-          bev(evhttp_connection_get_bufferevent(this->http_conn.get())),
-          ws_pending_opcode(0xFF) {}
-    ~WebSocketClient() = default;
-
-    void reset_pending_frame() {
-      this->ws_pending_opcode = 0xFF;
-      this->ws_pending_data.clear();
-    }
-  };
-
-  std::unordered_map<struct bufferevent*, std::shared_ptr<WebSocketClient>> bev_to_websocket_client;
-
-  // Converts an HTTP request to a WebSocket connection. If successful,
-  // handle_websocket_connect is called, and this function returns a
-  // WebSocketClient object; the EvHTTPREquest is no longer usable after this.
-  // If the request cannot be converted (because it isn't a GET request or
-  // doesn't have the appropriate request headers), this function returns
-  // nullptr, and the caller still must respond to the HTTP request.
-  std::shared_ptr<WebSocketClient> enable_websockets(EvHTTPRequest& req) {
-    if (req.get_command() != EVHTTP_REQ_GET) {
-      return nullptr;
-    }
-    const char* connection_header = req.get_input_header("Connection");
-    if (!connection_header || strcasecmp(connection_header, "upgrade")) {
-      return nullptr;
-    }
-    const char* upgrade_header = req.get_input_header("Upgrade");
-    if (!upgrade_header || strcasecmp(upgrade_header, "websocket")) {
-      return nullptr;
-    }
-    const char* ws_key_header = req.get_input_header("Sec-WebSocket-Key");
-    if (!ws_key_header) {
-      return nullptr;
-    }
-
-    // Note: it's important that we make a copy of this header's value since
-    // we're about to free the original
-    std::string ws_key = ws_key_header;
-
-    std::string sec_websocket_accept_data =
-        ws_key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    std::string sec_websocket_accept =
-        base64_encode(sha1(sec_websocket_accept_data));
-
-    // Hijack the bufferevent since it's no longer going to handle HTTP at all
-    struct evhttp_connection* conn = req.get_connection();
-    struct bufferevent* bev = evhttp_connection_get_bufferevent(conn);
-    bufferevent_setcb(
-        bev,
-        &HTTPWebSocketServer::dispatch_on_websocket_read,
-        nullptr,
-        &HTTPWebSocketServer::dispatch_on_websocket_error,
-        this);
-    bufferevent_enable(bev, EV_READ | EV_WRITE);
-
-    // Send the HTTP reply, which enables websockets
-    struct evbuffer* out_buf = bufferevent_get_output(bev);
-    evbuffer_add_printf(out_buf, "HTTP/1.1 101 Switching Protocols\r\n\
-  Upgrade: websocket\r\n\
-  Connection: upgrade\r\n\
-  Sec-WebSocket-Accept: %s\r\n\
-  \r\n",
-        sec_websocket_accept.c_str());
-
-    return this->bev_to_websocket_client.emplace(bev, new WebSocketClient(conn)).first->second;
-  }
-
-  static void dispatch_on_websocket_read(struct bufferevent* bev, void* ctx) {
-    reinterpret_cast<HTTPWebSocketServer*>(ctx)->on_websocket_read(bev);
-  }
-
-  static void dispatch_on_websocket_error(
-      struct bufferevent* bev, short events, void* ctx) {
-    reinterpret_cast<HTTPWebSocketServer*>(ctx)->on_websocket_error(bev, events);
-  }
-
-  void on_websocket_read(struct bufferevent* bev) {
-    EvBuffer buf(bufferevent_get_input(bev));
-
-    // We need at most 10 bytes to determine if there's a valid frame, or as
-    // little as 2
-    std::string header_data(10, '\0');
-    ssize_t bytes_read = buf.copyout_atmost(
-        const_cast<char*>(header_data.data()), header_data.size());
-    if (bytes_read < 2) {
-      return; // We don't have a full header yet
-    }
-
-    // Figure out the payload size
-    bool has_mask = header_data[1] & 0x80;
-    size_t header_size = 2;
-    size_t payload_size = header_data[1] & 0x7F;
-    if (payload_size == 0x7F) {
-      if (bytes_read < 10) {
-        return;
-      }
-      payload_size = bswap64(*reinterpret_cast<const uint64_t*>(&header_data[2]));
-      header_size = 10;
-    } else if (payload_size == 0x7E) {
-      if (bytes_read < 4) {
-        return;
-      }
-      payload_size = bswap16(*reinterpret_cast<const uint16_t*>(&header_data[2]));
-      header_size = 4;
-    }
-    if (has_mask) {
-      header_size += 4;
-    }
-    if (buf.get_length() < header_size + payload_size) {
-      return; // We don't have a complete message yet
-    }
-
-    // We have a complete message. Skip the header bytes (we already read them)
-    // and read the masking key if needed
-    buf.drain(header_size);
-    uint8_t mask_key[4];
-    if (has_mask) {
-      buf.remove(mask_key, 4);
-    }
-
-    // Get the client's state
-    auto c = this->bev_to_websocket_client.at(bev);
-
-    // Read the message data and unmask it
-    std::string payload = buf.remove(payload_size);
-    if (has_mask) {
-      for (size_t x = 0; x < payload_size; x++) {
-        payload[x] ^= mask_key[x & 3];
-      }
-    }
-
-    // If the current message is a control message, respond appropriately (these
-    // can be sent in the middle of fragmented messages)
-    uint8_t opcode = header_data[0] & 0x0F;
-    if (opcode & 0x08) {
-      if (opcode == 0x0A) {
-        // Ignore ping responses
-
-      } else if (opcode == 0x08) {
-        this->send_websocket_message(bev, move(payload), 0x08);
-        this->disconnect_websocket_client(bev);
-
-      } else if (opcode == 0x09) {
-        this->send_websocket_message(bev, move(payload), 0x0A);
-
-      } else {
-        this->disconnect_websocket_client(bev);
-      }
-      return;
-    }
-
-    // If there's an existing pending message, the current message's opcode
-    // should be zero; if there's no pending message, it must not be zero
-    if ((c->ws_pending_opcode != 0xFF) == (opcode != 0)) {
-      this->disconnect_websocket_client(bev);
-      return;
-    }
-
-    // Save the message opcode, if present, and append the frame data
-    if (opcode) {
-      c->ws_pending_opcode = opcode;
-    }
-    c->ws_pending_data += payload;
-
-    // If the FIN bit is set, then the frame is complete - append the payload to
-    // any pending payloads and call the message handler
-    if (header_data[0] & 0x80) {
-      this->handle_websocket_message(c, c->ws_pending_opcode, move(c->ws_pending_data));
-      c->reset_pending_frame();
-    }
-
-    // If the FIN bit isn't set, we're done for now; we need to receive at least
-    // one continuation frame to complete the message
-  }
-
-  void on_websocket_error(struct bufferevent* bev, short events) {
-    if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
-      this->disconnect_websocket_client(bev);
-    }
-  }
-
-  void disconnect_websocket_client(struct bufferevent* bev) {
-    auto it = this->bev_to_websocket_client.find(bev);
-    this->handle_websocket_disconnect(it->second);
-    this->bev_to_websocket_client.erase(it);
-  }
-
-  static void send_websocket_message(
-      EvBuffer& buf, std::string&& message, uint8_t opcode = 0x01) {
-    StringWriter w;
-    w.put_u8(0x80 | (opcode & 0x0F));
-    if (message.size() > 0xFFFF) {
-      w.put_u8(0x7F);
-      w.put_u64b(message.size());
-    } else if (message.size() > 0x7D) {
-      w.put_u8(0x7E);
-      w.put_u32b(message.size());
-    } else {
-      w.put_u8(message.size());
-    }
-
-    auto g = buf.lock_guard();
-    buf.add(w.str());
-    buf.add_reference(move(message));
-  }
-
-  static void send_websocket_message(
-      struct evbuffer* buf, std::string&& message, uint8_t opcode = 0x01) {
-    EvBuffer evbuf(buf);
-    HTTPWebSocketServer::send_websocket_message(evbuf, move(message), opcode);
-  }
-
-  static void send_websocket_message(
-      struct bufferevent* bev, std::string&& message, uint8_t opcode = 0x01) {
-    HTTPWebSocketServer::send_websocket_message(
-        bufferevent_get_output(bev), move(message), opcode);
-  }
-
-  static void send_websocket_message(
-      std::shared_ptr<WebSocketClient> c,
-      std::string&& message,
-      uint8_t opcode = 0x01) {
-    HTTPWebSocketServer::send_websocket_message(
-        c->bev.get(), move(message), opcode);
-  }
-
-  virtual void on_request(EvHTTPRequest& req) = 0;
-  virtual void on_websocket_message(std::shared_ptr<WebSocketClient> c,
-      uint8_t opcode, std::string&& message) = 0;
-
-  virtual void on_websocket_connect(std::shared_ptr<WebSocketClient>) {}
-  virtual void in_websocket_disconnect(std::shared_ptr<WebSocketClient>) {}
-};
+#pragma once
+
+#include <event2/buffer.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <phosg/Encoding.hh>
+#include <phosg/Hash.hh>
+#include <phosg/Network.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "BufferEvent.hh"
+#include "HTTPServer.hh"
+#include "StreamServer.hh"
+#include "TimerWheel.hh"
+#include "WebSocketDeflate.hh"
+#include "WebSocketFrame.hh"
+#include "WebSocketMask.hh"
+#include "WebSocketTopicIndex.hh"
+
+// What to do with messages sent to a client whose output buffer is over its
+// high-water mark. Control frames (pongs and close responses) are never
+// dropped.
+enum class WebSocketOverflowPolicy {
+  // Drop the message
+  DROP = 0,
+  // Queue the message if it has a coalescing key, replacing any queued message
+  // with the same key, and send the queued messages when the output buffer
+  // drains below the low-water mark. Messages without a key are dropped.
+  COALESCE,
+  // Disconnect the client
+  DISCONNECT,
+};
+
+struct WebSocketOutputLimits {
+  // If zero, output isn't limited
+  size_t high_water = 0;
+  // on_websocket_output_drained is called when a client's output buffer drains
+  // to this size after going over the high-water mark
+  size_t low_water = 0;
+  WebSocketOverflowPolicy policy = WebSocketOverflowPolicy::DROP;
+};
+
+template <typename ClientStateT>
+class HTTPWebSocketServer : public HTTPServer {
+public:
+  HTTPWebSocketServer(EventBase& base, std::shared_ptr<SSL_CTX> ssl_ctx = nullptr)
+      : HTTPServer(base, ssl_ctx) {}
+
+  HTTPWebSocketServer(const HTTPWebSocketServer&) = delete;
+  HTTPWebSocketServer(HTTPWebSocketServer&&) = delete;
+  HTTPWebSocketServer& operator=(const HTTPWebSocketServer&) = delete;
+  HTTPWebSocketServer& operator=(HTTPWebSocketServer&&) = delete;
+  virtual ~HTTPWebSocketServer() = default;
+
+  // Enables or configures the permessage-deflate extension for connections
+  // opened after this call. This cannot be called while any WebSocket clients
+  // are connected.
+  void set_websocket_deflate_options(const WebSocketDeflateOptions& options) {
+    if (!this->bev_to_websocket_client.empty()) {
+      throw std::logic_error("cannot change deflate options while clients are connected");
+    }
+    this->websocket_deflate_options = options;
+    this->zlib_pool.reset(options.enabled
+            ? new ZlibStreamPool(options.compression_level, options.mem_level)
+            : nullptr);
+  }
+
+  // Sets the default output limits for clients that connect after this call.
+  // Limits for existing clients can be changed with
+  // WebSocketClient::set_output_limits.
+  void set_websocket_output_limits(const WebSocketOutputLimits& limits) {
+    this->websocket_output_limits = limits;
+  }
+
+  // Sends a ping to clients that haven't sent anything for ping_interval_usecs,
+  // and calls on_websocket_keepalive_timeout (which disconnects the client by
+  // default) for clients that then don't send a pong or any other frame within
+  // pong_timeout_usecs. Keepalive timers are kept in a TimerWheel with the
+  // given resolution, so there's a single timer event for all clients and
+  // resetting a client's timer on every read is cheap. This only affects
+  // clients that connect after it's called. Passing zero for
+  // ping_interval_usecs disables keepalive for new clients.
+  void set_websocket_keepalive(uint64_t ping_interval_usecs,
+      uint64_t pong_timeout_usecs, uint64_t resolution_usecs = 100000) {
+    this->websocket_ping_interval_usecs = ping_interval_usecs;
+    this->websocket_pong_timeout_usecs = pong_timeout_usecs;
+    if (ping_interval_usecs && (!this->keepalive_timers ||
+            (this->keepalive_timers->get_resolution_usecs() != resolution_usecs))) {
+      if (!this->bev_to_websocket_client.empty()) {
+        throw std::logic_error("cannot change keepalive resolution while clients are connected");
+      }
+      this->keepalive_timers.reset(new TimerWheel(this->base, resolution_usecs));
+    }
+  }
+
+  // Sets the maximum size of a (possibly fragmented) incoming message. Clients
+  // that send a larger message are sent a close frame with status 1009
+  // (message too big) and disconnected; this is checked as soon as each frame
+  // header arrives, so the oversized data isn't buffered first. For compressed
+  // messages, the limit also applies to the decompressed size. Zero means no
+  // limit.
+  void set_websocket_max_message_size(size_t max_size) {
+    this->websocket_max_message_size = max_size;
+  }
+
+  // Sets the number of subscribers that publish_websocket_message sends to per
+  // event loop iteration
+  void set_websocket_publish_batch_size(size_t batch_size) {
+    this->websocket_publish_batch_size = batch_size ? batch_size : 1;
+  }
+
+  // Sends a message to every client subscribed to the topic on this server.
+  // This must be called on the server's thread; WebSocketPubSub can be used to
+  // publish from other threads or to many servers. The frame is encoded once
+  // for all subscribers, as for broadcast_websocket_message. Topics with more
+  // subscribers than the batch size are sent to in batches, one per event loop
+  // iteration, so a large publish doesn't block the loop; clients that
+  // disconnect before their batch is sent are skipped, and clients that
+  // subscribe after this call don't receive the message. Returns the number of
+  // subscribers the message will be sent to.
+  size_t publish_websocket_message(const std::string& topic,
+      const void* data, size_t size, uint8_t opcode = 0x01) {
+    const auto* subscribers = this->topic_index.get_subscribers(topic);
+    if (!subscribers) {
+      return 0;
+    }
+    if (subscribers->size() > this->websocket_publish_batch_size) {
+      return this->publish_websocket_message(topic,
+          std::make_shared<const std::string>(reinterpret_cast<const char*>(data), size),
+          opcode);
+    }
+    WebSocketBroadcast broadcast(this, data, size, opcode, "");
+    for (auto h : *subscribers) {
+      broadcast.send(*this->topic_index.get_client(h));
+    }
+    return subscribers->size();
+  }
+
+  size_t publish_websocket_message(const std::string& topic,
+      const std::string& message, uint8_t opcode = 0x01) {
+    return this->publish_websocket_message(topic, message.data(), message.size(), opcode);
+  }
+
+  // Like the above, but doesn't copy the message if it has to be sent in
+  // batches
+  size_t publish_websocket_message(const std::string& topic,
+      std::shared_ptr<const std::string> message, uint8_t opcode = 0x01) {
+    const auto* subscribers = this->topic_index.get_subscribers(topic);
+    if (!subscribers) {
+      return 0;
+    }
+    if (subscribers->size() <= this->websocket_publish_batch_size) {
+      return this->publish_websocket_message(topic, message->data(), message->size(), opcode);
+    }
+    auto batch = std::make_shared<WebSocketPublishBatch>(this, std::move(message), opcode);
+    batch->handles = *subscribers;
+    this->send_websocket_publish_batch(batch);
+    return batch->handles.size();
+  }
+
+protected:
+  struct WebSocketClient {
+    std::unique_ptr<struct evhttp_connection, void (*)(struct evhttp_connection*)> http_conn;
+    BufferEvent bev;
+    uint8_t ws_pending_opcode;
+    bool ws_pending_compressed;
+    // Payloads of the frames received so far for the current message. Frame
+    // payloads are moved here from the input buffer chain by chain, so
+    // fragmented messages aren't copied until they're delivered (if at all).
+    EvBuffer ws_pending_data;
+    // Null if the client didn't negotiate permessage-deflate
+    std::unique_ptr<WebSocketDeflateContext> deflate;
+    std::unique_ptr<ClientStateT> state;
+
+    struct CoalescedMessage {
+      std::string key;
+      uint8_t opcode;
+      // Exactly one of these is used; frames come from broadcasts
+      std::string message;
+      SharedWebSocketFrame frame;
+    };
+
+    WebSocketOutputLimits output_limits;
+    // True from when the output buffer goes over the high-water mark until it
+    // drains to the low-water mark
+    bool output_throttled;
+    bool disconnect_scheduled;
+    // True after a close frame has been sent; the client is disconnected when
+    // its output buffer is empty
+    bool close_sent;
+    // Refers to this client in the server's topic index
+    uint64_t topic_handle;
+
+    TimerWheel::Timer keepalive_timer;
+    // Keepalive settings in effect when the client connected; zero if
+    // keepalive is disabled for this client
+    uint64_t ping_interval_usecs;
+    uint64_t pong_timeout_usecs;
+    bool awaiting_pong;
+    // Time when the most recent ping was sent (its payload)
+    uint64_t last_ping_usecs;
+    // Round-trip time measured by the most recent ping/pong exchange; zero if
+    // no pong has been received yet
+    uint64_t rtt_usecs;
+    std::vector<CoalescedMessage> coalesced_messages;
+    std::unordered_map<std::string, size_t> coalesced_message_index;
+    size_t coalesced_bytes;
+    size_t peak_queued_bytes;
+    uint64_t messages_dropped;
+    uint64_t messages_coalesced;
+
+    WebSocketClient(struct evhttp_connection* conn)
+        : http_conn(conn, evhttp_connection_free),
+          bev(evhttp_connection_get_bufferevent(this->http_conn.get())),
+          ws_pending_opcode(0xFF),
+          ws_pending_compressed(false),
+          output_throttled(false),
+          disconnect_scheduled(false),
+          close_sent(false),
+          topic_handle(0),
+          ping_interval_usecs(0),
+          pong_timeout_usecs(0),
+          awaiting_pong(false),
+          last_ping_usecs(0),
+          rtt_usecs(0),
+          coalesced_bytes(0),
+          peak_queued_bytes(0),
+          messages_dropped(0),
+          messages_coalesced(0) {}
+    ~WebSocketClient() = default;
+
+    void set_output_limits(const WebSocketOutputLimits& limits) {
+      this->output_limits = limits;
+      if (this->output_limits.low_water > this->output_limits.high_water) {
+        this->output_limits.low_water = this->output_limits.high_water;
+      }
+      // The write callback is called when the output buffer drains to the
+      // low-water mark
+      this->bev.setwatermark(EV_WRITE, this->output_limits.low_water, 0);
+    }
+
+    // Returns the number of bytes waiting to be sent to the client, including
+    // coalesced messages that haven't been added to the output buffer yet
+    size_t queued_bytes() {
+      return evbuffer_get_length(bufferevent_get_output(this->bev.get())) + this->coalesced_bytes;
+    }
+
+    void update_peak_queued_bytes() {
+      size_t queued = this->queued_bytes();
+      if (queued > this->peak_queued_bytes) {
+        this->peak_queued_bytes = queued;
+      }
+    }
+
+    void coalesce_message(const std::string& key, uint8_t opcode,
+        std::string&& message, const SharedWebSocketFrame& frame) {
+      auto index_it = this->coalesced_message_index.find(key);
+      if (index_it == this->coalesced_message_index.end()) {
+        this->coalesced_message_index.emplace(key, this->coalesced_messages.size());
+        auto& m = this->coalesced_messages.emplace_back();
+        m.key = key;
+        m.opcode = opcode;
+        m.message = std::move(message);
+        m.frame = frame;
+        this->coalesced_bytes += m.message.size() + m.frame.size();
+      } else {
+        auto& m = this->coalesced_messages[index_it->second];
+        this->coalesced_bytes -= m.message.size() + m.frame.size();
+        m.opcode = opcode;
+        m.message = std::move(message);
+        m.frame = frame;
+        this->coalesced_bytes += m.message.size() + m.frame.size();
+        this->messages_coalesced++;
+      }
+      this->update_peak_queued_bytes();
+    }
+
+    void reset_pending_frame() {
+      this->ws_pending_opcode = 0xFF;
+      this->ws_pending_compressed = false;
+      this->ws_pending_data.drain_all();
+    }
+  };
+
+  WebSocketDeflateOptions websocket_deflate_options;
+  WebSocketOutputLimits websocket_output_limits;
+  size_t websocket_max_message_size = 0;
+  size_t websocket_publish_batch_size = 0x400;
+  uint64_t websocket_ping_interval_usecs = 0;
+  uint64_t websocket_pong_timeout_usecs = 0;
+  // The zlib pool and timer wheel must outlive the clients' deflate contexts
+  // and keepalive timers, so they're declared before the topic index and
+  // bev_to_websocket_client (both of which hold references to clients)
+  std::unique_ptr<ZlibStreamPool> zlib_pool;
+  std::unique_ptr<TimerWheel> keepalive_timers;
+  WebSocketTopicIndex<WebSocketClient> topic_index;
+  std::unordered_map<struct bufferevent*, std::shared_ptr<WebSocketClient>> bev_to_websocket_client;
+
+  // Converts an HTTP request to a WebSocket connection. If successful,
+  // on_websocket_connect is called, and this function returns a
+  // WebSocketClient object; the EvHTTPREquest is no longer usable after this.
+  // If the request cannot be converted (because it isn't a GET request or
+  // doesn't have the appropriate request headers), this function returns
+  // nullptr, and the caller still must respond to the HTTP request.
+  std::shared_ptr<WebSocketClient> enable_websockets(EvHTTPRequest& req) {
+    if (req.get_command() != EVHTTP_REQ_GET) {
+      return nullptr;
+    }
+    const char* connection_header = req.get_input_header("Connection");
+    if (!connection_header || strcasecmp(connection_header, "upgrade")) {
+      return nullptr;
+    }
+    const char* upgrade_header = req.get_input_header("Upgrade");
+    if (!upgrade_header || strcasecmp(upgrade_header, "websocket")) {
+      return nullptr;
+    }
+    const char* ws_key_header = req.get_input_header("Sec-WebSocket-Key");
+    if (!ws_key_header) {
+      return nullptr;
+    }
+
+    // Note: it's important that we make a copy of this header's value since
+    // we're about to free the original
+    std::string ws_key = ws_key_header;
+
+    WebSocketDeflateParameters deflate_params;
+    bool use_deflate = deflate_params.negotiate(
+        req.get_input_header("Sec-WebSocket-Extensions"),
+        this->websocket_deflate_options);
+
+    std::string sec_websocket_accept_data =
+        ws_key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    std::string sec_websocket_accept =
+        base64_encode(sha1(sec_websocket_accept_data));
+
+    // Hijack the bufferevent since it's no longer going to handle HTTP at all
+    struct evhttp_connection* conn = req.get_connection();
+    struct bufferevent* bev = evhttp_connection_get_bufferevent(conn);
+    bufferevent_setcb(
+        bev,
+        &HTTPWebSocketServer::dispatch_on_websocket_read,
+        &HTTPWebSocketServer::dispatch_on_websocket_write,
+        &HTTPWebSocketServer::dispatch_on_websocket_error,
+        this);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+
+    // Send the HTTP reply, which enables websockets
+    struct evbuffer* out_buf = bufferevent_get_output(bev);
+    evbuffer_add_printf(out_buf,
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n",
+        sec_websocket_accept.c_str());
+    if (use_deflate) {
+      evbuffer_add_printf(out_buf, "Sec-WebSocket-Extensions: %s\r\n",
+          deflate_params.response_header().c_str());
+    }
+    evbuffer_add(out_buf, "\r\n", 2);
+
+    auto c = this->bev_to_websocket_client.emplace(bev, new WebSocketClient(conn)).first->second;
+    if (use_deflate) {
+      c->deflate.reset(new WebSocketDeflateContext(*this->zlib_pool, deflate_params));
+    }
+    c->set_output_limits(this->websocket_output_limits);
+    c->topic_handle = this->topic_index.add_client(c);
+    if (this->websocket_ping_interval_usecs && this->keepalive_timers) {
+      c->ping_interval_usecs = this->websocket_ping_interval_usecs;
+      c->pong_timeout_usecs = this->websocket_pong_timeout_usecs;
+      c->keepalive_timer.set_callback([this, bev]() -> void {
+        this->on_websocket_keepalive_timer(bev);
+      });
+      this->keepalive_timers->schedule(c->keepalive_timer, c->ping_interval_usecs);
+    }
+    this->on_websocket_connect(c);
+    return c;
+  }
+
+  static void dispatch_on_websocket_read(struct bufferevent* bev, void* ctx) {
+    reinterpret_cast<HTTPWebSocketServer*>(ctx)->on_websocket_read(bev);
+  }
+
+  static void dispatch_on_websocket_write(struct bufferevent* bev, void* ctx) {
+    reinterpret_cast<HTTPWebSocketServer*>(ctx)->on_websocket_write(bev);
+  }
+
+  static void dispatch_on_websocket_error(
+      struct bufferevent* bev, short events, void* ctx) {
+    reinterpret_cast<HTTPWebSocketServer*>(ctx)->on_websocket_error(bev, events);
+  }
+
+  struct WebSocketFrameHeader {
+    bool fin;
+    uint8_t rsv;
+    uint8_t opcode;
+    bool has_mask;
+    uint8_t mask_key[4];
+    size_t header_size;
+    uint64_t payload_size;
+  };
+
+  // Reads a frame header from the beginning of the buffer without removing it.
+  // Returns false if the buffer doesn't contain a complete frame header (the
+  // payload may not have been received yet).
+  static bool peek_websocket_frame_header(EvBuffer& buf, WebSocketFrameHeader& h) {
+    // Headers are between 2 and 14 bytes long
+    uint8_t data[14];
+    size_t bytes_available = buf.copyout_atmost(data, sizeof(data));
+    if (bytes_available < 2) {
+      return false;
+    }
+
+    h.fin = data[0] & 0x80;
+    h.rsv = data[0] & 0x70;
+    h.opcode = data[0] & 0x0F;
+    h.has_mask = data[1] & 0x80;
+    h.payload_size = data[1] & 0x7F;
+    h.header_size = 2;
+    if (h.payload_size == 0x7F) {
+      h.header_size = 10;
+    } else if (h.payload_size == 0x7E) {
+      h.header_size = 4;
+    }
+    if (h.has_mask) {
+      h.header_size += 4;
+    }
+    if (bytes_available < h.header_size) {
+      return false;
+    }
+
+    if (h.payload_size == 0x7F) {
+      h.payload_size = 0;
+      for (size_t z = 2; z < 10; z++) {
+        h.payload_size = (h.payload_size << 8) | data[z];
+      }
+    } else if (h.payload_size == 0x7E) {
+      h.payload_size = (data[2] << 8) | data[3];
+    }
+    if (h.has_mask) {
+      memcpy(h.mask_key, &data[h.header_size - 4], 4);
+    }
+    return true;
+  }
+
+  // Processes every complete frame in the input buffer. Incomplete frames are
+  // left in the buffer until more data arrives.
+  void on_websocket_read(struct bufferevent* bev) {
+    auto client_it = this->bev_to_websocket_client.find(bev);
+    if (client_it == this->bev_to_websocket_client.end()) {
+      return;
+    }
+    std::shared_ptr<WebSocketClient> c = client_it->second;
+    EvBuffer buf(bufferevent_get_input(bev));
+
+    // Any data from the client shows that it's still alive
+    if (c->ping_interval_usecs && !c->disconnect_scheduled) {
+      c->awaiting_pong = false;
+      this->keepalive_timers->schedule(c->keepalive_timer, c->ping_interval_usecs);
+    }
+
+    // Once the client is closing or about to be disconnected (which leaves it
+    // in bev_to_websocket_client until the disconnect happens), any frames
+    // still in the buffer are ignored
+    WebSocketFrameHeader h;
+    while (!c->disconnect_scheduled && peek_websocket_frame_header(buf, h)) {
+      // Frames are validated as soon as their headers arrive, so clients can't
+      // make us buffer an invalid or oversized frame
+      bool is_control = (h.opcode & 0x08);
+      if (is_control) {
+        // Control frames (which can be sent in the middle of fragmented
+        // messages) must not be fragmented or compressed, and have at most
+        // 125 bytes of payload
+        if (!h.fin || h.rsv || (h.payload_size > 0x7D)) {
+          this->disconnect_websocket_client(bev);
+          return;
+        }
+      } else {
+        // If there's an existing pending message, the current frame's opcode
+        // should be zero; if there's no pending message, it must not be zero
+        if ((c->ws_pending_opcode != 0xFF) == (h.opcode != 0)) {
+          this->disconnect_websocket_client(bev);
+          return;
+        }
+        // RSV1 marks a compressed message; it's only allowed on the first
+        // frame of a message, and only if permessage-deflate was negotiated
+        if ((h.rsv & ~0x40) || ((h.rsv & 0x40) && (!c->deflate || !h.opcode))) {
+          this->disconnect_websocket_client(bev);
+          return;
+        }
+        if (this->websocket_max_message_size &&
+            (h.payload_size > this->websocket_max_message_size - c->ws_pending_data.get_length())) {
+          this->close_websocket_client(c, 1009);
+          return;
+        }
+      }
+      if ((buf.get_length() - h.header_size) < h.payload_size) {
+        break;
+      }
+      buf.drain(h.header_size);
+
+      if (is_control) {
+        std::string payload = buf.remove(h.payload_size);
+        if (h.has_mask) {
+          apply_websocket_mask(
+              reinterpret_cast<uint8_t*>(payload.data()), payload.size(), h.mask_key);
+        }
+
+        if (h.opcode == 0x0A) {
+          // Our pings contain the time they were sent; ignore unsolicited pongs
+          // and pongs for pings other than the most recent one
+          if ((payload.size() == 8) && c->last_ping_usecs) {
+            uint64_t ping_usecs = 0;
+            for (size_t z = 0; z < 8; z++) {
+              ping_usecs = (ping_usecs << 8) | static_cast<uint8_t>(payload[z]);
+            }
+            if (ping_usecs == c->last_ping_usecs) {
+              c->rtt_usecs = now() - ping_usecs;
+            }
+          }
+
+        } else if (h.opcode == 0x08) {
+          // Echo the client's status code, if any. A 1-byte payload or a code
+          // that isn't valid on the wire is a protocol error (1002).
+          uint16_t status_code = 0;
+          if (payload.size() == 1) {
+            status_code = 1002;
+          } else if (payload.size() >= 2) {
+            status_code = (static_cast<uint8_t>(payload[0]) << 8) | static_cast<uint8_t>(payload[1]);
+            if (!is_valid_websocket_close_status(status_code)) {
+              status_code = 1002;
+            }
+          }
+          this->close_websocket_client(c, status_code);
+          return;
+
+        } else if (h.opcode == 0x09) {
+          this->send_websocket_message(bev, std::move(payload), 0x0A);
+
+        } else {
+          this->disconnect_websocket_client(bev);
+          return;
+        }
+        continue;
+      }
+
+      if (h.opcode) {
+        c->ws_pending_opcode = h.opcode;
+        c->ws_pending_compressed = (h.rsv & 0x40);
+      }
+
+      // Unmask the payload in the input buffer, then move its chains to the
+      // end of the pending message
+      if (h.has_mask) {
+        apply_websocket_mask(buf, h.payload_size, h.mask_key);
+      }
+      buf.remove_buffer(c->ws_pending_data, h.payload_size);
+
+      // If the FIN bit isn't set, we need to receive at least one continuation
+      // frame to complete the message
+      if (h.fin) {
+        uint8_t opcode = c->ws_pending_opcode;
+        EvBuffer& message = c->ws_pending_data;
+        if (c->ws_pending_compressed) {
+          size_t max_size = this->websocket_deflate_options.max_decompressed_size;
+          if (this->websocket_max_message_size && (this->websocket_max_message_size < max_size)) {
+            max_size = this->websocket_max_message_size;
+          }
+          std::string decompressed;
+          try {
+            decompressed = c->deflate->decompress(message.get(), max_size);
+          } catch (const WebSocketDeflateContext::too_large_error&) {
+            this->close_websocket_client(c, 1009);
+            return;
+          } catch (const std::runtime_error&) {
+            this->disconnect_websocket_client(bev);
+            return;
+          }
+          message.drain_all();
+          message.add_reference(std::move(decompressed));
+        }
+        this->on_websocket_message_buffer(c, opcode, message);
+        // Discard anything the handler didn't consume
+        c->reset_pending_frame();
+
+        // The handler may have disconnected the client, which frees the
+        // bufferevent, or closed it or scheduled it to be disconnected
+        if (!this->bev_to_websocket_client.count(bev) || c->disconnect_scheduled) {
+          return;
+        }
+      }
+    }
+  }
+
+  void on_websocket_keepalive_timer(struct bufferevent* bev) {
+    auto client_it = this->bev_to_websocket_client.find(bev);
+    if (client_it == this->bev_to_websocket_client.end()) {
+      return;
+    }
+    std::shared_ptr<WebSocketClient> c = client_it->second;
+    if (c->disconnect_scheduled) {
+      return;
+    }
+    if (c->awaiting_pong) {
+      this->on_websocket_keepalive_timeout(c);
+      // The default handler disconnects the client. If an override keeps it
+      // connected instead, send another ping and keep waiting.
+      client_it = this->bev_to_websocket_client.find(bev);
+      if ((client_it == this->bev_to_websocket_client.end()) ||
+          (client_it->second != c) || c->disconnect_scheduled) {
+        return;
+      }
+    }
+
+    c->awaiting_pong = true;
+    c->last_ping_usecs = now();
+    std::string payload(8, '\0');
+    for (size_t z = 0; z < 8; z++) {
+      payload[z] = (c->last_ping_usecs >> (56 - z * 8)) & 0xFF;
+    }
+    HTTPWebSocketServer::send_websocket_message(bev, std::move(payload), 0x09);
+    this->keepalive_timers->schedule(c->keepalive_timer, c->pong_timeout_usecs);
+  }
+
+  // Called when the output buffer drains to the low-water mark
+  void on_websocket_write(struct bufferevent* bev) {
+    auto client_it = this->bev_to_websocket_client.find(bev);
+    if (client_it == this->bev_to_websocket_client.end()) {
+      return;
+    }
+    std::shared_ptr<WebSocketClient> c = client_it->second;
+    if (c->close_sent) {
+      if (!evbuffer_get_length(bufferevent_get_output(bev))) {
+        this->disconnect_websocket_client(bev);
+      }
+      return;
+    }
+    if (!c->output_throttled || c->disconnect_scheduled) {
+      return;
+    }
+    c->output_throttled = false;
+
+    // Send the coalesced messages in the order they were first queued. If
+    // these fill the output buffer again, the remaining messages are queued
+    // again (since they have keys).
+    auto messages = std::move(c->coalesced_messages);
+    c->coalesced_messages.clear();
+    c->coalesced_message_index.clear();
+    c->coalesced_bytes = 0;
+    for (auto& m : messages) {
+      if (m.frame.size()) {
+        this->send_websocket_frame(c, m.frame, m.key);
+      } else {
+        this->send_websocket_message(c, std::move(m.message), m.opcode, m.key);
+      }
+    }
+
+    if (!c->output_throttled && !c->disconnect_scheduled) {
+      this->on_websocket_output_drained(c);
+    }
+  }
+
+  void on_websocket_error(struct bufferevent* bev, short events) {
+    if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+      this->disconnect_websocket_client(bev);
+    }
+  }
+
+  void disconnect_websocket_client(struct bufferevent* bev) {
+    auto it = this->bev_to_websocket_client.find(bev);
+    if (it == this->bev_to_websocket_client.end()) {
+      return;
+    }
+    this->on_websocket_disconnect(it->second);
+    this->topic_index.remove_client(it->second->topic_handle);
+    this->bev_to_websocket_client.erase(it);
+  }
+
+  // Disconnects the client after the current callback returns (or after
+  // timeout_usecs). This is safe to call while iterating over
+  // bev_to_websocket_client.
+  void disconnect_websocket_client_later(
+      std::shared_ptr<WebSocketClient> c, uint64_t timeout_usecs = 0) {
+    if (c->disconnect_scheduled) {
+      return;
+    }
+    c->disconnect_scheduled = true;
+    c->bev.disable(EV_READ);
+    std::weak_ptr<WebSocketClient> weak_c = c;
+    this->base.once([this, weak_c]() -> void {
+      auto c = weak_c.lock();
+      if (!c) {
+        return;
+      }
+      // The client may already have been disconnected, in which case its
+      // bufferevent may have been freed and reused by another client
+      auto it = this->bev_to_websocket_client.find(c->bev.get());
+      if ((it != this->bev_to_websocket_client.end()) && (it->second == c)) {
+        this->disconnect_websocket_client(c->bev.get());
+      }
+    }, timeout_usecs);
+  }
+
+  // Clients that don't read the close frame are disconnected after this long
+  static constexpr uint64_t WEBSOCKET_CLOSE_TIMEOUT_USECS = 5000000;
+
+  // Returns true if status_code may appear in a close frame. 1004 is reserved,
+  // and 1005, 1006 and 1015 are only used locally to report that a connection
+  // closed without a status code, abnormally, or due to a TLS failure.
+  static bool is_valid_websocket_close_status(uint16_t status_code) {
+    return ((status_code >= 1000) && (status_code <= 1014) &&
+               ((status_code < 1004) || (status_code > 1006))) ||
+        ((status_code >= 3000) && (status_code <= 4999));
+  }
+
+  // Sends a close frame and disconnects the client once it has been sent.
+  // Incoming data from the client is ignored after this. If status_code is
+  // zero or can't be sent in a close frame (see
+  // is_valid_websocket_close_status), the close frame has no status code (and
+  // the reason is ignored).
+  void close_websocket_client(const std::shared_ptr<WebSocketClient>& c,
+      uint16_t status_code, const std::string& reason = "") {
+    if (c->disconnect_scheduled) {
+      return;
+    }
+    std::string payload;
+    if (is_valid_websocket_close_status(status_code)) {
+      payload.push_back(status_code >> 8);
+      payload.push_back(status_code & 0xFF);
+      payload.append(reason, 0, 0x7B);
+    }
+    HTTPWebSocketServer::send_websocket_message(c->bev.get(), std::move(payload), 0x08);
+    c->close_sent = true;
+    c->bev.setwatermark(EV_WRITE, 0, 0);
+    this->disconnect_websocket_client_later(c, WEBSOCKET_CLOSE_TIMEOUT_USECS);
+  }
+
+  // Returns true if a data message can be added to the client's output buffer
+  // now. If the output buffer is over the high-water mark, the client is
+  // throttled until it drains to the low-water mark, and if the policy is
+  // DISCONNECT, the client is disconnected.
+  bool can_send_websocket_output(const std::shared_ptr<WebSocketClient>& c) {
+    if (c->disconnect_scheduled) {
+      return false;
+    }
+    const auto& limits = c->output_limits;
+    if (!limits.high_water) {
+      return true;
+    }
+    if (!c->output_throttled &&
+        (evbuffer_get_length(bufferevent_get_output(c->bev.get())) <= limits.high_water)) {
+      return true;
+    }
+    c->output_throttled = true;
+    if (limits.policy == WebSocketOverflowPolicy::DISCONNECT) {
+      this->disconnect_websocket_client_later(c);
+    }
+    return false;
+  }
+
+  // Applies the client's overflow policy to a message that can't be sent now.
+  // Returns true if the message was queued.
+  bool handle_websocket_overflow(const std::shared_ptr<WebSocketClient>& c,
+      const std::string& coalesce_key, uint8_t opcode, std::string&& message,
+      const SharedWebSocketFrame& frame) {
+    if ((c->output_limits.policy == WebSocketOverflowPolicy::COALESCE) &&
+        !coalesce_key.empty() && !c->disconnect_scheduled) {
+      c->coalesce_message(coalesce_key, opcode, std::move(message), frame);
+      return true;
+    }
+    c->messages_dropped++;
+    return false;
+  }
+
+  // Messages up to this size are copied into the buffer along with the frame
+  // header (with a single evbuffer_add); larger messages are added by
+  // reference after it
+  static constexpr size_t MAX_COPIED_MESSAGE_SIZE = 0x400;
+
+  // If compressed is true, the message must already be compressed with
+  // permessage-deflate; this is only valid if the client negotiated it. To
+  // compress messages automatically, use the WebSocketClient overload.
+  static void send_websocket_message(EvBuffer& buf, std::string&& message,
+      uint8_t opcode = 0x01, bool compressed = false) {
+    uint8_t data[10 + MAX_COPIED_MESSAGE_SIZE];
+    size_t size = encode_websocket_frame_header(data, opcode, message.size(), true, compressed);
+    bool copy_message = (message.size() <= MAX_COPIED_MESSAGE_SIZE);
+    if (copy_message) {
+      memcpy(data + size, message.data(), message.size());
+      size += message.size();
+    }
+
+    auto g = buf.lock_guard();
+    buf.add(data, size);
+    if (!copy_message) {
+      buf.add_reference(std::move(message));
+    }
+  }
+
+  static void send_websocket_message(struct evbuffer* buf, std::string&& message,
+      uint8_t opcode = 0x01, bool compressed = false) {
+    EvBuffer evbuf(buf);
+    HTTPWebSocketServer::send_websocket_message(evbuf, std::move(message), opcode, compressed);
+  }
+
+  static void send_websocket_message(struct bufferevent* bev, std::string&& message,
+      uint8_t opcode = 0x01, bool compressed = false) {
+    HTTPWebSocketServer::send_websocket_message(
+        bufferevent_get_output(bev), std::move(message), opcode, compressed);
+  }
+
+  // Compresses the message if the client negotiated permessage-deflate and the
+  // message is a data message at least as long as min_compress_size. If the
+  // client's output buffer is over its high-water mark, the client's overflow
+  // policy is applied; messages with the same coalesce_key replace each other
+  // under the COALESCE policy. Returns false if the message was dropped.
+  bool send_websocket_message(
+      std::shared_ptr<WebSocketClient> c,
+      std::string&& message,
+      uint8_t opcode = 0x01,
+      const std::string& coalesce_key = "") {
+    if (!(opcode & 0x08) && !this->can_send_websocket_output(c)) {
+      return this->handle_websocket_overflow(
+          c, coalesce_key, opcode, std::move(message), SharedWebSocketFrame());
+    }
+    if (c->deflate && !(opcode & 0x08) &&
+        (message.size() >= this->websocket_deflate_options.min_compress_size)) {
+      HTTPWebSocketServer::send_websocket_message(c->bev.get(),
+          c->deflate->compress(message.data(), message.size()), opcode, true);
+    } else {
+      HTTPWebSocketServer::send_websocket_message(
+          c->bev.get(), std::move(message), opcode);
+    }
+    c->update_peak_queued_bytes();
+    return true;
+  }
+
+  // A compressed frame may only be sent to a client that negotiated
+  // permessage-deflate with a server window at least as large as the one the
+  // frame was compressed with. Output limits are applied in the same way as for
+  // send_websocket_message.
+  bool send_websocket_frame(std::shared_ptr<WebSocketClient> c,
+      const SharedWebSocketFrame& frame, const std::string& coalesce_key = "") {
+    if (!this->can_send_websocket_output(c)) {
+      return this->handle_websocket_overflow(c, coalesce_key, 0, "", frame);
+    }
+    // Small frames are cheaper to copy than to reference, since a reference
+    // requires a new buffer chain
+    struct evbuffer* out = bufferevent_get_output(c->bev.get());
+    if (frame.size() <= MAX_COPIED_MESSAGE_SIZE) {
+      if (evbuffer_add(out, frame.data(), frame.size())) {
+        throw std::runtime_error("evbuffer_add");
+      }
+    } else {
+      frame.send(out);
+    }
+    // The client's decompression window now contains data that our compressor
+    // didn't produce, so our compressor's history is no longer usable
+    if (c->deflate && frame.is_compressed()) {
+      c->deflate->reset_compressor();
+    }
+    c->update_peak_queued_bytes();
+    return true;
+  }
+
+  // Lazily encodes the frames for a broadcast message. At most one compressed
+  // and one uncompressed frame are created, regardless of how many clients the
+  // message is sent to.
+  class WebSocketBroadcast {
+  public:
+    WebSocketBroadcast(HTTPWebSocketServer* server, const void* data, size_t size,
+        uint8_t opcode, std::string coalesce_key)
+        : server(server),
+          data(data),
+          size(size),
+          opcode(opcode),
+          coalesce_key(std::move(coalesce_key)) {}
+
+    // Returns false if the message was dropped for this client
+    bool send(const std::shared_ptr<WebSocketClient>& c) {
+      const auto& options = this->server->websocket_deflate_options;
+      if (c->deflate && !(this->opcode & 0x08) &&
+          (this->size >= options.min_compress_size) &&
+          (c->deflate->get_params().server_max_window_bits >= options.server_max_window_bits)) {
+        if (!this->compressed_frame.size()) {
+          this->compressed_frame = SharedWebSocketFrame(
+              websocket_deflate(*this->server->zlib_pool,
+                  options.server_max_window_bits, this->data, this->size),
+              this->opcode, true);
+        }
+        return this->server->send_websocket_frame(c, this->compressed_frame, this->coalesce_key);
+      } else {
+        if (!this->frame.size()) {
+          this->frame = SharedWebSocketFrame(this->data, this->size, this->opcode);
+        }
+        return this->server->send_websocket_frame(c, this->frame, this->coalesce_key);
+      }
+    }
+
+  private:
+    HTTPWebSocketServer* server;
+    const void* data;
+    size_t size;
+    uint8_t opcode;
+    std::string coalesce_key;
+    SharedWebSocketFrame frame;
+    SharedWebSocketFrame compressed_frame;
+  };
+
+  // State for a publish that's sent to the topic's subscribers in batches
+  struct WebSocketPublishBatch {
+    std::shared_ptr<const std::string> message;
+    std::vector<uint64_t> handles;
+    size_t offset;
+    WebSocketBroadcast broadcast;
+
+    WebSocketPublishBatch(HTTPWebSocketServer* server,
+        std::shared_ptr<const std::string>&& message, uint8_t opcode)
+        : message(std::move(message)),
+          offset(0),
+          broadcast(server, this->message->data(), this->message->size(), opcode, "") {}
+  };
+
+  void send_websocket_publish_batch(std::shared_ptr<WebSocketPublishBatch> batch) {
+    size_t end_offset = std::min<size_t>(
+        batch->offset + this->websocket_publish_batch_size, batch->handles.size());
+    for (; batch->offset < end_offset; batch->offset++) {
+      const auto* c = this->topic_index.get_client(batch->handles[batch->offset]);
+      if (c) {
+        batch->broadcast.send(*c);
+      }
+    }
+    if (batch->offset < batch->handles.size()) {
+      this->base.once([this, batch]() -> void {
+        this->send_websocket_publish_batch(batch);
+      });
+    }
+  }
+
+  bool subscribe_websocket_client(
+      const std::shared_ptr<WebSocketClient>& c, const std::string& topic) {
+    return this->topic_index.subscribe(c->topic_handle, topic);
+  }
+
+  bool unsubscribe_websocket_client(
+      const std::shared_ptr<WebSocketClient>& c, const std::string& topic) {
+    return this->topic_index.unsubscribe(c->topic_handle, topic);
+  }
+
+  // Sends the same message to many clients. The frame is encoded (and
+  // compressed, for clients that negotiated permessage-deflate) once, and each
+  // client's output buffer holds a reference to it, so the per-client cost
+  // doesn't depend on the message size. ClientsT may be any iterable of
+  // shared_ptr<WebSocketClient>. Output limits are applied to each client as
+  // in send_websocket_message. Returns the number of clients the message was
+  // sent to (or queued for).
+  template <typename ClientsT>
+  size_t broadcast_websocket_message(const ClientsT& clients, const void* data,
+      size_t size, uint8_t opcode = 0x01, const std::string& coalesce_key = "") {
+    WebSocketBroadcast broadcast(this, data, size, opcode, coalesce_key);
+    size_t count = 0;
+    for (const auto& c : clients) {
+      count += broadcast.send(c);
+    }
+    return count;
+  }
+
+  // Sends the same message to all connected WebSocket clients
+  size_t broadcast_websocket_message(const void* data, size_t size,
+      uint8_t opcode = 0x01, const std::string& coalesce_key = "") {
+    WebSocketBroadcast broadcast(this, data, size, opcode, coalesce_key);
+    size_t count = 0;
+    for (const auto& it : this->bev_to_websocket_client) {
+      count += broadcast.send(it.second);
+    }
+    return count;
+  }
+
+  size_t broadcast_websocket_message(const std::string& message,
+      uint8_t opcode = 0x01, const std::string& coalesce_key = "") {
+    return this->broadcast_websocket_message(
+        message.data(), message.size(), opcode, coalesce_key);
+  }
+
+  virtual void on_websocket_message(std::shared_ptr<WebSocketClient> c,
+      uint8_t opcode, std::string&& message) = 0;
+  // Called with each complete message before it's converted to a string.
+  // Servers that can process messages directly from an EvBuffer (e.g. to
+  // avoid copying large messages) can override this; the data should be
+  // removed or moved out of the buffer (e.g. with remove_buffer) before
+  // returning, since any remaining data is discarded. The default
+  // implementation calls on_websocket_message.
+  virtual void on_websocket_message_buffer(std::shared_ptr<WebSocketClient> c,
+      uint8_t opcode, EvBuffer& message) {
+    this->on_websocket_message(c, opcode, message.remove(message.get_length()));
+  }
+
+  virtual void on_websocket_connect(std::shared_ptr<WebSocketClient>) {}
+  virtual void on_websocket_disconnect(std::shared_ptr<WebSocketClient>) {}
+  // Called when a client's output buffer drains to its low-water mark after
+  // having gone over its high-water mark (and after any coalesced messages
+  // have been sent)
+  virtual void on_websocket_output_drained(std::shared_ptr<WebSocketClient>) {}
+  // Called when a client doesn't respond to a keepalive ping in time. If this
+  // doesn't disconnect the client, another ping is sent and the client gets
+  // another pong_timeout_usecs to respond.
+  virtual void on_websocket_keepalive_timeout(std::shared_ptr<WebSocketClient> c) {
+    this->disconnect_websocket_client(c->bev.get());
+  }
+};
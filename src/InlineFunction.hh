@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// A move-only replacement for std::function which stores the callable inside
+// the object itself when it fits in InlineSize bytes, so wrapping a typical
+// lambda doesn't allocate. Callables that are too large (or too strictly
+// aligned, or whose move constructors can throw) are stored on the heap
+// instead, so any callable can be used, but only small ones are free.
+
+template <typename SignatureT, size_t InlineSize = 48>
+class InlineFunction;
+
+template <typename ReturnT, typename... ArgTs, size_t InlineSize>
+class InlineFunction<ReturnT(ArgTs...), InlineSize> {
+public:
+  InlineFunction() noexcept : ops(nullptr) {}
+  InlineFunction(std::nullptr_t) noexcept : ops(nullptr) {}
+
+  template <typename FnT,
+      std::enable_if_t<
+          !std::is_same_v<std::decay_t<FnT>, InlineFunction> &&
+              std::is_invocable_r_v<ReturnT, std::decay_t<FnT>&, ArgTs...>,
+          bool> = true>
+  InlineFunction(FnT&& fn) : ops(nullptr) {
+    using StoredT = std::decay_t<FnT>;
+    if constexpr (std::is_pointer_v<StoredT> || std::is_member_pointer_v<StoredT> ||
+        std::is_same_v<StoredT, std::function<ReturnT(ArgTs...)>>) {
+      if (!fn) {
+        return;
+      }
+    }
+    if constexpr (InlineFunction::fits_inline<StoredT>()) {
+      new (this->storage) StoredT(std::forward<FnT>(fn));
+      this->ops = &InlineFunction::inline_ops<StoredT>;
+    } else {
+      *reinterpret_cast<StoredT**>(this->storage) = new StoredT(std::forward<FnT>(fn));
+      this->ops = &InlineFunction::heap_ops<StoredT>;
+    }
+  }
+
+  InlineFunction(const InlineFunction&) = delete;
+  InlineFunction& operator=(const InlineFunction&) = delete;
+
+  InlineFunction(InlineFunction&& other) noexcept : ops(other.ops) {
+    if (this->ops) {
+      this->ops->move(this->storage, other.storage);
+      other.ops = nullptr;
+    }
+  }
+
+  InlineFunction& operator=(InlineFunction&& other) noexcept {
+    if (this != &other) {
+      this->reset();
+      if (other.ops) {
+        other.ops->move(this->storage, other.storage);
+        this->ops = other.ops;
+        other.ops = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  InlineFunction& operator=(std::nullptr_t) noexcept {
+    this->reset();
+    return *this;
+  }
+
+  ~InlineFunction() {
+    this->reset();
+  }
+
+  void reset() noexcept {
+    if (this->ops) {
+      this->ops->destroy(this->storage);
+      this->ops = nullptr;
+    }
+  }
+
+  explicit operator bool() const noexcept {
+    return this->ops != nullptr;
+  }
+
+  ReturnT operator()(ArgTs... args) {
+    if (!this->ops) {
+      throw std::bad_function_call();
+    }
+    return this->ops->invoke(this->storage, std::forward<ArgTs>(args)...);
+  }
+
+  // Returns true if a callable of type FnT would be stored without allocating
+  template <typename FnT>
+  static constexpr bool fits_inline() {
+    return (sizeof(FnT) <= InlineSize) &&
+        (alignof(FnT) <= alignof(std::max_align_t)) &&
+        std::is_nothrow_move_constructible_v<FnT>;
+  }
+
+private:
+  struct Ops {
+    ReturnT (*invoke)(void* storage, ArgTs&&... args);
+    void (*move)(void* dest_storage, void* src_storage) noexcept;
+    void (*destroy)(void* storage) noexcept;
+  };
+
+  template <typename FnT>
+  static ReturnT invoke_inline(void* storage, ArgTs&&... args) {
+    return std::invoke(*reinterpret_cast<FnT*>(storage), std::forward<ArgTs>(args)...);
+  }
+  template <typename FnT>
+  static void move_inline(void* dest_storage, void* src_storage) noexcept {
+    FnT* src = reinterpret_cast<FnT*>(src_storage);
+    new (dest_storage) FnT(std::move(*src));
+    src->~FnT();
+  }
+  template <typename FnT>
+  static void destroy_inline(void* storage) noexcept {
+    reinterpret_cast<FnT*>(storage)->~FnT();
+  }
+  template <typename FnT>
+  static constexpr Ops inline_ops = {
+      &InlineFunction::invoke_inline<FnT>,
+      &InlineFunction::move_inline<FnT>,
+      &InlineFunction::destroy_inline<FnT>};
+
+  template <typename FnT>
+  static ReturnT invoke_heap(void* storage, ArgTs&&... args) {
+    return std::invoke(**reinterpret_cast<FnT**>(storage), std::forward<ArgTs>(args)...);
+  }
+  static void move_heap(void* dest_storage, void* src_storage) noexcept {
+    *reinterpret_cast<void**>(dest_storage) = *reinterpret_cast<void**>(src_storage);
+  }
+  template <typename FnT>
+  static void destroy_heap(void* storage) noexcept {
+    delete *reinterpret_cast<FnT**>(storage);
+  }
+  template <typename FnT>
+  static constexpr Ops heap_ops = {
+      &InlineFunction::invoke_heap<FnT>,
+      &InlineFunction::move_heap,
+      &InlineFunction::destroy_heap<FnT>};
+
+  static_assert(InlineSize >= sizeof(void*), "InlineFunction storage must be able to hold a pointer");
+
+  alignas(std::max_align_t) unsigned char storage[InlineSize];
+  const Ops* ops;
+};
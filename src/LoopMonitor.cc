@@ -0,0 +1,324 @@
+#include "LoopMonitor.hh"
+
+#include <inttypes.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <phosg/Strings.hh>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+LatencyHistogram::LatencyHistogram() {
+  this->reset();
+}
+
+size_t LatencyHistogram::bucket_for_value(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return value;
+  }
+  size_t msb = 63 - __builtin_clzll(value);
+  size_t shift = msb - SUB_BUCKET_BITS;
+  return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::max_value_for_bucket(size_t bucket) {
+  size_t row = bucket / SUB_BUCKETS;
+  uint64_t sub = bucket % SUB_BUCKETS;
+  if (row == 0) {
+    return sub;
+  }
+  size_t shift = row - 1;
+  uint64_t limit = (SUB_BUCKETS + sub + 1) << shift;
+  return (limit == 0) ? UINT64_MAX : (limit - 1);
+}
+
+void LatencyHistogram::record(uint64_t value) {
+  this->buckets[LatencyHistogram::bucket_for_value(value)].fetch_add(1, memory_order_relaxed);
+  this->total_count.fetch_add(1, memory_order_relaxed);
+  this->total_sum.fetch_add(value, memory_order_relaxed);
+  uint64_t prev_max = this->max_value.load(memory_order_relaxed);
+  while ((value > prev_max) &&
+      !this->max_value.compare_exchange_weak(prev_max, value, memory_order_relaxed)) {
+  }
+}
+
+void LatencyHistogram::reset() {
+  for (auto& bucket : this->buckets) {
+    bucket.store(0, memory_order_relaxed);
+  }
+  this->total_count.store(0, memory_order_relaxed);
+  this->total_sum.store(0, memory_order_relaxed);
+  this->max_value.store(0, memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const {
+  return this->total_count.load(memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::sum() const {
+  return this->total_sum.load(memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const {
+  return this->max_value.load(memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::quantile(double q) const {
+  uint64_t total = this->count();
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t target = static_cast<uint64_t>(q * total);
+  if (target >= total) {
+    target = total - 1;
+  }
+  uint64_t seen = 0;
+  for (size_t z = 0; z < NUM_BUCKETS; z++) {
+    seen += this->buckets[z].load(memory_order_relaxed);
+    if (seen > target) {
+      return min<uint64_t>(LatencyHistogram::max_value_for_bucket(z), this->max());
+    }
+  }
+  return this->max();
+}
+
+void LatencyHistogram::print(FILE* stream, const char* name) const {
+  uint64_t count = this->count();
+  fprintf(stream, "%s: count=%" PRIu64 " mean=%" PRIu64 " p50=%" PRIu64 " p90=%" PRIu64 " p99=%" PRIu64 " p999=%" PRIu64 " max=%" PRIu64 "\n",
+      name, count, count ? (this->sum() / count) : 0, this->quantile(0.5),
+      this->quantile(0.9), this->quantile(0.99), this->quantile(0.999),
+      this->max());
+}
+
+atomic<bool> LoopMonitor::enabled(false);
+
+struct LoopMonitor::ThreadState {
+  static constexpr size_t MAX_DEPTH = 8;
+
+  // These are written by the owning thread and read by the watchdog
+  atomic<uint64_t> outer_start_ns;
+  atomic<size_t> depth;
+  atomic<Trampoline> stack[MAX_DEPTH];
+
+  // These are only used by the owning thread
+  size_t thread_num;
+  uint64_t iteration_callbacks;
+
+  // This is only used by the watchdog thread
+  uint64_t warned_start_ns;
+
+  ThreadState();
+  ~ThreadState();
+};
+
+struct LoopMonitor::Watchdog {
+  uint64_t threshold_ns;
+  mutex lock;
+  condition_variable cv;
+  bool should_exit;
+  thread t;
+
+  Watchdog(uint64_t threshold_usecs)
+      : threshold_ns(threshold_usecs * 1000),
+        should_exit(false),
+        t(&Watchdog::run, this) {}
+
+  ~Watchdog() {
+    {
+      lock_guard<mutex> g(this->lock);
+      this->should_exit = true;
+    }
+    this->cv.notify_all();
+    this->t.join();
+  }
+
+  void run();
+};
+
+// The registry of per-thread states is only modified when a thread first runs
+// an instrumented callback and when that thread exits, so a mutex is fine
+struct LoopMonitor::Registry {
+  mutex thread_states_lock;
+  vector<ThreadState*> thread_states;
+  mutex watchdog_lock;
+  unique_ptr<Watchdog> watchdog;
+  PrefixedLogger log;
+
+  Registry() : log("[LoopMonitor] ") {}
+};
+
+LoopMonitor::Registry& LoopMonitor::registry() {
+  static Registry r;
+  return r;
+}
+
+LoopMonitor::ThreadState::ThreadState()
+    : outer_start_ns(0),
+      depth(0),
+      iteration_callbacks(0),
+      warned_start_ns(0) {
+  static atomic<size_t> next_thread_num(0);
+  this->thread_num = next_thread_num.fetch_add(1, memory_order_relaxed);
+  auto& r = LoopMonitor::registry();
+  lock_guard<mutex> g(r.thread_states_lock);
+  r.thread_states.emplace_back(this);
+}
+
+LoopMonitor::ThreadState::~ThreadState() {
+  auto& r = LoopMonitor::registry();
+  lock_guard<mutex> g(r.thread_states_lock);
+  auto& states = r.thread_states;
+  for (auto it = states.begin(); it != states.end(); it++) {
+    if (*it == this) {
+      states.erase(it);
+      break;
+    }
+  }
+}
+
+void LoopMonitor::Watchdog::run() {
+  uint64_t check_interval_ns = max<uint64_t>(this->threshold_ns / 4, 1000000);
+  unique_lock<mutex> g(this->lock);
+  while (!this->should_exit) {
+    this->cv.wait_for(g, chrono::nanoseconds(check_interval_ns));
+    if (this->should_exit) {
+      break;
+    }
+
+    uint64_t now = LoopMonitor::now_ns();
+    auto& r = LoopMonitor::registry();
+    lock_guard<mutex> states_g(r.thread_states_lock);
+    for (ThreadState* ts : r.thread_states) {
+      uint64_t start_ns = ts->outer_start_ns.load(memory_order_acquire);
+      if (!start_ns || (start_ns == ts->warned_start_ns) ||
+          (now - start_ns < this->threshold_ns)) {
+        continue;
+      }
+      ts->warned_start_ns = start_ns;
+
+      string stack_str;
+      size_t depth = min<size_t>(ts->depth.load(memory_order_acquire), ThreadState::MAX_DEPTH);
+      for (size_t z = 0; z < depth; z++) {
+        if (!stack_str.empty()) {
+          stack_str += " > ";
+        }
+        stack_str += LoopMonitor::name_for_trampoline(ts->stack[z].load(memory_order_relaxed));
+      }
+      r.log.warning("Event loop on thread %zu has been blocked for %" PRIu64 "ms in [%s]",
+          ts->thread_num, (now - start_ns) / 1000000, stack_str.c_str());
+    }
+  }
+}
+
+void LoopMonitor::enable(uint64_t stall_threshold_usecs) {
+  auto& r = LoopMonitor::registry();
+  lock_guard<mutex> g(r.watchdog_lock);
+  r.watchdog.reset();
+  if (stall_threshold_usecs) {
+    r.watchdog.reset(new Watchdog(stall_threshold_usecs));
+  }
+  LoopMonitor::enabled.store(true, memory_order_relaxed);
+}
+
+void LoopMonitor::disable() {
+  auto& r = LoopMonitor::registry();
+  lock_guard<mutex> g(r.watchdog_lock);
+  LoopMonitor::enabled.store(false, memory_order_relaxed);
+  r.watchdog.reset();
+}
+
+const char* LoopMonitor::name_for_trampoline(Trampoline t) {
+  switch (t) {
+    case Trampoline::EVENT_TRIGGER:
+      return "Event::dispatch_on_trigger";
+    case Trampoline::BUFFEREVENT_READ:
+      return "BufferEvent::dispatch_on_read";
+    case Trampoline::STREAMSERVER_CLIENT_INPUT:
+      return "StreamServer::dispatch_on_client_input";
+    case Trampoline::HTTPSERVER_HANDLE_REQUEST:
+      return "HTTPServer::dispatch_handle_request";
+    case Trampoline::HTTPSERVER_RESPONSE_STREAM_WRITABLE:
+      return "HTTPServer::dispatch_on_response_stream_writable";
+    default:
+      return "<unknown>";
+  }
+}
+
+LatencyHistogram& LoopMonitor::iteration_time() {
+  static LatencyHistogram h;
+  return h;
+}
+
+LatencyHistogram& LoopMonitor::callbacks_per_iteration() {
+  static LatencyHistogram h;
+  return h;
+}
+
+LatencyHistogram& LoopMonitor::trampoline_time(Trampoline t) {
+  static LatencyHistogram hs[static_cast<size_t>(Trampoline::COUNT)];
+  return hs[static_cast<size_t>(t)];
+}
+
+void LoopMonitor::reset_stats() {
+  LoopMonitor::iteration_time().reset();
+  LoopMonitor::callbacks_per_iteration().reset();
+  for (size_t z = 0; z < static_cast<size_t>(Trampoline::COUNT); z++) {
+    LoopMonitor::trampoline_time(static_cast<Trampoline>(z)).reset();
+  }
+}
+
+void LoopMonitor::print_stats(FILE* stream) {
+  LoopMonitor::iteration_time().print(stream, "iteration time (ns)");
+  LoopMonitor::callbacks_per_iteration().print(stream, "callbacks per iteration");
+  for (size_t z = 0; z < static_cast<size_t>(Trampoline::COUNT); z++) {
+    auto t = static_cast<Trampoline>(z);
+    string name = string(LoopMonitor::name_for_trampoline(t)) + " (ns)";
+    LoopMonitor::trampoline_time(t).print(stream, name.c_str());
+  }
+}
+
+LoopMonitor::ThreadState& LoopMonitor::thread_state() {
+  static thread_local ThreadState ts;
+  return ts;
+}
+
+void LoopMonitor::CallbackScope::start() {
+  auto& ts = LoopMonitor::thread_state();
+  this->start_ns = LoopMonitor::now_ns();
+  size_t depth = ts.depth.load(memory_order_relaxed);
+  if (depth < ThreadState::MAX_DEPTH) {
+    ts.stack[depth].store(this->trampoline, memory_order_relaxed);
+  }
+  ts.depth.store(depth + 1, memory_order_release);
+  if (depth == 0) {
+    ts.outer_start_ns.store(this->start_ns, memory_order_release);
+    ts.iteration_callbacks++;
+  }
+}
+
+void LoopMonitor::CallbackScope::finish() {
+  auto& ts = LoopMonitor::thread_state();
+  uint64_t end_ns = LoopMonitor::now_ns();
+  LoopMonitor::trampoline_time(this->trampoline).record(end_ns - this->start_ns);
+  size_t depth = ts.depth.load(memory_order_relaxed) - 1;
+  ts.depth.store(depth, memory_order_release);
+  if (depth == 0) {
+    ts.outer_start_ns.store(0, memory_order_release);
+  }
+}
+
+LoopMonitor::IterationScope::IterationScope() : start_ns(0) {
+  if (LoopMonitor::is_enabled()) {
+    LoopMonitor::thread_state().iteration_callbacks = 0;
+    this->start_ns = LoopMonitor::now_ns();
+  }
+}
+
+LoopMonitor::IterationScope::~IterationScope() {
+  if (this->start_ns) {
+    LoopMonitor::iteration_time().record(LoopMonitor::now_ns() - this->start_ns);
+    LoopMonitor::callbacks_per_iteration().record(LoopMonitor::thread_state().iteration_callbacks);
+  }
+}
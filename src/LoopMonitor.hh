@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+// Lock-free log-linear histogram (in the style of HdrHistogram). Values are
+// grouped into buckets whose width is 1/16 of the power of two they fall in,
+// so quantiles are accurate to within about 6%. record() can be called from
+// any number of threads concurrently.
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram(LatencyHistogram&&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(LatencyHistogram&&) = delete;
+  ~LatencyHistogram() = default;
+
+  void record(uint64_t value);
+  void reset();
+
+  uint64_t count() const;
+  uint64_t sum() const;
+  uint64_t max() const;
+  // Returns an upper bound for the value at the given quantile (0.0-1.0)
+  uint64_t quantile(double q) const;
+
+  void print(FILE* stream, const char* name) const;
+
+private:
+  static constexpr size_t SUB_BUCKET_BITS = 4;
+  static constexpr size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static constexpr size_t NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  static size_t bucket_for_value(uint64_t value);
+  static uint64_t max_value_for_bucket(size_t bucket);
+
+  std::atomic<uint64_t> buckets[NUM_BUCKETS];
+  std::atomic<uint64_t> total_count;
+  std::atomic<uint64_t> total_sum;
+  std::atomic<uint64_t> max_value;
+};
+
+// Opt-in instrumentation for event loops. When enabled, this records the wall
+// time of each event loop iteration (for loops run via EventBase::dispatch or
+// EventBase::loop), the number of instrumented callbacks run per iteration,
+// and the time spent in each of the library's dispatch trampolines. All times
+// are in nanoseconds. Optionally, a watchdog thread logs a warning whenever a
+// single callback blocks its event loop for longer than a threshold; the
+// warning includes the stack of trampolines that are currently running on
+// that thread.
+//
+// An iteration is one event_base_loop call with EVLOOP_ONCE, so its time
+// includes waiting for events in the backend (e.g. epoll_wait) as well as
+// running all of the iteration's callbacks, instrumented or not. On a mostly
+// idle loop it's dominated by the time between events; the trampoline times
+// show how long the library's callbacks themselves took.
+//
+// When disabled (the default), the only overhead is one relaxed atomic load
+// per trampoline call and per dispatch()/loop() call.
+class LoopMonitor {
+public:
+  enum class Trampoline {
+    EVENT_TRIGGER = 0,
+    BUFFEREVENT_READ,
+    STREAMSERVER_CLIENT_INPUT,
+    HTTPSERVER_HANDLE_REQUEST,
+    HTTPSERVER_RESPONSE_STREAM_WRITABLE,
+    COUNT,
+  };
+
+  // If stall_threshold_usecs is nonzero, the watchdog thread is started.
+  static void enable(uint64_t stall_threshold_usecs = 0);
+  static void disable();
+  static inline bool is_enabled() {
+    return LoopMonitor::enabled.load(std::memory_order_relaxed);
+  }
+
+  static const char* name_for_trampoline(Trampoline t);
+
+  static LatencyHistogram& iteration_time();
+  static LatencyHistogram& callbacks_per_iteration();
+  static LatencyHistogram& trampoline_time(Trampoline t);
+  static void reset_stats();
+  static void print_stats(FILE* stream);
+
+  // Put one of these at the top of each trampoline function.
+  class CallbackScope {
+  public:
+    explicit inline CallbackScope(Trampoline t) : trampoline(t), start_ns(0) {
+      if (LoopMonitor::is_enabled()) {
+        this->start();
+      }
+    }
+    CallbackScope(const CallbackScope&) = delete;
+    CallbackScope(CallbackScope&&) = delete;
+    CallbackScope& operator=(const CallbackScope&) = delete;
+    CallbackScope& operator=(CallbackScope&&) = delete;
+    inline ~CallbackScope() {
+      if (this->start_ns) {
+        this->finish();
+      }
+    }
+
+  private:
+    void start();
+    void finish();
+
+    Trampoline trampoline;
+    uint64_t start_ns;
+  };
+
+  // Used by EventBase to time loop iterations.
+  class IterationScope {
+  public:
+    IterationScope();
+    IterationScope(const IterationScope&) = delete;
+    IterationScope(IterationScope&&) = delete;
+    IterationScope& operator=(const IterationScope&) = delete;
+    IterationScope& operator=(IterationScope&&) = delete;
+    ~IterationScope();
+
+  private:
+    uint64_t start_ns;
+  };
+
+  static inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+private:
+  struct ThreadState;
+  struct Watchdog;
+  struct Registry;
+
+  static ThreadState& thread_state();
+  static Registry& registry();
+
+  static std::atomic<bool> enabled;
+};
@@ -0,0 +1,379 @@
+#include "StaticFileCache.hh"
+
+#include <event2/util.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <stdexcept>
+
+#include "HTTPQuery.hh"
+
+using namespace std;
+
+StaticFileCache::Entry::Entry()
+    : segment(nullptr),
+      size(0),
+      mtime_secs(0),
+      content_type(nullptr),
+      etag{},
+      last_modified{},
+      dev(0),
+      ino(0),
+      mtime_nsecs(0),
+      load_time_usecs(0),
+      watch_descriptor(-1) {}
+
+StaticFileCache::Entry::~Entry() {
+  if (this->segment) {
+    evbuffer_file_segment_free(this->segment);
+  }
+}
+
+StaticFileCache::StaticFileCache(EventBase& base, const string& root_dir,
+    size_t max_entries, const string& index_filename)
+    : base(base),
+      root_dir(root_dir),
+      root_fd(open(root_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)),
+      max_entries(max_entries ? max_entries : 1),
+      index_filename(index_filename),
+      hits(0),
+      misses(0),
+      invalidations(0),
+      inotify_fd(-1),
+      inotify_event(nullptr) {
+  if (this->root_fd < 0) {
+    throw runtime_error("cannot open root directory: " + root_dir);
+  }
+
+#ifdef __linux__
+  // If inotify isn't available (e.g. because the per-user instance limit has
+  // been reached), entries are checked with stat() instead
+  this->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (this->inotify_fd >= 0) {
+    this->inotify_event = event_new(this->base.get(), this->inotify_fd,
+        EV_READ | EV_PERSIST, &StaticFileCache::dispatch_on_inotify_event, this);
+    if (!this->inotify_event) {
+      close(this->inotify_fd);
+      close(this->root_fd);
+      throw runtime_error("event_new");
+    }
+    if (event_add(this->inotify_event, nullptr)) {
+      event_free(this->inotify_event);
+      close(this->inotify_fd);
+      close(this->root_fd);
+      throw runtime_error("event_add");
+    }
+  }
+#endif
+}
+
+StaticFileCache::~StaticFileCache() {
+  // Entries hold file segments, which close their files when the last buffer
+  // referring to them is done with them
+  this->lru.clear();
+  this->entries.clear();
+  if (this->inotify_event) {
+    event_free(this->inotify_event);
+  }
+  if (this->inotify_fd >= 0) {
+    close(this->inotify_fd);
+  }
+  close(this->root_fd);
+}
+
+bool StaticFileCache::normalize_path(string& out, string_view raw_path) {
+  // Percent-decode the path (+ isn't special in paths)
+  string decoded;
+  decoded.reserve(raw_path.size());
+  for (size_t z = 0; z < raw_path.size(); z++) {
+    char ch = raw_path[z];
+    if (ch == '%') {
+      int high = (z + 2 < raw_path.size()) ? value_for_hex_digit(raw_path[z + 1]) : -1;
+      int low = (high >= 0) ? value_for_hex_digit(raw_path[z + 2]) : -1;
+      if (low < 0) {
+        return false;
+      }
+      ch = static_cast<char>((high << 4) | low);
+      z += 2;
+    }
+    if (ch == '\0') {
+      return false;
+    }
+    decoded.push_back(ch);
+  }
+
+  // Remove empty and . segments, and reject .. segments rather than resolving
+  // them, since no legitimate link needs them
+  out.clear();
+  size_t offset = 0;
+  while (offset <= decoded.size()) {
+    size_t end = decoded.find('/', offset);
+    if (end == string::npos) {
+      end = decoded.size();
+    }
+    string_view segment(decoded.data() + offset, end - offset);
+    if (segment == "..") {
+      return false;
+    }
+    if (!segment.empty() && (segment != ".")) {
+      if (!out.empty()) {
+        out.push_back('/');
+      }
+      out += segment;
+    }
+    offset = end + 1;
+  }
+  return true;
+}
+
+shared_ptr<const StaticFileCache::Entry> StaticFileCache::get(string_view raw_path) {
+  string path;
+  if (!normalize_path(path, raw_path)) {
+    return nullptr;
+  }
+  if (raw_path.empty() || (raw_path.back() == '/')) {
+    if (this->index_filename.empty()) {
+      return nullptr;
+    }
+    if (!path.empty()) {
+      path.push_back('/');
+    }
+    path += this->index_filename;
+  }
+
+  auto it = this->entries.find(path);
+  if (it != this->entries.end()) {
+    if (!this->is_stale(*it->second)) {
+      this->hits++;
+      this->lru.splice(this->lru.begin(), this->lru, it->second->lru_it);
+      return it->second;
+    }
+    this->invalidations++;
+    this->erase(path);
+  }
+
+  // Evict before loading, since evicting an entry can remove an inotify watch
+  // that the new entry shares (if both paths refer to the same file)
+  this->misses++;
+  while (this->entries.size() >= this->max_entries) {
+    this->erase(this->lru.back()->path);
+  }
+  auto entry = this->load(path);
+  if (!entry) {
+    return nullptr;
+  }
+  this->lru.emplace_front(entry.get());
+  entry->lru_it = this->lru.begin();
+  if (entry->watch_descriptor >= 0) {
+    this->watch_descriptor_to_paths[entry->watch_descriptor].emplace_back(path);
+  }
+  this->entries.emplace(path, entry);
+  return entry;
+}
+
+shared_ptr<StaticFileCache::Entry> StaticFileCache::load(const string& path) {
+  auto entry = make_shared<Entry>();
+  entry->path = path;
+
+#ifdef __linux__
+  // The watch is added before the file is opened, so changes made after we
+  // read the file's metadata can't be missed. If the watch can't be added
+  // (e.g. because the inotify watch limit was reached), the entry is checked
+  // with stat() instead; see is_stale().
+  if (this->inotify_fd >= 0) {
+    string full_path = this->root_dir + "/" + path;
+    entry->watch_descriptor = inotify_add_watch(this->inotify_fd, full_path.c_str(),
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+  }
+#endif
+
+  int fd = openat(this->root_fd, path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if ((fd < 0) || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    this->remove_unused_watch(entry->watch_descriptor);
+    return nullptr;
+  }
+
+  entry->size = st.st_size;
+  if (entry->size <= MAX_IN_MEMORY_FILE_SIZE) {
+    entry->data.resize(entry->size);
+    ssize_t bytes_read = pread(fd, entry->data.data(), entry->size, 0);
+    close(fd);
+    if (bytes_read != static_cast<ssize_t>(entry->size)) {
+      this->remove_unused_watch(entry->watch_descriptor);
+      return nullptr;
+    }
+  } else {
+    entry->segment = evbuffer_file_segment_new(fd, 0, entry->size, EVBUF_FS_CLOSE_ON_FREE);
+    if (!entry->segment) {
+      close(fd);
+      this->remove_unused_watch(entry->watch_descriptor);
+      throw runtime_error("evbuffer_file_segment_new");
+    }
+  }
+
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  entry->mtime_secs = st.st_mtim.tv_sec;
+  entry->mtime_nsecs = st.st_mtim.tv_nsec;
+  entry->content_type = content_type_for_filename(path);
+  snprintf(entry->etag, sizeof(entry->etag), "\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "\"",
+      static_cast<uint64_t>(entry->ino), entry->size,
+      static_cast<uint64_t>(entry->mtime_secs) * 1000000000 + entry->mtime_nsecs);
+  struct tm t;
+  gmtime_r(&entry->mtime_secs, &t);
+  evutil_date_rfc1123(entry->last_modified, sizeof(entry->last_modified), &t);
+  entry->load_time_usecs = this->base.gettimeofday_cached64();
+  return entry;
+}
+
+void StaticFileCache::remove_unused_watch(int watch_descriptor) {
+  // If another path shares the watch (e.g. through a hard link), it must be
+  // kept
+  if ((watch_descriptor >= 0) && !this->watch_descriptor_to_paths.count(watch_descriptor)) {
+#ifdef __linux__
+    inotify_rm_watch(this->inotify_fd, watch_descriptor);
+#endif
+  }
+}
+
+bool StaticFileCache::is_stale(Entry& entry) {
+  // Watched entries are removed as soon as their files change
+  if (entry.watch_descriptor >= 0) {
+    return false;
+  }
+  uint64_t now_usecs = this->base.gettimeofday_cached64();
+  if (now_usecs - entry.load_time_usecs < 1000000) {
+    return false;
+  }
+  struct stat st;
+  if (fstatat(this->root_fd, entry.path.c_str(), &st, 0) ||
+      (st.st_dev != entry.dev) ||
+      (st.st_ino != entry.ino) ||
+      (static_cast<uint64_t>(st.st_size) != entry.size) ||
+      (st.st_mtim.tv_sec != entry.mtime_secs) ||
+      (st.st_mtim.tv_nsec != entry.mtime_nsecs)) {
+    return true;
+  }
+  entry.load_time_usecs = now_usecs;
+  return false;
+}
+
+void StaticFileCache::erase(const string& path) {
+  auto it = this->entries.find(path);
+  if (it == this->entries.end()) {
+    return;
+  }
+  auto entry = std::move(it->second);
+  this->entries.erase(it);
+  this->lru.erase(entry->lru_it);
+
+  auto wd_it = this->watch_descriptor_to_paths.find(entry->watch_descriptor);
+  if (wd_it != this->watch_descriptor_to_paths.end()) {
+    auto& paths = wd_it->second;
+    for (size_t z = 0; z < paths.size(); z++) {
+      if (paths[z] == path) {
+        paths[z] = std::move(paths.back());
+        paths.pop_back();
+        break;
+      }
+    }
+    if (paths.empty()) {
+#ifdef __linux__
+      inotify_rm_watch(this->inotify_fd, wd_it->first);
+#endif
+      this->watch_descriptor_to_paths.erase(wd_it);
+    }
+  }
+}
+
+void StaticFileCache::dispatch_on_inotify_event(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<StaticFileCache*>(ctx)->on_inotify_event();
+}
+
+void StaticFileCache::on_inotify_event() {
+#ifdef __linux__
+  alignas(struct inotify_event) char buf[0x1000];
+  for (;;) {
+    ssize_t bytes_read = read(this->inotify_fd, buf, sizeof(buf));
+    if (bytes_read <= 0) {
+      break;
+    }
+    for (ssize_t offset = 0; offset < bytes_read;) {
+      const auto* ev = reinterpret_cast<const struct inotify_event*>(buf + offset);
+      offset += sizeof(struct inotify_event) + ev->len;
+
+      // IN_IGNORED events (sent after a watch is removed) and events for
+      // watches we've already removed refer to watch descriptors that aren't
+      // in the map
+      auto wd_it = this->watch_descriptor_to_paths.find(ev->wd);
+      if (wd_it == this->watch_descriptor_to_paths.end()) {
+        continue;
+      }
+      // erase() removes the watch when its last path is erased, which
+      // invalidates wd_it
+      vector<string> paths = wd_it->second;
+      for (const auto& path : paths) {
+        this->invalidations++;
+        this->erase(path);
+      }
+    }
+  }
+#endif
+}
+
+const char* StaticFileCache::content_type_for_filename(string_view filename) {
+  static const struct {
+    const char* extension;
+    const char* content_type;
+  } content_types[] = {
+      {"html", "text/html; charset=utf-8"},
+      {"htm", "text/html; charset=utf-8"},
+      {"css", "text/css; charset=utf-8"},
+      {"js", "text/javascript; charset=utf-8"},
+      {"mjs", "text/javascript; charset=utf-8"},
+      {"json", "application/json"},
+      {"txt", "text/plain; charset=utf-8"},
+      {"xml", "application/xml"},
+      {"svg", "image/svg+xml"},
+      {"png", "image/png"},
+      {"jpg", "image/jpeg"},
+      {"jpeg", "image/jpeg"},
+      {"gif", "image/gif"},
+      {"webp", "image/webp"},
+      {"ico", "image/x-icon"},
+      {"wasm", "application/wasm"},
+      {"woff", "font/woff"},
+      {"woff2", "font/woff2"},
+      {"pdf", "application/pdf"},
+      {"mp4", "video/mp4"},
+      {"webm", "video/webm"},
+      {"mp3", "audio/mpeg"},
+  };
+
+  size_t dot_offset = filename.rfind('.');
+  size_t slash_offset = filename.rfind('/');
+  if ((dot_offset != string_view::npos) &&
+      ((slash_offset == string_view::npos) || (dot_offset > slash_offset))) {
+    string_view extension = filename.substr(dot_offset + 1);
+    for (const auto& it : content_types) {
+      if ((extension.size() == strlen(it.extension)) &&
+          !strncasecmp(extension.data(), it.extension, extension.size())) {
+        return it.content_type;
+      }
+    }
+  }
+  return "application/octet-stream";
+}
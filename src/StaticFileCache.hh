@@ -0,0 +1,126 @@
+#pragma once
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "EventBase.hh"
+
+// Keeps files under a root directory open, along with the metadata needed to
+// serve them over HTTP. Each file is held as a libevent file segment, which
+// can be added to any number of output buffers at once without copying it;
+// libevent sends it with sendfile when the buffer drains directly to a socket,
+// and maps it into memory otherwise (e.g. for TLS connections).
+//
+// On Linux, cached files are watched with inotify, and an entry is dropped as
+// soon as its file is modified, replaced, or deleted. Elsewhere (and for files
+// that can't be watched, e.g. because the watch limit was reached), entries
+// are checked with stat() when they're more than a second old. This class is not
+// thread-safe; each server (and hence each EventBase thread) should have its
+// own cache.
+class StaticFileCache {
+public:
+  struct Entry {
+    // Path relative to the root directory, after decoding and normalization
+    std::string path;
+    // Small files are read into memory (data) when they're loaded, since
+    // copying them into the output buffer is cheaper than a separate sendfile
+    // call; larger files are referred to by segment. At most one of these is
+    // used.
+    struct evbuffer_file_segment* segment;
+    std::string data;
+    uint64_t size;
+    time_t mtime_secs;
+    const char* content_type;
+    // Strong validator based on the inode, size, and modification time
+    char etag[64];
+    char last_modified[32];
+
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime_nsecs;
+    uint64_t load_time_usecs;
+    // Position in the LRU list
+    std::list<Entry*>::iterator lru_it;
+    int watch_descriptor;
+
+    Entry();
+    Entry(const Entry&) = delete;
+    Entry(Entry&&) = delete;
+    Entry& operator=(const Entry&) = delete;
+    Entry& operator=(Entry&&) = delete;
+    ~Entry();
+  };
+
+  StaticFileCache(EventBase& base, const std::string& root_dir,
+      size_t max_entries = 0x400, const std::string& index_filename = "index.html");
+  StaticFileCache(const StaticFileCache&) = delete;
+  StaticFileCache(StaticFileCache&&) = delete;
+  StaticFileCache& operator=(const StaticFileCache&) = delete;
+  StaticFileCache& operator=(StaticFileCache&&) = delete;
+  ~StaticFileCache();
+
+  // Returns the entry for a file, opening the file if it isn't cached.
+  // raw_path is URL-encoded and relative to the root (as it appears in the
+  // request URI). Paths that would escape the root directory are rejected.
+  // If the path is empty or ends with a slash, the directory's index file is
+  // returned. Returns nullptr if there's no such regular file.
+  std::shared_ptr<const Entry> get(std::string_view raw_path);
+
+  inline size_t size() const {
+    return this->entries.size();
+  }
+  inline uint64_t get_hits() const {
+    return this->hits;
+  }
+  inline uint64_t get_misses() const {
+    return this->misses;
+  }
+  inline uint64_t get_invalidations() const {
+    return this->invalidations;
+  }
+
+  static constexpr size_t MAX_IN_MEMORY_FILE_SIZE = 0x4000;
+
+  // Returns a MIME type based on the filename's extension
+  static const char* content_type_for_filename(std::string_view filename);
+
+private:
+  EventBase base;
+  std::string root_dir;
+  int root_fd;
+  size_t max_entries;
+  std::string index_filename;
+
+  std::unordered_map<std::string, std::shared_ptr<Entry>> entries;
+  // Most recently used entries are at the front
+  std::list<Entry*> lru;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t invalidations;
+
+  // The inotify descriptor and its read event; -1 and null if inotify isn't
+  // available
+  int inotify_fd;
+  struct event* inotify_event;
+  std::unordered_map<int, std::vector<std::string>> watch_descriptor_to_paths;
+
+  static bool normalize_path(std::string& out, std::string_view raw_path);
+  std::shared_ptr<Entry> load(const std::string& path);
+  // Removes a watch added by load() for an entry that couldn't be loaded,
+  // unless a cached entry uses the same watch
+  void remove_unused_watch(int watch_descriptor);
+  bool is_stale(Entry& entry);
+  void erase(const std::string& path);
+
+  static void dispatch_on_inotify_event(evutil_socket_t fd, short what, void* ctx);
+  void on_inotify_event();
+};
@@ -3,7 +3,12 @@
 #include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <event2/listener.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <atomic>
 #include <memory>
@@ -17,7 +22,10 @@
 #include "BufferEvent.hh"
 #include "Event.hh"
 #include "EventBase.hh"
+#include "EventBasePool.hh"
 #include "Listener.hh"
+#include "LoopMonitor.hh"
+#include "TimerWheel.hh"
 
 struct StreamServerClientBase {};
 
@@ -37,24 +45,52 @@ public:
     return fd;
   }
 
+  // In sharded mode, this opens one SO_REUSEPORT socket per shard, so the
+  // kernel distributes incoming connections across the pool's threads. In this
+  // case, the returned fd is the socket belonging to the first shard. If port
+  // is zero, the first shard's socket gets an ephemeral port, and the other
+  // shards' sockets are bound to the same port.
   int listen(const std::string& addr, int port) {
-    int fd = ::listen(addr, port, SOMAXCONN);
-    this->add_socket(fd);
-    return fd;
+    if (this->shards.size() == 1) {
+      int fd = ::listen(addr, port, SOMAXCONN);
+      this->add_socket(fd);
+      return fd;
+    }
+
+    int first_fd = -1;
+    for (size_t z = 0; z < this->shards.size(); z++) {
+      int fd = StreamServer::listen_reuseport(addr, port);
+      this->add_socket(fd, z);
+      if (first_fd < 0) {
+        first_fd = fd;
+        if (port == 0) {
+          port = StreamServer::get_socket_port(fd);
+        }
+      }
+    }
+    return first_fd;
   }
 
   int listen(int port) {
     return this->listen("", port);
   }
 
+  // Adds a listening socket to the first shard. In sharded mode, sockets added
+  // this way will only accept connections on the first pool thread; use
+  // listen(addr, port) or add_socket(fd, shard_index) to spread the load.
   void add_socket(int fd) {
-    if (this->listeners.count(fd)) {
+    this->add_socket(fd, 0);
+  }
+
+  void add_socket(int fd, size_t shard_index) {
+    auto& shard = *this->shards.at(shard_index);
+    if (shard.listeners.count(fd)) {
       return;
     }
     struct evconnlistener* listener = evconnlistener_new(
-        this->base.get(),
+        shard.base.get(),
         StreamServer::dispatch_on_listen_accept,
-        this,
+        &shard,
         LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_EXEC,
         0,
         fd);
@@ -63,18 +99,22 @@ public:
     }
     evconnlistener_set_error_cb(
         listener, StreamServer::dispatch_on_listen_error);
-    auto& l = this->listeners.emplace(fd, listener).first->second;
+    auto& l = shard.listeners.emplace(fd, listener).first->second;
     l.set_owned(true);
   }
 
   void remove_socket(int fd) {
-    this->listeners.erase(fd);
+    for (auto& shard : this->shards) {
+      shard->listeners.erase(fd);
+    }
   }
 
   std::unordered_set<int> all_sockets() const {
     std::unordered_set<int> ret;
-    for (const auto& it : this->listeners) {
-      ret.emplace(it.first);
+    for (const auto& shard : this->shards) {
+      for (const auto& it : shard->listeners) {
+        ret.emplace(it.first);
+      }
     }
     return ret;
   }
@@ -87,26 +127,105 @@ public:
     return this->ssl_ctx != nullptr;
   }
 
-  inline bool socket_count() const {
-    return this->listeners.size();
+  inline size_t socket_count() const {
+    size_t ret = 0;
+    for (const auto& shard : this->shards) {
+      ret += shard->listeners.size();
+    }
+    return ret;
   }
 
+  // In sharded mode, this is only approximate if the pool is running, since
+  // each shard's client map is modified by its own thread.
   inline size_t client_count() const {
-    return this->bev_to_client.size();
+    size_t ret = 0;
+    for (const auto& shard : this->shards) {
+      ret += shard->bev_to_client.size();
+    }
+    return ret;
+  }
+
+  inline size_t shard_count() const {
+    return this->shards.size();
+  }
+
+  // Disconnects clients that don't send any data for the given time. Idle
+  // timers are kept in a TimerWheel per shard (with the given resolution), so
+  // resetting a client's timer on every read is cheap even with many clients.
+  // Connected clients' timers are restarted with the new timeout (and moved to
+  // a new wheel if the resolution changed). Passing zero disables idle
+  // timeouts for all clients. This accesses every shard's clients, so in
+  // sharded mode it should be called before the pool is started.
+  void set_client_idle_timeout(uint64_t usecs, uint64_t resolution_usecs = 100000) {
+    this->client_idle_timeout_usecs = usecs;
+    for (auto& shard : this->shards) {
+      if (usecs && (!shard->idle_timers || (shard->idle_timers->get_resolution_usecs() != resolution_usecs))) {
+        // The old wheel (if any) must outlive the timers scheduled on it, so
+        // they're moved to the new wheel before it's destroyed
+        std::unique_ptr<TimerWheel> idle_timers(new TimerWheel(shard->base, resolution_usecs));
+        for (auto& it : shard->bev_to_client) {
+          idle_timers->schedule(it.second->idle_timer, usecs);
+        }
+        shard->idle_timers = std::move(idle_timers);
+      } else if (shard->idle_timers) {
+        for (auto& it : shard->bev_to_client) {
+          if (usecs) {
+            shard->idle_timers->schedule(it.second->idle_timer, usecs);
+          } else if (it.second->idle_timer.is_scheduled()) {
+            shard->idle_timers->cancel(it.second->idle_timer);
+          }
+        }
+      }
+    }
   }
 
 protected:
+  struct Shard;
+
   struct Client {
     BufferEvent bev;
     std::unique_ptr<ClientStateT> state;
+    // Null for clients created with the single-argument constructor, which
+    // belong to the first shard
+    Shard* shard;
+    TimerWheel::Timer idle_timer;
+
+    explicit Client(BufferEvent&& bev) : bev(std::move(bev)), shard(nullptr) {}
+    Client(BufferEvent&& bev, Shard* shard) : bev(std::move(bev)), shard(shard) {}
+  };
+
+  // Each shard owns its listeners and clients, and is only accessed from the
+  // thread running its EventBase. When not using an EventBasePool, there is
+  // exactly one shard, which uses the base passed to the constructor.
+  struct Shard {
+    StreamServer* server;
+    size_t index;
+    EventBase base;
+    // This must be declared before bev_to_client, so the clients' idle timers
+    // are destroyed before the wheel is
+    std::unique_ptr<TimerWheel> idle_timers;
+    std::unordered_map<int, Listener> listeners;
+    std::unordered_map<struct bufferevent*, std::shared_ptr<Client>> bev_to_client;
 
-    Client(BufferEvent&& bev) : bev(std::move(bev)) {}
+    Shard(StreamServer* server, size_t index, EventBase& base)
+        : server(server),
+          index(index),
+          base(base) {}
   };
 
   EventBase base;
   std::shared_ptr<SSL_CTX> ssl_ctx;
-  std::unordered_map<int, Listener> listeners;
-  std::unordered_map<struct bufferevent*, std::shared_ptr<Client>> bev_to_client;
+  std::vector<std::unique_ptr<Shard>> shards;
+  // The first shard's listeners and clients. These are all of the server's
+  // listeners and clients when it isn't sharded; they're kept for subclasses
+  // written before sharding was added.
+  std::unordered_map<int, Listener>& listeners;
+  std::unordered_map<struct bufferevent*, std::shared_ptr<Client>>& bev_to_client;
+  uint64_t client_idle_timeout_usecs = 0;
+  // Subclasses that override on_client_output must set this in their
+  // constructors. It's off by default so that other servers don't pay for a
+  // callback every time a client's output buffer drains.
+  bool client_output_callback_enabled = false;
   PrefixedLogger log;
 
   explicit StreamServer(
@@ -115,13 +234,100 @@ protected:
       const char* log_prefix = "[StreamServer] ")
       : base(base),
         ssl_ctx(ssl_ctx),
+        shards(StreamServer::make_shards(this, base)),
+        listeners(this->shards[0]->listeners),
+        bev_to_client(this->shards[0]->bev_to_client),
         log(log_prefix) {}
 
+  // Creates a sharded server with one shard per base in the pool. All of the
+  // virtual on_client_* functions may then be called concurrently from the
+  // pool's threads (but calls for any single client always happen on the same
+  // thread), so subclasses must synchronize access to any state they share
+  // between clients.
+  explicit StreamServer(
+      EventBasePool& pool,
+      std::shared_ptr<SSL_CTX> ssl_ctx = nullptr,
+      const char* log_prefix = "[StreamServer] ")
+      : base(pool.get(0)),
+        ssl_ctx(ssl_ctx),
+        shards(StreamServer::make_shards(this, pool)),
+        listeners(this->shards[0]->listeners),
+        bev_to_client(this->shards[0]->bev_to_client),
+        log(log_prefix) {}
+
+  static std::vector<std::unique_ptr<Shard>> make_shards(
+      StreamServer* server, EventBase& base) {
+    std::vector<std::unique_ptr<Shard>> ret;
+    ret.emplace_back(new Shard(server, 0, base));
+    return ret;
+  }
+
+  static std::vector<std::unique_ptr<Shard>> make_shards(
+      StreamServer* server, EventBasePool& pool) {
+    std::vector<std::unique_ptr<Shard>> ret;
+    for (size_t z = 0; z < pool.size(); z++) {
+      ret.emplace_back(new Shard(server, z, pool.get(z)));
+    }
+    return ret;
+  }
+
+  static int get_socket_port(int fd) {
+    struct sockaddr_storage ss;
+    socklen_t ss_len = sizeof(ss);
+    if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&ss), &ss_len)) {
+      throw std::runtime_error(std::string("can\'t get socket address: ") + strerror(errno));
+    }
+    if (ss.ss_family == AF_INET) {
+      return ntohs(reinterpret_cast<const struct sockaddr_in*>(&ss)->sin_port);
+    } else if (ss.ss_family == AF_INET6) {
+      return ntohs(reinterpret_cast<const struct sockaddr_in6*>(&ss)->sin6_port);
+    }
+    throw std::runtime_error("listening socket is not an IP socket");
+  }
+
+  static int listen_reuseport(const std::string& addr, int port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    std::string port_str = std::to_string(port);
+    struct addrinfo* res = nullptr;
+    int gai_ret = getaddrinfo(addr.empty() ? nullptr : addr.c_str(),
+        port_str.c_str(), &hints, &res);
+    if (gai_ret) {
+      throw std::runtime_error(std::string("can\'t resolve listen address: ") + gai_strerror(gai_ret));
+    }
+    std::unique_ptr<struct addrinfo, void (*)(struct addrinfo*)> res_unique(res, freeaddrinfo);
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+      throw std::runtime_error("can\'t create socket");
+    }
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) ||
+        bind(fd, res->ai_addr, res->ai_addrlen) ||
+        ::listen(fd, SOMAXCONN) ||
+        evutil_make_socket_nonblocking(fd)) {
+      int err = errno;
+      close(fd);
+      throw std::runtime_error(std::string("can\'t listen on socket: ") + strerror(err));
+    }
+    return fd;
+  }
+
   void disconnect_client(std::shared_ptr<Client> c) {
-    auto it = this->bev_to_client.find(c->bev.get());
-    if (it != this->bev_to_client.end()) {
+    Shard* shard = c->shard ? c->shard : this->shards[0].get();
+    // The client may outlive its entry in bev_to_client (if the caller holds
+    // a reference), so its timer must not fire after it's disconnected
+    if (c->idle_timer.is_scheduled()) {
+      shard->idle_timers->cancel(c->idle_timer);
+    }
+    auto it = shard->bev_to_client.find(c->bev.get());
+    if (it != shard->bev_to_client.end()) {
       this->on_client_disconnect(c);
-      this->bev_to_client.erase(it);
+      shard->bev_to_client.erase(it);
     }
   }
 
@@ -131,22 +337,34 @@ protected:
       struct sockaddr*,
       int,
       void* ctx) {
-    StreamServer* s = reinterpret_cast<StreamServer*>(ctx);
+    Shard* shard = reinterpret_cast<Shard*>(ctx);
+    StreamServer* s = shard->server;
 
-    BufferEvent bev(s->base, fd, BEV_OPT_CLOSE_ON_FREE, s->ssl_ctx.get());
+    BufferEvent bev(shard->base, fd, BEV_OPT_CLOSE_ON_FREE, s->ssl_ctx.get());
     bufferevent* bev_ptr = bev.get();
     bufferevent_setcb(
         bev_ptr,
         &StreamServer::dispatch_on_client_input,
-        nullptr,
+        s->client_output_callback_enabled ? &StreamServer::dispatch_on_client_output : nullptr,
         &StreamServer::dispatch_on_client_error,
-        s);
+        shard);
     bufferevent_enable(bev_ptr, EV_READ | EV_WRITE);
 
     try {
-      shared_ptr<Client> c(new Client(std::move(bev)));
+      std::shared_ptr<Client> c(new Client(std::move(bev), shard));
+      // The callback is set even if idle timeouts are disabled, since they
+      // may be enabled while the client is connected
+      c->idle_timer.set_callback([shard, bev_ptr]() {
+        auto it = shard->bev_to_client.find(bev_ptr);
+        if (it != shard->bev_to_client.end()) {
+          shard->server->on_client_idle_timeout(it->second);
+        }
+      });
+      if (s->client_idle_timeout_usecs) {
+        shard->idle_timers->schedule(c->idle_timer, s->client_idle_timeout_usecs);
+      }
       s->on_client_connect(c);
-      s->bev_to_client.emplace(bev_ptr, std::move(c));
+      shard->bev_to_client.emplace(bev_ptr, std::move(c));
     } catch (const std::exception& e) {
       s->log.error("Error handling client connection: %s", e.what());
     }
@@ -154,7 +372,7 @@ protected:
 
   static void dispatch_on_listen_error(
       struct evconnlistener* listener, void* ctx) {
-    StreamServer* s = reinterpret_cast<StreamServer*>(ctx);
+    StreamServer* s = reinterpret_cast<Shard*>(ctx)->server;
     int err = EVUTIL_SOCKET_ERROR();
     s->log.error("Failure on listening socket %d: %d (%s)",
         evconnlistener_get_fd(listener),
@@ -164,14 +382,21 @@ protected:
 
   static void dispatch_on_client_input(
       struct bufferevent* bev, void* ctx) {
-    StreamServer* s = reinterpret_cast<StreamServer*>(ctx);
+    LoopMonitor::CallbackScope scope(LoopMonitor::Trampoline::STREAMSERVER_CLIENT_INPUT);
+    Shard* shard = reinterpret_cast<Shard*>(ctx);
+    StreamServer* s = shard->server;
     std::shared_ptr<Client> c;
     try {
-      c = s->bev_to_client.at(bev);
+      c = shard->bev_to_client.at(bev);
     } catch (const std::out_of_range&) {
       bufferevent_free(bev);
     }
     if (c) {
+      // The timer isn't necessarily scheduled here: on_client_idle_timeout may
+      // have kept the client after its timer fired
+      if (s->client_idle_timeout_usecs) {
+        shard->idle_timers->schedule(c->idle_timer, s->client_idle_timeout_usecs);
+      }
       try {
         s->on_client_input(c);
       } catch (const std::exception& e) {
@@ -181,12 +406,29 @@ protected:
     }
   }
 
+  static void dispatch_on_client_output(
+      struct bufferevent* bev, void* ctx) {
+    Shard* shard = reinterpret_cast<Shard*>(ctx);
+    StreamServer* s = shard->server;
+    auto it = shard->bev_to_client.find(bev);
+    if (it != shard->bev_to_client.end()) {
+      std::shared_ptr<Client> c = it->second;
+      try {
+        s->on_client_output(c);
+      } catch (const std::exception& e) {
+        s->log.error("Error handling client output: %s", e.what());
+        s->disconnect_client(c);
+      }
+    }
+  }
+
   static void dispatch_on_client_error(
       struct bufferevent* bev, short events, void* ctx) {
-    StreamServer* s = reinterpret_cast<StreamServer*>(ctx);
+    Shard* shard = reinterpret_cast<Shard*>(ctx);
+    StreamServer* s = shard->server;
     std::shared_ptr<Client> c;
     try {
-      c = s->bev_to_client.at(bev);
+      c = shard->bev_to_client.at(bev);
     } catch (const std::out_of_range&) {
       bufferevent_free(bev);
     }
@@ -205,4 +447,14 @@ protected:
   virtual void on_client_connect(std::shared_ptr<Client>) {}
   virtual void on_client_input(std::shared_ptr<Client>) = 0;
   virtual void on_client_disconnect(std::shared_ptr<Client>) {}
+  // Called when a client's output buffer has been drained. This is only called
+  // if client_output_callback_enabled was set before the client connected.
+  virtual void on_client_output(std::shared_ptr<Client>) {}
+
+  // Called when a client hasn't sent any data within the idle timeout. The
+  // default behavior is to disconnect the client. If an override doesn't, the
+  // client's timer starts again the next time it sends data.
+  virtual void on_client_idle_timeout(std::shared_ptr<Client> c) {
+    this->disconnect_client(c);
+  }
 };
@@ -0,0 +1,179 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AwaitableBufferEvent.hh"
+#include "CoroutineStreamServer.hh"
+#include "EventBasePool.hh"
+#include "StreamServer.hh"
+
+using namespace std;
+
+static constexpr size_t NUM_CLIENT_THREADS = 4;
+static constexpr size_t CONNECTIONS_PER_CLIENT_THREAD = 16;
+static constexpr size_t MESSAGE_SIZE = 64;
+static constexpr uint64_t DURATION_USECS = 2000000;
+
+class CallbackEchoServer : public StreamServer<> {
+public:
+  explicit CallbackEchoServer(EventBasePool& pool) : StreamServer(pool) {}
+  virtual ~CallbackEchoServer() = default;
+
+protected:
+  virtual void on_client_input(shared_ptr<Client> c) {
+    EvBuffer input = c->bev.get_input();
+    c->bev.get_output().add_buffer(input);
+  }
+};
+
+class CoroutineEchoServer : public CoroutineStreamServer {
+public:
+  explicit CoroutineEchoServer(EventBasePool& pool) : CoroutineStreamServer(pool) {}
+  virtual ~CoroutineEchoServer() = default;
+
+protected:
+  virtual task<> handle_connection(AwaitableBufferEvent& abev) {
+    for (;;) {
+      co_await abev.await_bytes_available(1);
+      EvBuffer input = abev.get_input();
+      abev.get_output().add_buffer(input);
+    }
+  }
+};
+
+static int get_port(int fd) {
+  struct sockaddr_in sin;
+  socklen_t sin_len = sizeof(sin);
+  if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&sin), &sin_len)) {
+    throw runtime_error("getsockname");
+  }
+  return ntohs(sin.sin_port);
+}
+
+static void read_all(int fd, void* data, size_t size) {
+  uint8_t* ptr = reinterpret_cast<uint8_t*>(data);
+  while (size) {
+    ssize_t bytes_read = read(fd, ptr, size);
+    if (bytes_read <= 0) {
+      throw runtime_error("connection closed by server");
+    }
+    ptr += bytes_read;
+    size -= bytes_read;
+  }
+}
+
+// Each client thread keeps one message in flight on each of its connections,
+// and returns the number of round trips completed in DURATION_USECS
+static uint64_t run_echo_clients(int port) {
+  atomic<uint64_t> num_round_trips(0);
+  vector<thread> threads;
+  for (size_t z = 0; z < NUM_CLIENT_THREADS; z++) {
+    threads.emplace_back([&]() -> void {
+      vector<int> fds;
+      for (size_t x = 0; x < CONNECTIONS_PER_CLIENT_THREAD; x++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in sin = {};
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, reinterpret_cast<struct sockaddr*>(&sin), sizeof(sin))) {
+          throw runtime_error("connect");
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fds.emplace_back(fd);
+      }
+
+      char message[MESSAGE_SIZE];
+      memset(message, 'x', sizeof(message));
+      char response[MESSAGE_SIZE];
+      uint64_t local_round_trips = 0;
+      auto end = chrono::steady_clock::now() + chrono::microseconds(DURATION_USECS);
+      while (chrono::steady_clock::now() < end) {
+        for (int fd : fds) {
+          if (write(fd, message, sizeof(message)) != sizeof(message)) {
+            throw runtime_error("write");
+          }
+        }
+        for (int fd : fds) {
+          read_all(fd, response, sizeof(response));
+        }
+        local_round_trips += fds.size();
+      }
+      for (int fd : fds) {
+        close(fd);
+      }
+      num_round_trips += local_round_trips;
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  return num_round_trips.load();
+}
+
+template <typename ServerT>
+static double run_echo_benchmark(size_t num_server_threads) {
+  EventBasePool pool(num_server_threads);
+  ServerT server(pool);
+  int port = get_port(server.listen("127.0.0.1", 0));
+  pool.start();
+  uint64_t num_round_trips = run_echo_clients(port);
+  pool.stop();
+  return num_round_trips * 1000000.0 / DURATION_USECS;
+}
+
+static void benchmark_echo_scaling() {
+  size_t max_threads = max<size_t>(thread::hardware_concurrency(), 1);
+  for (size_t num_threads = 1;; num_threads *= 2) {
+    num_threads = min(num_threads, max_threads);
+    double rate = run_echo_benchmark<CallbackEchoServer>(num_threads);
+    printf("%3zu server threads: %9.0f round trips/s\n", num_threads, rate);
+    if (num_threads == max_threads) {
+      break;
+    }
+  }
+}
+
+static void benchmark_echo_coroutine() {
+  double callback_rate = run_echo_benchmark<CallbackEchoServer>(1);
+  double coroutine_rate = run_echo_benchmark<CoroutineEchoServer>(1);
+  printf("callback echo:  %9.0f round trips/s\n", callback_rate);
+  printf("coroutine echo: %9.0f round trips/s\n", coroutine_rate);
+}
+
+static const struct {
+  const char* name;
+  void (*fn)();
+} benchmarks[] = {
+    {"echo-scaling", benchmark_echo_scaling},
+    {"echo-coroutine", benchmark_echo_coroutine},
+};
+
+int main(int argc, char** argv) {
+  bool found = false;
+  for (const auto& b : benchmarks) {
+    if ((argc < 2) || !strcmp(argv[1], b.name)) {
+      printf("-- %s\n", b.name);
+      b.fn();
+      found = true;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+// Coroutine frames are allocated from per-thread free lists, bucketed by size.
+// In a server where each connection runs a coroutine, this means that after
+// warmup, starting a connection's coroutine doesn't call malloc. Frames freed
+// on a different thread than the one that allocated them simply move to the
+// freeing thread's list.
+class CoroutineFramePool {
+public:
+  static inline void* allocate(size_t size) {
+    size_t index = CoroutineFramePool::index_for_size(size);
+    if (index >= NUM_CLASSES) {
+      return ::operator new(size);
+    }
+    auto& fl = CoroutineFramePool::free_lists()[index];
+    if (fl.head) {
+      FreeBlock* block = fl.head;
+      fl.head = block->next;
+      fl.count--;
+      return block;
+    }
+    return ::operator new((index + 1) * GRANULARITY);
+  }
+
+  static inline void free(void* ptr, size_t size) {
+    size_t index = CoroutineFramePool::index_for_size(size);
+    if (index >= NUM_CLASSES) {
+      ::operator delete(ptr);
+      return;
+    }
+    auto& fl = CoroutineFramePool::free_lists()[index];
+    if (fl.count >= MAX_FREE_PER_CLASS) {
+      ::operator delete(ptr);
+      return;
+    }
+    FreeBlock* block = reinterpret_cast<FreeBlock*>(ptr);
+    block->next = fl.head;
+    fl.head = block;
+    fl.count++;
+  }
+
+private:
+  static constexpr size_t GRANULARITY = 64;
+  static constexpr size_t NUM_CLASSES = 64; // Frames up to 4KB are pooled
+  static constexpr size_t MAX_FREE_PER_CLASS = 1024;
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  struct FreeList {
+    FreeBlock* head = nullptr;
+    size_t count = 0;
+
+    ~FreeList() {
+      while (this->head) {
+        FreeBlock* next = this->head->next;
+        ::operator delete(this->head);
+        this->head = next;
+      }
+    }
+  };
+
+  static inline size_t index_for_size(size_t size) {
+    return (size + GRANULARITY - 1) / GRANULARITY - 1;
+  }
+
+  static inline FreeList* free_lists() {
+    static thread_local FreeList lists[NUM_CLASSES];
+    return lists;
+  }
+};
+
+template <typename T = void>
+class task;
+
+// Called when a top-level task (one that isn't being awaited by another
+// coroutine) finishes, either by returning or by throwing. The callback is
+// responsible for destroying the coroutine (either directly or by destroying
+// the task object that owns it).
+using TaskCompletionCallback = void (*)(void* ctx, std::coroutine_handle<> h, std::exception_ptr exc);
+
+class TaskPromiseBase {
+public:
+  struct FinalAwaiter {
+    bool await_ready() noexcept {
+      return false;
+    }
+
+    template <typename PromiseT>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<PromiseT> h) noexcept {
+      TaskPromiseBase& p = h.promise();
+      if (p.continuation) {
+        return p.continuation;
+      }
+      if (p.on_complete) {
+        p.on_complete(p.on_complete_ctx, h, p.exception);
+      }
+      return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept {
+    return {};
+  }
+
+  FinalAwaiter final_suspend() noexcept {
+    return {};
+  }
+
+  void unhandled_exception() noexcept {
+    this->exception = std::current_exception();
+  }
+
+  static void* operator new(size_t size) {
+    return CoroutineFramePool::allocate(size);
+  }
+
+  static void operator delete(void* ptr, size_t size) {
+    CoroutineFramePool::free(ptr, size);
+  }
+
+  std::coroutine_handle<> continuation;
+  std::exception_ptr exception;
+  TaskCompletionCallback on_complete = nullptr;
+  void* on_complete_ctx = nullptr;
+};
+
+template <typename T>
+class TaskPromise : public TaskPromiseBase {
+public:
+  task<T> get_return_object() noexcept;
+
+  template <typename ValueT>
+  void return_value(ValueT&& value) {
+    this->value.emplace(std::forward<ValueT>(value));
+  }
+
+  T result() {
+    if (this->exception) {
+      std::rethrow_exception(this->exception);
+    }
+    return std::move(*this->value);
+  }
+
+  std::optional<T> value;
+};
+
+template <>
+class TaskPromise<void> : public TaskPromiseBase {
+public:
+  task<void> get_return_object() noexcept;
+
+  void return_void() noexcept {}
+
+  void result() {
+    if (this->exception) {
+      std::rethrow_exception(this->exception);
+    }
+  }
+};
+
+// A lazily-started coroutine. Awaiting a task starts it and suspends the
+// awaiting coroutine until the task finishes; the task's result (or exception)
+// is returned from the co_await expression. Top-level tasks are started with
+// start() instead, usually via CoroutineExecutor::spawn. Destroying a task
+// destroys its coroutine frame, which must not be running at the time (but it
+// may be suspended).
+template <typename T>
+class task {
+public:
+  using promise_type = TaskPromise<T>;
+
+  task() noexcept = default;
+  explicit task(std::coroutine_handle<promise_type> h) noexcept : h(h) {}
+  task(const task&) = delete;
+  task& operator=(const task&) = delete;
+  task(task&& other) noexcept : h(std::exchange(other.h, nullptr)) {}
+  task& operator=(task&& other) noexcept {
+    if (this != &other) {
+      if (this->h) {
+        this->h.destroy();
+      }
+      this->h = std::exchange(other.h, nullptr);
+    }
+    return *this;
+  }
+  ~task() {
+    if (this->h) {
+      this->h.destroy();
+    }
+  }
+
+  inline bool valid() const {
+    return static_cast<bool>(this->h);
+  }
+
+  inline bool done() const {
+    return !this->h || this->h.done();
+  }
+
+  // Starts a top-level task. on_complete is called when the task finishes; see
+  // the comments on TaskCompletionCallback.
+  void start(TaskCompletionCallback on_complete = nullptr, void* ctx = nullptr) {
+    if (!this->h) {
+      throw std::logic_error("cannot start an empty task");
+    }
+    this->h.promise().on_complete = on_complete;
+    this->h.promise().on_complete_ctx = ctx;
+    this->h.resume();
+  }
+
+  // Gives up ownership of the coroutine frame
+  std::coroutine_handle<promise_type> release() noexcept {
+    return std::exchange(this->h, nullptr);
+  }
+
+  auto operator co_await() && noexcept {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> h;
+
+      bool await_ready() noexcept {
+        return !this->h || this->h.done();
+      }
+
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        this->h.promise().continuation = awaiting;
+        return this->h;
+      }
+
+      T await_resume() {
+        if (!this->h) {
+          throw std::logic_error("cannot await an empty task");
+        }
+        return this->h.promise().result();
+      }
+    };
+    return Awaiter{this->h};
+  }
+
+private:
+  std::coroutine_handle<promise_type> h;
+};
+
+template <typename T>
+task<T> TaskPromise<T>::get_return_object() noexcept {
+  return task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline task<void> TaskPromise<void>::get_return_object() noexcept {
+  return task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
@@ -0,0 +1,199 @@
+#include "TimerWheel.hh"
+
+#include <stdexcept>
+
+using namespace std;
+
+TimerWheel::Timer::Timer()
+    : wheel(nullptr),
+      prev(nullptr),
+      next(nullptr),
+      slot(0),
+      expire_tick(0) {}
+
+TimerWheel::Timer::Timer(InlineFunction<void()> fn)
+    : wheel(nullptr),
+      prev(nullptr),
+      next(nullptr),
+      slot(0),
+      expire_tick(0),
+      fn(std::move(fn)) {}
+
+TimerWheel::Timer::~Timer() {
+  if (this->wheel) {
+    this->wheel->cancel(*this);
+  }
+}
+
+void TimerWheel::Timer::set_callback(InlineFunction<void()> fn) {
+  this->fn = std::move(fn);
+}
+
+TimerWheel::TickEvent::TickEvent(TimerWheel* wheel, EventBase& base, uint64_t usecs)
+    : TimeoutEvent(base, usecs, true),
+      wheel(wheel) {}
+
+void TimerWheel::TickEvent::on_trigger(evutil_socket_t, short) {
+  this->wheel->on_tick();
+}
+
+TimerWheel::TimerWheel(
+    EventBase& base,
+    uint64_t resolution_usecs,
+    size_t slot_bits,
+    size_t num_levels)
+    : base(base),
+      resolution_usecs(resolution_usecs),
+      slot_bits(slot_bits),
+      num_levels(num_levels),
+      slot_mask((1ULL << slot_bits) - 1),
+      start_usecs(this->base.gettimeofday_cached64()),
+      current_tick(0),
+      num_timers(0),
+      slots(num_levels << slot_bits, nullptr),
+      tick_event(this, this->base, resolution_usecs) {
+  if (resolution_usecs == 0) {
+    throw invalid_argument("timer wheel resolution must be nonzero");
+  }
+  if ((slot_bits == 0) || (num_levels == 0) || (slot_bits * num_levels > 63)) {
+    throw invalid_argument("invalid timer wheel dimensions");
+  }
+}
+
+TimerWheel::~TimerWheel() {
+  // Detach any remaining timers so their destructors don't refer to this wheel
+  for (Timer* head : this->slots) {
+    while (head) {
+      Timer* next = head->next;
+      head->wheel = nullptr;
+      head->prev = nullptr;
+      head->next = nullptr;
+      head = next;
+    }
+  }
+}
+
+uint64_t TimerWheel::elapsed_usecs() {
+  // The cached time comes from a coarse clock, so it can be slightly earlier
+  // than start_usecs if the wheel was created outside of the event loop
+  uint64_t now_usecs = this->base.gettimeofday_cached64();
+  return (now_usecs > this->start_usecs) ? (now_usecs - this->start_usecs) : 0;
+}
+
+uint64_t TimerWheel::now_tick() {
+  return this->elapsed_usecs() / this->resolution_usecs;
+}
+
+void TimerWheel::schedule(Timer& t, uint64_t usecs) {
+  if (t.wheel) {
+    t.wheel->cancel(t);
+  }
+
+  if (this->num_timers == 0) {
+    // Nothing was scheduled, so no ticks need to be processed to catch up
+    this->current_tick = max<uint64_t>(this->current_tick, this->now_tick());
+    this->tick_event.add();
+  }
+
+  // Round up, so the timer never fires early
+  uint64_t expire_usecs = this->elapsed_usecs() + usecs;
+  uint64_t expire_tick = (expire_usecs + this->resolution_usecs - 1) / this->resolution_usecs;
+  t.expire_tick = max<uint64_t>(expire_tick, this->current_tick + 1);
+  t.wheel = this;
+  this->link(t);
+  this->num_timers++;
+}
+
+void TimerWheel::cancel(Timer& t) {
+  if (t.wheel != this) {
+    if (t.wheel) {
+      throw logic_error("timer is scheduled on a different wheel");
+    }
+    return;
+  }
+  this->unlink(t);
+  t.wheel = nullptr;
+  this->num_timers--;
+}
+
+void TimerWheel::link(Timer& t) {
+  uint64_t delta = (t.expire_tick > this->current_tick) ? (t.expire_tick - this->current_tick) : 0;
+  size_t level = 0;
+  for (; level < this->num_levels - 1; level++) {
+    if (delta < (1ULL << (this->slot_bits * (level + 1)))) {
+      break;
+    }
+  }
+  // Timers beyond the end of the wheel's range go at the end of the top level
+  uint64_t max_delta = (1ULL << (this->slot_bits * this->num_levels)) - 1;
+  if (delta > max_delta) {
+    t.expire_tick = this->current_tick + max_delta;
+  }
+
+  size_t index = (t.expire_tick >> (this->slot_bits * level)) & this->slot_mask;
+  t.slot = (level << this->slot_bits) | index;
+  Timer*& head = this->slots[t.slot];
+  t.prev = nullptr;
+  t.next = head;
+  if (head) {
+    head->prev = &t;
+  }
+  head = &t;
+}
+
+void TimerWheel::unlink(Timer& t) {
+  if (t.prev) {
+    t.prev->next = t.next;
+  } else {
+    this->slots[t.slot] = t.next;
+  }
+  if (t.next) {
+    t.next->prev = t.prev;
+  }
+  t.prev = nullptr;
+  t.next = nullptr;
+}
+
+void TimerWheel::advance_one_tick() {
+  this->current_tick++;
+
+  // When a level's index wraps around to zero, the next slot in the level
+  // above it is due; move its timers down to the lower levels. Timers moved
+  // down from level N always go into a level below N, so this never moves a
+  // timer into the slot being emptied.
+  for (size_t level = 1; level < this->num_levels; level++) {
+    if ((this->current_tick >> (this->slot_bits * (level - 1))) & this->slot_mask) {
+      break;
+    }
+    size_t index = (this->current_tick >> (this->slot_bits * level)) & this->slot_mask;
+    Timer*& head = this->slots[(level << this->slot_bits) | index];
+    while (head) {
+      Timer* t = head;
+      this->unlink(*t);
+      this->link(*t);
+    }
+  }
+
+  Timer*& head = this->slots[this->current_tick & this->slot_mask];
+  while (head) {
+    Timer* t = head;
+    this->unlink(*t);
+    t->wheel = nullptr;
+    this->num_timers--;
+    // The callback may destroy the timer, so we can't touch it afterward
+    if (t->fn) {
+      t->fn();
+    }
+  }
+}
+
+void TimerWheel::on_tick() {
+  uint64_t target_tick = this->now_tick();
+  while ((this->current_tick < target_tick) && (this->num_timers > 0)) {
+    this->advance_one_tick();
+  }
+  if (this->num_timers == 0) {
+    this->current_tick = max<uint64_t>(this->current_tick, target_tick);
+    this->tick_event.del();
+  }
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <event2/event.h>
+
+#include <memory>
+#include <vector>
+
+#include "Event.hh"
+#include "EventBase.hh"
+#include "InlineFunction.hh"
+
+// A hierarchical timer wheel for large numbers of coarse timers (e.g. one idle
+// timeout per connection). Scheduling, rescheduling, and cancelling a timer are
+// all O(1), and the whole wheel is driven by a single persistent timeout event
+// which fires once per resolution interval while any timers are scheduled.
+// Timers never fire earlier than requested (according to the base's cached
+// time), and usually fire within a few resolution intervals after that.
+//
+// There are num_levels levels of 2^slot_bits slots each; level N has a
+// granularity of 2^(slot_bits * N) ticks. Timers scheduled further in the
+// future than the wheel's range are clamped to the end of the range. With the
+// defaults (10ms resolution, 8 bits, 4 levels) the range is about 497 days.
+//
+// A TimerWheel is bound to one EventBase and must only be used from that
+// base's thread.
+
+class TimerWheel {
+public:
+  class Timer {
+  public:
+    Timer();
+    explicit Timer(InlineFunction<void()> fn);
+    Timer(const Timer&) = delete;
+    Timer(Timer&&) = delete;
+    Timer& operator=(const Timer&) = delete;
+    Timer& operator=(Timer&&) = delete;
+    ~Timer();
+
+    // The callback may reschedule, cancel, or destroy the timer.
+    void set_callback(InlineFunction<void()> fn);
+
+    inline bool is_scheduled() const {
+      return this->wheel != nullptr;
+    }
+
+  protected:
+    friend class TimerWheel;
+
+    TimerWheel* wheel;
+    Timer* prev;
+    Timer* next;
+    size_t slot;
+    uint64_t expire_tick;
+    InlineFunction<void()> fn;
+  };
+
+  explicit TimerWheel(
+      EventBase& base,
+      uint64_t resolution_usecs = 10000,
+      size_t slot_bits = 8,
+      size_t num_levels = 4);
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel(TimerWheel&&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+  TimerWheel& operator=(TimerWheel&&) = delete;
+  ~TimerWheel();
+
+  // Schedules the timer to fire after usecs. If the timer is already
+  // scheduled (on this wheel or another), it's rescheduled.
+  void schedule(Timer& t, uint64_t usecs);
+  void cancel(Timer& t);
+
+  inline size_t size() const {
+    return this->num_timers;
+  }
+
+  inline uint64_t get_resolution_usecs() const {
+    return this->resolution_usecs;
+  }
+
+protected:
+  class TickEvent : public TimeoutEvent {
+  public:
+    TickEvent(TimerWheel* wheel, EventBase& base, uint64_t usecs);
+    virtual ~TickEvent() = default;
+
+  protected:
+    virtual void on_trigger(evutil_socket_t fd, short what);
+
+    TimerWheel* wheel;
+  };
+
+  uint64_t elapsed_usecs();
+  uint64_t now_tick();
+  void link(Timer& t);
+  void unlink(Timer& t);
+  void advance_one_tick();
+  void on_tick();
+
+  EventBase base;
+  uint64_t resolution_usecs;
+  size_t slot_bits;
+  size_t num_levels;
+  uint64_t slot_mask;
+  uint64_t start_usecs;
+  uint64_t current_tick;
+  size_t num_timers;
+  std::vector<Timer*> slots; // [level << slot_bits | index]
+  TickEvent tick_event;
+};
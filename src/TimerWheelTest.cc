@@ -0,0 +1,120 @@
+#include <stdio.h>
+
+#include <memory>
+#include <phosg/UnitTest.hh>
+#include <stdexcept>
+#include <vector>
+
+#include "EventBase.hh"
+#include "TimerWheel.hh"
+
+using namespace std;
+
+// Times are measured with the base's cached time, since that's what the wheel
+// uses (and it may lag the real time by a few milliseconds)
+struct FiredTimer {
+  size_t index;
+  uint64_t usecs;
+};
+
+static void test_cascading() {
+  fprintf(stderr, "-- timers on upper levels cascade down and fire in order\n");
+  // With 2-bit slots, level 0 covers 4 ticks and level 1 covers 16, so most of
+  // these timers start on an upper level and have to be moved down (in some
+  // cases twice) before they fire
+  EventBase base;
+  TimerWheel wheel(base, 1000, 2, 3);
+  vector<uint64_t> delays;
+  for (uint64_t delay = 1000; delay < 60000; delay += 2500) {
+    delays.emplace_back(delay);
+  }
+
+  vector<FiredTimer> fired;
+  vector<unique_ptr<TimerWheel::Timer>> timers;
+  uint64_t start_usecs = base.gettimeofday_cached64();
+  for (size_t z = 0; z < delays.size(); z++) {
+    timers.emplace_back(new TimerWheel::Timer([&base, &fired, z]() -> void {
+      fired.emplace_back(FiredTimer{z, base.gettimeofday_cached64()});
+    }));
+    wheel.schedule(*timers.back(), delays[z]);
+  }
+  expect_eq(wheel.size(), delays.size());
+
+  while (fired.size() < delays.size()) {
+    base.loop(EVLOOP_ONCE);
+  }
+  expect_eq(wheel.size(), 0u);
+  for (size_t z = 0; z < fired.size(); z++) {
+    expect_eq(fired[z].index, z);
+    expect(fired[z].usecs - start_usecs >= delays[z]);
+  }
+}
+
+static void test_schedule_during_callback() {
+  fprintf(stderr, "-- timers scheduled from a callback cascade from the current tick\n");
+  // The second batch is scheduled when the wheel's current tick isn't aligned
+  // to any level, so its timers wrap around the lower levels' slots
+  EventBase base;
+  TimerWheel wheel(base, 1000, 2, 3);
+  vector<FiredTimer> fired;
+  vector<unique_ptr<TimerWheel::Timer>> timers;
+  for (size_t z = 0; z < 8; z++) {
+    timers.emplace_back(new TimerWheel::Timer([&base, &fired, z]() -> void {
+      fired.emplace_back(FiredTimer{z, base.gettimeofday_cached64()});
+    }));
+  }
+  uint64_t second_batch_usecs = 0;
+  TimerWheel::Timer trigger([&]() -> void {
+    second_batch_usecs = base.gettimeofday_cached64();
+    for (size_t z = 0; z < timers.size(); z++) {
+      wheel.schedule(*timers[z], 3000 + z * 5000);
+    }
+  });
+  wheel.schedule(trigger, 7000);
+
+  while (fired.size() < timers.size()) {
+    base.loop(EVLOOP_ONCE);
+  }
+  for (size_t z = 0; z < fired.size(); z++) {
+    expect_eq(fired[z].index, z);
+    expect(fired[z].usecs - second_batch_usecs >= 3000 + z * 5000);
+  }
+}
+
+static void test_clamping_and_moving() {
+  fprintf(stderr, "-- timers beyond the wheel's range are clamped to its end\n");
+  EventBase base;
+  TimerWheel wheel(base, 1000, 2, 3);
+  bool fired = false;
+  TimerWheel::Timer t([&fired]() -> void { fired = true; });
+  // The range is 63 ticks, so this fires after about 63ms instead of 1 hour
+  uint64_t start_usecs = base.gettimeofday_cached64();
+  wheel.schedule(t, 3600000000);
+  while (!fired) {
+    base.loop(EVLOOP_ONCE);
+  }
+  expect(base.gettimeofday_cached64() - start_usecs < 1000000);
+
+  fprintf(stderr, "-- scheduling a timer on another wheel moves it there\n");
+  TimerWheel other_wheel(base, 2000);
+  wheel.schedule(t, 1000000);
+  other_wheel.schedule(t, 1000000);
+  expect_eq(wheel.size(), 0u);
+  expect_eq(other_wheel.size(), 1u);
+  try {
+    wheel.cancel(t);
+    expect(false);
+  } catch (const logic_error&) {
+  }
+  other_wheel.cancel(t);
+  expect(!t.is_scheduled());
+  expect_eq(other_wheel.size(), 0u);
+}
+
+int main(int, char**) {
+  test_cascading();
+  test_schedule_during_callback();
+  test_clamping_and_moving();
+  fprintf(stderr, "All tests passed\n");
+  return 0;
+}
@@ -0,0 +1,307 @@
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "HTTPWebsocketServer.hh"
+#include "WebSocketDeflate.hh"
+#include "WebSocketMask.hh"
+
+using namespace std;
+
+static uint64_t now_nsecs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct BenchmarkClientState {};
+
+// A server whose clients are connected to bufferevent pairs instead of
+// sockets, so the benchmarks measure the server's own overhead
+class BenchmarkWebSocketServer : public HTTPWebSocketServer<BenchmarkClientState> {
+public:
+  using HTTPWebSocketServer::WebSocketClient;
+  using HTTPWebSocketServer::broadcast_websocket_message;
+  using HTTPWebSocketServer::send_websocket_message;
+  using HTTPWebSocketServer::subscribe_websocket_client;
+
+  explicit BenchmarkWebSocketServer(EventBase& base) : HTTPWebSocketServer(base) {}
+  virtual ~BenchmarkWebSocketServer() {
+    this->bev_to_websocket_client.clear();
+    for (struct bufferevent* bev : this->peer_bevs) {
+      bufferevent_free(bev);
+    }
+  }
+
+  // Returns the new client; its peer, which can send frames to the server, is
+  // peer_bevs.back(). The peer doesn't read, so everything sent to the client
+  // stays in its output buffer until drain_client_output is called.
+  shared_ptr<WebSocketClient> add_client() {
+    struct bufferevent* pair[2];
+    if (bufferevent_pair_new(this->base.get(), 0, pair)) {
+      throw runtime_error("bufferevent_pair_new");
+    }
+    struct evhttp_connection* conn = evhttp_connection_base_bufferevent_new(
+        this->base.get(), nullptr, pair[0], "127.0.0.1", 1);
+    bufferevent_setcb(pair[0],
+        &BenchmarkWebSocketServer::dispatch_on_websocket_read,
+        &BenchmarkWebSocketServer::dispatch_on_websocket_write,
+        &BenchmarkWebSocketServer::dispatch_on_websocket_error,
+        this);
+    bufferevent_enable(pair[0], EV_READ | EV_WRITE);
+    this->peer_bevs.emplace_back(pair[1]);
+
+    auto c = this->bev_to_websocket_client.emplace(pair[0], new WebSocketClient(conn)).first->second;
+    c->set_output_limits(this->websocket_output_limits);
+    c->topic_handle = this->topic_index.add_client(c);
+    return c;
+  }
+
+  // Discards everything the server has sent to its clients, and returns the
+  // number of bytes discarded
+  size_t drain_client_output() {
+    size_t ret = 0;
+    for (const auto& it : this->bev_to_websocket_client) {
+      struct evbuffer* buf = bufferevent_get_output(it.first);
+      ret += evbuffer_get_length(buf);
+      // bufferevent pairs keep the front of their output buffers frozen, since
+      // data only leaves them by being moved to the peer
+      evbuffer_unfreeze(buf, 1);
+      evbuffer_drain(buf, evbuffer_get_length(buf));
+      evbuffer_freeze(buf, 1);
+    }
+    return ret;
+  }
+
+  vector<struct bufferevent*> peer_bevs;
+  size_t num_messages_received = 0;
+
+protected:
+  virtual void on_websocket_message(shared_ptr<WebSocketClient>, uint8_t, string&&) {
+    this->num_messages_received++;
+  }
+};
+
+static void benchmark_small_frames() {
+  // Masked 10-byte text frames, written to the server in 64KB batches
+  static constexpr size_t NUM_MESSAGES = 2000000;
+  static const uint8_t mask_key[4] = {0x12, 0x34, 0x56, 0x78};
+  string frame("\x81\x8A", 2);
+  frame.append(reinterpret_cast<const char*>(mask_key), 4);
+  frame.append("abcdefghij", 10);
+  apply_websocket_mask(reinterpret_cast<uint8_t*>(frame.data() + 6), 10, mask_key);
+  string batch;
+  while (batch.size() + frame.size() <= 0x10000) {
+    batch += frame;
+  }
+  size_t frames_per_batch = batch.size() / frame.size();
+
+  EventBase base;
+  BenchmarkWebSocketServer server(base);
+  server.add_client();
+  struct bufferevent* peer = server.peer_bevs.back();
+
+  uint64_t start = now_nsecs();
+  for (size_t num_sent = 0; num_sent < NUM_MESSAGES; num_sent += frames_per_batch) {
+    bufferevent_write(peer, batch.data(), batch.size());
+    while (server.num_messages_received < num_sent + frames_per_batch) {
+      base.loop(EVLOOP_NONBLOCK);
+    }
+  }
+  uint64_t elapsed = now_nsecs() - start;
+  printf("10-byte messages: %5.2fM messages/s\n",
+      server.num_messages_received * 1000.0 / elapsed);
+}
+
+static void benchmark_mask() {
+  static const uint8_t mask_key[4] = {0x12, 0x34, 0x56, 0x78};
+  static constexpr size_t BYTES_PER_SIZE = 0x10000000;
+  for (size_t size : {16, 125, 1024, 0x10000, 0x100000}) {
+    vector<uint8_t> data(size, 0x5A);
+    size_t iterations = BYTES_PER_SIZE / size;
+
+    uint64_t start = now_nsecs();
+    for (size_t z = 0; z < iterations; z++) {
+      apply_websocket_mask(data.data(), size, mask_key);
+    }
+    uint64_t kernel_elapsed = now_nsecs() - start;
+
+    // This is the loop apply_websocket_mask replaced
+    start = now_nsecs();
+    for (size_t z = 0; z < iterations; z++) {
+      uint8_t* ptr = data.data();
+      for (size_t x = 0; x < size; x++) {
+        ptr[x] ^= mask_key[x & 3];
+      }
+    }
+    uint64_t loop_elapsed = now_nsecs() - start;
+
+    printf("%7zu bytes: apply_websocket_mask %6.2f GB/s, byte loop %6.2f GB/s (%02hhX)\n",
+        size, static_cast<double>(BYTES_PER_SIZE) / kernel_elapsed,
+        static_cast<double>(BYTES_PER_SIZE) / loop_elapsed, data[size / 2]);
+  }
+}
+
+static void benchmark_broadcast() {
+  string message(0x1000, 'm');
+  for (size_t num_clients : {1000, 10000}) {
+    EventBase base;
+    BenchmarkWebSocketServer server(base);
+    vector<shared_ptr<BenchmarkWebSocketServer::WebSocketClient>> clients;
+    for (size_t z = 0; z < num_clients; z++) {
+      clients.emplace_back(server.add_client());
+    }
+
+    uint64_t start = now_nsecs();
+    server.broadcast_websocket_message(message);
+    uint64_t shared_elapsed = now_nsecs() - start;
+    size_t shared_bytes = server.drain_client_output();
+
+    start = now_nsecs();
+    for (const auto& c : clients) {
+      server.send_websocket_message(c, string(message));
+    }
+    uint64_t per_client_elapsed = now_nsecs() - start;
+    size_t per_client_bytes = server.drain_client_output();
+    if (shared_bytes != per_client_bytes) {
+      throw logic_error("broadcast sent the wrong amount of data");
+    }
+
+    printf("%5zu clients, 4KB message: shared frame %6.0f ns/client, per-client frames %6.0f ns/client\n",
+        num_clients, static_cast<double>(shared_elapsed) / num_clients,
+        static_cast<double>(per_client_elapsed) / num_clients);
+  }
+}
+
+static string make_json_message(size_t num_entries, size_t seed) {
+  string ret = "[";
+  for (size_t z = 0; z < num_entries; z++) {
+    ret += "{\"id\":" + to_string(seed + z) + ",\"name\":\"user" + to_string(z) + "\",\"active\":true},";
+  }
+  ret += "{}]";
+  return ret;
+}
+
+static void benchmark_deflate() {
+  static constexpr size_t NUM_MESSAGES = 2000;
+  for (size_t num_entries : {50, 400}) {
+    for (bool context_takeover : {false, true}) {
+      ZlibStreamPool pool;
+      WebSocketDeflateParameters params;
+      params.server_no_context_takeover = !context_takeover;
+      params.client_no_context_takeover = !context_takeover;
+      // The compressor plays the client's role here, so its output can be
+      // decompressed by the server-side context
+      WebSocketDeflateContext compressor(pool, params);
+      WebSocketDeflateContext decompressor(pool, params);
+
+      vector<string> messages;
+      for (size_t z = 0; z < NUM_MESSAGES; z++) {
+        messages.emplace_back(make_json_message(num_entries, z));
+      }
+      vector<string> compressed(NUM_MESSAGES);
+      size_t compressed_bytes = 0;
+      uint64_t start = now_nsecs();
+      for (size_t z = 0; z < NUM_MESSAGES; z++) {
+        compressed[z] = compressor.compress(messages[z].data(), messages[z].size());
+        compressed_bytes += compressed[z].size();
+      }
+      uint64_t compress_elapsed = now_nsecs() - start;
+      start = now_nsecs();
+      for (size_t z = 0; z < NUM_MESSAGES; z++) {
+        string decompressed = decompressor.decompress(
+            compressed[z].data(), compressed[z].size(), 0x1000000);
+        if (decompressed.size() != messages[z].size()) {
+          throw logic_error("decompressed message is incorrect");
+        }
+      }
+      uint64_t decompress_elapsed = now_nsecs() - start;
+
+      printf("%5zu-byte JSON, %-18s: %5zu bytes on the wire, compress %6.1f us, decompress %6.1f us\n",
+          messages[0].size(), context_takeover ? "context takeover" : "no context takeover",
+          compressed_bytes / NUM_MESSAGES,
+          compress_elapsed / (1000.0 * NUM_MESSAGES),
+          decompress_elapsed / (1000.0 * NUM_MESSAGES));
+    }
+  }
+}
+
+static void benchmark_publish() {
+  // Compares publishing to a topic against sending to each subscriber from a
+  // set maintained by the application
+  string message(0x100, 'm');
+  for (size_t num_subscribers : {100, 1000, 10000, 50000}) {
+    EventBase base;
+    BenchmarkWebSocketServer server(base);
+    server.set_websocket_publish_batch_size(SIZE_MAX);
+    unordered_set<shared_ptr<BenchmarkWebSocketServer::WebSocketClient>> subscribers;
+    for (size_t z = 0; z < num_subscribers; z++) {
+      auto c = server.add_client();
+      server.subscribe_websocket_client(c, "topic");
+      subscribers.emplace(c);
+    }
+
+    size_t num_publishes = max<size_t>(20, 2000000 / num_subscribers);
+    uint64_t start = now_nsecs();
+    for (size_t z = 0; z < num_publishes; z++) {
+      server.publish_websocket_message("topic", message);
+      if ((z & 7) == 7) {
+        server.drain_client_output();
+      }
+    }
+    uint64_t publish_elapsed = now_nsecs() - start;
+    server.drain_client_output();
+
+    start = now_nsecs();
+    for (size_t z = 0; z < num_publishes; z++) {
+      for (const auto& c : subscribers) {
+        server.send_websocket_message(c, string(message));
+      }
+      if ((z & 7) == 7) {
+        server.drain_client_output();
+      }
+    }
+    uint64_t set_elapsed = now_nsecs() - start;
+    server.drain_client_output();
+
+    double num_deliveries = num_publishes * num_subscribers;
+    printf("%5zu subscribers: publish %5.2fM deliveries/s, per-subscriber sends %5.2fM deliveries/s\n",
+        num_subscribers, num_deliveries * 1000.0 / publish_elapsed,
+        num_deliveries * 1000.0 / set_elapsed);
+  }
+}
+
+static const struct {
+  const char* name;
+  void (*fn)();
+} benchmarks[] = {
+    {"small-frames", benchmark_small_frames},
+    {"mask", benchmark_mask},
+    {"broadcast", benchmark_broadcast},
+    {"deflate", benchmark_deflate},
+    {"publish", benchmark_publish},
+};
+
+int main(int argc, char** argv) {
+  bool found = false;
+  for (const auto& b : benchmarks) {
+    if ((argc < 2) || !strcmp(argv[1], b.name)) {
+      printf("-- %s\n", b.name);
+      b.fn();
+      found = true;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,464 @@
+#include "WebSocketDeflate.hh"
+
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+
+using namespace std;
+
+static string_view trim(string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+// Parses a window size parameter value, which may be quoted. Returns 0 if the
+// value isn't valid.
+static uint8_t parse_window_bits(string_view value) {
+  if ((value.size() >= 2) && (value.front() == '\"') && (value.back() == '\"')) {
+    value = value.substr(1, value.size() - 2);
+  }
+  if ((value.size() == 1) && (value[0] == '8' || value[0] == '9')) {
+    return value[0] - '0';
+  }
+  if ((value.size() == 2) && (value[0] == '1') && (value[1] >= '0') && (value[1] <= '5')) {
+    return 10 + (value[1] - '0');
+  }
+  return 0;
+}
+
+// Returns false if the offer isn't for permessage-deflate, or if it has
+// unknown, duplicate, or invalid parameters
+static bool accept_offer(string_view offer,
+    const WebSocketDeflateOptions& options,
+    WebSocketDeflateParameters& params) {
+  size_t name_end = offer.find(';');
+  if (trim(offer.substr(0, name_end)) != "permessage-deflate") {
+    return false;
+  }
+
+  bool server_no_context_takeover = false;
+  bool client_no_context_takeover = false;
+  uint8_t server_max_window_bits = 0;
+  bool client_max_window_bits_offered = false;
+  uint8_t client_max_window_bits = 0;
+  while (name_end != string_view::npos) {
+    offer.remove_prefix(name_end + 1);
+    name_end = offer.find(';');
+    string_view param = offer.substr(0, name_end);
+    size_t equals_pos = param.find('=');
+    string_view param_name = trim(param.substr(0, equals_pos));
+    bool has_value = (equals_pos != string_view::npos);
+    string_view value = has_value ? trim(param.substr(equals_pos + 1)) : string_view();
+
+    if (param_name == "server_no_context_takeover") {
+      if (server_no_context_takeover || has_value) {
+        return false;
+      }
+      server_no_context_takeover = true;
+    } else if (param_name == "client_no_context_takeover") {
+      if (client_no_context_takeover || has_value) {
+        return false;
+      }
+      client_no_context_takeover = true;
+    } else if (param_name == "server_max_window_bits") {
+      if (server_max_window_bits || !has_value) {
+        return false;
+      }
+      server_max_window_bits = parse_window_bits(value);
+      if (!server_max_window_bits) {
+        return false;
+      }
+    } else if (param_name == "client_max_window_bits") {
+      if (client_max_window_bits_offered) {
+        return false;
+      }
+      client_max_window_bits_offered = true;
+      client_max_window_bits = has_value ? parse_window_bits(value) : 15;
+      if (!client_max_window_bits) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+
+  uint8_t server_bits = server_max_window_bits
+      ? min<uint8_t>(server_max_window_bits, options.server_max_window_bits)
+      : options.server_max_window_bits;
+  if (server_bits < 9) {
+    return false;
+  }
+
+  params.server_no_context_takeover = server_no_context_takeover || options.server_no_context_takeover;
+  params.client_no_context_takeover = client_no_context_takeover || options.client_no_context_takeover;
+  params.server_max_window_bits = server_bits;
+  params.server_max_window_bits_offered = (server_max_window_bits != 0);
+  // If the client didn't offer client_max_window_bits, we can't limit its
+  // window, so it may use the full 15 bits
+  params.client_max_window_bits = client_max_window_bits_offered
+      ? min<uint8_t>(client_max_window_bits, options.client_max_window_bits)
+      : 15;
+  params.client_max_window_bits_offered = client_max_window_bits_offered;
+  return true;
+}
+
+bool WebSocketDeflateParameters::negotiate(
+    const char* extensions_header, const WebSocketDeflateOptions& options) {
+  if (!options.enabled || !extensions_header) {
+    return false;
+  }
+  // Offers are listed in order of preference, separated by commas. None of
+  // the parameters' valid values contain commas, so we don't have to handle
+  // quoted strings here.
+  string_view remaining(extensions_header);
+  for (;;) {
+    size_t offer_end = remaining.find(',');
+    if (accept_offer(remaining.substr(0, offer_end), options, *this)) {
+      return true;
+    }
+    if (offer_end == string_view::npos) {
+      return false;
+    }
+    remaining.remove_prefix(offer_end + 1);
+  }
+}
+
+string WebSocketDeflateParameters::response_header() const {
+  string ret = "permessage-deflate";
+  if (this->server_no_context_takeover) {
+    ret += "; server_no_context_takeover";
+  }
+  if (this->client_no_context_takeover) {
+    ret += "; client_no_context_takeover";
+  }
+  if (this->server_max_window_bits_offered || (this->server_max_window_bits < 15)) {
+    ret += "; server_max_window_bits=";
+    ret += to_string(this->server_max_window_bits);
+  }
+  if (this->client_max_window_bits_offered && (this->client_max_window_bits < 15)) {
+    ret += "; client_max_window_bits=";
+    ret += to_string(this->client_max_window_bits);
+  }
+  return ret;
+}
+
+ZlibStreamPool::ZlibStreamPool(
+    int compression_level, int mem_level, size_t max_free_per_window_size)
+    : compression_level(compression_level),
+      mem_level(mem_level),
+      max_free_per_window_size(max_free_per_window_size) {}
+
+ZlibStreamPool::~ZlibStreamPool() {
+  for (auto& free_list : this->free_deflaters) {
+    for (z_stream* z : free_list) {
+      deflateEnd(z);
+      delete z;
+    }
+  }
+  for (auto& free_list : this->free_inflaters) {
+    for (z_stream* z : free_list) {
+      inflateEnd(z);
+      delete z;
+    }
+  }
+}
+
+size_t ZlibStreamPool::index_for_window_bits(uint8_t window_bits) {
+  if ((window_bits < MIN_WINDOW_BITS) || (window_bits > MAX_WINDOW_BITS)) {
+    throw invalid_argument("window size must be between 9 and 15 bits");
+  }
+  return window_bits - MIN_WINDOW_BITS;
+}
+
+z_stream* ZlibStreamPool::get_deflater(uint8_t window_bits) {
+  auto& free_list = this->free_deflaters[this->index_for_window_bits(window_bits)];
+  if (!free_list.empty()) {
+    z_stream* z = free_list.back();
+    free_list.pop_back();
+    return z;
+  }
+
+  z_stream* z = new z_stream();
+  // Negative window sizes make zlib produce raw deflate data
+  if (deflateInit2(z, this->compression_level, Z_DEFLATED, -static_cast<int>(window_bits),
+          this->mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+    delete z;
+    throw runtime_error("deflateInit2");
+  }
+  return z;
+}
+
+void ZlibStreamPool::put_deflater(z_stream* z, uint8_t window_bits) {
+  auto& free_list = this->free_deflaters[this->index_for_window_bits(window_bits)];
+  if ((free_list.size() >= this->max_free_per_window_size) || (deflateReset(z) != Z_OK)) {
+    deflateEnd(z);
+    delete z;
+  } else {
+    free_list.emplace_back(z);
+  }
+}
+
+z_stream* ZlibStreamPool::get_inflater(uint8_t window_bits) {
+  auto& free_list = this->free_inflaters[this->index_for_window_bits(window_bits)];
+  if (!free_list.empty()) {
+    z_stream* z = free_list.back();
+    free_list.pop_back();
+    return z;
+  }
+
+  z_stream* z = new z_stream();
+  if (inflateInit2(z, -static_cast<int>(window_bits)) != Z_OK) {
+    delete z;
+    throw runtime_error("inflateInit2");
+  }
+  return z;
+}
+
+void ZlibStreamPool::put_inflater(z_stream* z, uint8_t window_bits) {
+  auto& free_list = this->free_inflaters[this->index_for_window_bits(window_bits)];
+  if ((free_list.size() >= this->max_free_per_window_size) || (inflateReset(z) != Z_OK)) {
+    inflateEnd(z);
+    delete z;
+  } else {
+    free_list.emplace_back(z);
+  }
+}
+
+size_t ZlibStreamPool::free_deflater_count() const {
+  size_t ret = 0;
+  for (const auto& free_list : this->free_deflaters) {
+    ret += free_list.size();
+  }
+  return ret;
+}
+
+size_t ZlibStreamPool::free_inflater_count() const {
+  size_t ret = 0;
+  for (const auto& free_list : this->free_inflaters) {
+    ret += free_list.size();
+  }
+  return ret;
+}
+
+// Every message compressed with Z_SYNC_FLUSH ends with an empty stored block,
+// which RFC 7692 says to remove before sending (and to add back before
+// decompressing)
+static const uint8_t DEFLATE_TRAILER[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+static string deflate_message(z_stream* z, const void* data, size_t size) {
+  string ret;
+  ret.resize(deflateBound(z, size) + 8);
+  z->next_in = reinterpret_cast<Bytef*>(const_cast<void*>(data));
+  z->avail_in = size;
+
+  size_t bytes_written = 0;
+  for (;;) {
+    z->next_out = reinterpret_cast<Bytef*>(ret.data() + bytes_written);
+    z->avail_out = ret.size() - bytes_written;
+    int result = deflate(z, Z_SYNC_FLUSH);
+    if ((result != Z_OK) && (result != Z_BUF_ERROR)) {
+      throw runtime_error("deflate");
+    }
+    bytes_written = ret.size() - z->avail_out;
+    // If deflate didn't fill the output buffer, the flush is complete
+    if (z->avail_out) {
+      break;
+    }
+    ret.resize(ret.size() * 2);
+  }
+
+  if ((bytes_written >= 4) &&
+      !memcmp(ret.data() + bytes_written - 4, DEFLATE_TRAILER, 4)) {
+    bytes_written -= 4;
+  }
+  ret.resize(bytes_written);
+  return ret;
+}
+
+WebSocketDeflateContext::too_large_error::too_large_error()
+    : runtime_error("decompressed message is too large") {}
+
+// Inflates one message, which may be given to add() in several pieces
+class MessageInflater {
+public:
+  MessageInflater(z_stream* z, size_t input_size, size_t max_size)
+      : z(z),
+        max_size(max_size),
+        // Allow one extra byte so we can tell if the limit is exceeded
+        max_buffer_size(max_size + 1),
+        bytes_written(0) {
+    this->ret.resize(min<size_t>(this->max_buffer_size, max<size_t>(input_size * 4, 0x400)));
+  }
+
+  void add(const void* input, size_t input_size) {
+    this->z->next_in = reinterpret_cast<Bytef*>(const_cast<void*>(input));
+    this->z->avail_in = input_size;
+    do {
+      if (this->bytes_written == this->ret.size()) {
+        if (this->ret.size() >= this->max_buffer_size) {
+          throw WebSocketDeflateContext::too_large_error();
+        }
+        this->ret.resize(min<size_t>(this->max_buffer_size, this->ret.size() * 2));
+      }
+      this->z->next_out = reinterpret_cast<Bytef*>(this->ret.data() + this->bytes_written);
+      this->z->avail_out = this->ret.size() - this->bytes_written;
+      int result = inflate(this->z, Z_SYNC_FLUSH);
+      this->bytes_written = this->ret.size() - this->z->avail_out;
+      if (result == Z_STREAM_END) {
+        // The sender ended the deflate stream (by setting BFINAL). Any
+        // remaining input begins a new stream.
+        if (inflateReset(this->z) != Z_OK) {
+          throw runtime_error("inflateReset");
+        }
+      } else if (result == Z_BUF_ERROR) {
+        // No progress was possible, so all input has been consumed
+        if (this->z->avail_out) {
+          break;
+        }
+      } else if (result != Z_OK) {
+        throw runtime_error("inflate");
+      }
+    } while (this->z->avail_in || !this->z->avail_out);
+  }
+
+  string finish() {
+    this->add(DEFLATE_TRAILER, sizeof(DEFLATE_TRAILER));
+    if (this->bytes_written > this->max_size) {
+      throw WebSocketDeflateContext::too_large_error();
+    }
+    this->ret.resize(this->bytes_written);
+    return std::move(this->ret);
+  }
+
+private:
+  z_stream* z;
+  size_t max_size;
+  size_t max_buffer_size;
+  size_t bytes_written;
+  string ret;
+};
+
+static string inflate_message(
+    z_stream* z, const void* data, size_t size, size_t max_size) {
+  MessageInflater inflater(z, size, max_size);
+  inflater.add(data, size);
+  return inflater.finish();
+}
+
+static string inflate_message(z_stream* z, struct evbuffer* data, size_t max_size) {
+  size_t size = evbuffer_get_length(data);
+  MessageInflater inflater(z, size, max_size);
+  // Peek at up to 16 chains at a time, so this doesn't need to allocate
+  struct evbuffer_iovec vecs[16];
+  struct evbuffer_ptr pos;
+  evbuffer_ptr_set(data, &pos, 0, EVBUFFER_PTR_SET);
+  size_t offset = 0;
+  while (offset < size) {
+    int num_vecs = min(evbuffer_peek(data, size - offset, &pos, vecs, 16), 16);
+    for (int y = 0; y < num_vecs; y++) {
+      inflater.add(vecs[y].iov_base, vecs[y].iov_len);
+      offset += vecs[y].iov_len;
+    }
+    if ((num_vecs <= 0) ||
+        ((offset < size) && evbuffer_ptr_set(data, &pos, offset, EVBUFFER_PTR_SET))) {
+      throw runtime_error("evbuffer_peek");
+    }
+  }
+  return inflater.finish();
+}
+
+// The client may compress with an 8-bit window, but zlib only supports 9-bit
+// windows and up. A larger window can always decompress the data.
+static uint8_t inflate_window_bits(const WebSocketDeflateParameters& params) {
+  return max<uint8_t>(params.client_max_window_bits, 9);
+}
+
+WebSocketDeflateContext::WebSocketDeflateContext(
+    ZlibStreamPool& pool, const WebSocketDeflateParameters& params)
+    : pool(&pool),
+      params(params),
+      deflater(nullptr),
+      inflater(nullptr) {
+  if (!this->params.server_no_context_takeover) {
+    this->deflater = this->pool->get_deflater(this->params.server_max_window_bits);
+  }
+  if (!this->params.client_no_context_takeover) {
+    try {
+      this->inflater = this->pool->get_inflater(inflate_window_bits(this->params));
+    } catch (const exception&) {
+      if (this->deflater) {
+        this->pool->put_deflater(this->deflater, this->params.server_max_window_bits);
+      }
+      throw;
+    }
+  }
+}
+
+WebSocketDeflateContext::~WebSocketDeflateContext() {
+  if (this->deflater) {
+    this->pool->put_deflater(this->deflater, this->params.server_max_window_bits);
+  }
+  if (this->inflater) {
+    this->pool->put_inflater(this->inflater, inflate_window_bits(this->params));
+  }
+}
+
+string WebSocketDeflateContext::compress(const void* data, size_t size) {
+  if (this->deflater) {
+    return deflate_message(this->deflater, data, size);
+  }
+  return websocket_deflate(*this->pool, this->params.server_max_window_bits, data, size);
+}
+
+template <typename... ArgsT>
+string WebSocketDeflateContext::decompress_with_inflater(ArgsT&&... args) {
+  if (this->inflater) {
+    return inflate_message(this->inflater, std::forward<ArgsT>(args)...);
+  }
+
+  uint8_t window_bits = inflate_window_bits(this->params);
+  z_stream* z = this->pool->get_inflater(window_bits);
+  try {
+    string ret = inflate_message(z, std::forward<ArgsT>(args)...);
+    this->pool->put_inflater(z, window_bits);
+    return ret;
+  } catch (const exception&) {
+    this->pool->put_inflater(z, window_bits);
+    throw;
+  }
+}
+
+string WebSocketDeflateContext::decompress(
+    const void* data, size_t size, size_t max_size) {
+  return this->decompress_with_inflater(data, size, max_size);
+}
+
+string WebSocketDeflateContext::decompress(struct evbuffer* data, size_t max_size) {
+  return this->decompress_with_inflater(data, max_size);
+}
+
+void WebSocketDeflateContext::reset_compressor() {
+  if (this->deflater && (deflateReset(this->deflater) != Z_OK)) {
+    throw runtime_error("deflateReset");
+  }
+}
+
+string websocket_deflate(
+    ZlibStreamPool& pool, uint8_t window_bits, const void* data, size_t size) {
+  z_stream* z = pool.get_deflater(window_bits);
+  try {
+    string ret = deflate_message(z, data, size);
+    pool.put_deflater(z, window_bits);
+    return ret;
+  } catch (const exception&) {
+    pool.put_deflater(z, window_bits);
+    throw;
+  }
+}
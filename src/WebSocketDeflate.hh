@@ -0,0 +1,150 @@
+#pragma once
+
+#include <event2/buffer.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Server-side configuration for the permessage-deflate WebSocket extension
+// (RFC 7692). Window sizes are in bits (the LZ77 window is 1 << bits bytes),
+// and must be between 9 and 15. zlib can't produce raw deflate streams with an
+// 8-bit window, so offers that limit the server's window to 8 bits are
+// declined.
+struct WebSocketDeflateOptions {
+  bool enabled = false;
+  // If true, the server compresses each message independently. This allows
+  // compression streams to be returned to the pool between messages, which
+  // saves a lot of memory when there are many idle connections, at the cost
+  // of a worse compression ratio.
+  bool server_no_context_takeover = false;
+  // If true, the server asks clients to compress each message independently,
+  // which similarly allows decompression streams to be pooled between
+  // messages.
+  bool client_no_context_takeover = false;
+  uint8_t server_max_window_bits = 15;
+  uint8_t client_max_window_bits = 15;
+  int compression_level = Z_DEFAULT_COMPRESSION;
+  int mem_level = 8;
+  // Messages shorter than this are sent uncompressed
+  size_t min_compress_size = 0x80;
+  // Compressed messages which would decompress to more than this are rejected
+  size_t max_decompressed_size = 0x1000000;
+};
+
+// The parameters agreed on for a single connection
+struct WebSocketDeflateParameters {
+  bool server_no_context_takeover = false;
+  bool client_no_context_takeover = false;
+  uint8_t server_max_window_bits = 15;
+  uint8_t client_max_window_bits = 15;
+  // The response may only include client_max_window_bits if the client's offer
+  // did, and must include server_max_window_bits if the offer did
+  bool server_max_window_bits_offered = false;
+  bool client_max_window_bits_offered = false;
+
+  // Parses a Sec-WebSocket-Extensions request header and chooses the first
+  // acceptable permessage-deflate offer in it. Returns false if there is no
+  // acceptable offer (or if deflate is disabled in the options), in which case
+  // the connection should not use compression.
+  bool negotiate(const char* extensions_header, const WebSocketDeflateOptions& options);
+  // Returns the value of the Sec-WebSocket-Extensions response header
+  std::string response_header() const;
+};
+
+// Per-server pool of zlib streams. Streams are reset before being returned to
+// the pool, and are kept in separate lists for each window size. This class is
+// not thread-safe; each server (and hence each EventBase thread) should have
+// its own pool.
+class ZlibStreamPool {
+public:
+  ZlibStreamPool(int compression_level = Z_DEFAULT_COMPRESSION, int mem_level = 8,
+      size_t max_free_per_window_size = 0x400);
+  ZlibStreamPool(const ZlibStreamPool&) = delete;
+  ZlibStreamPool(ZlibStreamPool&&) = delete;
+  ZlibStreamPool& operator=(const ZlibStreamPool&) = delete;
+  ZlibStreamPool& operator=(ZlibStreamPool&&) = delete;
+  ~ZlibStreamPool();
+
+  // Streams produce and consume raw deflate data (no zlib header or trailer)
+  z_stream* get_deflater(uint8_t window_bits);
+  void put_deflater(z_stream* z, uint8_t window_bits);
+  z_stream* get_inflater(uint8_t window_bits);
+  void put_inflater(z_stream* z, uint8_t window_bits);
+
+  size_t free_deflater_count() const;
+  size_t free_inflater_count() const;
+
+private:
+  static constexpr uint8_t MIN_WINDOW_BITS = 9;
+  static constexpr uint8_t MAX_WINDOW_BITS = 15;
+
+  int compression_level;
+  int mem_level;
+  size_t max_free_per_window_size;
+  std::vector<z_stream*> free_deflaters[MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1];
+  std::vector<z_stream*> free_inflaters[MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1];
+
+  static size_t index_for_window_bits(uint8_t window_bits);
+};
+
+// Compression state for one connection. If context takeover is enabled in a
+// direction, the stream for that direction is held for the lifetime of the
+// connection (since the peer expects the LZ77 window to carry over between
+// messages); otherwise, it's taken from the pool for each message and returned
+// immediately afterward.
+class WebSocketDeflateContext {
+public:
+  // Thrown by decompress() when a message would decompress to more than the
+  // allowed size (as opposed to being invalid)
+  class too_large_error : public std::runtime_error {
+  public:
+    too_large_error();
+  };
+
+  WebSocketDeflateContext(ZlibStreamPool& pool, const WebSocketDeflateParameters& params);
+  WebSocketDeflateContext(const WebSocketDeflateContext&) = delete;
+  WebSocketDeflateContext(WebSocketDeflateContext&&) = delete;
+  WebSocketDeflateContext& operator=(const WebSocketDeflateContext&) = delete;
+  WebSocketDeflateContext& operator=(WebSocketDeflateContext&&) = delete;
+  ~WebSocketDeflateContext();
+
+  inline const WebSocketDeflateParameters& get_params() const {
+    return this->params;
+  }
+
+  // Compresses a message payload. The returned data has the trailing empty
+  // block removed, as RFC 7692 requires.
+  std::string compress(const void* data, size_t size);
+  // Decompresses a message payload. Throws too_large_error if it would
+  // decompress to more than max_size bytes, or runtime_error if the data is
+  // invalid. The evbuffer overload reads the buffer's chains in place, so the
+  // payload doesn't need to be contiguous; it doesn't drain the buffer.
+  std::string decompress(const void* data, size_t size, size_t max_size);
+  std::string decompress(struct evbuffer* data, size_t max_size);
+
+  // Discards the compression history. This must be called when a message
+  // compressed by some other means (e.g. a shared broadcast frame) is sent on
+  // this connection, since the peer's window then no longer matches ours.
+  void reset_compressor();
+
+private:
+  ZlibStreamPool* pool;
+  WebSocketDeflateParameters params;
+
+  template <typename... ArgsT>
+  std::string decompress_with_inflater(ArgsT&&... args);
+
+  z_stream* deflater;
+  z_stream* inflater;
+};
+
+// Compresses a message independently of any connection's history (as if
+// server_no_context_takeover were in effect), using a stream from the pool.
+// The result can be sent to any client whose negotiated server_max_window_bits
+// is at least window_bits.
+std::string websocket_deflate(
+    ZlibStreamPool& pool, uint8_t window_bits, const void* data, size_t size);
@@ -0,0 +1,129 @@
+#include "WebSocketFrame.hh"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+#include <stdexcept>
+
+using namespace std;
+
+size_t encode_websocket_frame_header(uint8_t* out, uint8_t opcode,
+    uint64_t payload_size, bool fin, bool rsv1) {
+  out[0] = (fin ? 0x80 : 0x00) | (rsv1 ? 0x40 : 0x00) | (opcode & 0x0F);
+  if (payload_size > 0xFFFF) {
+    out[1] = 0x7F;
+    for (size_t z = 0; z < 8; z++) {
+      out[2 + z] = (payload_size >> (56 - z * 8)) & 0xFF;
+    }
+    return 10;
+  } else if (payload_size > 0x7D) {
+    out[1] = 0x7E;
+    out[2] = (payload_size >> 8) & 0xFF;
+    out[3] = payload_size & 0xFF;
+    return 4;
+  } else {
+    out[1] = payload_size;
+    return 2;
+  }
+}
+
+SharedWebSocketFrame::SharedWebSocketFrame() : block(nullptr) {}
+
+SharedWebSocketFrame::SharedWebSocketFrame(
+    const void* payload, size_t size, uint8_t opcode, bool compressed)
+    : block(nullptr) {
+  // Encode the header into a temporary buffer first, so we know how much
+  // memory to allocate
+  uint8_t header[10];
+  size_t header_size = encode_websocket_frame_header(header, opcode, size, true, compressed);
+
+  void* mem = malloc(sizeof(Block) + header_size + size);
+  if (!mem) {
+    throw bad_alloc();
+  }
+  this->block = new (mem) Block();
+  this->block->refcount.store(1, memory_order_relaxed);
+  this->block->size = header_size + size;
+  memcpy(this->block->data(), header, header_size);
+  memcpy(this->block->data() + header_size, payload, size);
+}
+
+SharedWebSocketFrame::SharedWebSocketFrame(
+    const string& payload, uint8_t opcode, bool compressed)
+    : SharedWebSocketFrame(payload.data(), payload.size(), opcode, compressed) {}
+
+SharedWebSocketFrame::SharedWebSocketFrame(const SharedWebSocketFrame& other)
+    : block(other.block) {
+  SharedWebSocketFrame::retain(this->block);
+}
+
+SharedWebSocketFrame::SharedWebSocketFrame(SharedWebSocketFrame&& other)
+    : block(other.block) {
+  other.block = nullptr;
+}
+
+SharedWebSocketFrame& SharedWebSocketFrame::operator=(const SharedWebSocketFrame& other) {
+  SharedWebSocketFrame::retain(other.block);
+  SharedWebSocketFrame::release(this->block);
+  this->block = other.block;
+  return *this;
+}
+
+SharedWebSocketFrame& SharedWebSocketFrame::operator=(SharedWebSocketFrame&& other) {
+  if (this != &other) {
+    SharedWebSocketFrame::release(this->block);
+    this->block = other.block;
+    other.block = nullptr;
+  }
+  return *this;
+}
+
+SharedWebSocketFrame::~SharedWebSocketFrame() {
+  SharedWebSocketFrame::release(this->block);
+}
+
+size_t SharedWebSocketFrame::size() const {
+  return this->block ? this->block->size : 0;
+}
+
+const uint8_t* SharedWebSocketFrame::data() const {
+  return this->block ? this->block->data() : nullptr;
+}
+
+bool SharedWebSocketFrame::is_compressed() const {
+  return this->block && (this->block->data()[0] & 0x40);
+}
+
+void SharedWebSocketFrame::send(EvBuffer& buf) const {
+  this->send(buf.get());
+}
+
+void SharedWebSocketFrame::send(struct evbuffer* buf) const {
+  if (!this->block) {
+    throw logic_error("cannot send an empty frame");
+  }
+  SharedWebSocketFrame::retain(this->block);
+  if (evbuffer_add_reference(buf, this->block->data(), this->block->size,
+          &SharedWebSocketFrame::dispatch_release, this->block)) {
+    SharedWebSocketFrame::release(this->block);
+    throw runtime_error("evbuffer_add_reference");
+  }
+}
+
+void SharedWebSocketFrame::retain(Block* block) {
+  if (block) {
+    block->refcount.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+void SharedWebSocketFrame::release(Block* block) {
+  if (block && (block->refcount.fetch_sub(1, memory_order_acq_rel) == 1)) {
+    block->~Block();
+    free(block);
+  }
+}
+
+void SharedWebSocketFrame::dispatch_release(const void*, size_t, void* ctx) {
+  SharedWebSocketFrame::release(reinterpret_cast<Block*>(ctx));
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "EvBuffer.hh"
+
+// Encodes a WebSocket frame header (without a masking key, since servers
+// don't mask frames) for a payload of the given size into out, which must have
+// room for at least 10 bytes. Returns the header's size. rsv1 should be set on
+// the first frame of a message compressed with permessage-deflate.
+size_t encode_websocket_frame_header(uint8_t* out, uint8_t opcode,
+    uint64_t payload_size, bool fin = true, bool rsv1 = false);
+
+// A complete, immutable WebSocket frame (header and payload) which can be
+// added to any number of output buffers without copying it. Each buffer holds
+// a reference to the frame via evbuffer_add_reference, and the frame's memory
+// is freed when the last buffer (or SharedWebSocketFrame object) releases it.
+// The reference count is atomic, so a frame may be sent to buffers that
+// belong to different threads.
+class SharedWebSocketFrame {
+public:
+  SharedWebSocketFrame();
+  // If compressed is true, the payload must already be compressed with
+  // permessage-deflate (e.g. by websocket_deflate)
+  SharedWebSocketFrame(const void* payload, size_t size, uint8_t opcode = 0x01,
+      bool compressed = false);
+  SharedWebSocketFrame(const std::string& payload, uint8_t opcode = 0x01,
+      bool compressed = false);
+  SharedWebSocketFrame(const SharedWebSocketFrame& other);
+  SharedWebSocketFrame(SharedWebSocketFrame&& other);
+  SharedWebSocketFrame& operator=(const SharedWebSocketFrame& other);
+  SharedWebSocketFrame& operator=(SharedWebSocketFrame&& other);
+  ~SharedWebSocketFrame();
+
+  // Returns the size of the encoded frame, including the header
+  size_t size() const;
+  const uint8_t* data() const;
+  // Returns true if the frame's payload is compressed with permessage-deflate
+  bool is_compressed() const;
+
+  void send(EvBuffer& buf) const;
+  void send(struct evbuffer* buf) const;
+
+private:
+  struct Block {
+    std::atomic<size_t> refcount;
+    size_t size;
+
+    inline uint8_t* data() {
+      return reinterpret_cast<uint8_t*>(this + 1);
+    }
+  };
+
+  static void retain(Block* block);
+  static void release(Block* block);
+  static void dispatch_release(const void* data, size_t size, void* ctx);
+
+  Block* block;
+};
@@ -0,0 +1,134 @@
+#include "WebSocketMask.hh"
+
+#include <string.h>
+
+#include <stdexcept>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PHOSG_EVENT_X86_MASK 1
+#endif
+
+using namespace std;
+
+using MaskFunction = void (*)(uint8_t* data, size_t size, uint32_t key);
+
+// key is the mask key rotated to the data's phase, in memory order. All of
+// these functions consume a multiple of 4 bytes before handling the tail, so
+// the tail always starts at phase 0 relative to key.
+
+static void apply_mask_tail(uint8_t* data, size_t size, uint32_t key) {
+  uint8_t key_bytes[4];
+  memcpy(key_bytes, &key, 4);
+  for (size_t x = 0; x < size; x++) {
+    data[x] ^= key_bytes[x & 3];
+  }
+}
+
+static void apply_mask_scalar64(uint8_t* data, size_t size, uint32_t key) {
+  uint64_t key64 = (static_cast<uint64_t>(key) << 32) | key;
+  size_t x = 0;
+  for (; x + 8 <= size; x += 8) {
+    uint64_t v;
+    memcpy(&v, data + x, 8);
+    v ^= key64;
+    memcpy(data + x, &v, 8);
+  }
+  apply_mask_tail(data + x, size - x, key);
+}
+
+#ifdef PHOSG_EVENT_X86_MASK
+
+__attribute__((target("sse2"))) static void apply_mask_sse2(
+    uint8_t* data, size_t size, uint32_t key) {
+  __m128i key128 = _mm_set1_epi32(static_cast<int32_t>(key));
+  size_t x = 0;
+  for (; x + 16 <= size; x += 16) {
+    __m128i* p = reinterpret_cast<__m128i*>(data + x);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key128));
+  }
+  apply_mask_scalar64(data + x, size - x, key);
+}
+
+__attribute__((target("avx2"))) static void apply_mask_avx2(
+    uint8_t* data, size_t size, uint32_t key) {
+  __m256i key256 = _mm256_set1_epi32(static_cast<int32_t>(key));
+  size_t x = 0;
+  for (; x + 64 <= size; x += 64) {
+    __m256i* p = reinterpret_cast<__m256i*>(data + x);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key256));
+    _mm256_storeu_si256(p + 1, _mm256_xor_si256(_mm256_loadu_si256(p + 1), key256));
+  }
+  for (; x + 32 <= size; x += 32) {
+    __m256i* p = reinterpret_cast<__m256i*>(data + x);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key256));
+  }
+  apply_mask_scalar64(data + x, size - x, key);
+}
+
+#endif
+
+static MaskFunction choose_mask_function() {
+#ifdef PHOSG_EVENT_X86_MASK
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return apply_mask_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return apply_mask_sse2;
+  }
+#endif
+  return apply_mask_scalar64;
+}
+
+static const MaskFunction mask_function = choose_mask_function();
+
+size_t apply_websocket_mask(
+    uint8_t* data, size_t size, const uint8_t* mask_key, size_t phase) {
+  uint8_t rotated_key[4];
+  for (size_t z = 0; z < 4; z++) {
+    rotated_key[z] = mask_key[(phase + z) & 3];
+  }
+  uint32_t key;
+  memcpy(&key, rotated_key, 4);
+
+  // Short payloads (common for small messages) aren't worth the call
+  if (size < 16) {
+    apply_mask_tail(data, size, key);
+  } else {
+    mask_function(data, size, key);
+  }
+  return (phase + size) & 3;
+}
+
+void apply_websocket_mask(
+    EvBuffer& buf, size_t size, const uint8_t* mask_key, size_t phase) {
+  if (size == 0) {
+    return;
+  }
+  if (size > buf.get_length()) {
+    throw EvBuffer::insufficient_data();
+  }
+
+  struct evbuffer_iovec inline_vecs[8];
+  struct evbuffer_iovec* vecs = inline_vecs;
+  vector<struct evbuffer_iovec> heap_vecs;
+  int num_vecs = buf.peek(size, nullptr, inline_vecs, 8);
+  if (num_vecs > 8) {
+    heap_vecs.resize(num_vecs);
+    vecs = heap_vecs.data();
+    num_vecs = buf.peek(size, nullptr, vecs, num_vecs);
+  }
+  if (num_vecs < 0) {
+    throw runtime_error("evbuffer_peek");
+  }
+
+  size_t remaining = size;
+  for (int z = 0; (z < num_vecs) && remaining; z++) {
+    size_t segment_size = min<size_t>(vecs[z].iov_len, remaining);
+    phase = apply_websocket_mask(
+        reinterpret_cast<uint8_t*>(vecs[z].iov_base), segment_size, mask_key, phase);
+    remaining -= segment_size;
+  }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "EvBuffer.hh"
+
+// Applies a WebSocket masking key to data in place (masking and unmasking are
+// the same operation). phase is the offset of data[0] within the masked
+// payload, so a payload that's split into multiple segments can be processed
+// one segment at a time; the return value is the phase for the next segment.
+//
+// On x86, this uses AVX2 or SSE2 (chosen at runtime based on CPU support);
+// elsewhere it processes 8 bytes at a time.
+size_t apply_websocket_mask(
+    uint8_t* data, size_t size, const uint8_t* mask_key, size_t phase = 0);
+
+// Applies a masking key in place to the first size bytes of buf, one chain at
+// a time, without making the data contiguous. The data must be in ordinary
+// chains (e.g. read from a socket), not added with add_reference or add_file.
+void apply_websocket_mask(
+    EvBuffer& buf, size_t size, const uint8_t* mask_key, size_t phase = 0);
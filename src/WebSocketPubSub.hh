@@ -0,0 +1,78 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "EventBase.hh"
+
+// Publishes messages to topic subscribers across several HTTPWebSocketServers,
+// each running on its own EventBase (usually one per EventBasePool thread).
+// Each server keeps the subscriptions for its own clients, so subscribing and
+// unsubscribing are done directly on the server that owns the client, from
+// within its callbacks (see subscribe_websocket_client).
+//
+// publish() may be called from any thread. The message is copied once, and a
+// task referencing it is queued to each shard with EventBase::post; each shard
+// then fans the message out to its own subscribers on its own thread. Messages
+// published from a single thread are delivered in order.
+//
+// ServerT must be (or derive from) an HTTPWebSocketServer. Shards must be
+// added before any thread calls publish().
+template <typename ServerT>
+class WebSocketPubSub {
+public:
+  WebSocketPubSub() = default;
+  WebSocketPubSub(const WebSocketPubSub&) = delete;
+  WebSocketPubSub(WebSocketPubSub&&) = delete;
+  WebSocketPubSub& operator=(const WebSocketPubSub&) = delete;
+  WebSocketPubSub& operator=(WebSocketPubSub&&) = delete;
+  ~WebSocketPubSub() = default;
+
+  // base must be the EventBase that server runs on (or any EventBase object
+  // that refers to the same event_base), and must outlive this object.
+  void add_shard(EventBase& base, ServerT* server) {
+    base.enable_post();
+    this->shards.emplace_back(Shard{&base, server});
+  }
+
+  inline size_t shard_count() const {
+    return this->shards.size();
+  }
+
+  ServerT* get_server(size_t shard_index) {
+    return this->shards.at(shard_index).server;
+  }
+
+  void publish(const std::string& topic, const void* data, size_t size, uint8_t opcode = 0x01) {
+    this->publish(topic,
+        std::make_shared<const std::string>(reinterpret_cast<const char*>(data), size),
+        opcode);
+  }
+
+  void publish(const std::string& topic, std::string&& message, uint8_t opcode = 0x01) {
+    this->publish(topic, std::make_shared<const std::string>(std::move(message)), opcode);
+  }
+
+  void publish(const std::string& topic, std::shared_ptr<const std::string> message,
+      uint8_t opcode = 0x01) {
+    if (this->shards.empty()) {
+      throw std::logic_error("no shards have been added");
+    }
+    auto shared_topic = std::make_shared<const std::string>(topic);
+    for (const auto& shard : this->shards) {
+      ServerT* server = shard.server;
+      shard.base->post([server, shared_topic, message, opcode]() -> void {
+        server->publish_websocket_message(*shared_topic, message, opcode);
+      });
+    }
+  }
+
+private:
+  struct Shard {
+    EventBase* base;
+    ServerT* server;
+  };
+  std::vector<Shard> shards;
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Maps topic names to the clients subscribed to them. Clients are referred to
+// by compact handles (a slot index and a generation number) rather than by
+// shared_ptr, so each topic's subscriber list is a dense array of 8-byte
+// values that's cheap to iterate over and to copy. Handles of removed clients
+// are never reused (the slot's generation changes), so a handle saved before a
+// client disconnects simply resolves to nullptr afterward.
+//
+// Subscribing, unsubscribing, and removing a client are all O(1) in the number
+// of subscribers to the topic, and O(n) in the number of topics the client is
+// subscribed to (which is usually small). This class is not thread-safe.
+template <typename ClientT>
+class WebSocketTopicIndex {
+public:
+  using Handle = uint64_t;
+
+  WebSocketTopicIndex() = default;
+  WebSocketTopicIndex(const WebSocketTopicIndex&) = delete;
+  WebSocketTopicIndex(WebSocketTopicIndex&&) = delete;
+  WebSocketTopicIndex& operator=(const WebSocketTopicIndex&) = delete;
+  WebSocketTopicIndex& operator=(WebSocketTopicIndex&&) = delete;
+  ~WebSocketTopicIndex() = default;
+
+  Handle add_client(std::shared_ptr<ClientT> c) {
+    uint32_t slot_index;
+    if (!this->free_slots.empty()) {
+      slot_index = this->free_slots.back();
+      this->free_slots.pop_back();
+    } else {
+      slot_index = this->slots.size();
+      this->slots.emplace_back();
+    }
+    auto& slot = this->slots[slot_index];
+    slot.client = std::move(c);
+    this->num_clients++;
+    return WebSocketTopicIndex::make_handle(slot_index, slot.generation);
+  }
+
+  // Unsubscribes the client from all topics and invalidates its handle
+  void remove_client(Handle h) {
+    Slot* slot = this->slot_for_handle(h);
+    if (!slot) {
+      return;
+    }
+    while (!slot->subscriptions.empty()) {
+      this->remove_subscription(*slot, slot->subscriptions.size() - 1);
+    }
+    slot->client.reset();
+    slot->generation++;
+    this->free_slots.emplace_back(WebSocketTopicIndex::slot_index_for_handle(h));
+    this->num_clients--;
+  }
+
+  // Returns nullptr if the handle refers to a client that has been removed
+  const std::shared_ptr<ClientT>* get_client(Handle h) const {
+    const Slot* slot = const_cast<WebSocketTopicIndex*>(this)->slot_for_handle(h);
+    return slot ? &slot->client : nullptr;
+  }
+
+  // Returns false if the client was already subscribed
+  bool subscribe(Handle h, const std::string& topic_name) {
+    Slot* slot = this->slot_for_handle(h);
+    if (!slot) {
+      return false;
+    }
+    auto topic_it = this->topics.try_emplace(topic_name).first;
+    Topic* topic = &topic_it->second;
+    topic->name = &topic_it->first;
+    for (const auto& sub : slot->subscriptions) {
+      if (sub.topic == topic) {
+        return false;
+      }
+    }
+    topic->subscription_indexes.emplace_back(slot->subscriptions.size());
+    slot->subscriptions.emplace_back(Subscription{topic, static_cast<uint32_t>(topic->subscribers.size())});
+    topic->subscribers.emplace_back(h);
+    this->num_subscriptions++;
+    return true;
+  }
+
+  // Returns false if the client wasn't subscribed
+  bool unsubscribe(Handle h, const std::string& topic_name) {
+    Slot* slot = this->slot_for_handle(h);
+    if (!slot) {
+      return false;
+    }
+    auto topic_it = this->topics.find(topic_name);
+    if (topic_it == this->topics.end()) {
+      return false;
+    }
+    for (size_t z = 0; z < slot->subscriptions.size(); z++) {
+      if (slot->subscriptions[z].topic == &topic_it->second) {
+        this->remove_subscription(*slot, z);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Returns nullptr if the topic has no subscribers. The returned vector is
+  // invalidated by any call that changes the index.
+  const std::vector<Handle>* get_subscribers(const std::string& topic_name) const {
+    auto topic_it = this->topics.find(topic_name);
+    return (topic_it == this->topics.end()) ? nullptr : &topic_it->second.subscribers;
+  }
+
+  inline size_t client_count() const {
+    return this->num_clients;
+  }
+  inline size_t topic_count() const {
+    return this->topics.size();
+  }
+  inline size_t subscription_count() const {
+    return this->num_subscriptions;
+  }
+
+private:
+  struct Topic {
+    // Points to the map key, which is never moved
+    const std::string* name = nullptr;
+    std::vector<Handle> subscribers;
+    // For each entry in subscribers, the index of the corresponding entry in
+    // that client's Slot::subscriptions
+    std::vector<uint32_t> subscription_indexes;
+  };
+
+  struct Subscription {
+    // Elements of an unordered_map are never moved, so this pointer remains
+    // valid until the topic is erased (which only happens when it has no
+    // subscribers)
+    Topic* topic;
+    // Index of this client in topic->subscribers
+    uint32_t position;
+  };
+
+  struct Slot {
+    std::shared_ptr<ClientT> client;
+    uint32_t generation = 0;
+    std::vector<Subscription> subscriptions;
+  };
+
+  std::vector<Slot> slots;
+  std::vector<uint32_t> free_slots;
+  std::unordered_map<std::string, Topic> topics;
+  size_t num_clients = 0;
+  size_t num_subscriptions = 0;
+
+  static inline Handle make_handle(uint32_t slot_index, uint32_t generation) {
+    return (static_cast<Handle>(generation) << 32) | slot_index;
+  }
+  static inline uint32_t slot_index_for_handle(Handle h) {
+    return h & 0xFFFFFFFF;
+  }
+
+  Slot* slot_for_handle(Handle h) {
+    uint32_t slot_index = WebSocketTopicIndex::slot_index_for_handle(h);
+    if (slot_index >= this->slots.size()) {
+      return nullptr;
+    }
+    Slot& slot = this->slots[slot_index];
+    if ((slot.generation != (h >> 32)) || !slot.client) {
+      return nullptr;
+    }
+    return &slot;
+  }
+
+  // Removes the given entry from slot.subscriptions and the corresponding
+  // entry from the topic's subscriber list. Both are removed by moving the
+  // last entry into the removed entry's place, so the back-references of the
+  // moved entries have to be updated.
+  void remove_subscription(Slot& slot, size_t sub_index) {
+    Subscription sub = slot.subscriptions[sub_index];
+    Topic* topic = sub.topic;
+
+    size_t last_position = topic->subscribers.size() - 1;
+    if (sub.position != last_position) {
+      Handle moved_h = topic->subscribers[last_position];
+      uint32_t moved_sub_index = topic->subscription_indexes[last_position];
+      topic->subscribers[sub.position] = moved_h;
+      topic->subscription_indexes[sub.position] = moved_sub_index;
+      Slot& moved_slot = this->slots[WebSocketTopicIndex::slot_index_for_handle(moved_h)];
+      moved_slot.subscriptions[moved_sub_index].position = sub.position;
+    }
+    topic->subscribers.pop_back();
+    topic->subscription_indexes.pop_back();
+
+    size_t last_sub_index = slot.subscriptions.size() - 1;
+    if (sub_index != last_sub_index) {
+      const Subscription& moved_sub = slot.subscriptions[last_sub_index];
+      moved_sub.topic->subscription_indexes[moved_sub.position] = sub_index;
+      slot.subscriptions[sub_index] = moved_sub;
+    }
+    slot.subscriptions.pop_back();
+    this->num_subscriptions--;
+
+    if (topic->subscribers.empty()) {
+      // Topics are only referenced by subscriptions, so nothing else points to
+      // this one now. The name is copied because erase() destroys the key.
+      std::string name = *topic->name;
+      this->topics.erase(name);
+    }
+  }
+};